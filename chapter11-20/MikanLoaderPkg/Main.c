@@ -1,16 +1,21 @@
 #include  <Uefi.h>
 #include  <Library/UefiLib.h>
+#include  <Library/BaseLib.h>
 #include  <Library/UefiBootServicesTableLib.h>
 #include  <Library/PrintLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/BaseMemoryLib.h>
+#include  <Library/DevicePathLib.h>
 #include  <Protocol/LoadedImage.h>
 #include  <Protocol/SimpleFileSystem.h>
 #include  <Protocol/DiskIo2.h>
 #include  <Protocol/BlockIo.h>
+#include  <Protocol/DevicePath.h>
+#include  <Protocol/PciIo.h>
 #include  <Guid/FileInfo.h>
 #include  "frame_buffer_config.hpp"
 #include  "memory_map.hpp"
+#include  "boot_info.hpp"
 #include  "elf.hpp"
 
 EFI_STATUS GetMemoryMap(struct MemoryMap* map) {
@@ -169,35 +174,210 @@ void Halt(void) {
   while (1) __asm__("hlt");
 }
 
-void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+void CalcLoadAddressRange(Elf64_Phdr* phdr, Elf64_Half phnum,
+                          UINT64* first, UINT64* last) {
   *first = MAX_UINT64;
   *last = 0;
-  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+  for (Elf64_Half i = 0; i < phnum; ++i) {
     if (phdr[i].p_type != PT_LOAD) continue;
     *first = MIN(*first, phdr[i].p_vaddr);
     *last = MAX(*last, phdr[i].p_vaddr + phdr[i].p_memsz);
   }
 }
 
-void CopyLoadSegments(Elf64_Ehdr* ehdr) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
-  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
-    if (phdr[i].p_type != PT_LOAD) continue;
+BOOLEAN IsElf64(CONST Elf64_Ehdr* ehdr) {
+  return ehdr->e_ident[0] == 0x7f && ehdr->e_ident[1] == 'E' &&
+         ehdr->e_ident[2] == 'L' && ehdr->e_ident[3] == 'F' &&
+         ehdr->e_phentsize == sizeof(Elf64_Phdr);
+}
+
+/** @brief LOAD セグメントが収まるページをカーネルのアドレスに確保する */
+EFI_STATUS AllocateKernelPages(UINT64 first, UINT64 last) {
+  UINTN num_pages = (last - first + 0xfff) / 0x1000;
+  return gBS->AllocatePages(AllocateAddress, EfiLoaderData, num_pages, &first);
+}
+
+/** @brief ファイルの offset バイト目から size バイトを buffer に読む */
+EFI_STATUS ReadFileAt(EFI_FILE_PROTOCOL* file, UINT64 offset,
+                      UINTN size, VOID* buffer) {
+  EFI_STATUS status = file->SetPosition(file, offset);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  UINTN read_bytes = size;
+  status = file->Read(file, &read_bytes, buffer);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  return read_bytes == size ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+/** @brief ELF ファイルのヘッダだけを読み，LOAD セグメントを最終的なアドレスへ直接読み込む．
+ *
+ * ファイル全体を読むための一時バッファも，そこからのコピーも要らない．
+ */
+EFI_STATUS LoadKernelFile(EFI_FILE_PROTOCOL* file,
+                          UINT64* first, UINT64* last, UINT64* entry) {
+  EFI_STATUS status;
+
+  Elf64_Ehdr ehdr;
+  status = ReadFileAt(file, 0, sizeof(ehdr), &ehdr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (!IsElf64(&ehdr)) {
+    return EFI_LOAD_ERROR;
+  }
+
+  Elf64_Phdr* phdr;
+  UINTN phdr_bytes = sizeof(Elf64_Phdr) * ehdr.e_phnum;
+  status = gBS->AllocatePool(EfiLoaderData, phdr_bytes, (VOID**)&phdr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  status = ReadFileAt(file, ehdr.e_phoff, phdr_bytes, phdr);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(phdr);
+    return status;
+  }
 
-    UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
-    CopyMem((VOID*)phdr[i].p_vaddr, (VOID*)segm_in_file, phdr[i].p_filesz);
+  CalcLoadAddressRange(phdr, ehdr.e_phnum, first, last);
+  status = AllocateKernelPages(*first, *last);
 
+  for (Elf64_Half i = 0; !EFI_ERROR(status) && i < ehdr.e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+
+    status = ReadFileAt(file, phdr[i].p_offset, phdr[i].p_filesz, (VOID*)phdr[i].p_vaddr);
     UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
     SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
   }
+
+  gBS->FreePool(phdr);
+  *entry = ehdr.e_entry;
+  return status;
 }
 
-// day17a
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+/** @brief LZ4 のブロックを dst[*dst_pos] 以降に展開する．
+ *
+ * 一致の参照先は同じブロック内に限らず，dst の先頭からの展開済みの範囲全体を許す．
+ * これによりブロック間の依存がある（linked）フレームも扱える．
+ */
+EFI_STATUS Lz4DecompressBlock(CONST UINT8* src, UINTN src_len,
+                              UINT8* dst, UINTN* dst_pos, UINTN dst_cap) {
+  CONST UINT8* src_end = src + src_len;
+  UINTN pos = *dst_pos;
+
+  while (src < src_end) {
+    UINT8 token = *src++;
+
+    UINTN literal_len = token >> 4;
+    if (literal_len == 15) {
+      UINT8 b;
+      do {
+        if (src >= src_end) return EFI_COMPROMISED_DATA;
+        b = *src++;
+        literal_len += b;
+      } while (b == 255);
+    }
+    if ((UINTN)(src_end - src) < literal_len || dst_cap - pos < literal_len) {
+      return EFI_COMPROMISED_DATA;
+    }
+    CopyMem(dst + pos, src, literal_len);
+    src += literal_len;
+    pos += literal_len;
+
+    if (src == src_end) { // 最後のシーケンスはリテラルだけ
+      break;
+    }
+
+    if (src_end - src < 2) return EFI_COMPROMISED_DATA;
+    UINTN offset = src[0] | (src[1] << 8);
+    src += 2;
+    if (offset == 0 || offset > pos) return EFI_COMPROMISED_DATA;
+
+    UINTN match_len = token & 0xf;
+    if (match_len == 15) {
+      UINT8 b;
+      do {
+        if (src >= src_end) return EFI_COMPROMISED_DATA;
+        b = *src++;
+        match_len += b;
+      } while (b == 255);
+    }
+    match_len += 4;
+    if (dst_cap - pos < match_len) return EFI_COMPROMISED_DATA;
+
+    // 参照先と書き込み先が重なることがあるので 1 バイトずつコピーする
+    for (UINTN i = 0; i < match_len; ++i, ++pos) {
+      dst[pos] = dst[pos - offset];
+    }
+  }
+
+  *dst_pos = pos;
+  return EFI_SUCCESS;
+}
+
+/** @brief ファイルの offset バイト目からの len バイトのうち，LOAD セグメントの部分を配置する */
+void PlaceLoadSegmentBytes(CONST Elf64_Phdr* phdr, Elf64_Half phnum,
+                           CONST UINT8* data, UINTN len, UINT64 offset) {
+  for (Elf64_Half i = 0; i < phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+
+    UINT64 begin = MAX(offset, phdr[i].p_offset);
+    UINT64 end = MIN(offset + len, phdr[i].p_offset + phdr[i].p_filesz);
+    if (begin < end) {
+      CopyMem((VOID*)(phdr[i].p_vaddr + (begin - phdr[i].p_offset)),
+              data + (begin - offset), end - begin);
+    }
+  }
+}
+
+/** @brief 展開した ELF の先頭からプログラムヘッダを取り出し，LOAD セグメントのページを確保する．
+ *
+ * *load_end には最後の LOAD セグメントのファイル上の終わりを返す．
+ */
+EFI_STATUS PrepareLoadSegments(CONST UINT8* image, UINTN image_size,
+                               Elf64_Ehdr* ehdr, Elf64_Phdr** phdr,
+                               UINT64* first, UINT64* last, UINT64* load_end) {
   EFI_STATUS status;
 
-  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
+  if (image_size < sizeof(Elf64_Ehdr)) {
+    return EFI_LOAD_ERROR;
+  }
+  CopyMem(ehdr, image, sizeof(Elf64_Ehdr));
+  UINTN phdr_bytes = sizeof(Elf64_Phdr) * ehdr->e_phnum;
+  if (!IsElf64(ehdr) || ehdr->e_phoff > image_size ||
+      image_size - ehdr->e_phoff < phdr_bytes) {
+    return EFI_LOAD_ERROR;
+  }
+
+  status = gBS->AllocatePool(EfiLoaderData, phdr_bytes, (VOID**)phdr);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  CopyMem(*phdr, image + ehdr->e_phoff, phdr_bytes);
+
+  CalcLoadAddressRange(*phdr, ehdr->e_phnum, first, last);
+  status = AllocateKernelPages(*first, *last);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  *load_end = 0;
+  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+    Elf64_Phdr* ph = &(*phdr)[i];
+    if (ph->p_type != PT_LOAD) continue;
+
+    SetMem((VOID*)(ph->p_vaddr + ph->p_filesz), ph->p_memsz - ph->p_filesz, 0);
+    *load_end = MAX(*load_end, ph->p_offset + ph->p_filesz);
+  }
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS GetFileSize(EFI_FILE_PROTOCOL* file, UINTN* file_size) {
+  EFI_STATUS status;
+
+  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 32;
   UINT8 file_info_buffer[file_info_size];
   status = file->GetInfo(
       file, &gEfiFileInfoGuid,
@@ -207,7 +387,19 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
   }
 
   EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
-  UINTN file_size = file_info->FileSize;
+  *file_size = file_info->FileSize;
+  return EFI_SUCCESS;
+}
+
+// day17a
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+  EFI_STATUS status;
+
+  UINTN file_size;
+  status = GetFileSize(file, &file_size);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
 
   status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
   if (EFI_ERROR(status)) {
@@ -217,6 +409,117 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
   return file->Read(file, &file_size, *buffer);
 }
 
+/** @brief LZ4 で圧縮した ELF ファイルを展開しながら，LOAD セグメントを配置する．
+ *
+ * フレームをブロックごとに読んで展開し，LOAD セグメントに含まれる部分だけを最終的なアドレスへ
+ * コピーする．圧縮したファイル全体も展開した ELF 全体もメモリに置かないので，使うメモリは
+ * 最大ブロックサイズの 2 倍と，一致の参照先として残す直前の 64KiB で済む．
+ * 最後の LOAD セグメントの終わりまで展開したら，残り（シンボルなど）は読まない．
+ *
+ * プログラムヘッダは最初のブロックに収まっていること．チェックサムは検証しない．
+ */
+EFI_STATUS LoadCompressedKernel(EFI_FILE_PROTOCOL* file,
+                                UINT64* first, UINT64* last, UINT64* entry) {
+  EFI_STATUS status;
+
+  UINT8 header[4 + 2 + 8 + 1]; // magic, FLG, BD, Content Size, HC
+  status = ReadFileAt(file, 0, 6, header);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (ReadUnaligned32((CONST UINT32*)header) != 0x184d2204) {
+    return EFI_UNSUPPORTED;
+  }
+  UINT8 flg = header[4];
+  BOOLEAN has_block_checksum = (flg >> 4) & 1;
+  BOOLEAN has_content_size = (flg >> 3) & 1;
+  BOOLEAN has_dict_id = flg & 1;
+  UINTN block_max_index = (header[5] >> 4) & 7;
+  if ((flg >> 6) != 1 || has_dict_id || block_max_index < 4) {
+    return EFI_UNSUPPORTED;
+  }
+  UINTN block_max_size = 1ul << (2 * block_max_index + 8); // 4: 64KiB 〜 7: 4MiB
+  // Content Size は使わないので HC とともに読み飛ばす
+  UINT64 file_pos = 6 + (has_content_size ? 8 : 0) + 1;
+
+  // LZ4 の一致の参照先は最大で 65535 バイト前なので，直前の 64KiB だけを残しておけばよい
+  CONST UINTN kWindowSize = 64 * 1024;
+  UINT8* block;
+  status = gBS->AllocatePool(EfiLoaderData, block_max_size + 4, (VOID**)&block);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  UINT8* window;
+  status = gBS->AllocatePool(EfiLoaderData, kWindowSize + block_max_size, (VOID**)&window);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(block);
+    return status;
+  }
+
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr* phdr = NULL;
+  UINT64 load_end = 0;
+  UINT64 offset = 0;  // window[history] が展開後の ELF ファイルの何バイト目か
+  UINTN history = 0;  // window の先頭に残した，前のブロックまでの展開結果の長さ
+  while (phdr == NULL || offset < load_end) {
+    UINT32 block_size;
+    status = ReadFileAt(file, file_pos, sizeof(block_size), &block_size);
+    if (EFI_ERROR(status)) {
+      break;
+    }
+    if (block_size == 0) { // LOAD セグメントの途中で EndMark が来た
+      status = EFI_COMPROMISED_DATA;
+      break;
+    }
+
+    BOOLEAN uncompressed = block_size >> 31;
+    block_size &= 0x7fffffffu;
+    if (block_size > block_max_size) {
+      status = EFI_COMPROMISED_DATA;
+      break;
+    }
+    UINTN read_size = block_size + (has_block_checksum ? 4 : 0);
+    status = ReadFileAt(file, file_pos + 4, read_size, block);
+    if (EFI_ERROR(status)) {
+      break;
+    }
+    file_pos += 4 + read_size;
+
+    UINTN pos = history;
+    if (uncompressed) {
+      CopyMem(window + pos, block, block_size);
+      pos += block_size;
+    } else {
+      status = Lz4DecompressBlock(block, block_size, window, &pos, history + block_max_size);
+      if (EFI_ERROR(status)) {
+        break;
+      }
+    }
+
+    if (phdr == NULL) {
+      status = PrepareLoadSegments(window, pos, &ehdr, &phdr, first, last, &load_end);
+      if (EFI_ERROR(status)) {
+        break;
+      }
+    }
+    PlaceLoadSegmentBytes(phdr, ehdr.e_phnum, window + history, pos - history, offset);
+    offset += pos - history;
+
+    history = MIN(pos, kWindowSize);
+    CopyMem(window, window + pos - history, history);
+  }
+
+  if (phdr != NULL) {
+    gBS->FreePool(phdr);
+  }
+  gBS->FreePool(window);
+  gBS->FreePool(block);
+  if (!EFI_ERROR(status)) {
+    *entry = ehdr.e_entry;
+  }
+  return status;
+}
+
 // day17a
 EFI_STATUS OpenBlockIoProtocolForLoadedImage(
     EFI_HANDLE image_handle, EFI_BLOCK_IO_PROTOCOL** block_io) {
@@ -245,25 +548,143 @@ EFI_STATUS OpenBlockIoProtocolForLoadedImage(
   return status;
 }
 
-// day17a
-EFI_STATUS ReadBlocks(
-      EFI_BLOCK_IO_PROTOCOL* block_io, UINT32 media_id,
-      UINTN read_bytes, VOID** buffer) {
+/** @brief カーネルにドライバがある（virtio-blk の）PCI デバイスなら TRUE */
+BOOLEAN KernelHasDiskDriver(EFI_PCI_IO_PROTOCOL* pci_io) {
+  UINT16 ids[2]; // Vendor ID, Device ID
+  EFI_STATUS status = pci_io->Pci.Read(pci_io, EfiPciIoWidthUint16, 0, 2, ids);
+  if (EFI_ERROR(status)) {
+    return FALSE;
+  }
+  return ids[0] == 0x1af4 && (ids[1] == 0x1001 || ids[1] == 0x1042);
+}
+
+/** @brief ローダを読み込んだブロックデバイスの情報を volume に書き込む．
+ *
+ * ボリュームの中身は読まない．カーネルが自分のドライバで必要な分だけ読む．
+ * カーネルがそのデバイスを扱えるかどうかを *kernel_has_driver に書き込む．
+ */
+EFI_STATUS GetBootVolume(EFI_HANDLE image_handle, struct BootVolume* volume,
+                         BOOLEAN* kernel_has_driver) {
+  *kernel_has_driver = FALSE;
   EFI_STATUS status;
+  EFI_BLOCK_IO_PROTOCOL* block_io;
+  status = OpenBlockIoProtocolForLoadedImage(image_handle, &block_io);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  EFI_BLOCK_IO_MEDIA* media = block_io->Media;
+  if (!media->MediaPresent) {
+    return EFI_NO_MEDIA;
+  }
+  volume->type = kBootVolumeBlockDevice;
+  volume->block_size = media->BlockSize;
+  volume->num_blocks = media->LastBlock + 1;
 
-  status = gBS->AllocatePool(EfiLoaderData, read_bytes, buffer);
+  EFI_LOADED_IMAGE_PROTOCOL* loaded_image;
+  status = gBS->OpenProtocol(
+      image_handle,
+      &gEfiLoadedImageProtocolGuid,
+      (VOID**)&loaded_image,
+      image_handle,
+      NULL,
+      EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
   if (EFI_ERROR(status)) {
     return status;
   }
 
-  status = block_io->ReadBlocks(
-      block_io,
-      media_id,
-      0, // start LBA
-      read_bytes,
-      *buffer);
+  EFI_DEVICE_PATH_PROTOCOL* device_path;
+  status = gBS->OpenProtocol(
+      loaded_image->DeviceHandle,
+      &gEfiDevicePathProtocolGuid,
+      (VOID**)&device_path,
+      image_handle,
+      NULL,
+      EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+  if (EFI_ERROR(status)) {
+    // 位置が分からなくても，ブロック数などは渡せる
+    return EFI_SUCCESS;
+  }
 
-  return status;
+  // パーティションならディスク上の開始位置をデバイスパスの HardDrive ノードから得る
+  for (EFI_DEVICE_PATH_PROTOCOL* node = device_path;
+       !IsDevicePathEnd(node); node = NextDevicePathNode(node)) {
+    if (DevicePathType(node) == MEDIA_DEVICE_PATH &&
+        DevicePathSubType(node) == MEDIA_HARDDRIVE_DP) {
+      volume->start_lba = ((HARDDRIVE_DEVICE_PATH*)node)->PartitionStart;
+    }
+  }
+
+  EFI_HANDLE pci_handle;
+  EFI_PCI_IO_PROTOCOL* pci_io;
+  status = gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &device_path, &pci_handle);
+  if (!EFI_ERROR(status)) {
+    status = gBS->OpenProtocol(
+        pci_handle,
+        &gEfiPciIoProtocolGuid,
+        (VOID**)&pci_io,
+        image_handle,
+        NULL,
+        EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+  }
+  if (!EFI_ERROR(status)) {
+    UINTN segment, bus, device, function;
+    status = pci_io->GetLocation(pci_io, &segment, &bus, &device, &function);
+    if (!EFI_ERROR(status) && segment == 0) {
+      *kernel_has_driver = KernelHasDiskDriver(pci_io);
+      volume->has_pci = 1;
+      volume->pci_bus = bus;
+      volume->pci_device = device;
+      volume->pci_function = function;
+    }
+  }
+  return EFI_SUCCESS;
+}
+
+/** @brief ローダを読み込んだボリュームの先頭から最大 16MiB をメモリに読み込む．
+ *
+ * カーネルにドライバの無いディスクから起動したときに使う．
+ * 読み込んだ範囲を volume のブロックの大きさと数に書き込む．
+ */
+EFI_STATUS ReadBootVolume(EFI_HANDLE image_handle, struct BootVolume* volume,
+                          VOID** buffer) {
+  EFI_STATUS status;
+  EFI_BLOCK_IO_PROTOCOL* block_io;
+  status = OpenBlockIoProtocolForLoadedImage(image_handle, &block_io);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  EFI_BLOCK_IO_MEDIA* media = block_io->Media;
+  UINTN volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
+  if (volume_bytes > 16 * 1024 * 1024) {
+    volume_bytes = 16 * 1024 * 1024;
+  }
+
+  status = gBS->AllocatePool(EfiLoaderData, volume_bytes, buffer);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  status = block_io->ReadBlocks(block_io, media->MediaId, 0, volume_bytes, *buffer);
+  if (EFI_ERROR(status)) {
+    gBS->FreePool(*buffer);
+    return status;
+  }
+
+  volume->type = kBootVolumeImage;
+  volume->block_size = media->BlockSize;
+  volume->num_blocks = volume_bytes / media->BlockSize;
+  return EFI_SUCCESS;
+}
+
+/** @brief 起動段階 name が終わった時点の TSC を記録する */
+void RecordBootPhase(struct BootInfo* boot_info, CONST CHAR8* name) {
+  if (boot_info->num_trace_records >= kMaxLoaderTraceRecords) {
+    return;
+  }
+  struct BootTraceRecord* record = &boot_info->trace[boot_info->num_trace_records++];
+  AsciiStrnCpyS(record->name, sizeof(record->name), name, sizeof(record->name) - 1);
+  record->tsc = AsmReadTsc();
 }
 
 EFI_STATUS EFIAPI UefiMain(
@@ -271,6 +692,9 @@ EFI_STATUS EFIAPI UefiMain(
     EFI_SYSTEM_TABLE* system_table) {
   EFI_STATUS status;
 
+  struct BootInfo boot_info = {0};
+  RecordBootPhase(&boot_info, "loader entry");
+
   Print(L"Hello, Mikan World!\n");
 
   CHAR8 memmap_buf[4096 * 4];
@@ -307,6 +731,7 @@ EFI_STATUS EFIAPI UefiMain(
       Halt();
     }
   }
+  RecordBootPhase(&boot_info, "loader memmap");
 
   EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
   status = OpenGOP(image_handle, &gop);
@@ -329,44 +754,37 @@ EFI_STATUS EFIAPI UefiMain(
   for (UINTN i = 0; i < gop->Mode->FrameBufferSize; ++i) {
     frame_buffer[i] = 255;
   }
+  RecordBootPhase(&boot_info, "loader gop");
 
   // day17a
+  // 圧縮したカーネルがあればそれを展開し，無ければ ELF ファイルを直接読み込む
   EFI_FILE_PROTOCOL* kernel_file;
+  UINT64 kernel_first_addr, kernel_last_addr, entry_addr;
   status = root_dir->Open(
-      root_dir, &kernel_file, L"\\kernel.elf",
+      root_dir, &kernel_file, L"\\kernel.elf.lz4",
       EFI_FILE_MODE_READ, 0);
-  if (EFI_ERROR(status)) {
-    Print(L"failed to open file '\\kernel.elf': %r\n", status);
-    Halt();
-  }
-
-  VOID* kernel_buffer;
-  status = ReadFile(kernel_file, &kernel_buffer);
-  if (EFI_ERROR(status)) {
-    Print(L"error: %r", status);
-    Halt();
+  if (status == EFI_SUCCESS) {
+    status = LoadCompressedKernel(kernel_file, &kernel_first_addr, &kernel_last_addr,
+                                  &entry_addr);
+  } else {
+    status = root_dir->Open(
+        root_dir, &kernel_file, L"\\kernel.elf",
+        EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(status)) {
+      Print(L"failed to open file '\\kernel.elf': %r\n", status);
+      Halt();
+    }
+    status = LoadKernelFile(kernel_file, &kernel_first_addr, &kernel_last_addr,
+                            &entry_addr);
   }
-
-  Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
-  UINT64 kernel_first_addr, kernel_last_addr;
-  CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
-
-  UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
-  status = gBS->AllocatePages(AllocateAddress, EfiLoaderData,
-                              num_pages, &kernel_first_addr);
   if (EFI_ERROR(status)) {
-    Print(L"failed to allocate pages: %r\n", status);
+    Print(L"failed to load kernel: %r\n", status);
     Halt();
   }
+  kernel_file->Close(kernel_file);
 
-  CopyLoadSegments(kernel_ehdr);
   Print(L"Kernel: 0x%0lx - 0x%0lx\n", kernel_first_addr, kernel_last_addr);
-
-  status = gBS->FreePool(kernel_buffer);
-  if (EFI_ERROR(status)) {
-    Print(L"failed to free pool: %r\n", status);
-    Halt();
-  }
+  RecordBootPhase(&boot_info, "loader load kernel");
 
   // day17a
   VOID* volume_image;
@@ -376,34 +794,43 @@ EFI_STATUS EFIAPI UefiMain(
       root_dir, &volume_file, L"\\fat_disk",
       EFI_FILE_MODE_READ, 0);
   if (status == EFI_SUCCESS) {
-    status = ReadFile(volume_file, &volume_image);
+    UINTN volume_file_size;
+    status = GetFileSize(volume_file, &volume_file_size);
+    if (!EFI_ERROR(status)) {
+      status = ReadFile(volume_file, &volume_image);
+    }
     if (EFI_ERROR(status)) {
       Print(L"failed to read volume file: %r", status);
       Halt();
     }
+    // カーネルが読み込んだ範囲の外を読まないよう，ファイルの大きさを 512 バイトのブロック数で渡す
+    boot_info.volume.type = kBootVolumeImage;
+    boot_info.volume.block_size = 512;
+    boot_info.volume.num_blocks = volume_file_size / 512;
   } else {
-    EFI_BLOCK_IO_PROTOCOL* block_io;
-    status = OpenBlockIoProtocolForLoadedImage(image_handle, &block_io);
-    if (EFI_ERROR(status)) {
-      Print(L"failed to open Block I/O Protocol: %r\n", status);
-      Halt();
-    }
-
-    EFI_BLOCK_IO_MEDIA* media = block_io->Media;
-    UINTN volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
-    if (volume_bytes > 16 * 1024 * 1024) {
-      volume_bytes = 16 * 1024 * 1024;
-    }
-
-    Print(L"Reading %lu bytes (Present %d, BlockSize %u, LastBlock %u)\n",
-        volume_bytes, media->MediaPresent, media->BlockSize, media->LastBlock);
-
-    status = ReadBlocks(block_io, media->MediaId, volume_bytes, &volume_image);
+    // カーネルがディスクを扱えれば，ボリュームは読み込まずに必要な分だけ読んでもらう
+    volume_image = NULL;
+    BOOLEAN kernel_has_driver;
+    status = GetBootVolume(image_handle, &boot_info.volume, &kernel_has_driver);
     if (EFI_ERROR(status)) {
-      Print(L"failed to read blocks: %r\n", status);
-      Halt();
+      Print(L"failed to get boot volume: %r\n", status);
+      boot_info.volume.type = kBootVolumeNone;
+    } else if (kernel_has_driver) {
+      Print(L"Boot volume: %lu blocks of %u bytes from LBA %lu (PCI %d.%d.%d)\n",
+          boot_info.volume.num_blocks, boot_info.volume.block_size,
+          boot_info.volume.start_lba, boot_info.volume.pci_bus,
+          boot_info.volume.pci_device, boot_info.volume.pci_function);
+    } else {
+      status = ReadBootVolume(image_handle, &boot_info.volume, &volume_image);
+      if (EFI_ERROR(status)) {
+        Print(L"failed to read boot volume: %r\n", status);
+        Halt();
+      }
+      Print(L"Boot volume: read %lu blocks of %u bytes\n",
+          boot_info.volume.num_blocks, boot_info.volume.block_size);
     }
   }
+  RecordBootPhase(&boot_info, "loader volume");
 
   status = gBS->ExitBootServices(image_handle, memmap.map_key);
   if (EFI_ERROR(status)) {
@@ -419,8 +846,6 @@ EFI_STATUS EFIAPI UefiMain(
     }
   }
 
-  UINT64 entry_addr = *(UINT64*)(kernel_first_addr + 24);
-
   struct FrameBufferConfig config = {
     (UINT8*)gop->Mode->FrameBufferBase,
     gop->Mode->Info->PixelsPerScanLine,
@@ -456,9 +881,11 @@ EFI_STATUS EFIAPI UefiMain(
   typedef void EntryPointType(const struct FrameBufferConfig*,
                               const struct MemoryMap*,
                               const VOID*,
-                              VOID*);
+                              VOID*,
+                              const struct BootInfo*);
   EntryPointType* entry_point = (EntryPointType*)entry_addr;
-  entry_point(&config, &memmap, acpi_table, volume_image);
+  RecordBootPhase(&boot_info, "loader exit");
+  entry_point(&config, &memmap, acpi_table, volume_image, &boot_info);
 
   Print(L"All done\n");
 
@@ -54,5 +54,11 @@ inline bool IsAvailable(MemoryType memory_type) {
     memory_type == MemoryType::kEfiConventionalMemory;
 }
 
+inline bool IsLoaderMemory(MemoryType memory_type) {
+  return
+    memory_type == MemoryType::kEfiLoaderCode ||
+    memory_type == MemoryType::kEfiLoaderData;
+}
+
 const int kUEFIPageSize = 4096;
 #endif
@@ -80,7 +80,44 @@ size_t XSDT::Count() const {
   return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
 }
 
+/** @brief 先頭のアフィニティ構造 */
+const SRAT::Entry* SRAT::begin() const {
+  return reinterpret_cast<const Entry*>(this + 1);
+}
+
+/** @brief 最後のアフィニティ構造の次 */
+const SRAT::Entry* SRAT::end() const {
+  return reinterpret_cast<const Entry*>(
+      reinterpret_cast<const uint8_t*>(this) + this->header.length);
+}
+
+/** @brief entry の次のアフィニティ構造 */
+const SRAT::Entry* SRAT::Next(const Entry* entry) {
+  return reinterpret_cast<const Entry*>(
+      reinterpret_cast<const uint8_t*>(entry) + entry->length);
+}
+
+/** @brief 行列の (from, to) 要素を返す */
+uint8_t SLIT::Distance(uint64_t from, uint64_t to) const {
+  auto matrix = reinterpret_cast<const uint8_t*>(this + 1);
+  return matrix[from * this->num_localities + to];
+}
+
+/** @brief i 番目の ECAM 領域 */
+const MCFG::Entry& MCFG::operator[](size_t i) const {
+  return reinterpret_cast<const Entry*>(this + 1)[i];
+}
+
+/** @brief ECAM 領域の個数 */
+size_t MCFG::Count() const {
+  return (this->header.length - sizeof(MCFG)) / sizeof(Entry);
+}
+
 const FADT* fadt;
+const SRAT* srat;
+const SLIT* slit;
+const MCFG* mcfg;
+const HPET* hpet;
 
 // day12b
 /**
@@ -101,6 +138,19 @@ void WaitMilliseconds(unsigned long msec) {
   while (IoIn32(fadt->pm_tmr_blk) < end);
 }
 
+uint32_t ReadPMTimer() {
+  return IoIn32(fadt->pm_tmr_blk);
+}
+
+unsigned long PMTimerElapsedMicroseconds(uint32_t start, uint32_t end) {
+  const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+  uint32_t ticks = end - start;
+  if (!pm_timer_32) {
+    ticks &= 0x00ffffffu;
+  }
+  return static_cast<uint64_t>(ticks) * 1000000 / kPMTimerFreq;
+}
+
 // day12a
 /**
  * Initialize
@@ -119,11 +169,22 @@ void Initialize(const RSDP& rsdp) {
   }
 
   fadt = nullptr;
+  srat = nullptr;
+  slit = nullptr;
+  mcfg = nullptr;
+  hpet = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto& entry = xsdt[i];
     if (entry.IsValid("FACP")) { // FACP is the signature of FADT
       fadt = reinterpret_cast<const FADT*>(&entry);
-      break;
+    } else if (entry.IsValid("SRAT")) {
+      srat = reinterpret_cast<const SRAT*>(&entry);
+    } else if (entry.IsValid("SLIT")) {
+      slit = reinterpret_cast<const SLIT*>(&entry);
+    } else if (entry.IsValid("MCFG")) {
+      mcfg = reinterpret_cast<const MCFG*>(&entry);
+    } else if (entry.IsValid("HPET")) {
+      hpet = reinterpret_cast<const HPET*>(&entry);
     }
   }
 
@@ -76,10 +76,143 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+/**
+ * SRAT
+ *   System Resource Affinity Table の構造体の定義
+ *   ヘッダの後ろに CPU やメモリと NUMA ノード（近接ドメイン）の対応が並ぶ
+ */
+struct SRAT {
+  DescriptionHeader header;
+  uint32_t reserved1;
+  uint64_t reserved2;
+
+  /** @brief アフィニティ構造の共通ヘッダ */
+  struct Entry {
+    uint8_t type;
+    uint8_t length;
+  } __attribute__((packed));
+
+  /** @brief アフィニティ構造の種類 */
+  enum EntryType {
+    kProcessorLocalAPIC = 0,
+    kMemory = 1,
+    kProcessorLocalx2APIC = 2,
+  };
+
+  /** @brief i 番目の要素の先頭を指すポインタを begin, end で辿る */
+  const Entry* begin() const;
+  const Entry* end() const;
+  static const Entry* Next(const Entry* entry);
+} __attribute__((packed));
+
+struct SRATProcessorLocalAPIC {
+  SRAT::Entry header;
+  uint8_t proximity_domain_low;
+  uint8_t apic_id;
+  uint32_t flags; // bit 0: enabled
+  uint8_t local_sapic_eid;
+  uint8_t proximity_domain_high[3];
+  uint32_t clock_domain;
+
+  uint32_t ProximityDomain() const {
+    return proximity_domain_low |
+      (proximity_domain_high[0] << 8) |
+      (proximity_domain_high[1] << 16) |
+      (proximity_domain_high[2] << 24);
+  }
+} __attribute__((packed));
+
+struct SRATMemory {
+  SRAT::Entry header;
+  uint32_t proximity_domain;
+  uint16_t reserved1;
+  uint64_t base_address;
+  uint64_t length_bytes;
+  uint32_t reserved2;
+  uint32_t flags; // bit 0: enabled, bit 1: hot pluggable, bit 2: non-volatile
+  uint64_t reserved3;
+} __attribute__((packed));
+
+struct SRATProcessorLocalx2APIC {
+  SRAT::Entry header;
+  uint16_t reserved1;
+  uint32_t proximity_domain;
+  uint32_t x2apic_id;
+  uint32_t flags; // bit 0: enabled
+  uint32_t clock_domain;
+  uint32_t reserved2;
+} __attribute__((packed));
+
+/**
+ * SLIT
+ *   System Locality Information Table の構造体の定義
+ *   近接ドメイン間の相対的な距離を num_localities x num_localities の行列で表す
+ */
+struct SLIT {
+  DescriptionHeader header;
+  uint64_t num_localities;
+
+  /** @brief 近接ドメイン from から to への距離．自分自身への距離は 10 */
+  uint8_t Distance(uint64_t from, uint64_t to) const;
+} __attribute__((packed));
+
+/**
+ * MCFG
+ *   PCI Express の ECAM（メモリマップドコンフィグレーション空間）の配置を表すテーブル
+ *   ヘッダの後ろに PCI セグメントとバス範囲ごとの ECAM 領域が並ぶ
+ */
+struct MCFG {
+  DescriptionHeader header;
+  uint64_t reserved;
+
+  struct Entry {
+    uint64_t base_address; // start_bus の領域の先頭アドレス
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+  } __attribute__((packed));
+
+  const Entry& operator[](size_t i) const;
+  size_t Count() const;
+} __attribute__((packed));
+
+/**
+ * HPET
+ *   High Precision Event Timer の配置を表すテーブル
+ *   レジスタの位置は Generic Address Structure で示される
+ */
+struct HPET {
+  DescriptionHeader header;
+  uint32_t event_timer_block_id;
+  uint8_t address_space_id; // 0 = メモリ空間
+  uint8_t register_bit_width;
+  uint8_t register_bit_offset;
+  uint8_t access_size;
+  uint64_t base_address;
+  uint8_t hpet_number;
+  uint16_t min_clock_tick;
+  uint8_t page_protection;
+} __attribute__((packed));
+
 extern const FADT* fadt;
+/** @brief SRAT と SLIT．ファームウェアが提供しなければ nullptr */
+extern const SRAT* srat;
+extern const SLIT* slit;
+/** @brief MCFG．ファームウェアが提供しなければ nullptr */
+extern const MCFG* mcfg;
+/** @brief HPET．ファームウェアが提供しなければ nullptr */
+extern const HPET* hpet;
 const int kPMTimerFreq = 3579545;
 
 void WaitMilliseconds(unsigned long msec);
+/** @brief ACPI PM タイマの現在のカウント値 */
+uint32_t ReadPMTimer();
+/** @brief ReadPMTimer() で得た start から end までの経過時間（マイクロ秒）．
+ *
+ * カウンタが 1 周（24 ビットなら約 4.7 秒）以上進んだ場合は正しく求まらない．
+ */
+unsigned long PMTimerElapsedMicroseconds(uint32_t start, uint32_t end);
 void Initialize(const RSDP& rsdp);
 
 } // namespace acpi
@@ -0,0 +1,309 @@
+#include "address_space.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include "memory_manager.hpp"
+#include "task.hpp"
+
+namespace {
+  /** @brief 複数のアドレス空間から参照されているフレームの参照数．
+   *
+   * キーはフレーム ID．登録されていないフレームは 1 つのアドレス空間だけが参照している．
+   */
+  std::map<size_t, unsigned int> frame_share_count;
+
+  /** @brief ページフォルトのエラーコード */
+  const uint64_t kPFPresent = 1u << 0;
+  const uint64_t kPFWrite   = 1u << 1;
+
+  WithError<uint64_t> AllocateZeroedFrame() {
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return {0, frame.error};
+    }
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+    return {reinterpret_cast<uint64_t>(frame.value.Frame()), MAKE_ERROR(Error::kSuccess)};
+  }
+
+  void ShareFrame(uint64_t phys_addr) {
+    auto [ it, inserted ] = frame_share_count.insert({phys_addr / kBytesPerFrame, 2});
+    if (!inserted) {
+      ++it->second;
+    }
+  }
+
+  /** @brief 参照を 1 つ減らす．まだ他から参照されていれば true を返す． */
+  bool UnshareFrame(uint64_t phys_addr) {
+    auto it = frame_share_count.find(phys_addr / kBytesPerFrame);
+    if (it == frame_share_count.end()) {
+      return false;
+    }
+    if (--it->second == 1) {
+      frame_share_count.erase(it);
+    }
+    return true;
+  }
+
+  bool IsSharedFrame(uint64_t phys_addr) {
+    return frame_share_count.count(phys_addr / kBytesPerFrame) > 0;
+  }
+
+  /** @brief フレームへの参照を手放し，誰も参照しなくなったら解放する */
+  void ReleaseFrame(uint64_t phys_addr) {
+    if (!UnshareFrame(phys_addr)) {
+      memory_manager->Free(FrameID{phys_addr / kBytesPerFrame}, 1);
+    }
+  }
+
+  /** @brief level 階層以下の末端エントリが指すフレームをすべて手放す．
+   *
+   * 大きなページはデマンドページングで割り当てたものではないので所有していない．
+   */
+  void ReleaseTableFrames(PageMapEntry* table, int level) {
+    for (int i = 0; i < 512; ++i) {
+      if (!table[i].bits.present) {
+        continue;
+      }
+      if (level == 1) {
+        ReleaseFrame(table[i].bits.addr << 12);
+      } else if (!table[i].bits.huge_page) {
+        ReleaseTableFrames(table[i].Pointer(), level - 1);
+      }
+    }
+  }
+
+  /** @brief src の内容を dst にコピーし，末端のページを両方で読み込み専用の共有にする */
+  Error CopyTableForCOW(PageMapEntry* dst, PageMapEntry* src, int level) {
+    for (int i = 0; i < 512; ++i) {
+      if (!src[i].bits.present) {
+        continue;
+      }
+
+      if (level == 1) {
+        if (src[i].bits.writable) {
+          src[i].bits.writable = 0;
+          src[i].bits.cow = 1;
+        }
+        dst[i] = src[i];
+        ShareFrame(src[i].bits.addr << 12);
+      } else if (src[i].bits.huge_page) {
+        dst[i] = src[i];
+      } else {
+        auto child = AllocateZeroedFrame();
+        if (child.error) {
+          return child.error;
+        }
+        dst[i] = src[i];
+        dst[i].SetPointer(reinterpret_cast<PageMapEntry*>(child.value));
+        if (auto err = CopyTableForCOW(dst[i].Pointer(), src[i].Pointer(), level - 1)) {
+          return err;
+        }
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
+
+AddressSpace::~AddressSpace() {
+  if (pml4_ == nullptr) {
+    return;
+  }
+
+  for (int i = kKernelPML4Entries; i < 512; ++i) {
+    if (pml4_[i].bits.present) {
+      ReleaseTableFrames(pml4_[i].Pointer(), 3);
+    }
+  }
+  FreePageMap(pml4_);
+  FreePCID(pcid_);
+}
+
+Error AddressSpace::Initialize() {
+  auto pml4 = NewPageMap();
+  if (pml4.error) {
+    return pml4.error;
+  }
+  pml4_ = pml4.value;
+  pcid_ = AllocatePCID(pml4_);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint64_t> AddressSpace::MapAnonymous(uint64_t bytes, uint64_t attr) {
+  const uint64_t addr = next_free_;
+  if (auto err = MapAnonymous(addr, bytes, attr)) {
+    return {0, err};
+  }
+  return {addr, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error AddressSpace::MapAnonymous(uint64_t addr, uint64_t bytes, uint64_t attr) {
+  if (addr % kPageSize4K != 0) {
+    return MAKE_ERROR(Error::kNotAligned);
+  }
+  if (addr < kTaskSpaceBegin) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  const uint64_t end = addr + (bytes + kPageSize4K - 1) / kPageSize4K * kPageSize4K;
+  for (const auto& r : regions_) {
+    if (addr < r.end && r.begin < end) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+  }
+
+  regions_.push_back({addr, end, attr});
+  next_free_ = std::max(next_free_, end);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AddressSpace::Unmap(uint64_t addr) {
+  auto it = std::find_if(regions_.begin(), regions_.end(),
+                         [addr](const Region& r) { return r.begin == addr; });
+  if (it == regions_.end()) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  for (uint64_t page = it->begin; page < it->end; page += kPageSize4K) {
+    if (auto entry = FindPageEntry(pml4_, page)) {
+      ReleaseFrame(entry->bits.addr << 12);
+    }
+  }
+  if (auto err = UnmapRange(pml4_, it->begin, it->end - it->begin)) {
+    return err;
+  }
+  FlushTLB(pml4_, it->begin, it->end - it->begin);
+
+  regions_.erase(it);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<std::unique_ptr<AddressSpace>> AddressSpace::Clone() {
+  auto space = std::make_unique<AddressSpace>();
+  if (auto err = space->Initialize()) {
+    return {nullptr, err};
+  }
+
+  for (int i = kKernelPML4Entries; i < 512; ++i) {
+    if (!pml4_[i].bits.present) {
+      continue;
+    }
+    auto child = AllocateZeroedFrame();
+    if (child.error) {
+      return {nullptr, child.error};
+    }
+    space->pml4_[i] = pml4_[i];
+    space->pml4_[i].SetPointer(reinterpret_cast<PageMapEntry*>(child.value));
+    if (auto err = CopyTableForCOW(space->pml4_[i].Pointer(), pml4_[i].Pointer(), 3)) {
+      return {nullptr, err};
+    }
+  }
+  space->regions_ = regions_;
+  space->next_free_ = next_free_;
+
+  // 元のアドレス空間のページも読み込み専用にしたので，書き込み可能なエントリを TLB から除く
+  for (const auto& r : regions_) {
+    FlushTLB(pml4_, r.begin, r.end - r.begin);
+  }
+  return {std::move(space), MAKE_ERROR(Error::kSuccess)};
+}
+
+Error AddressSpace::HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+  const Region* region = FindRegion(causal_addr);
+  if (region == nullptr) {
+    return MAKE_ERROR(Error::kUnhandledPageFault);
+  }
+  const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+
+  if ((error_code & kPFPresent) == 0) {
+    // 初めてのアクセス：0 で埋めたフレームを割り当てる
+    auto frame = AllocateZeroedFrame();
+    if (frame.error) {
+      return frame.error;
+    }
+    ++stats_.demand_faults;
+    return MapRange(pml4_, page, frame.value, kPageSize4K, region->attr);
+  }
+
+  auto entry = FindPageEntry(pml4_, page);
+  if ((error_code & kPFWrite) == 0 || entry == nullptr || !entry->bits.cow ||
+      (region->attr & page_attr::kWritable) == 0) {
+    return MAKE_ERROR(Error::kUnhandledPageFault);
+  }
+
+  // コピーオンライト：他のアドレス空間と共有していればコピーし，そうでなければそのまま使う
+  const uint64_t phys_addr = entry->bits.addr << 12;
+  if (IsSharedFrame(phys_addr)) {
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return frame.error;
+    }
+    memcpy(frame.value.Frame(), reinterpret_cast<const void*>(phys_addr), kBytesPerFrame);
+    UnshareFrame(phys_addr);
+    entry->bits.addr = frame.value.ID();
+  }
+  entry->bits.cow = 0;
+  entry->bits.writable = 1;
+  ++stats_.cow_faults;
+  FlushTLB(pml4_, page, kPageSize4K);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+const AddressSpace::Region* AddressSpace::FindRegion(uint64_t addr) const {
+  for (const auto& r : regions_) {
+    if (r.begin <= addr && addr < r.end) {
+      return &r;
+    }
+  }
+  return nullptr;
+}
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+  if (task_manager == nullptr) {
+    return MAKE_ERROR(Error::kUnhandledPageFault);
+  }
+  auto space = task_manager->CurrentTask().Space();
+  if (space == nullptr) {
+    return MAKE_ERROR(Error::kUnhandledPageFault);
+  }
+  return space->HandlePageFault(error_code, causal_addr);
+}
+
+Error CheckPageFaultHandling(AddressSpace& space) {
+  auto [ addr, err ] = space.MapAnonymous(2 * kPageSize4K, page_attr::kWritable);
+  if (err) {
+    return err;
+  }
+  auto words = reinterpret_cast<volatile uint64_t*>(addr);
+  const size_t kWordsPerPage = kPageSize4K / sizeof(uint64_t);
+  const auto before = space.FaultStats();
+
+  // 書き込みと読み込みのそれぞれで，まだフレームの無いページに触れる
+  words[0] = 0x1234;
+  const uint64_t untouched = words[kWordsPerPage];
+  if (words[0] != 0x1234 || untouched != 0 ||
+      space.FaultStats().demand_faults != before.demand_faults + 2) {
+    space.Unmap(addr);
+    return MAKE_ERROR(Error::kUnhandledPageFault);
+  }
+
+  // 複製した空間と共有しているページに書き込むと，自分の側にだけコピーが作られる
+  auto [ clone, clone_err ] = space.Clone();
+  if (clone_err) {
+    space.Unmap(addr);
+    return clone_err;
+  }
+  words[0] = 0x5678;
+  auto clone_entry = FindPageEntry(clone->PageMap(), addr);
+  const bool copied = clone_entry &&
+    *reinterpret_cast<const uint64_t*>(clone_entry->bits.addr << 12) == 0x1234;
+  const bool ok = copied && words[0] == 0x5678 &&
+    space.FaultStats().cow_faults == before.cow_faults + 1;
+
+  clone.reset();
+  if (auto err = space.Unmap(addr)) {
+    return err;
+  }
+  return ok ? MAKE_ERROR(Error::kSuccess) : MAKE_ERROR(Error::kUnhandledPageFault);
+}
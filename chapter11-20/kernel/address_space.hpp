@@ -0,0 +1,95 @@
+/**
+ * @file address_space.hpp
+ *
+ * タスクごとの仮想アドレス空間（デマンドページング，コピーオンライト）を集めたファイル．
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "error.hpp"
+#include "paging.hpp"
+
+/** @brief タスク用の領域の先頭アドレス．カーネル領域と重ならない上位半分に置く． */
+const uint64_t kTaskSpaceBegin = 0xffff800000000000;
+
+/** @brief タスク用の仮想アドレス空間．
+ *
+ * 匿名メモリ領域は予約するだけで，物理フレームはページフォルトが起きたときに割り当てる．
+ * Clone で作ったアドレス空間とは書き込まれるまで物理フレームを共有する（コピーオンライト）．
+ */
+class AddressSpace {
+ public:
+  /** @brief 処理したページフォルトの数 */
+  struct Stats {
+    uint64_t demand_faults, cow_faults;
+  };
+
+  /** @brief 予約済みの匿名メモリ領域 [begin, end) */
+  struct Region {
+    uint64_t begin, end;
+    uint64_t attr;
+  };
+
+  AddressSpace() = default;
+  AddressSpace(const AddressSpace&) = delete;
+  AddressSpace& operator=(const AddressSpace&) = delete;
+  ~AddressSpace();
+
+  /** @brief ページマップと PCID を確保する． */
+  Error Initialize();
+
+  PageMapEntry* PageMap() const { return pml4_; }
+  uint16_t PCID() const { return pcid_; }
+
+  /** @brief bytes バイトの匿名メモリ領域を予約し，その先頭アドレスを返す． */
+  WithError<uint64_t> MapAnonymous(uint64_t bytes, uint64_t attr);
+
+  /** @brief addr から bytes バイトの匿名メモリ領域を予約する． */
+  Error MapAnonymous(uint64_t addr, uint64_t bytes, uint64_t attr);
+
+  /** @brief MapAnonymous で予約した領域を解放する．割り当て済みのフレームも解放する． */
+  Error Unmap(uint64_t addr);
+
+  /** @brief このアドレス空間の複製を作る．
+   *
+   * 割り当て済みのフレームは両方のアドレス空間で読み込み専用にして共有し，
+   * 書き込まれたときにコピーする．
+   */
+  WithError<std::unique_ptr<AddressSpace>> Clone();
+
+  /** @brief このアドレス空間で起きたページフォルトを処理する．
+   *
+   * @param error_code  CPU が積んだエラーコード
+   * @param causal_addr フォルトの原因となったアドレス（CR2）
+   */
+  Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+  const Stats& FaultStats() const { return stats_; }
+
+ private:
+  PageMapEntry* pml4_{nullptr};
+  uint16_t pcid_{0};
+  std::vector<Region> regions_{};
+  /** @brief 次に MapAnonymous(bytes, attr) で予約する候補のアドレス */
+  uint64_t next_free_{kTaskSpaceBegin};
+  Stats stats_{};
+
+  const Region* FindRegion(uint64_t addr) const;
+};
+
+/** @brief 現在のタスクのアドレス空間でページフォルトを処理する．
+ *
+ * 割り込みハンドラから呼ばれる．処理できなかった場合はエラーを返す．
+ */
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+/** @brief デマンドページングとコピーオンライトが働くことを確かめる．
+ *
+ * space は現在のタスクのアドレス空間でなければならない．匿名メモリ領域に触れてページフォルトを起こし，
+ * Clone した空間とフレームを共有した状態で書き込んでコピーオンライトを起こす．
+ */
+Error CheckPageFaultHandling(AddressSpace& space);
@@ -84,6 +84,49 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR2  ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
+InvalidateTLB:
+    invlpg [rdi]
+    ret
+
+global CPUID  ; void CPUID(uint32_t eax, uint32_t ecx, uint32_t* eax_out,
+              ;            uint32_t* ebx_out, uint32_t* ecx_out, uint32_t* edx_out);
+CPUID:
+    push rbx
+    mov r10, rdx  ; eax_out
+    mov r11, rcx  ; ebx_out
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -153,8 +196,16 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     ; コンテキストの復帰
     fxrstor [rdi + 0xc0]
 
+    ; CR3 が変わらなければ書き込まない（書き込むと TLB が破棄される）．
+    ; 読み出した CR3 にはビット 63（no-flush）が現れないので除いて比較する
     mov rax, [rdi + 0x00]
+    mov rcx, rax
+    btr rcx, 63
+    mov rdx, cr3
+    cmp rcx, rdx
+    je .skip_cr3
     mov cr3, rax
+.skip_cr3:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -12,5 +12,12 @@ extern "C" {
   void SetDSAll(uint16_t value);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR2();
+  void SetCR4(uint64_t value);
+  uint64_t GetCR4();
+  void InvalidateTLB(uint64_t addr);
+  void CPUID(uint32_t eax, uint32_t ecx, uint32_t* eax_out, uint32_t* ebx_out,
+             uint32_t* ecx_out, uint32_t* edx_out);
   void SwitchContext(void* next_ctx, void* current_ctx);
+  uint64_t ReadTSC();
 }
@@ -0,0 +1,261 @@
+#include "block_device.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+
+MemoryBlockDevice::MemoryBlockDevice(void* image, size_t block_size, uint64_t num_blocks)
+    : image_{reinterpret_cast<uint8_t*>(image)},
+      block_size_{block_size}, num_blocks_{num_blocks} {
+}
+
+Error MemoryBlockDevice::Read(uint64_t lba, size_t num_blocks, void* buf) {
+  if (lba + num_blocks > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  memcpy(buf, image_ + lba * block_size_, num_blocks * block_size_);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MemoryBlockDevice::Write(uint64_t lba, size_t num_blocks, const void* buf) {
+  if (lba + num_blocks > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  memcpy(image_ + lba * block_size_, buf, num_blocks * block_size_);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+PartitionBlockDevice::PartitionBlockDevice(BlockDevice& disk,
+                                           uint64_t start_lba, uint64_t num_blocks)
+    : disk_{disk}, start_lba_{start_lba}, num_blocks_{num_blocks} {
+}
+
+Error PartitionBlockDevice::Read(uint64_t lba, size_t num_blocks, void* buf) {
+  if (lba + num_blocks > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return disk_.Read(start_lba_ + lba, num_blocks, buf);
+}
+
+Error PartitionBlockDevice::Write(uint64_t lba, size_t num_blocks, const void* buf) {
+  if (lba + num_blocks > num_blocks_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return disk_.Write(start_lba_ + lba, num_blocks, buf);
+}
+
+BlockCache::BlockCache(BlockDevice& dev)
+    : dev_{dev}, block_size_{dev.BlockSize()},
+      entries_(kNumEntries), data_(kNumEntries * dev.BlockSize()),
+      read_ahead_buf_(kMaxReadAhead * dev.BlockSize()) {
+}
+
+Error BlockCache::Read(uint64_t offset, void* buf, size_t len) {
+  auto dst = reinterpret_cast<uint8_t*>(buf);
+  while (len > 0) {
+    const uint64_t lba = offset / block_size_;
+    const size_t in_block = offset % block_size_;
+
+    // 先読みの単位を超える連続領域はキャッシュを通さずに 1 度に読む
+    const size_t num_whole_blocks = in_block == 0 ? len / block_size_ : 0;
+    if (num_whole_blocks >= kMaxReadAhead) {
+      if (auto err = ReadBlocks(lba, num_whole_blocks, dst)) {
+        return err;
+      }
+      const size_t n = num_whole_blocks * block_size_;
+      dst += n;
+      offset += n;
+      len -= n;
+      continue;
+    }
+
+    const size_t n = std::min(len, block_size_ - in_block);
+    auto [ data, err ] = Lookup(lba);
+    if (err) {
+      return err;
+    }
+    memcpy(dst, data + in_block, n);
+    dst += n;
+    offset += n;
+    len -= n;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error BlockCache::Write(uint64_t offset, const void* buf, size_t len) {
+  auto src = reinterpret_cast<const uint8_t*>(buf);
+  while (len > 0) {
+    const uint64_t lba = offset / block_size_;
+    const size_t in_block = offset % block_size_;
+
+    const size_t num_whole_blocks = in_block == 0 ? len / block_size_ : 0;
+    if (num_whole_blocks > 0) {
+      if (auto err = WriteBlocks(lba, num_whole_blocks, src)) {
+        return err;
+      }
+      const size_t n = num_whole_blocks * block_size_;
+      src += n;
+      offset += n;
+      len -= n;
+      continue;
+    }
+
+    // ブロックの一部だけを書く場合は，残りの部分を読んでから書き戻す
+    const size_t n = std::min(len, block_size_ - in_block);
+    auto [ data, err ] = Lookup(lba);
+    if (err) {
+      return err;
+    }
+    memcpy(data + in_block, src, n);
+    if (auto err = dev_.Write(lba, 1, data)) {
+      return err;
+    }
+    src += n;
+    offset += n;
+    len -= n;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error BlockCache::ReadBlocks(uint64_t lba, size_t num_blocks, void* buf) {
+  ++stats_.device_reads;
+  return dev_.Read(lba, num_blocks, buf);
+}
+
+Error BlockCache::WriteBlocks(uint64_t lba, size_t num_blocks, const void* buf) {
+  if (auto err = dev_.Write(lba, num_blocks, buf)) {
+    return err;
+  }
+  auto src = reinterpret_cast<const uint8_t*>(buf);
+  for (auto it = index_.lower_bound(lba);
+       it != index_.end() && it->first < lba + num_blocks; ++it) {
+    memcpy(EntryData(it->second), src + (it->first - lba) * block_size_, block_size_);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint8_t*> BlockCache::Lookup(uint64_t lba) {
+  if (auto it = index_.find(lba); it != index_.end()) {
+    ++stats_.hits;
+    entries_[it->second].last_use = ++clock_;
+    return {EntryData(it->second), MAKE_ERROR(Error::kSuccess)};
+  }
+  ++stats_.misses;
+
+  if (lba >= dev_.NumBlocks()) {
+    return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+  }
+
+  // 続きのブロックも読むことが多いので，キャッシュに無い範囲をまとめて読む
+  size_t num_blocks = 1;
+  while (num_blocks < kMaxReadAhead && lba + num_blocks < dev_.NumBlocks() &&
+         index_.count(lba + num_blocks) == 0) {
+    ++num_blocks;
+  }
+  if (auto err = ReadBlocks(lba, num_blocks, read_ahead_buf_.data())) {
+    return {nullptr, err};
+  }
+
+  // 先読みした分を先に入れ，要求されたブロックを最も新しく使ったものにする
+  for (size_t i = num_blocks - 1; i > 0; --i) {
+    Insert(lba + i, &read_ahead_buf_[i * block_size_]);
+  }
+  const size_t i = Insert(lba, read_ahead_buf_.data());
+  return {EntryData(i), MAKE_ERROR(Error::kSuccess)};
+}
+
+size_t BlockCache::Insert(uint64_t lba, const void* data) {
+  size_t victim = 0;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (!entries_[i].valid) {
+      victim = i;
+      break;
+    }
+    if (entries_[i].last_use < entries_[victim].last_use) {
+      victim = i;
+    }
+  }
+
+  auto& entry = entries_[victim];
+  if (entry.valid) {
+    index_.erase(entry.lba);
+  }
+  entry = Entry{lba, ++clock_, true};
+  index_[lba] = victim;
+  memcpy(EntryData(victim), data, block_size_);
+  return victim;
+}
+
+void RegisterBlockDevice(BlockDevice* dev) {
+  Log(kInfo, "block device %s: %lu blocks of %lu bytes\n",
+      dev->Name(), dev->NumBlocks(), dev->BlockSize());
+  block_devices.push_back(dev);
+}
+
+namespace {
+  /** @brief BPB から求めたボリュームのバイト数 */
+  size_t FileSystemBytes(const void* volume_image) {
+    const size_t kMaxVolumeBytes = 16 * 1024 * 1024;
+    auto p = reinterpret_cast<const uint8_t*>(volume_image);
+
+    const uint16_t bytes_per_sector = p[11] | (p[12] << 8);
+    const uint16_t total_sectors_16 = p[19] | (p[20] << 8);
+    const uint32_t total_sectors_32 = p[32] | (p[33] << 8) | (p[34] << 16) | (p[35] << 24);
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 ||
+        (bytes_per_sector & (bytes_per_sector - 1)) != 0) {
+      return kMaxVolumeBytes;
+    }
+
+    const size_t total_sectors = total_sectors_16 != 0 ? total_sectors_16 : total_sectors_32;
+    return total_sectors * bytes_per_sector;
+  }
+}
+
+size_t VolumeImageBytes(const BootVolume& info, const void* volume_image) {
+  const size_t loaded_bytes = info.num_blocks * info.block_size;
+  // BPB を含む先頭のセクタすら読み込まれていなければ使えない
+  if (loaded_bytes < 512) {
+    return 0;
+  }
+  return std::min(FileSystemBytes(volume_image), loaded_bytes);
+}
+
+Error InitializeBootVolume(const BootVolume& info, void* volume_image) {
+  if (info.type == kBootVolumeImage && volume_image) {
+    const size_t kBlockSize = 512;
+    boot_volume = new MemoryBlockDevice{
+      volume_image, kBlockSize, VolumeImageBytes(info, volume_image) / kBlockSize};
+  } else if (info.type == kBootVolumeBlockDevice && info.has_pci) {
+    auto it = std::find_if(block_devices.begin(), block_devices.end(), [&](BlockDevice* dev) {
+      auto pci_dev = dev->PCIDevice();
+      return pci_dev && pci_dev->bus == info.pci_bus &&
+        pci_dev->device == info.pci_device && pci_dev->function == info.pci_function;
+    });
+    if (it == block_devices.end()) {
+      Log(kWarn, "no driver for the boot disk %d.%d.%d\n",
+          info.pci_bus, info.pci_device, info.pci_function);
+      return MAKE_ERROR(Error::kUnknownDevice);
+    }
+
+    BlockDevice& disk = **it;
+    if (disk.BlockSize() != info.block_size) {
+      // ローダの数えたブロックの大きさが違う場合はバイト数から換算する
+      const uint64_t start_bytes = info.start_lba * info.block_size;
+      const uint64_t volume_bytes = info.num_blocks * info.block_size;
+      boot_volume = new PartitionBlockDevice{
+        disk, start_bytes / disk.BlockSize(), volume_bytes / disk.BlockSize()};
+    } else if (info.start_lba != 0 || info.num_blocks != disk.NumBlocks()) {
+      boot_volume = new PartitionBlockDevice{disk, info.start_lba, info.num_blocks};
+    } else {
+      boot_volume = &disk;
+    }
+  } else {
+    return MAKE_ERROR(Error::kUnknownDevice);
+  }
+
+  boot_volume_cache = new BlockCache{*boot_volume};
+  Log(kInfo, "boot volume: %lu blocks of %lu bytes on %s\n",
+      boot_volume->NumBlocks(), boot_volume->BlockSize(), boot_volume->Name());
+  return MAKE_ERROR(Error::kSuccess);
+}
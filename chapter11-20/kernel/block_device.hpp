@@ -0,0 +1,162 @@
+/**
+ * @file block_device.hpp
+ *
+ * ブロックデバイスの共通インターフェースと，ブロック単位のキャッシュ．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "boot_info.hpp"
+#include "error.hpp"
+#include "pci.hpp"
+
+/** @brief ブロック単位で読み書きするデバイス．
+ *
+ * Read / Write は完了するまで戻らない．1 度に 1 つの要求だけを扱うので，
+ * 複数のタスクから使う場合は呼び出し側で排他すること．
+ * buf は現在のアドレス空間で読み書きできればよく，DMA できる物理アドレスへの対応は
+ * 各ドライバが受け持つ．
+ */
+class BlockDevice {
+ public:
+  virtual ~BlockDevice() = default;
+  virtual const char* Name() const = 0;
+  /** @brief 1 ブロックのバイト数 */
+  virtual size_t BlockSize() const = 0;
+  virtual uint64_t NumBlocks() const = 0;
+  /** @brief lba から num_blocks ブロックを buf に読む */
+  virtual Error Read(uint64_t lba, size_t num_blocks, void* buf) = 0;
+  /** @brief buf の num_blocks ブロックを lba から書く */
+  virtual Error Write(uint64_t lba, size_t num_blocks, const void* buf) = 0;
+  /** @brief デバイスが PCI デバイスなら，その PCI デバイス．そうでなければ nullptr． */
+  virtual const pci::Device* PCIDevice() const { return nullptr; }
+};
+
+/** @brief メモリ上のボリュームイメージをブロックデバイスとして扱う */
+class MemoryBlockDevice : public BlockDevice {
+ public:
+  MemoryBlockDevice(void* image, size_t block_size, uint64_t num_blocks);
+
+  const char* Name() const override { return "memory"; }
+  size_t BlockSize() const override { return block_size_; }
+  uint64_t NumBlocks() const override { return num_blocks_; }
+  Error Read(uint64_t lba, size_t num_blocks, void* buf) override;
+  Error Write(uint64_t lba, size_t num_blocks, const void* buf) override;
+
+ private:
+  uint8_t* const image_;
+  const size_t block_size_;
+  const uint64_t num_blocks_;
+};
+
+/** @brief 別のブロックデバイスの一部（パーティション）を 1 つのデバイスとして扱う */
+class PartitionBlockDevice : public BlockDevice {
+ public:
+  PartitionBlockDevice(BlockDevice& disk, uint64_t start_lba, uint64_t num_blocks);
+
+  const char* Name() const override { return "partition"; }
+  size_t BlockSize() const override { return disk_.BlockSize(); }
+  uint64_t NumBlocks() const override { return num_blocks_; }
+  Error Read(uint64_t lba, size_t num_blocks, void* buf) override;
+  Error Write(uint64_t lba, size_t num_blocks, const void* buf) override;
+  const pci::Device* PCIDevice() const override { return disk_.PCIDevice(); }
+
+ private:
+  BlockDevice& disk_;
+  const uint64_t start_lba_, num_blocks_;
+};
+
+/** @brief ブロックデバイスの読み出しをブロック単位でキャッシュする．
+ *
+ * 最近使ったブロックを kNumEntries 個まで保持し，溢れたら最も長く使っていないものを捨てる．
+ * キャッシュに無いブロックを読むときは，続くブロックもまとめて読んでおく．
+ * 書き込みはデバイスへ直ちに書き，キャッシュにある分も更新する（ライトスルー）．
+ */
+class BlockCache {
+ public:
+  static const size_t kNumEntries = 256;
+  /** @brief キャッシュに無いブロックを読むときに 1 度に読む最大のブロック数 */
+  static const size_t kMaxReadAhead = 8;
+
+  struct Stats {
+    uint64_t hits, misses, device_reads;
+  };
+
+  explicit BlockCache(BlockDevice& dev);
+
+  BlockDevice& Device() { return dev_; }
+  size_t BlockSize() const { return block_size_; }
+  const Stats& GetStats() const { return stats_; }
+
+  /** @brief ボリューム先頭から offset バイト目の len バイトを buf に読む．
+   *
+   * ブロック境界から始まる kMaxReadAhead ブロック以上の部分は，キャッシュを通さずに 1 度に読む．
+   */
+  Error Read(uint64_t offset, void* buf, size_t len);
+  /** @brief buf の len バイトをボリューム先頭から offset バイト目に書く．
+   *
+   * ブロック全体を覆う部分はまとめて 1 度に書く．
+   */
+  Error Write(uint64_t offset, const void* buf, size_t len);
+
+  /** @brief キャッシュを通さずに lba から num_blocks ブロックを読む．
+   *
+   * 大きな連続領域を読むときに使い，キャッシュの中身を追い出さない．
+   * 書き込みはライトスルーなので，キャッシュにある内容とは常に一致する．
+   */
+  Error ReadBlocks(uint64_t lba, size_t num_blocks, void* buf);
+  /** @brief キャッシュを通さずに書く．キャッシュにあるブロックは書いた内容で更新する． */
+  Error WriteBlocks(uint64_t lba, size_t num_blocks, const void* buf);
+
+ private:
+  struct Entry {
+    uint64_t lba;
+    uint64_t last_use;
+    bool valid;
+  };
+
+  BlockDevice& dev_;
+  const size_t block_size_;
+  std::vector<Entry> entries_;
+  /** @brief entries_[i] のデータは data_[i * block_size_] から */
+  std::vector<uint8_t> data_;
+  /** @brief LBA からエントリの番号を引く索引 */
+  std::map<uint64_t, size_t> index_;
+  std::vector<uint8_t> read_ahead_buf_;
+  uint64_t clock_{0};
+  Stats stats_{};
+
+  uint8_t* EntryData(size_t i) { return &data_[i * block_size_]; }
+  /** @brief lba のブロックのデータを返す．キャッシュに無ければ読み込む． */
+  WithError<uint8_t*> Lookup(uint64_t lba);
+  /** @brief 空きか最も長く使っていないエントリに lba を割り当てる */
+  size_t Insert(uint64_t lba, const void* data);
+};
+
+/** @brief 見つかったブロックデバイス */
+inline std::vector<BlockDevice*> block_devices;
+
+/** @brief ローダが起動したボリューム．無ければ nullptr． */
+inline BlockDevice* boot_volume = nullptr;
+inline BlockCache* boot_volume_cache = nullptr;
+
+void RegisterBlockDevice(BlockDevice* dev);
+
+/** @brief メモリ上のボリュームイメージのうち，ファイルシステムが使う範囲のバイト数を返す．
+ *
+ * FAT の BPB から求める．BPB が読めなければローダが読み込む上限の 16MiB とみなす．
+ * いずれの場合もローダが読み込んだ範囲（info のブロック数）を超えない．
+ */
+size_t VolumeImageBytes(const BootVolume& info, const void* volume_image);
+
+/** @brief ローダから受け取った情報をもとに boot_volume と boot_volume_cache を設定する．
+ *
+ * ボリュームがブロックデバイス上にある場合は，PCI の位置が一致するブロックデバイスを探すので，
+ * PCI デバイスのドライバを結び付けた後に呼び出す．
+ */
+Error InitializeBootVolume(const BootVolume& info, void* volume_image);
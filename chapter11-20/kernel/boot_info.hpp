@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+/** @brief ローダが記録できる起動段階の最大数 */
+enum { kMaxLoaderTraceRecords = 16 };
+
+/** @brief 起動段階が終わった時点の TSC */
+struct BootTraceRecord {
+  char name[24];
+  uint64_t tsc;
+};
+
+/** @brief ローダがボリュームを渡した方法 */
+enum {
+  kBootVolumeNone,        // ボリュームが無い
+  kBootVolumeImage,       // ボリュームをメモリに読み込んだ（volume_image）．読み込んだのは num_blocks 個のブロック
+  kBootVolumeBlockDevice, // 読み込まず，ブロックデバイスの位置だけを渡した
+};
+
+/** @brief ローダが起動したブロックデバイス上のボリュームの情報 */
+struct BootVolume {
+  uint32_t type;
+  /** @brief 1 ブロックのバイト数 */
+  uint32_t block_size;
+  /** @brief ボリュームのブロック数 */
+  uint64_t num_blocks;
+  /** @brief ディスク先頭からボリューム（パーティション）先頭までのブロック数 */
+  uint64_t start_lba;
+  /** @brief ディスクを持つ PCI デバイスの位置．has_pci が 0 なら分からない． */
+  uint8_t has_pci, pci_bus, pci_device, pci_function;
+};
+
+/** @brief ローダからカーネルへ渡す起動時の情報 */
+struct BootInfo {
+  uint32_t num_trace_records;
+  struct BootTraceRecord trace[kMaxLoaderTraceRecords];
+  struct BootVolume volume;
+};
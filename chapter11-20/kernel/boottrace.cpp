@@ -0,0 +1,63 @@
+#include "boottrace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include "asmfunc.h"
+#include "timer.hpp"
+
+namespace {
+  struct Record {
+    const char* name;
+    uint64_t tsc;
+  };
+
+  /** @brief 名前を参照し続けるためのローダの記録のコピー */
+  BootInfo loader_info;
+  std::array<Record, 64> records;
+  size_t num_records = 0;
+
+  /** @brief tsc_freq が分かっていれば cycles を us に変換する */
+  unsigned long ToMicroseconds(uint64_t cycles) {
+    if (tsc_freq == 0) {
+      return cycles;
+    }
+    return cycles / (tsc_freq / 1000000);
+  }
+}
+
+void InitializeBootTrace(const BootInfo* boot_info) {
+  num_records = 0;
+  if (boot_info) {
+    loader_info = *boot_info;
+    const uint32_t n = std::min<uint32_t>(loader_info.num_trace_records,
+                                          kMaxLoaderTraceRecords);
+    for (uint32_t i = 0; i < n; ++i) {
+      auto& record = loader_info.trace[i];
+      record.name[sizeof(record.name) - 1] = '\0';
+      records[num_records++] = {record.name, record.tsc};
+    }
+  }
+  RecordBootPhase("kernel entry");
+}
+
+void RecordBootPhase(const char* name) {
+  if (num_records < records.size()) {
+    records[num_records++] = {name, ReadTSC()};
+  }
+}
+
+void PrintBootTimeline(const std::function<void (const char* line)>& print) {
+  char line[128];
+  sprintf(line, "%-24s %10s %10s\n", "phase",
+          tsc_freq ? "at[us]" : "at[cyc]", tsc_freq ? "delta[us]" : "delta[cyc]");
+  print(line);
+
+  for (size_t i = 0; i < num_records; ++i) {
+    const uint64_t at = records[i].tsc - records[0].tsc;
+    const uint64_t delta = i == 0 ? 0 : records[i].tsc - records[i - 1].tsc;
+    sprintf(line, "%-24s %10lu %10lu\n",
+            records[i].name, ToMicroseconds(at), ToMicroseconds(delta));
+    print(line);
+  }
+}
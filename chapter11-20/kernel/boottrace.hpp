@@ -0,0 +1,31 @@
+/**
+ * @file boottrace.hpp
+ *
+ * 起動段階ごとの所要時間を TSC で記録する．
+ */
+
+#pragma once
+
+#include <functional>
+
+#include "boot_info.hpp"
+
+/** @brief ローダが記録した起動段階を取り込み，カーネルの記録を始める．
+ *
+ * boot_info はローダのスタックにあるので，メモリ管理の初期化より前に呼ぶこと．
+ */
+void InitializeBootTrace(const BootInfo* boot_info);
+
+/** @brief 起動段階 name が終わった時点の TSC を記録する．
+ *
+ * name は文字列リテラルなど，記録を出力し終えるまで有効なものを渡す．
+ */
+void RecordBootPhase(const char* name);
+
+/** @brief 記録した起動段階を 1 行ずつ print に渡す．
+ *
+ * 1 行は段階の名前，ローダの開始からの時刻，直前の段階からの所要時間（いずれも us）．
+ * 行の書式は固定なので，ビルド間で出力を diff すれば遅くなった段階が分かる．
+ * TSC の周波数が未測定なら時刻の代わりにサイクル数を出力する．
+ */
+void PrintBootTimeline(const std::function<void (const char* line)>& print);
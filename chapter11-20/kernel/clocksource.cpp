@@ -0,0 +1,106 @@
+#include "clocksource.hpp"
+
+#include <algorithm>
+#include <vector>
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "hpet.hpp"
+#include "logger.hpp"
+
+namespace {
+  std::vector<ClockSource*> clock_sources;
+
+  class PMTimerClockSource : public ClockSource {
+   public:
+    const char* Name() const override { return "acpi_pm"; }
+    uint64_t Read() const override { return acpi::ReadPMTimer(); }
+    uint64_t Mask() const override {
+      const bool pm_timer_32 = (acpi::fadt->flags >> 8) & 1;
+      return pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+    }
+    uint64_t Frequency() const override { return acpi::kPMTimerFreq; }
+    int Rating() const override { return 200; } // I/O ポートの読み出しは遅い
+  };
+
+  class TSCClockSource : public ClockSource {
+   public:
+    explicit TSCClockSource(uint64_t freq) : freq_{freq} {}
+    const char* Name() const override { return "tsc"; }
+    uint64_t Read() const override { return ReadTSC(); }
+    uint64_t Mask() const override { return ~uint64_t{0}; }
+    uint64_t Frequency() const override { return freq_; }
+    int Rating() const override { return 300; }
+    bool IsReference() const override { return false; } // 周波数は他のタイマで求めたもの
+
+   private:
+    uint64_t freq_;
+  };
+
+  bool HasInvariantTSC() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) {
+      return false;
+    }
+    CPUID(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+  }
+
+  ClockSource* Best(bool reference_only) {
+    ClockSource* best = nullptr;
+    for (auto source : clock_sources) {
+      if (reference_only && !source->IsReference()) {
+        continue;
+      }
+      if (best == nullptr || best->Rating() < source->Rating()) {
+        best = source;
+      }
+    }
+    return best;
+  }
+}
+
+void InitializeClockSources() {
+  RegisterClockSource(new PMTimerClockSource);
+  if (acpi::hpet) {
+    if (auto [source, err] = InitializeHPET(*acpi::hpet); err) {
+      Log(kWarn, "HPET is not available: %s\n", err.Name());
+    } else {
+      RegisterClockSource(source);
+    }
+  }
+}
+
+void RegisterClockSource(ClockSource* source) {
+  clock_sources.push_back(source);
+  Log(kInfo, "clock source %s: %lu Hz, rating %d\n",
+      source->Name(), source->Frequency(), source->Rating());
+}
+
+ClockSource* BestClockSource() {
+  return Best(false);
+}
+
+ClockSource* ReferenceClockSource() {
+  return Best(true);
+}
+
+Error StartPeriodicClockInterrupt(unsigned long freq, uint8_t vector) {
+  std::vector<ClockSource*> sources = clock_sources;
+  std::sort(sources.begin(), sources.end(),
+            [](auto a, auto b) { return a->Rating() > b->Rating(); });
+  for (auto source : sources) {
+    if (!source->StartPeriodicInterrupt(freq, vector)) {
+      Log(kWarn, "%s is used as the system timer\n", source->Name());
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+void RegisterTSCClockSource(uint64_t freq) {
+  if (freq == 0 || !HasInvariantTSC()) {
+    return;
+  }
+  RegisterClockSource(new TSCClockSource{freq});
+}
@@ -0,0 +1,62 @@
+/**
+ * @file clocksource.hpp
+ *
+ * 時刻を読むためのカウンタ（クロックソース）を共通の形で扱う．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief 一定の周波数で増え続けるカウンタ */
+class ClockSource {
+ public:
+  virtual ~ClockSource() = default;
+
+  virtual const char* Name() const = 0;
+  /** @brief カウンタの現在値．Mask() のビットだけが有効で，超えると 0 に戻る． */
+  virtual uint64_t Read() const = 0;
+  virtual uint64_t Mask() const = 0;
+  /** @brief カウンタの周波数（Hz） */
+  virtual uint64_t Frequency() const = 0;
+  /** @brief 選ぶときの優先度．読み出しが軽く，安定しているものほど大きい． */
+  virtual int Rating() const = 0;
+  /** @brief 周波数がハードウェアで決まっていて，他のタイマの較正に使えるなら true */
+  virtual bool IsReference() const { return true; }
+
+  /** @brief freq Hz でベクタ vector の割り込みを繰り返し起こす．
+   *
+   * LAPIC タイマが使えないときの代わりに使う．できなければ Error::kNotImplemented．
+   */
+  virtual Error StartPeriodicInterrupt(unsigned long freq, uint8_t vector) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  /** @brief Read() で得た start から end までに進んだカウント数 */
+  uint64_t Elapsed(uint64_t start, uint64_t end) const { return (end - start) & Mask(); }
+  /** @brief カウント数をマイクロ秒に換算する */
+  uint64_t ToMicroseconds(uint64_t ticks) const { return ticks * 1000000 / Frequency(); }
+};
+
+/** @brief ACPI PM タイマと，ACPI テーブルにあれば HPET を登録する． */
+void InitializeClockSources();
+
+/** @brief クロックソースを登録する．source は登録後ずっと有効でなければならない． */
+void RegisterClockSource(ClockSource* source);
+
+/** @brief 登録済みのうち Rating() が最大のもの．何も登録されていなければ nullptr． */
+ClockSource* BestClockSource();
+
+/** @brief IsReference() が真のうち Rating() が最大のもの．他のタイマの較正に使う． */
+ClockSource* ReferenceClockSource();
+
+/** @brief 周期割り込みを起こせるクロックソースのうち，Rating() が最大のもので割り込みを始める． */
+Error StartPeriodicClockInterrupt(unsigned long freq, uint8_t vector);
+
+/** @brief 周波数 freq の TSC をクロックソースとして登録する．
+ *
+ * 電源状態によらず一定の速さで進む TSC（Invariant TSC）でなければ登録しない．
+ */
+void RegisterTSCClockSource(uint64_t freq);
@@ -29,6 +29,12 @@ class Error {
     kNoPCIMSI,
     kUnknownPixelFormat,
     kNoSuchTask,
+    kNotAligned,
+    kUnhandledPageFault,
+    kTimeout,
+    kNoSuchEntry,
+    kIsDirectory,
+    kInvalidFormat,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -57,6 +63,12 @@ class Error {
     "kNoPCIMSI",
     "kUnknownPixelFormat",
     "kNoSuchTask",
+    "kNotAligned",
+    "kUnhandledPageFault",
+    "kTimeout",
+    "kNoSuchEntry",
+    "kIsDirectory",
+    "kInvalidFormat",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
@@ -0,0 +1,622 @@
+#include "fat.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "logger.hpp"
+
+namespace {
+  const uint32_t kClusterMask = 0x0fffffffu;
+  const uint32_t kEndOfChainMark = 0x0fffffffu;
+  const size_t kEntrySize = sizeof(fat::DirectoryEntry);
+
+  // ext_flags のビット
+  const uint16_t kNoFATMirroring = 1u << 7;
+  const uint16_t kActiveFATMask = 0xfu;
+
+  // FSInfo セクタ内の位置
+  const uint32_t kFSInfoFreeCount = 488;
+
+  const uint8_t kDeletedEntry = 0xe5;
+
+  bool IsPowerOfTwo(uint32_t v) {
+    return v != 0 && (v & (v - 1)) == 0;
+  }
+
+  /** @brief name の先頭 len 文字を 11 バイトの 8.3 名 short_name に変換する．
+   *
+   * 8.3 形式に収まらない名前なら false を返す．
+   */
+  bool ToShortName(const char* name, size_t len, char* short_name) {
+    memset(short_name, ' ', 11);
+    if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+      memcpy(short_name, name, len);
+      return true;
+    }
+
+    const char* dot = nullptr;
+    for (size_t i = 0; i < len; ++i) {
+      if (name[i] == '.') {
+        dot = &name[i];
+      }
+    }
+    const size_t base_len = dot ? dot - name : len;
+    const size_t ext_len = dot ? len - base_len - 1 : 0;
+    if (base_len == 0 || base_len > 8 || ext_len > 3) {
+      return false;
+    }
+
+    auto copy = [](const char* src, size_t n, char* dst) {
+      for (size_t i = 0; i < n; ++i) {
+        const char c = src[i];
+        if (c == '.' || c == ' ' || static_cast<unsigned char>(c) < 0x20) {
+          return false;
+        }
+        dst[i] = toupper(c);
+      }
+      return true;
+    };
+    return copy(name, base_len, short_name) &&
+      copy(dot ? dot + 1 : name + len, ext_len, short_name + 8);
+  }
+
+  std::string NameKey(const fat::DirectoryEntry& entry) {
+    return std::string(reinterpret_cast<const char*>(entry.name), 11);
+  }
+}
+
+namespace fat {
+  void FormatName(const DirectoryEntry& entry, char* dest) {
+    char* p = dest;
+    for (int i = 0; i < 8 && entry.name[i] != ' '; ++i) {
+      // 先頭の 0x05 は，0xe5 で始まる名前を削除済みの印と区別するための置き換え
+      *p++ = (i == 0 && entry.name[i] == 0x05) ? kDeletedEntry : entry.name[i];
+    }
+    if (entry.name[8] != ' ') {
+      *p++ = '.';
+      for (int i = 8; i < 11 && entry.name[i] != ' '; ++i) {
+        *p++ = entry.name[i];
+      }
+    }
+    *p = '\0';
+  }
+
+  FileSystem::FileSystem(BlockCache& cache) : cache_{cache} {
+  }
+
+  Error FileSystem::Mount() {
+    if (auto err = cache_.Read(0, &bpb_, sizeof(bpb_))) {
+      return err;
+    }
+
+    const uint32_t bytes_per_sector = bpb_.bytes_per_sector;
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 ||
+        !IsPowerOfTwo(bytes_per_sector) || !IsPowerOfTwo(bpb_.sectors_per_cluster) ||
+        bpb_.num_fats == 0) {
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+    // FAT12/16 はルートディレクトリが固定の領域にあり，FAT のエントリの大きさも違う
+    if (bpb_.fat_size_16 != 0 || bpb_.root_entry_count != 0 || bpb_.fat_size_32 == 0) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    bytes_per_cluster_ = bytes_per_sector * bpb_.sectors_per_cluster;
+    fat_offset_ = static_cast<uint64_t>(bpb_.reserved_sector_count) * bytes_per_sector;
+    fat_bytes_ = static_cast<uint64_t>(bpb_.fat_size_32) * bytes_per_sector;
+    data_offset_ = fat_offset_ + bpb_.num_fats * fat_bytes_;
+
+    if (bpb_.ext_flags & kNoFATMirroring) {
+      active_fat_ = bpb_.ext_flags & kActiveFATMask;
+      mirror_fats_ = false;
+      if (active_fat_ >= bpb_.num_fats) {
+        return MAKE_ERROR(Error::kInvalidFormat);
+      }
+    }
+
+    const uint64_t total_sectors =
+      bpb_.total_sectors_16 != 0 ? bpb_.total_sectors_16 : bpb_.total_sectors_32;
+    const uint64_t volume_bytes = cache_.Device().NumBlocks() * cache_.BlockSize();
+    if (total_sectors * bytes_per_sector > volume_bytes ||
+        data_offset_ >= total_sectors * bytes_per_sector) {
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+    const uint64_t num_clusters = std::min<uint64_t>(
+        (total_sectors * bytes_per_sector - data_offset_) / bytes_per_cluster_,
+        fat_bytes_ / sizeof(uint32_t) - 2);
+    if (bpb_.root_cluster < 2 || bpb_.root_cluster >= num_clusters + 2) {
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+
+    // FAT はここで 1 度だけ読む．大きな連続領域なので BlockCache はまとめて読む．
+    next_cluster_.resize(num_clusters + 2);
+    const uint64_t active_fat_offset = fat_offset_ + active_fat_ * fat_bytes_;
+    if (auto err = cache_.Read(active_fat_offset, next_cluster_.data(),
+                               next_cluster_.size() * sizeof(uint32_t))) {
+      next_cluster_.clear();
+      return err;
+    }
+    num_free_clusters_ = 0;
+    for (size_t i = 0; i < next_cluster_.size(); ++i) {
+      next_cluster_[i] &= kClusterMask;
+      if (i >= 2 && next_cluster_[i] == 0) {
+        ++num_free_clusters_;
+      }
+    }
+
+    root_ = Node{};
+    root_.entry.attr = Attribute::kDirectory;
+    root_.entry.SetFirstCluster(bpb_.root_cluster);
+
+    Log(kInfo, "FAT32: %u clusters of %u bytes, %u free\n",
+        NumClusters(), bytes_per_cluster_, num_free_clusters_);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  uint32_t FileSystem::NextCluster(uint32_t cluster) const {
+    if (cluster < 2 || cluster >= next_cluster_.size()) {
+      return kEndOfClusterchain;
+    }
+    const uint32_t next = next_cluster_[cluster];
+    // 0 （空き）や 1 がチェーンの途中にあるのは壊れているので，そこで終わりとみなす
+    return next < 2 || next >= next_cluster_.size() ? kEndOfClusterchain : next;
+  }
+
+  std::vector<Extent> FileSystem::Extents(uint32_t first_cluster) const {
+    std::vector<Extent> extents;
+    uint32_t cluster = first_cluster;
+    // 壊れたチェーンが輪になっていても止まるよう，クラスタの数だけたどる
+    for (size_t n = 0; cluster < kEndOfClusterchain && cluster >= 2 &&
+           n < next_cluster_.size(); ++n) {
+      if (!extents.empty() &&
+          extents.back().cluster + extents.back().num_clusters == cluster) {
+        ++extents.back().num_clusters;
+      } else {
+        extents.push_back({cluster, 1});
+      }
+      cluster = NextCluster(cluster);
+    }
+    return extents;
+  }
+
+  WithError<FileSystem::DirectoryIndex*> FileSystem::Index(uint32_t dir_cluster) {
+    if (auto it = directories_.find(dir_cluster); it != directories_.end()) {
+      return {&it->second, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    DirectoryIndex index{};
+    std::vector<uint8_t> buf;
+    bool end_of_directory = false;
+    for (const auto& extent : Extents(dir_cluster)) {
+      const size_t extent_bytes = static_cast<size_t>(extent.num_clusters) * bytes_per_cluster_;
+      const uint64_t extent_offset = ClusterOffset(extent.cluster);
+      index.last_cluster = extent.cluster + extent.num_clusters - 1;
+      if (end_of_directory) {
+        // 終端の印より後ろはすべて空き
+        for (size_t off = 0; off < extent_bytes; off += kEntrySize) {
+          index.free_slots.push_back(extent_offset + off);
+        }
+        continue;
+      }
+
+      buf.resize(extent_bytes);
+      if (auto err = cache_.Read(extent_offset, buf.data(), extent_bytes)) {
+        return {nullptr, err};
+      }
+
+      for (size_t off = 0; off < extent_bytes; off += kEntrySize) {
+        if (end_of_directory) {
+          index.free_slots.push_back(extent_offset + off);
+          continue;
+        }
+
+        DirectoryEntry entry;
+        memcpy(&entry, &buf[off], kEntrySize);
+        if (entry.name[0] == 0x00) {
+          end_of_directory = true;
+          index.free_slots.push_back(extent_offset + off);
+          continue;
+        } else if (entry.name[0] == kDeletedEntry) {
+          index.free_slots.push_back(extent_offset + off);
+          continue;
+        }
+        const auto attr = static_cast<uint8_t>(entry.attr);
+        if ((attr & 0x3fu) == static_cast<uint8_t>(Attribute::kLongName) ||
+            (attr & static_cast<uint8_t>(Attribute::kVolumeID))) {
+          continue;
+        }
+        if (entry.name[0] == '.') {
+          if (entry.name[1] == '.') {
+            index.parent_cluster = entry.FirstCluster();
+          }
+          continue;
+        }
+
+        index.by_name[NameKey(entry)] = index.nodes.size();
+        index.nodes.push_back(Node{entry, extent_offset + off, dir_cluster});
+      }
+    }
+
+    auto [ it, inserted ] = directories_.emplace(dir_cluster, std::move(index));
+    return {&it->second, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<Node> FileSystem::Find(const char* path) {
+    Node node = root_;
+    const char* p = path;
+    while (*p) {
+      if (*p == '/') {
+        ++p;
+        continue;
+      }
+      const char* next = strchr(p, '/');
+      const size_t len = next ? next - p : strlen(p);
+
+      if (!node.entry.IsDirectory()) {
+        return {node, MAKE_ERROR(Error::kNoSuchEntry)};
+      }
+      char short_name[11];
+      if (!ToShortName(p, len, short_name)) {
+        return {node, MAKE_ERROR(Error::kNoSuchEntry)};
+      }
+
+      if (len == 1 && p[0] == '.') {
+        p += len;
+        continue;
+      }
+      auto [ index, err ] = Index(node.entry.FirstCluster());
+      if (err) {
+        return {node, err};
+      }
+      if (len == 2 && p[0] == '.' && p[1] == '.') {
+        // ".." の指すクラスタが 0 ならルートディレクトリ．ルートディレクトリの ".." はそれ自身．
+        if (index->parent_cluster == 0) {
+          node = root_;
+        } else {
+          node = Node{root_.entry, 0, 0};
+          node.entry.SetFirstCluster(index->parent_cluster);
+        }
+        p += len;
+        continue;
+      }
+      auto it = index->by_name.find(std::string(short_name, 11));
+      if (it == index->by_name.end()) {
+        return {node, MAKE_ERROR(Error::kNoSuchEntry)};
+      }
+      node = index->nodes[it->second];
+      p += len;
+    }
+    return {node, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<const std::vector<Node>*> FileSystem::List(const Node& dir) {
+    if (!dir.entry.IsDirectory()) {
+      return {nullptr, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+    auto [ index, err ] = Index(dir.entry.FirstCluster());
+    if (err) {
+      return {nullptr, err};
+    }
+    return {&index->nodes, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<size_t> FileSystem::Read(const Node& file, uint64_t offset,
+                                     void* buf, size_t len) {
+    if (file.entry.IsDirectory()) {
+      return {0, MAKE_ERROR(Error::kIsDirectory)};
+    }
+    if (offset >= file.entry.file_size) {
+      return {0, MAKE_ERROR(Error::kSuccess)};
+    }
+    len = std::min<uint64_t>(len, file.entry.file_size - offset);
+
+    auto dst = reinterpret_cast<uint8_t*>(buf);
+    size_t total = 0;
+    uint64_t extent_begin = 0;
+    for (const auto& extent : Extents(file.entry.FirstCluster())) {
+      if (total == len) {
+        break;
+      }
+      const uint64_t extent_bytes =
+        static_cast<uint64_t>(extent.num_clusters) * bytes_per_cluster_;
+      const uint64_t extent_end = extent_begin + extent_bytes;
+      if (offset < extent_end) {
+        const uint64_t in_extent = offset - extent_begin;
+        const size_t n = std::min<uint64_t>(len - total, extent_bytes - in_extent);
+        if (auto err = cache_.Read(ClusterOffset(extent.cluster) + in_extent, dst, n)) {
+          return {total, err};
+        }
+        dst += n;
+        offset += n;
+        total += n;
+      }
+      extent_begin = extent_end;
+    }
+    return {total, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<size_t> FileSystem::Write(Node& file, uint64_t offset,
+                                      const void* buf, size_t len) {
+    if (file.entry.IsDirectory()) {
+      return {0, MAKE_ERROR(Error::kIsDirectory)};
+    }
+    const uint64_t end = offset + len;
+    if (end > 0xffffffffu) { // FAT のファイルは 4GiB 未満
+      return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    // 足りない分のクラスタを，なるべく直前のクラスタに続く位置に確保する
+    auto extents = Extents(file.entry.FirstCluster());
+    uint64_t num_clusters = 0;
+    for (const auto& extent : extents) {
+      num_clusters += extent.num_clusters;
+    }
+    uint32_t last =
+      extents.empty() ? 0 : extents.back().cluster + extents.back().num_clusters - 1;
+    const uint32_t original_last = last;
+
+    // 途中で失敗したら，この呼び出しで確保したクラスタを解放して元のチェーンに戻す．
+    // ディレクトリエントリは最後にしか書かないので，ディスク上のエントリは元のまま．
+    auto rollback = [&](Error cause) -> WithError<size_t> {
+      if (original_last == 0) {
+        FreeChain(file.entry.FirstCluster());
+        file.entry.SetFirstCluster(0);
+      } else if (const uint32_t next = NextCluster(original_last);
+                 next < kEndOfClusterchain) {
+        FreeChain(next);
+        next_cluster_[original_last] = kEndOfChainMark;
+        WriteFAT(original_last, 1);
+      }
+      return {0, cause};
+    };
+
+    const uint64_t needed = (end + bytes_per_cluster_ - 1) / bytes_per_cluster_;
+    while (num_clusters < needed) {
+      auto [ extent, err ] = AllocateExtent(last, needed - num_clusters);
+      if (err) {
+        return rollback(err);
+      }
+      if (last == 0) {
+        file.entry.SetFirstCluster(extent.cluster);
+      }
+      last = extent.cluster + extent.num_clusters - 1;
+      num_clusters += extent.num_clusters;
+    }
+
+    extents = Extents(file.entry.FirstCluster());
+    // ファイルの pos バイト目から n バイトを書く．Extent の境界で分けて書く．
+    auto write_at = [&](uint64_t pos, const uint8_t* src, size_t n) -> Error {
+      uint64_t extent_begin = 0;
+      for (const auto& extent : extents) {
+        if (n == 0) {
+          break;
+        }
+        const uint64_t extent_bytes =
+          static_cast<uint64_t>(extent.num_clusters) * bytes_per_cluster_;
+        const uint64_t extent_end = extent_begin + extent_bytes;
+        if (pos < extent_end) {
+          const uint64_t in_extent = pos - extent_begin;
+          const size_t m = std::min<uint64_t>(n, extent_bytes - in_extent);
+          if (auto err = cache_.Write(ClusterOffset(extent.cluster) + in_extent, src, m)) {
+            return err;
+          }
+          src += m;
+          pos += m;
+          n -= m;
+        }
+        extent_begin = extent_end;
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    };
+
+    // 今の終端より後ろから書く場合，間は 0 で埋める
+    const uint8_t zero[512] = {};
+    for (uint64_t pos = file.entry.file_size; pos < offset; ) {
+      const size_t n = std::min<uint64_t>(sizeof(zero), offset - pos);
+      if (auto err = write_at(pos, zero, n)) {
+        return rollback(err);
+      }
+      pos += n;
+    }
+
+    if (auto err = write_at(offset, reinterpret_cast<const uint8_t*>(buf), len)) {
+      return rollback(err);
+    }
+
+    if (end > file.entry.file_size) {
+      file.entry.file_size = end;
+    }
+    if (auto err = WriteEntry(file)) {
+      return {len, err};
+    }
+    return {len, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  WithError<Node> FileSystem::Create(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    char short_name[11];
+    if (!ToShortName(name, strlen(name), short_name) || name[0] == '.') {
+      return {Node{}, MAKE_ERROR(Error::kInvalidFormat)};
+    }
+
+    Node parent = root_;
+    if (slash) {
+      const std::string parent_path(path, slash - path);
+      auto [ node, err ] = Find(parent_path.c_str());
+      if (err) {
+        return {Node{}, err};
+      }
+      parent = node;
+    }
+    if (!parent.entry.IsDirectory()) {
+      return {Node{}, MAKE_ERROR(Error::kNoSuchEntry)};
+    }
+
+    const uint32_t dir_cluster = parent.entry.FirstCluster();
+    auto [ index, err ] = Index(dir_cluster);
+    if (err) {
+      return {Node{}, err};
+    }
+    const std::string key(short_name, 11);
+    if (index->by_name.count(key)) {
+      return {index->nodes[index->by_name[key]], MAKE_ERROR(Error::kAlreadyAllocated)};
+    }
+
+    if (index->free_slots.empty()) {
+      // ディレクトリを 1 クラスタ伸ばし，0 で埋める（先頭の 0 が終端の印になる）
+      auto [ extent, err ] = AllocateExtent(index->last_cluster, 1);
+      if (err) {
+        return {Node{}, err};
+      }
+      const uint32_t cluster = extent.cluster;
+      const std::vector<uint8_t> zero(bytes_per_cluster_);
+      if (auto err = cache_.Write(ClusterOffset(cluster), zero.data(), zero.size())) {
+        return {Node{}, err};
+      }
+      index->last_cluster = cluster;
+      for (uint32_t off = 0; off < bytes_per_cluster_; off += kEntrySize) {
+        index->free_slots.push_back(ClusterOffset(cluster) + off);
+      }
+    }
+
+    // 終端の印より前が埋まっているよう，空きは前から使う
+    Node node{};
+    memcpy(node.entry.name, short_name, sizeof(node.entry.name));
+    node.entry.attr = Attribute::kArchive;
+    node.entry_offset = index->free_slots.front();
+    node.dir_cluster = dir_cluster;
+    index->free_slots.erase(index->free_slots.begin());
+    if (auto err = cache_.Write(node.entry_offset, &node.entry, kEntrySize)) {
+      return {Node{}, err};
+    }
+
+    index->by_name[key] = index->nodes.size();
+    index->nodes.push_back(node);
+    return {node, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  Error FileSystem::WriteFAT(uint32_t first, uint32_t count) {
+    // 上位 4 ビットは予約されているので，ディスク上の値を保つ
+    const uint64_t range_offset = static_cast<uint64_t>(first) * sizeof(uint32_t);
+    std::vector<uint32_t> values(count);
+    if (auto err = cache_.Read(fat_offset_ + active_fat_ * fat_bytes_ + range_offset,
+                               values.data(), count * sizeof(uint32_t))) {
+      return err;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      values[i] = (values[i] & ~kClusterMask) | next_cluster_[first + i];
+    }
+
+    for (uint32_t i = 0; i < bpb_.num_fats; ++i) {
+      if (!mirror_fats_ && i != active_fat_) {
+        continue;
+      }
+      if (auto err = cache_.Write(fat_offset_ + i * fat_bytes_ + range_offset,
+                                  values.data(), count * sizeof(uint32_t))) {
+        return err;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error FileSystem::FreeChain(uint32_t first_cluster) {
+    for (const auto& extent : Extents(first_cluster)) {
+      std::fill_n(next_cluster_.begin() + extent.cluster, extent.num_clusters, 0);
+      num_free_clusters_ += extent.num_clusters;
+      if (auto err = WriteFAT(extent.cluster, extent.num_clusters)) {
+        return err;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  WithError<Extent> FileSystem::AllocateExtent(uint32_t prev, uint32_t max_clusters) {
+    const uint32_t n = next_cluster_.size();
+    auto free_run = [&](uint32_t c) {
+      uint32_t len = 0;
+      while (c + len < n && len < max_clusters && next_cluster_[c + len] == 0) {
+        ++len;
+      }
+      return len;
+    };
+
+    // 直前のクラスタに続けられればそうする．そうでなければ，max_clusters 個が
+    // 連続して空いている最初の場所を探し，無ければ最も長く空いている場所を使う．
+    Extent extent{0, 0};
+    if (prev >= 2 && prev + 1 < n && next_cluster_[prev + 1] == 0) {
+      extent = {prev + 1, free_run(prev + 1)};
+    } else {
+      for (uint32_t i = 0; i < n - 2 && extent.num_clusters < max_clusters; ) {
+        const uint32_t c = 2 + (alloc_hint_ - 2 + i) % (n - 2);
+        const uint32_t len = free_run(c);
+        if (len > extent.num_clusters) {
+          extent = {c, len};
+        }
+        i += std::max<uint32_t>(len, 1);
+      }
+    }
+    if (extent.num_clusters == 0) {
+      return {extent, MAKE_ERROR(Error::kFull)};
+    }
+
+    // FSInfo の空きクラスタ数は更新しないので，不明を表す値にしておく
+    if (!fs_info_invalidated_ && bpb_.fs_info != 0 &&
+        bpb_.fs_info < bpb_.reserved_sector_count) {
+      const uint32_t unknown = 0xffffffffu;
+      const uint64_t fs_info_offset =
+        static_cast<uint64_t>(bpb_.fs_info) * bpb_.bytes_per_sector + kFSInfoFreeCount;
+      if (auto err = cache_.Write(fs_info_offset, &unknown, sizeof(unknown))) {
+        return {extent, err};
+      }
+      fs_info_invalidated_ = true;
+    }
+
+    const uint32_t last = extent.cluster + extent.num_clusters - 1;
+    for (uint32_t c = extent.cluster; c < last; ++c) {
+      next_cluster_[c] = c + 1;
+    }
+    next_cluster_[last] = kEndOfChainMark;
+    if (auto err = WriteFAT(extent.cluster, extent.num_clusters)) {
+      return {extent, err};
+    }
+    if (prev >= 2) {
+      next_cluster_[prev] = extent.cluster;
+      if (auto err = WriteFAT(prev, 1)) {
+        return {extent, err};
+      }
+    }
+    num_free_clusters_ -= extent.num_clusters;
+    alloc_hint_ = last + 1 < n ? last + 1 : 2;
+    return {extent, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  Error FileSystem::WriteEntry(const Node& node) {
+    if (node.entry_offset == 0) { // ルートディレクトリにはエントリが無い
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (auto err = cache_.Write(node.entry_offset, &node.entry, kEntrySize)) {
+      return err;
+    }
+
+    // 索引に持っているコピーも揃える
+    if (auto it = directories_.find(node.dir_cluster); it != directories_.end()) {
+      auto& index = it->second;
+      if (auto name_it = index.by_name.find(NameKey(node.entry));
+          name_it != index.by_name.end()) {
+        index.nodes[name_it->second].entry = node.entry;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Initialize(BlockCache& cache) {
+    auto fs = new FileSystem{cache};
+    if (auto err = fs->Mount()) {
+      delete fs;
+      return err;
+    }
+    boot_file_system = fs;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
@@ -0,0 +1,197 @@
+/**
+ * @file fat.hpp
+ *
+ * FAT32 ファイルシステムのドライバ．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "block_device.hpp"
+#include "error.hpp"
+
+namespace fat {
+  struct BPB {
+    uint8_t jump_boot[3];
+    char oem_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sector_count;
+    uint8_t num_fats;
+    uint16_t root_entry_count;
+    uint16_t total_sectors_16;
+    uint8_t media;
+    uint16_t fat_size_16;
+    uint16_t sectors_per_track;
+    uint16_t num_heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_32;
+    uint32_t fat_size_32;
+    uint16_t ext_flags;
+    uint16_t fs_version;
+    uint32_t root_cluster;
+    uint16_t fs_info;
+    uint16_t backup_boot_sector;
+    uint8_t reserved[12];
+    uint8_t drive_number;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    char volume_label[11];
+    char fs_type[8];
+  } __attribute__((packed));
+
+  enum class Attribute : uint8_t {
+    kReadOnly  = 0x01,
+    kHidden    = 0x02,
+    kSystem    = 0x04,
+    kVolumeID  = 0x08,
+    kDirectory = 0x10,
+    kArchive   = 0x20,
+    kLongName  = 0x0f,
+  };
+
+  struct DirectoryEntry {
+    unsigned char name[11];
+    Attribute attr;
+    uint8_t ntres;
+    uint8_t create_time_tenth;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t last_access_date;
+    uint16_t first_cluster_high;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint16_t first_cluster_low;
+    uint32_t file_size;
+
+    uint32_t FirstCluster() const {
+      return first_cluster_low | (static_cast<uint32_t>(first_cluster_high) << 16);
+    }
+    void SetFirstCluster(uint32_t cluster) {
+      first_cluster_low = cluster & 0xffffu;
+      first_cluster_high = cluster >> 16;
+    }
+    bool IsDirectory() const {
+      return static_cast<uint8_t>(attr) & static_cast<uint8_t>(Attribute::kDirectory);
+    }
+  } __attribute__((packed));
+
+  /** @brief ボリューム上で連続しているクラスタの並び */
+  struct Extent {
+    uint32_t cluster;
+    uint32_t num_clusters;
+  };
+
+  /** @brief 見つけたファイルやディレクトリ */
+  struct Node {
+    DirectoryEntry entry;
+    /** @brief ディレクトリエントリのボリューム先頭からのバイト位置．ルートディレクトリは 0． */
+    uint64_t entry_offset;
+    /** @brief エントリを含むディレクトリの先頭クラスタ．ルートディレクトリは 0． */
+    uint32_t dir_cluster;
+  };
+
+  /** @brief 8.3 形式の名前を "NAME.EXT" の形で dest に書き込む（dest は 13 バイト以上） */
+  void FormatName(const DirectoryEntry& entry, char* dest);
+
+  /** @brief FAT32 のボリューム．
+   *
+   * FAT はマウント時に 1 度だけ読み，予約ビットを除いた次のクラスタ番号の配列として持つ．
+   * クラスタチェーンはこの配列をたどるだけで分かり，連続する部分は Extent にまとめて
+   * 1 回の要求で読み書きする．
+   * ディレクトリは初めて参照したときに全エントリを読み，名前から引くハッシュ表を作る．
+   * 名前は 8.3 形式だけを扱い，長いファイル名のエントリは読み飛ばす．
+   */
+  class FileSystem {
+   public:
+    static const uint32_t kEndOfClusterchain = 0x0ffffff8u;
+
+    explicit FileSystem(BlockCache& cache);
+
+    /** @brief BPB と FAT を読む．FAT32 でなければ Error::kNotImplemented． */
+    Error Mount();
+
+    uint32_t BytesPerCluster() const { return bytes_per_cluster_; }
+    uint32_t NumClusters() const { return next_cluster_.size() - 2; }
+    uint32_t NumFreeClusters() const { return num_free_clusters_; }
+    const Node& Root() const { return root_; }
+
+    /** @brief cluster の次のクラスタ番号．チェーンの終わりなら kEndOfClusterchain 以上． */
+    uint32_t NextCluster(uint32_t cluster) const;
+    /** @brief first_cluster から始まるチェーンを連続した部分ごとにまとめる */
+    std::vector<Extent> Extents(uint32_t first_cluster) const;
+
+    /** @brief "/" で区切ったパスの項目を探す．大文字と小文字は区別しない．
+     *
+     * "." と ".." も使える．ルートディレクトリの ".." はルートディレクトリ自身．
+     */
+    WithError<Node> Find(const char* path);
+    /** @brief ディレクトリ dir の項目をディスク上の順に返す．"." と ".." は含まない． */
+    WithError<const std::vector<Node>*> List(const Node& dir);
+
+    /** @brief ファイルの offset バイト目から最大 len バイトを読み，読んだバイト数を返す */
+    WithError<size_t> Read(const Node& file, uint64_t offset, void* buf, size_t len);
+    /** @brief ファイルの offset バイト目から len バイトを書き，必要ならファイルを伸ばす */
+    WithError<size_t> Write(Node& file, uint64_t offset, const void* buf, size_t len);
+    /** @brief 空のファイルを作る．既にあれば Error::kAlreadyAllocated． */
+    WithError<Node> Create(const char* path);
+
+   private:
+    /** @brief ディレクトリの項目と，名前からの索引 */
+    struct DirectoryIndex {
+      std::vector<Node> nodes;
+      /** @brief 11 バイトの 8.3 名から nodes の添字を引く */
+      std::unordered_map<std::string, size_t> by_name;
+      /** @brief 再利用できる空きエントリの位置 */
+      std::vector<uint64_t> free_slots;
+      /** @brief ディレクトリの最後のクラスタ */
+      uint32_t last_cluster;
+      /** @brief ".." の指すディレクトリの先頭クラスタ．ルートディレクトリなら 0． */
+      uint32_t parent_cluster;
+    };
+
+    BlockCache& cache_;
+    BPB bpb_{};
+    uint32_t bytes_per_cluster_{0};
+    uint64_t fat_offset_{0}, fat_bytes_{0}, data_offset_{0};
+    /** @brief 読む FAT の番号．mirror_fats_ なら書き込みはすべての FAT に反映する． */
+    uint32_t active_fat_{0};
+    bool mirror_fats_{true};
+    std::vector<uint32_t> next_cluster_;
+    uint32_t num_free_clusters_{0};
+    /** @brief 次に空きクラスタを探し始める位置 */
+    uint32_t alloc_hint_{2};
+    bool fs_info_invalidated_{false};
+    Node root_{};
+    /** @brief ディレクトリの先頭クラスタから索引を引く */
+    std::map<uint32_t, DirectoryIndex> directories_;
+
+    uint64_t ClusterOffset(uint32_t cluster) const {
+      return data_offset_ + static_cast<uint64_t>(cluster - 2) * bytes_per_cluster_;
+    }
+    WithError<DirectoryIndex*> Index(uint32_t dir_cluster);
+    /** @brief next_cluster_ の [first, first + count) を FAT（すべてのコピー）に書き込む */
+    Error WriteFAT(uint32_t first, uint32_t count);
+    /** @brief 連続した空きクラスタを最大 max_clusters 個確保して prev の後ろにつなぐ．
+     *
+     * prev が 0 なら新しいチェーンにする．
+     */
+    WithError<Extent> AllocateExtent(uint32_t prev, uint32_t max_clusters);
+    /** @brief first_cluster から始まるチェーンのクラスタをすべて空きに戻す */
+    Error FreeChain(uint32_t first_cluster);
+    Error WriteEntry(const Node& node);
+  };
+
+  /** @brief 起動ボリュームのファイルシステム．マウントしていなければ nullptr． */
+  inline FileSystem* boot_file_system = nullptr;
+
+  /** @brief 起動ボリュームを FAT32 としてマウントする */
+  Error Initialize(BlockCache& cache);
+}
@@ -0,0 +1,94 @@
+#include "hpet.hpp"
+
+#include "logger.hpp"
+
+namespace {
+  // General Capabilities and ID Register のビット
+  const uint64_t kCapCounter64Bit = 1u << 13;
+
+  // General Configuration Register のビット
+  const uint64_t kConfEnable = 1u << 0;
+  const uint64_t kConfLegacyRoute = 1u << 1;
+
+  // Timer N Configuration and Capability Register のビット
+  const uint64_t kTimerIntEnable = 1u << 2;
+  const uint64_t kTimerPeriodic = 1u << 3;
+  const uint64_t kTimerPeriodicCap = 1u << 4;
+  const uint64_t kTimerValueSet = 1u << 6;
+  const uint64_t kTimerFSBEnable = 1u << 14;
+  const uint64_t kTimerFSBCap = 1u << 15;
+
+  const uint32_t kRegCapabilities = 0x000;
+  const uint32_t kRegConfig = 0x010;
+  const uint32_t kRegMainCounter = 0x0f0;
+
+  /** @brief 仕様上の周期の上限（100ns）をフェムト秒で表したもの */
+  const uint64_t kMaxPeriodFemtoseconds = 100000000;
+}
+
+HPETClockSource::HPETClockSource(uintptr_t mmio_base)
+    : regs_{reinterpret_cast<volatile uint64_t*>(mmio_base)} {
+  const uint64_t cap = Reg(kRegCapabilities);
+  period_fs_ = cap >> 32;
+  freq_ = period_fs_ == 0 ? 0 : 1000000000000000ul / period_fs_;
+  counter_64bit_ = cap & kCapCounter64Bit;
+  num_timers_ = ((cap >> 8) & 0x1fu) + 1;
+}
+
+uint64_t HPETClockSource::Read() const {
+  return Reg(kRegMainCounter) & Mask();
+}
+
+void HPETClockSource::Enable() {
+  // ファームウェアが残した割り込みを止めてから動かす
+  for (int n = 0; n < num_timers_; ++n) {
+    TimerConfig(n) = TimerConfig(n) & ~(kTimerIntEnable | kTimerFSBEnable);
+  }
+  Reg(kRegConfig) = (Reg(kRegConfig) & ~kConfLegacyRoute) | kConfEnable;
+}
+
+Error HPETClockSource::StartPeriodicInterrupt(unsigned long freq, uint8_t vector) {
+  // I/O APIC を扱わないので，FSB で LAPIC に直接送れる比較器だけを使う
+  int timer = -1;
+  for (int n = 0; n < num_timers_; ++n) {
+    const uint64_t conf = TimerConfig(n);
+    if ((conf & kTimerPeriodicCap) && (conf & kTimerFSBCap)) {
+      timer = n;
+      break;
+    }
+  }
+  if (timer < 0 || freq == 0) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  const uint32_t bsp_local_apic_id = *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+  const uint64_t msi_addr = 0xfee00000u | (bsp_local_apic_id << 12);
+  TimerFSBRoute(timer) = (msi_addr << 32) | vector;
+
+  // 周期モードでは，VAL_SET を立てて 1 回目の書き込みで次の発火時刻，2 回目で周期を設定する
+  const uint64_t period = freq_ / freq;
+  TimerConfig(timer) = kTimerIntEnable | kTimerPeriodic | kTimerValueSet | kTimerFSBEnable;
+  TimerComparator(timer) = Read() + period;
+  TimerComparator(timer) = period;
+
+  Log(kInfo, "HPET: timer %d fires every %lu ticks\n", timer, period);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<HPETClockSource*> InitializeHPET(const acpi::HPET& table) {
+  if (table.address_space_id != 0 || table.base_address == 0) {
+    return {nullptr, MAKE_ERROR(Error::kNotImplemented)};
+  }
+
+  auto hpet = new HPETClockSource{table.base_address};
+  const uint64_t period_fs = hpet->PeriodFemtoseconds();
+  if (period_fs == 0 || period_fs > kMaxPeriodFemtoseconds) {
+    delete hpet;
+    return {nullptr, MAKE_ERROR(Error::kInvalidDescriptor)};
+  }
+  hpet->Enable();
+
+  Log(kInfo, "HPET: %d timers, %lu Hz, %d-bit counter\n",
+      hpet->NumTimers(), hpet->Frequency(), hpet->Mask() == ~uint64_t{0} ? 64 : 32);
+  return {hpet, MAKE_ERROR(Error::kSuccess)};
+}
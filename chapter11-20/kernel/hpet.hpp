@@ -0,0 +1,55 @@
+/**
+ * @file hpet.hpp
+ *
+ * High Precision Event Timer のドライバ．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "acpi.hpp"
+#include "clocksource.hpp"
+#include "error.hpp"
+
+/** @brief HPET のメインカウンタと比較器（タイマ）．
+ *
+ * メインカウンタはクロックソースとして読む．
+ * 比較器は FSB（MSI）で割り込みを送れる場合に限り，周期割り込みの源として使う．
+ */
+class HPETClockSource : public ClockSource {
+ public:
+  explicit HPETClockSource(uintptr_t mmio_base);
+
+  const char* Name() const override { return "hpet"; }
+  uint64_t Read() const override;
+  uint64_t Mask() const override { return counter_64bit_ ? ~uint64_t{0} : 0xffffffffu; }
+  uint64_t Frequency() const override { return freq_; }
+  int Rating() const override { return 250; }
+  Error StartPeriodicInterrupt(unsigned long freq, uint8_t vector) override;
+
+  int NumTimers() const { return num_timers_; }
+  /** @brief メインカウンタの 1 カウントの長さ（フェムト秒） */
+  uint64_t PeriodFemtoseconds() const { return period_fs_; }
+
+  /** @brief 比較器の割り込みを止め，レガシー置換なしでメインカウンタを動かす */
+  void Enable();
+
+ private:
+  volatile uint64_t* const regs_;
+  uint64_t period_fs_, freq_;
+  bool counter_64bit_;
+  int num_timers_;
+
+  volatile uint64_t& Reg(uint32_t offset) const { return regs_[offset / 8]; }
+  /** @brief 比較器 n の設定レジスタ */
+  volatile uint64_t& TimerConfig(int n) const { return Reg(0x100 + 0x20 * n); }
+  volatile uint64_t& TimerComparator(int n) const { return Reg(0x108 + 0x20 * n); }
+  volatile uint64_t& TimerFSBRoute(int n) const { return Reg(0x110 + 0x20 * n); }
+};
+
+/** @brief ACPI の HPET テーブルが示す HPET を初期化し，メインカウンタを動かす．
+ *
+ * レジスタがメモリ空間に無い場合や，周期が仕様の範囲外なら失敗する．
+ */
+WithError<HPETClockSource*> InitializeHPET(const acpi::HPET& table);
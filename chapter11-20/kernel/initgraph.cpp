@@ -0,0 +1,107 @@
+#include "initgraph.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "boottrace.hpp"
+#include "logger.hpp"
+#include "task.hpp"
+
+namespace {
+  /** @brief kTask の処理を実行するタスクに渡す引数 */
+  struct TaskArg {
+    std::function<void ()>* func;
+    uint64_t owner_task_id;
+    int step;
+  };
+}
+
+InitGraph::InitGraph(uint64_t owner_task_id) : owner_task_id_{owner_task_id} {
+}
+
+InitGraph& InitGraph::Add(const char* name, Mode mode, std::function<void ()> func,
+                          std::initializer_list<const char*> deps) {
+  Step step{name, mode, std::move(func), {}, State::kWaiting};
+  for (auto dep : deps) {
+    auto it = std::find_if(steps_.begin(), steps_.end(),
+                           [dep](const Step& s) { return strcmp(s.name, dep) == 0; });
+    if (it == steps_.end()) {
+      Log(kError, "InitGraph: %s depends on unknown step %s\n", name, dep);
+      continue;
+    }
+    step.deps.push_back(it - steps_.begin());
+  }
+  steps_.push_back(std::move(step));
+  return *this;
+}
+
+void InitGraph::Start() {
+  RunReadySteps();
+}
+
+void InitGraph::OnStepDone(int step) {
+  if (step < 0 || steps_.size() <= static_cast<size_t>(step) ||
+      steps_[step].state != State::kRunning) {
+    return;
+  }
+  MarkDone(step);
+  RunReadySteps();
+}
+
+void InitGraph::RunReadySteps() {
+  // kSync の処理が終わると新たに実行できる処理が増えるので，増えなくなるまで繰り返す
+  bool progressed = true;
+  while (progressed) {
+    progressed = false;
+    for (size_t i = 0; i < steps_.size(); ++i) {
+      auto& step = steps_[i];
+      if (step.state != State::kWaiting ||
+          !std::all_of(step.deps.begin(), step.deps.end(),
+                       [this](int dep) { return steps_[dep].state == State::kDone; })) {
+        continue;
+      }
+
+      step.state = State::kRunning;
+      if (step.mode == Mode::kSync) {
+        step.func();
+        MarkDone(i);
+        progressed = true;
+        continue;
+      }
+
+      // steps_ は Start() 以降は増えないので，要素へのポインタを渡してよい
+      auto arg = new TaskArg{&step.func, owner_task_id_, static_cast<int>(i)};
+      task_manager->NewTask()
+        .InitContext(TaskEntry, reinterpret_cast<int64_t>(arg), kTaskStackBytes)
+        .Wakeup();
+    }
+  }
+}
+
+void InitGraph::MarkDone(int step) {
+  steps_[step].state = State::kDone;
+  ++num_done_;
+  RecordBootPhase(steps_[step].name);
+}
+
+void InitGraph::TaskEntry(uint64_t task_id, int64_t data) {
+  auto arg = reinterpret_cast<TaskArg*>(data);
+  // メモリの確保やログの出力はメインタスクと同時に行えないので，割り込みを禁止して実行する．
+  // SleepMilliseconds で待っている間だけ他のタスクに切り替わる．
+  __asm__("cli");
+  (*arg->func)();
+
+  Message msg{Message::kInitDone, task_id};
+  msg.arg.init.step = arg->step;
+  __asm__("cli");
+  const auto owner_task_id = arg->owner_task_id;
+  delete arg;
+  task_manager->SendMessage(owner_task_id, msg);
+  __asm__("sti");
+
+  // タスクを終了する仕組みは無いので，眠らせたままにする
+  while (true) {
+    __asm__("cli");
+    task_manager->Sleep(task_id);
+    __asm__("sti");
+  }
+}
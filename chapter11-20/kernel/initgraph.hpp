@@ -0,0 +1,73 @@
+/**
+ * @file initgraph.hpp
+ *
+ * 依存関係に従って起動時の初期化処理を進める仕組み．
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+/** @brief 初期化処理とその依存関係のグラフ．
+ *
+ * 依存する処理がすべて終わった処理から実行する．kTask の処理は専用のタスクで実行し，
+ * SleepMilliseconds で待っている間もメインタスクは画面の更新や入力の処理を続けられる．
+ * kTask の処理は割り込みを禁止したまま動くので，待っている間を除いてメインタスクと
+ * 同時には動かない．ヒープやレイヤなどをそのまま使ってよいが，待つときは必ず眠ること．
+ * kSync の処理はメインタスクでその場で実行する．
+ * 処理を実行するのは Start() と OnStepDone() の中だけなので，どちらもメインタスクから呼ぶ．
+ */
+class InitGraph {
+ public:
+  enum class Mode {
+    kSync, // メインタスクで実行する
+    kTask, // 専用のタスクで実行する
+  };
+
+  /** @brief kTask の処理を実行するタスクのスタックの大きさ */
+  static const size_t kTaskStackBytes = 16 * 1024;
+
+  /** @brief 初期化処理が終わったら owner_task_id に Message::kInitDone を送る */
+  explicit InitGraph(uint64_t owner_task_id);
+
+  /** @brief 初期化処理 name を追加する．deps には先に Add した処理の名前を指定する． */
+  InitGraph& Add(const char* name, Mode mode, std::function<void ()> func,
+                 std::initializer_list<const char*> deps = {});
+
+  /** @brief 依存する処理の無い処理から実行を始める． */
+  void Start();
+
+  /** @brief Message::kInitDone を受け取ったときに呼び，後続の処理を実行する． */
+  void OnStepDone(int step);
+
+  /** @brief すべての処理が終わっていれば true */
+  bool Finished() const { return num_done_ == steps_.size(); }
+
+ private:
+  enum class State {
+    kWaiting,
+    kRunning,
+    kDone,
+  };
+
+  struct Step {
+    const char* name;
+    Mode mode;
+    std::function<void ()> func;
+    std::vector<int> deps;
+    State state;
+  };
+
+  const uint64_t owner_task_id_;
+  std::vector<Step> steps_;
+  size_t num_done_{0};
+
+  /** @brief 依存する処理が終わった処理を，実行できるものが無くなるまで実行する． */
+  void RunReadySteps();
+  void MarkDone(int step);
+
+  static void TaskEntry(uint64_t task_id, int64_t data);
+};
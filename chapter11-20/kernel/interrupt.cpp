@@ -6,10 +6,14 @@
 
 #include "interrupt.hpp"
 
+#include "address_space.hpp"
 #include "asmfunc.h"
+#include "logger.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 #include "task.hpp"
+#include "usb/xhci/xhci.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -30,28 +34,95 @@ void NotifyEndOfInterrupt() {
 }
 
 namespace {
+  /** @brief xHC のインタラプタ interrupter のイベントリングを処理するようメインタスクに伝える */
+  void NotifyXHCIInterrupt(int interrupter) {
+    // 前回の通知がまだ処理されていなければ，そのときにまとめて処理される
+    if (usb::xhci::ShouldNotifyEvents(interrupter)) {
+      Message msg{Message::kInterruptXHCI};
+      msg.arg.xhci.interrupter = interrupter;
+      // day14b
+      /** @brief msg_queue（main.cpp）の代わりに、task_manager（task.cpp）のメッセージキューを使うように修正 */
+      task_manager->SendMessage(1, msg);
+    }
+    NotifyEndOfInterrupt();
+  }
+
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
-    // day14b
-    /** @brief msg_queue（main.cpp）の代わりに、task_manager（task.cpp）のメッセージキューを使うように修正 */
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
-    NotifyEndOfInterrupt();
+    NotifyXHCIInterrupt(0);
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerXHCI1(InterruptFrame* frame) {
+    NotifyXHCIInterrupt(1);
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerXHCI2(InterruptFrame* frame) {
+    NotifyXHCIInterrupt(2);
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerXHCI3(InterruptFrame* frame) {
+    NotifyXHCIInterrupt(3);
   }
 
   __attribute__((interrupt))
   void IntHandlerLAPICTimer(InterruptFrame* frame) {
     LAPICTimerOnInterrupt();
   }
+
+  __attribute__((interrupt))
+  void IntHandlerPageFault(InterruptFrame* frame, uint64_t error_code) {
+    // フレームのコピーやゼロクリアで SSE レジスタが使われても良いように退避しておく
+    alignas(16) std::array<uint8_t, 512> fxsave_area;
+    __asm__ volatile("fxsave64 %0" : "=m"(fxsave_area));
+
+    const uint64_t causal_addr = GetCR2();
+    if (auto err = HandlePageFault(error_code, causal_addr)) {
+      Log(kError, "#PF at %016lx (error %lx, RIP %016lx): %s at %s:%d\n",
+          causal_addr, error_code, frame->rip, err.Name(), err.File(), err.Line());
+      while (true) __asm__("hlt");
+    }
+
+    __asm__ volatile("fxrstor64 %0" : : "m"(fxsave_area));
+  }
+
+  __attribute__((interrupt))
+  void IntHandlerTLBShootdown(InterruptFrame* frame) {
+    OnTLBShootdownInterrupt();
+    NotifyEndOfInterrupt();
+  }
 }
 
 void InitializeInterrupt() {
+  SetIDTEntry(idt[InterruptVector::kPageFault],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerPageFault),
+              kKernelCS);
   SetIDTEntry(idt[InterruptVector::kXHCI],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerXHCI),
               kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kXHCI1],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerXHCI1),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kXHCI2],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerXHCI2),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kXHCI3],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerXHCI3),
+              kKernelCS);
   SetIDTEntry(idt[InterruptVector::kLAPICTimer],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kTLBShootdown],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerTLBShootdown),
+              kKernelCS);
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -57,8 +57,14 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
  public:
   enum Number {
+    kPageFault = 14,
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kTLBShootdown = 0x42,
+    // MSI-X が使えるときの xHC のインタラプタ 1〜3 用（インタラプタ 0 は kXHCI）
+    kXHCI1 = 0x48,
+    kXHCI2 = 0x49,
+    kXHCI3 = 0x4a,
   };
 };
 
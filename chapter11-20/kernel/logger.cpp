@@ -4,6 +4,7 @@
 #include <cstdio>
 
 #include "console.hpp"
+#include "serial.hpp"
 
 namespace {
   LogLevel log_level = kWarn;
@@ -29,5 +30,6 @@ int Log(LogLevel level, const char* format, ...) {
   va_end(ap);
 
   console->PutString(s);
+  WriteSerialConsole(s);
   return result;
 }
@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 
 #include <deque>
 #include <limits>
@@ -22,6 +23,7 @@
 #include "pci.hpp"
 #include "logger.hpp"
 #include "usb/xhci/xhci.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "interrupt.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
@@ -34,10 +36,17 @@
 #include "timer.hpp"
 // day11e
 #include "acpi.hpp"
+#include "clocksource.hpp"
 #include "keyboard.hpp"
+#include "serial.hpp"
 // day13a
 #include "task.hpp"
 #include "terminal.hpp"
+#include "boottrace.hpp"
+#include "initgraph.hpp"
+#include "block_device.hpp"
+#include "virtio_blk.hpp"
+#include "fat.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -117,38 +126,119 @@ void InputTextWindow(char c) {
   layer_manager->Draw(text_window_layer_id);
 }
 
+/** @brief PCI デバイスとドライバの対応表．前の行ほど優先される．
+ *
+ * xHC は 1 つだけ使うので Intel 製を先に試す．
+ */
+const pci::DriverMatch pci_drivers[] = {
+  {0x8086, pci::kAnyID, 0x0c0330, 0xffffff, "xhci-intel", usb::xhci::Probe},
+  {pci::kAnyID, pci::kAnyID, 0x0c0330, 0xffffff, "xhci", usb::xhci::Probe},
+  {0x1af4, 0x1001, 0, 0, "virtio-blk", virtio::ProbeBlockDevice}, // transitional
+  {0x1af4, 0x1042, 0, 0, "virtio-blk", virtio::ProbeBlockDevice},
+};
+
+void BindPCIDrivers() {
+  pci::BindDrivers(pci_drivers, sizeof(pci_drivers) / sizeof(pci_drivers[0]));
+  if (usb::xhci::controller == nullptr) {
+    Log(kError, "xHC has not been found\n");
+  }
+}
+
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
+/** @brief ローダから受け取ったメモリマップのコピー．
+ *
+ * 元のバッファはローダのスタック（解放済みとして扱うメモリ）にあるので，
+ * フレームの割り当てを始める前にカーネルの領域へ移しておく．
+ */
+alignas(16) char memory_map_buf[4096 * 4];
+
+/** @brief ローダから受け取ったボリュームの情報のコピー */
+BootVolume boot_volume_info;
+void* boot_volume_image;
+
+/** @brief 起動ボリュームを開き，FAT32 としてマウントする */
+void OpenBootVolume() {
+  if (auto err = InitializeBootVolume(boot_volume_info, boot_volume_image)) {
+    Log(kWarn, "boot volume is not available: %s\n", err.Name());
+    return;
+  }
+  if (auto err = fat::Initialize(*boot_volume_cache)) {
+    Log(kWarn, "failed to mount the boot volume: %s\n", err.Name());
+  }
+}
+
 // day17a, day11e, day11a
 extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table,
-    void* volume_image) {
+    void* volume_image,
+    const BootInfo* boot_info) {
+  InitializeBootTrace(boot_info);
+  // BootInfo はローダのメモリにあり，メモリ管理の初期化後は上書きされうるので先に写す
+  boot_volume_info = boot_info ? boot_info->volume : BootVolume{};
+
   MemoryMap memory_map{memory_map_ref};
+  // 入り切らない分は捨て，記述子の途中で切れないようにする
+  const bool memory_map_truncated = memory_map.map_size > sizeof(memory_map_buf);
+  if (memory_map_truncated) {
+    memory_map.map_size =
+      sizeof(memory_map_buf) / memory_map.descriptor_size * memory_map.descriptor_size;
+  }
+  memcpy(memory_map_buf, memory_map_ref.buffer, memory_map.map_size);
+  memory_map.buffer = memory_map_buf;
+  memory_map.buffer_size = sizeof(memory_map_buf);
 
   InitializeGraphics(frame_buffer_config_ref);
   InitializeConsole();
+  RecordBootPhase("graphics/console");
 
   printk("Welcome to MikanOS!\n");
   SetLogLevel(kWarn);
+  if (memory_map_truncated) {
+    Log(kWarn, "memory map truncated: %llu of %llu bytes are used\n",
+        memory_map.map_size, memory_map_ref.map_size);
+  }
 
   InitializeSegmentation();
+  RecordBootPhase("segmentation");
   InitializePaging();
+  RecordBootPhase("paging");
   InitializeMemoryManager(memory_map);
+  RecordBootPhase("memory manager");
+
+  // ボリュームイメージ以外にローダが残したメモリを回収する
+  boot_volume_image = volume_image;
+  const auto volume_begin = reinterpret_cast<uintptr_t>(volume_image);
+  const size_t volume_bytes =
+    volume_image ? VolumeImageBytes(boot_volume_info, volume_image) : 0;
+  const size_t num_reclaimed = ReclaimLoaderMemory(
+      memory_map, volume_begin, volume_begin + volume_bytes);
+  Log(kInfo, "reclaimed %lu KiB of loader memory\n", num_reclaimed * kBytesPerFrame / 1024);
+  RecordBootPhase("reclaim loader memory");
+
   InitializeInterrupt();
+  RecordBootPhase("interrupt");
 
+  // PCI のコンフィグレーション空間へのアクセスに MCFG を使うので，先に ACPI を読む
+  acpi::Initialize(acpi_table);
+  InitializeClockSources();
+  InitializeMemoryAffinity();
+  RecordBootPhase("acpi");
   InitializePCI();
+  RecordBootPhase("pci");
 
   InitializeLayer();
   InitializeMainWindow();
   InitializeTextWindow();
   layer_manager->Draw({{0, 0}, ScreenSize()});
+  RecordBootPhase("layers/windows");
 
   // day11e, day11c, day11b
-  acpi::Initialize(acpi_table);
   /** @brief LocalAPICタイマを開始し、特定の時間ごとに割り込みを発生させる */
   InitializeLAPICTimer();
+  RecordBootPhase("lapic timer");
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
@@ -160,34 +250,34 @@ extern "C" void KernelMainNewStack(
   InitializeTask();
   // day14b
   Task& main_task = task_manager->CurrentTask();
+  // ターミナルは自分のアドレス空間を持ち，ファイルを読むバッファなどをそこに置く
+  auto terminal_space = std::make_unique<AddressSpace>();
+  if (auto err = terminal_space->Initialize()) {
+    Log(kWarn, "failed to create an address space for the terminal: %s\n", err.Name());
+    terminal_space.reset();
+  }
   const uint64_t task_terminal_id = task_manager->NewTask()
-    .InitContext(TaskTerminal, 0)
+    .InitContext(TaskTerminal, 0, kTerminalStackBytes)
+    .SetAddressSpace(std::move(terminal_space))
     .Wakeup()
     .ID();
-
-  usb::xhci::Initialize();
-  InitializeKeyboard();
-  InitializeMouse();
-
-  // day17a
-  uint8_t* p = reinterpret_cast<uint8_t*>(volume_image);
-  printk("Volume Image:\n");
-  for (int i = 0; i < 16; ++i) {
-    printk("%04x:", i * 16);
-    for (int j = 0; j < 8; ++j) {
-      printk(" %02x", *p);
-      ++p;
-    }
-    printk(" ");
-    for (int j = 0; j < 8; ++j) {
-      printk(" %02x", *p);
-      ++p;
-    }
-    printk("\n");
-  }
+  RecordBootPhase("tasks");
+
+  // xHC のリセットなど待ち時間の長い処理は別のタスクで進め，その間もメインループを回す
+  InitGraph init_graph{main_task.ID()};
+  init_graph
+    .Add("keyboard", InitGraph::Mode::kSync, InitializeKeyboard)
+    .Add("mouse", InitGraph::Mode::kSync, InitializeMouse)
+    .Add("serial", InitGraph::Mode::kSync, InitializeSerialConsole)
+    .Add("pci drivers", InitGraph::Mode::kTask, BindPCIDrivers)
+    .Add("usb", InitGraph::Mode::kSync, usb::xhci::Start,
+         {"pci drivers", "keyboard", "mouse", "serial"})
+    .Add("boot volume", InitGraph::Mode::kSync, OpenBootVolume, {"pci drivers"});
+  init_graph.Start();
 
   char str[128];
 
+  RecordBootPhase("main loop");
   while (true) {
     __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
@@ -213,7 +303,7 @@ extern "C" void KernelMainNewStack(
     // day11d, day11b
     switch (msg->type) {
     case Message::kInterruptXHCI:
-      usb::xhci::ProcessEvents();
+      usb::xhci::ProcessEvents(msg->arg.xhci.interrupter);
       break;
     case Message::kTimerTimeout:
       if (msg->arg.timer.value == kTextboxCursorTimer) {
@@ -228,6 +318,8 @@ extern "C" void KernelMainNewStack(
         __asm__("cli");
         task_manager->SendMessage(task_terminal_id, *msg);
         __asm__("sti");
+      } else if (msg->arg.timer.value == kUSBHubTimerValue) {
+        usb::HubDriver::OnTimerTimeout(msg->arg.timer.timeout);
       }
       break;
     case Message::kKeyPush:
@@ -248,6 +340,15 @@ extern "C" void KernelMainNewStack(
         }
       }
       break;
+    case Message::kSerialFlush:
+      FlushSerialConsole();
+      break;
+    case Message::kInitDone:
+      init_graph.OnStepDone(msg->arg.init.step);
+      if (init_graph.Finished()) {
+        PrintBootTimeline([](const char* line) { Log(kInfo, "%s", line); });
+      }
+      break;
     case Message::kLayer:
       ProcessLayerMessage(*msg);
       __asm__("cli");
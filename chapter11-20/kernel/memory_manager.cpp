@@ -1,17 +1,79 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
+#include <array>
+
+#include "acpi.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
 
 BitmapMemoryManager::BitmapMemoryManager()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}},
+    nodes_{}, num_nodes_{0}, local_node_{0} {
+}
+
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames,
+                                                 MemoryZone zone,
+                                                 int node) {
+  if (node < 0 || node >= num_nodes_) {
+    node = local_node_;
+  }
+
+  // 近いノードを優先し，同じノードの中では 4GiB 以上のメモリを優先する
+  const std::array<std::pair<size_t, size_t>, 2> zones{{
+    {kDMA32FrameEnd, range_end_.ID()},
+    {range_begin_.ID(), kDMA32FrameEnd},
+  }};
+  const size_t first_zone = zone == MemoryZone::kNormal ? 0 : 1;
+  for (int i = 0; i < num_nodes_; ++i) {
+    const int fallback = nodes_[node].fallback[i];
+    for (size_t z = first_zone; z < zones.size(); ++z) {
+      auto frame = AllocateInNode(num_frames, zones[z].first, zones[z].second, fallback);
+      if (!frame.error) {
+        return frame;
+      }
+    }
+  }
+
+  // どのノードにも属さないメモリ（SRAT がない場合は全メモリ）
+  for (size_t z = first_zone; z < zones.size(); ++z) {
+    auto frame = AllocateInRange(num_frames,
+                                 std::max(zones[z].first, range_begin_.ID()),
+                                 std::min(zones[z].second, range_end_.ID()));
+    if (!frame.error) {
+      return frame;
+    }
+  }
+  return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateInNode(size_t num_frames,
+                                                       size_t zone_begin,
+                                                       size_t zone_end,
+                                                       int node) {
+  zone_begin = std::max(zone_begin, range_begin_.ID());
+  zone_end = std::min(zone_end, range_end_.ID());
+
+  const auto& n = nodes_[node];
+  for (int r = 0; r < n.num_ranges; ++r) {
+    auto frame = AllocateInRange(num_frames,
+                                 std::max(zone_begin, n.ranges[r].begin),
+                                 std::min(zone_end, n.ranges[r].end));
+    if (!frame.error) {
+      return frame;
+    }
+  }
+  return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
+WithError<FrameID> BitmapMemoryManager::AllocateInRange(size_t num_frames,
+                                                        size_t begin,
+                                                        size_t end) {
+  size_t start_frame_id = begin;
   while (true) {
     size_t i = 0;
     for (; i < num_frames; ++i) {
-      if (start_frame_id + i >= range_end_.ID()) {
+      if (start_frame_id + i >= end) {
         return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
       }
       if (GetBit(FrameID{start_frame_id + i})) {
@@ -50,6 +112,56 @@ void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end)
   range_end_ = range_end;
 }
 
+int BitmapMemoryManager::AddNode() {
+  if (num_nodes_ == kMaxNodes) {
+    return -1;
+  }
+
+  const int node = num_nodes_++;
+  nodes_[node].num_ranges = 0;
+  for (int i = 0; i < kMaxNodes; ++i) {
+    nodes_[node].distance[i] = 20;
+    nodes_[i].distance[node] = 20;
+  }
+  nodes_[node].distance[node] = 10;
+  UpdateFallbackOrder();
+  return node;
+}
+
+Error BitmapMemoryManager::AddNodeRange(int node, FrameID begin, FrameID end) {
+  if (node < 0 || node >= num_nodes_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  auto& n = nodes_[node];
+  if (n.num_ranges == kMaxNodeRanges) {
+    return MAKE_ERROR(Error::kFull);
+  }
+  n.ranges[n.num_ranges++] = {begin.ID(), end.ID()};
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BitmapMemoryManager::SetNodeDistance(int from, int to, uint8_t distance) {
+  if (0 <= from && from < num_nodes_ && 0 <= to && to < num_nodes_) {
+    nodes_[from].distance[to] = distance;
+  }
+}
+
+void BitmapMemoryManager::SetLocalNode(int node) {
+  local_node_ = node;
+  UpdateFallbackOrder();
+}
+
+void BitmapMemoryManager::UpdateFallbackOrder() {
+  for (int node = 0; node < num_nodes_; ++node) {
+    auto& n = nodes_[node];
+    for (int i = 0; i < num_nodes_; ++i) {
+      n.fallback[i] = i;
+    }
+    std::stable_sort(n.fallback.begin(), n.fallback.begin() + num_nodes_,
+                     [&n](int a, int b) { return n.distance[a] < n.distance[b]; });
+  }
+}
+
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
   auto line_index = frame.ID() / kBitsPerMapLine;
   auto bit_index = frame.ID() % kBitsPerMapLine;
@@ -69,10 +181,13 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
 }
 
 extern "C" caddr_t program_break, program_break_end;
+// リンカが定義する，カーネルイメージの先頭（ELF ヘッダ）と終端
+extern "C" const char __ehdr_start[], _end[];
+
+BitmapMemoryManager* memory_manager;
 
 namespace {
   char memory_manager_buf[sizeof(BitmapMemoryManager)];
-  BitmapMemoryManager* memory_manager;
 
   Error InitializeHeap(BitmapMemoryManager& memory_manager) {
     const int kHeapFrames = 64 * 512;
@@ -85,6 +200,33 @@ namespace {
     program_break_end = program_break + kHeapFrames * kBytesPerFrame;
     return MAKE_ERROR(Error::kSuccess);
   }
+
+  /** @brief フレーム ID の範囲 [begin, end) */
+  using FrameRange = std::pair<size_t, size_t>;
+
+  /** @brief [begin, end) のうち excludes に含まれないフレームを解放し，解放したフレーム数を返す */
+  size_t FreeFramesExcept(size_t begin, size_t end, std::array<FrameRange, 2> excludes) {
+    std::sort(excludes.begin(), excludes.end());
+
+    size_t num_freed = 0;
+    auto free_frames = [&num_freed](size_t begin, size_t end) {
+      if (begin < end) {
+        memory_manager->Free(FrameID{begin}, end - begin);
+        num_freed += end - begin;
+      }
+    };
+
+    for (const auto& [ ex_begin, ex_end ] : excludes) {
+      free_frames(begin, std::min(end, ex_begin));
+      begin = std::max(begin, ex_end);
+    }
+    free_frames(begin, end);
+    return num_freed;
+  }
+
+  FrameRange FramesCovering(uintptr_t begin, uintptr_t end) {
+    return {begin / kBytesPerFrame, (end + kBytesPerFrame - 1) / kBytesPerFrame};
+  }
 }
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
@@ -104,14 +246,21 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
 
     const auto physical_end =
       desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+    const auto type = static_cast<MemoryType>(desc->type);
+    if (IsAvailable(type)) {
       available_end = physical_end;
     } else {
       memory_manager->MarkAllocated(
           FrameID{desc->physical_start / kBytesPerFrame},
           desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+      if (IsLoaderMemory(type)) {
+        // 後で ReclaimLoaderMemory により解放できるよう，管理範囲には含めておく
+        available_end = physical_end;
+      }
     }
   }
+  // アイデンティティマッピングされていないメモリは割り当てても使えない
+  available_end = std::min<uintptr_t>(available_end, kPageDirectoryCount * 1_GiB);
   memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
 
   if (auto err = InitializeHeap(*memory_manager)) {
@@ -120,3 +269,104 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
     exit(1);
   }
 }
+
+size_t ReclaimLoaderMemory(const MemoryMap& memory_map,
+                           uintptr_t keep_begin, uintptr_t keep_end) {
+  const std::array<FrameRange, 2> excludes{
+    FramesCovering(reinterpret_cast<uintptr_t>(__ehdr_start),
+                   reinterpret_cast<uintptr_t>(_end)),
+    FramesCovering(keep_begin, keep_end),
+  };
+
+  size_t num_freed = 0;
+  const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+  for (uintptr_t iter = memory_map_base;
+       iter < memory_map_base + memory_map.map_size;
+       iter += memory_map.descriptor_size) {
+    auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+    if (!IsLoaderMemory(static_cast<MemoryType>(desc->type))) {
+      continue;
+    }
+    const auto [ begin, end ] = FramesCovering(
+        desc->physical_start,
+        desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    num_freed += FreeFramesExcept(begin, end, excludes);
+  }
+  return num_freed;
+}
+
+void InitializeMemoryAffinity() {
+  if (acpi::srat == nullptr) {
+    Log(kInfo, "SRAT is not found: all memory belongs to a single node\n");
+    return;
+  }
+
+  // ノード番号から近接ドメインへの対応
+  std::array<uint32_t, BitmapMemoryManager::kMaxNodes> domains;
+  auto node_of = [&domains](uint32_t domain) {
+    for (int node = 0; node < memory_manager->NumNodes(); ++node) {
+      if (domains[node] == domain) {
+        return node;
+      }
+    }
+    const int node = memory_manager->AddNode();
+    if (node >= 0) {
+      domains[node] = domain;
+    }
+    return node;
+  };
+
+  const uint32_t bsp_apic_id = *reinterpret_cast<volatile uint32_t*>(0xfee00020) >> 24;
+  int local_node = 0;
+
+  for (auto entry = acpi::srat->begin(); entry < acpi::srat->end();
+       entry = acpi::SRAT::Next(entry)) {
+    if (entry->length == 0) {
+      break;
+    }
+
+    if (entry->type == acpi::SRAT::kMemory) {
+      auto mem = reinterpret_cast<const acpi::SRATMemory*>(entry);
+      if ((mem->flags & 1) == 0) {
+        continue;
+      }
+      const int node = node_of(mem->proximity_domain);
+      if (node < 0) {
+        Log(kWarn, "too many NUMA nodes: domain %u is ignored\n", mem->proximity_domain);
+        continue;
+      }
+      const auto begin = mem->base_address / kBytesPerFrame;
+      const auto end = (mem->base_address + mem->length_bytes) / kBytesPerFrame;
+      if (auto err = memory_manager->AddNodeRange(node, FrameID{begin}, FrameID{end})) {
+        Log(kWarn, "failed to add memory range to node %d: %s\n", node, err.Name());
+      }
+    } else if (entry->type == acpi::SRAT::kProcessorLocalAPIC) {
+      auto cpu = reinterpret_cast<const acpi::SRATProcessorLocalAPIC*>(entry);
+      if ((cpu->flags & 1) && cpu->apic_id == bsp_apic_id) {
+        local_node = node_of(cpu->ProximityDomain());
+      }
+    } else if (entry->type == acpi::SRAT::kProcessorLocalx2APIC) {
+      auto cpu = reinterpret_cast<const acpi::SRATProcessorLocalx2APIC*>(entry);
+      if ((cpu->flags & 1) && cpu->x2apic_id == bsp_apic_id) {
+        local_node = node_of(cpu->proximity_domain);
+      }
+    }
+  }
+
+  const int num_nodes = memory_manager->NumNodes();
+  if (acpi::slit) {
+    for (int from = 0; from < num_nodes; ++from) {
+      for (int to = 0; to < num_nodes; ++to) {
+        if (domains[from] < acpi::slit->num_localities &&
+            domains[to] < acpi::slit->num_localities) {
+          memory_manager->SetNodeDistance(
+              from, to, acpi::slit->Distance(domains[from], domains[to]));
+        }
+      }
+    }
+  }
+  memory_manager->SetLocalNode(std::max(local_node, 0));
+
+  Log(kInfo, "NUMA: %d nodes, local node %d (APIC ID %u)\n",
+      num_nodes, std::max(local_node, 0), bsp_apic_id);
+}
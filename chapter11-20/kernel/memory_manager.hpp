@@ -41,6 +41,14 @@ class FrameID {
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+/** @brief フレームを割り当てるメモリゾーン */
+enum class MemoryZone {
+  /** @brief 4GiB 未満．32 ビットアドレスしか扱えない DMA デバイス用 */
+  kDMA32,
+  /** @brief 通常の割り当て．4GiB 以上を優先し，足りなければ 4GiB 未満も使う */
+  kNormal,
+};
+
 /** @brief ビットマップ配列を用いてフレーム単位でメモリ管理するクラス．
  *
  * 1 ビットを 1 フレームに対応させて，ビットマップにより空きフレームを管理する．
@@ -60,14 +68,40 @@ class BitmapMemoryManager {
   /** @brief ビットマップ配列の 1 つの要素のビット数 == フレーム数 */
   static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
+  /** @brief 扱える NUMA ノードの最大数 */
+  static const int kMaxNodes = 8;
+  /** @brief 1 つの NUMA ノードが持てるメモリ範囲の最大数 */
+  static const int kMaxNodeRanges = 16;
+  /** @brief Allocate でノードを指定しない（現在の CPU のノードを優先する）ことを表す */
+  static const int kAnyNode = -1;
+  /** @brief 4GiB 境界のフレーム ID．これ未満が MemoryZone::kDMA32 */
+  static const size_t kDMA32FrameEnd{4_GiB / kBytesPerFrame};
+
   /** @brief インスタンスを初期化する． */
   BitmapMemoryManager();
 
-  /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す */
-  WithError<FrameID> Allocate(size_t num_frames);
+  /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す
+   *
+   * node（kAnyNode なら現在の CPU のノード）から近い順に NUMA ノードを探す．
+   * MemoryZone::kNormal では各ノードの中で 4GiB 以上を先に探してから 4GiB 未満を探すので，
+   * 近いノードの 4GiB 未満のメモリが遠いノードのメモリより優先される．
+   */
+  WithError<FrameID> Allocate(size_t num_frames,
+                              MemoryZone zone = MemoryZone::kNormal,
+                              int node = kAnyNode);
   Error Free(FrameID start_frame, size_t num_frames);
   void MarkAllocated(FrameID start_frame, size_t num_frames);
 
+  /** @brief NUMA ノードを追加し，そのノード番号を返す．これ以上追加できなければ -1． */
+  int AddNode();
+  /** @brief NUMA ノードにメモリ範囲 [begin, end) を追加する． */
+  Error AddNodeRange(int node, FrameID begin, FrameID end);
+  /** @brief ノード間の距離を設定する．設定しなければ全ノードが等距離とみなされる． */
+  void SetNodeDistance(int from, int to, uint8_t distance);
+  /** @brief 現在の CPU が属するノードを設定し，ノードを探す順序を計算し直す． */
+  void SetLocalNode(int node);
+  int NumNodes() const { return num_nodes_; }
+
   /** @brief このメモリマネージャで扱うメモリ範囲を設定する．
    * この呼び出し以降，Allocate によるメモリ割り当ては設定された範囲内でのみ行われる．
    *
@@ -83,8 +117,47 @@ class BitmapMemoryManager {
   /** @brief このメモリマネージャで扱うメモリ範囲の終点．最終フレームの次のフレーム． */
   FrameID range_end_;
 
+  /** @brief NUMA ノードが持つメモリ範囲 [begin, end)（フレーム ID） */
+  struct NodeRange {
+    size_t begin, end;
+  };
+  struct Node {
+    std::array<NodeRange, kMaxNodeRanges> ranges;
+    int num_ranges;
+    /** @brief 各ノードへの距離（SLIT の値．自分自身は 10） */
+    std::array<uint8_t, kMaxNodes> distance;
+    /** @brief このノードを優先するときにノードを探す順序 */
+    std::array<int, kMaxNodes> fallback;
+  };
+  std::array<Node, kMaxNodes> nodes_;
+  int num_nodes_;
+  int local_node_;
+
   bool GetBit(FrameID frame) const;
   void SetBit(FrameID frame, bool allocated);
+  WithError<FrameID> AllocateInRange(size_t num_frames, size_t begin, size_t end);
+  /** @brief NUMA ノード node のメモリのうち [zone_begin, zone_end) の範囲から確保する */
+  WithError<FrameID> AllocateInNode(size_t num_frames, size_t zone_begin, size_t zone_end,
+                                    int node);
+  void UpdateFallbackOrder();
 };
 
+extern BitmapMemoryManager* memory_manager;
+
 void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/** @brief UEFI ローダが使っていたメモリ（EfiLoaderCode，EfiLoaderData）を解放する．
+ *
+ * カーネル自身のイメージと [keep_begin, keep_end) は解放しない．
+ * ローダから受け取ったデータのうち，必要なものを保持する範囲が決まってから呼び出す．
+ *
+ * @return 解放したフレーム数
+ */
+size_t ReclaimLoaderMemory(const MemoryMap& memory_map,
+                           uintptr_t keep_begin, uintptr_t keep_end);
+
+/** @brief ACPI の SRAT と SLIT に従って NUMA ノードを設定する．
+ *
+ * acpi::Initialize の後に呼び出す．SRAT がなければ全メモリを 1 つのノードとして扱う．
+ */
+void InitializeMemoryAffinity();
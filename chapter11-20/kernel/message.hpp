@@ -20,6 +20,8 @@ struct Message {
     kKeyPush,
     kLayer,
     kLayerFinish,
+    kSerialFlush,
+    kInitDone,
   } type;
 
   uint64_t src_task;
@@ -43,5 +45,13 @@ struct Message {
       int x, y;
       int w, h;
     } layer;
+
+    struct {
+      int interrupter; // イベントが届いた xHC のインタラプタ番号
+    } xhci;
+
+    struct {
+      int step; // 終わった初期化処理の番号
+    } init;
   } arg;
 };
@@ -57,7 +57,7 @@ void Mouse::SetPosition(Vector2D<int> position) {
   layer_manager->Move(layer_id_, position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+void Mouse::OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y) {
   const auto oldpos = position_;
   auto newpos = position_ + Vector2D<int>{displacement_x, displacement_y};
   newpos = ElementMin(newpos, ScreenSize() + Vector2D<int>{-1, -1});
@@ -88,6 +88,17 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
   previous_buttons_ = buttons;
 }
 
+void Mouse::OnAbsoluteInterrupt(uint8_t buttons, int x, int y, int range) {
+  const auto screen_size = ScreenSize();
+  const Vector2D<int> target{
+    static_cast<int>(static_cast<int64_t>(x) * (screen_size.x - 1) / range),
+    static_cast<int>(static_cast<int64_t>(y) * (screen_size.y - 1) / range),
+  };
+  // ドラッグの処理を共通にするため，移動量に直して渡す
+  const auto displacement = target - position_;
+  OnInterrupt(buttons, displacement.x, displacement.y);
+}
+
 void InitializeMouse() {
   auto mouse_window = std::make_shared<Window>(
       kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
@@ -103,9 +114,13 @@ void InitializeMouse() {
   layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
   usb::HIDMouseDriver::default_observer =
-    [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+    [mouse](uint8_t buttons, int displacement_x, int displacement_y, int wheel) {
       mouse->OnInterrupt(buttons, displacement_x, displacement_y);
     };
+  usb::HIDMouseDriver::default_absolute_observer =
+    [mouse](uint8_t buttons, int x, int y, int wheel) {
+      mouse->OnAbsoluteInterrupt(buttons, x, y, usb::HIDMouseDriver::kAbsoluteRange);
+    };
 
   active_layer->SetMouseLayer(mouse_layer_id);
 }
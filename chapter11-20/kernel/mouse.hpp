@@ -19,7 +19,9 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 class Mouse {
  public:
   Mouse(unsigned int layer_id);
-  void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  void OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y);
+  /** @brief タブレットの入力を処理する．x, y は画面全体を 0 〜 range とした位置． */
+  void OnAbsoluteInterrupt(uint8_t buttons, int x, int y, int range);
 
   unsigned int LayerID() const { return layer_id_; }
   void SetPosition(Vector2D<int> position);
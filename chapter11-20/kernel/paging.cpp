@@ -1,18 +1,326 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstring>
 
 #include "asmfunc.h"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
 
 namespace {
-  const uint64_t kPageSize4K = 4096;
-  const uint64_t kPageSize2M = 512 * kPageSize4K;
-  const uint64_t kPageSize1G = 512 * kPageSize2M;
-
   alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
   alignas(kPageSize4K)
     std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  /** @brief FlushTLB で invlpg を使うページ数の上限．これを超えたら CR3 を再設定する． */
+  const uint64_t kMaxInvlpgPages = 32;
+
+  bool page_1g_supported = false;
+  bool pcid_enabled = false;
+
+  const uint64_t kCR3AddressMask = 0x000ffffffffff000u;
+  const uint64_t kCR3NoFlush = 1ul << 63;
+  const uint64_t kCR4PGE = 1u << 7;
+  const uint64_t kCR4PCIDE = 1u << 17;
+
+  /** @brief 各 PCID を最後に使った PML4 のアドレス．0 なら未割り当て． */
+  std::array<uint64_t, kNumPCIDs> pcid_owner;
+  /** @brief true なら，その PCID に古い TLB エントリが残っている可能性がある */
+  std::array<bool, kNumPCIDs> pcid_stale;
+
+  /** @brief level 階層（1=PT, 2=PD, 3=PDP, 4=PML4）の 1 エントリが表す大きさ */
+  uint64_t PageSizeOfLevel(int level) {
+    return kPageSize4K << (9 * (level - 1));
+  }
+
+  /** @brief level 階層のテーブルにおける addr のインデックス */
+  int IndexOf(uint64_t addr, int level) {
+    return (addr >> (12 + 9 * (level - 1))) & 0x1ffu;
+  }
+
+  /** @brief level 階層のエントリが直接ページを指せるなら true */
+  bool CanMapDirectly(int level) {
+    return level == 1 || level == 2 || (level == 3 && page_1g_supported);
+  }
+
+  WithError<PageMapEntry*> NewPageTable() {
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return {nullptr, frame.error};
+    }
+    auto table = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
+    memset(table, 0, kBytesPerFrame);
+    return {table, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  /** @brief table がカーネルのアイデンティティマッピング用の静的なテーブルなら true */
+  bool IsStaticPageTable(const PageMapEntry* table) {
+    const auto addr = reinterpret_cast<uintptr_t>(table);
+    auto in = [addr](const auto& t) {
+      const auto begin = reinterpret_cast<uintptr_t>(&t);
+      return begin <= addr && addr < begin + sizeof(t);
+    };
+    return in(pml4_table) || in(pdp_table) || in(page_directory);
+  }
+
+  /** @brief 動的に確保したページテーブルを解放する．静的なテーブルは解放しない． */
+  Error FreePageTable(PageMapEntry* table) {
+    if (IsStaticPageTable(table)) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return memory_manager->Free(
+        FrameID{reinterpret_cast<uint64_t>(table) / kBytesPerFrame}, 1);
+  }
+
+  /** @brief level 階層のテーブルとそこから辿れる下位のテーブルをすべて解放する */
+  Error FreePageTableTree(PageMapEntry* table, int level) {
+    if (level > 1) {
+      for (int i = 0; i < 512; ++i) {
+        if (table[i].bits.present && !table[i].bits.huge_page) {
+          if (auto err = FreePageTableTree(table[i].Pointer(), level - 1)) {
+            return err;
+          }
+        }
+      }
+    }
+    return FreePageTable(table);
+  }
+
+  bool IsEmptyTable(const PageMapEntry* table) {
+    return std::all_of(table, table + 512,
+                       [](const PageMapEntry& e) { return e.data == 0; });
+  }
+
+  /** @brief 下位のテーブルを指すエントリを設定する．
+   *
+   * 中間エントリは書き込みを許可しておき，実際の権限は末端のエントリで決める．
+   */
+  void SetTableEntry(PageMapEntry& entry, PageMapEntry* table, uint64_t attr) {
+    entry.data = 0;
+    entry.SetPointer(table);
+    entry.bits.present = 1;
+    entry.bits.writable = 1;
+    entry.bits.user = (attr & page_attr::kUser) != 0;
+  }
+
+  void SetLeafEntry(PageMapEntry& entry, uint64_t phys_addr, int level, uint64_t attr) {
+    entry.data = phys_addr | (attr & page_attr::kMask);
+    entry.bits.present = 1;
+    entry.bits.huge_page = level > 1;
+  }
+
+  /** @brief level 階層の大きなページを，1 つ下の階層のページ 512 個に分割する */
+  Error SplitHugePage(PageMapEntry& entry, int level) {
+    auto table = NewPageTable();
+    if (table.error) {
+      return table.error;
+    }
+
+    const uint64_t attr = entry.data & page_attr::kMask;
+    const uint64_t phys_addr = entry.bits.addr << 12;
+    const uint64_t child_size = PageSizeOfLevel(level - 1);
+    for (int i = 0; i < 512; ++i) {
+      SetLeafEntry(table.value[i], phys_addr + i * child_size, level - 1, attr);
+    }
+    SetTableEntry(entry, table.value, attr);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** @brief 範囲 [virt_addr, virt_addr + bytes) が table のエントリ境界で
+   * 区切られる次のかたまりの大きさ
+   */
+  uint64_t ChunkSize(uint64_t virt_addr, uint64_t bytes, int level) {
+    const uint64_t page_size = PageSizeOfLevel(level);
+    const uint64_t entry_end = (virt_addr & ~(page_size - 1)) + page_size;
+    return std::min(bytes, entry_end - virt_addr);
+  }
+
+  Error MapLevel(PageMapEntry* table, int level, uint64_t virt_addr,
+                 uint64_t phys_addr, uint64_t bytes, uint64_t attr) {
+    const uint64_t page_size = PageSizeOfLevel(level);
+    while (bytes > 0) {
+      auto& entry = table[IndexOf(virt_addr, level)];
+      const uint64_t chunk = ChunkSize(virt_addr, bytes, level);
+
+      if (CanMapDirectly(level) && chunk == page_size && phys_addr % page_size == 0) {
+        if (level > 1 && entry.bits.present && !entry.bits.huge_page) {
+          if (auto err = FreePageTableTree(entry.Pointer(), level - 1)) {
+            return err;
+          }
+        }
+        SetLeafEntry(entry, phys_addr, level, attr);
+      } else {
+        if (!entry.bits.present) {
+          auto child = NewPageTable();
+          if (child.error) {
+            return child.error;
+          }
+          SetTableEntry(entry, child.value, attr);
+        } else if (entry.bits.huge_page) {
+          if (auto err = SplitHugePage(entry, level)) {
+            return err;
+          }
+        }
+        if (attr & page_attr::kUser) {
+          entry.bits.user = 1;
+        }
+        if (auto err = MapLevel(entry.Pointer(), level - 1,
+                                virt_addr, phys_addr, chunk, attr)) {
+          return err;
+        }
+      }
+
+      virt_addr += chunk;
+      phys_addr += chunk;
+      bytes -= chunk;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error UnmapLevel(PageMapEntry* table, int level, uint64_t virt_addr, uint64_t bytes) {
+    const uint64_t page_size = PageSizeOfLevel(level);
+    while (bytes > 0) {
+      auto& entry = table[IndexOf(virt_addr, level)];
+      const uint64_t chunk = ChunkSize(virt_addr, bytes, level);
+
+      if (!entry.bits.present) {
+        // 何もマップされていない
+      } else if (level == 1 || (entry.bits.huge_page && chunk == page_size)) {
+        entry.data = 0;
+      } else {
+        if (entry.bits.huge_page) {
+          if (auto err = SplitHugePage(entry, level)) {
+            return err;
+          }
+        }
+        if (auto err = UnmapLevel(entry.Pointer(), level - 1, virt_addr, chunk)) {
+          return err;
+        }
+        // カーネル領域の PDP テーブルは全アドレス空間で共有しているので解放しない．
+        // アイデンティティマッピングの静的なテーブルも，空になっても使い続ける．
+        const bool shared = level == 4 && IndexOf(virt_addr, 4) < kKernelPML4Entries;
+        if (!shared && !IsStaticPageTable(entry.Pointer()) &&
+            IsEmptyTable(entry.Pointer())) {
+          if (auto err = FreePageTable(entry.Pointer())) {
+            return err;
+          }
+          entry.data = 0;
+        }
+      }
+
+      virt_addr += chunk;
+      bytes -= chunk;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ChangeProtectionLevel(PageMapEntry* table, int level,
+                              uint64_t virt_addr, uint64_t bytes, uint64_t attr) {
+    const uint64_t page_size = PageSizeOfLevel(level);
+    while (bytes > 0) {
+      auto& entry = table[IndexOf(virt_addr, level)];
+      const uint64_t chunk = ChunkSize(virt_addr, bytes, level);
+
+      if (!entry.bits.present) {
+        // 何もマップされていない
+      } else if (level == 1 || (entry.bits.huge_page && chunk == page_size)) {
+        entry.data = (entry.data & ~page_attr::kMask) | (attr & page_attr::kMask);
+      } else {
+        if (entry.bits.huge_page) {
+          if (auto err = SplitHugePage(entry, level)) {
+            return err;
+          }
+        }
+        if (attr & page_attr::kUser) {
+          entry.bits.user = 1;
+        }
+        if (auto err = ChangeProtectionLevel(entry.Pointer(), level - 1,
+                                             virt_addr, chunk, attr)) {
+          return err;
+        }
+      }
+
+      virt_addr += chunk;
+      bytes -= chunk;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  bool IsAligned(uint64_t value) {
+    return value % kPageSize4K == 0;
+  }
+
+  /** @brief PCID を含めたすべての TLB エントリ（グローバルページを含む）を破棄する */
+  void FlushAllTLB() {
+    const uint64_t cr4 = GetCR4();
+    if (cr4 & kCR4PGE) {
+      SetCR4(cr4 & ~kCR4PGE);
+      SetCR4(cr4);
+    } else {
+      SetCR3(GetCR3());
+    }
+  }
+
+  /** @brief pml4_addr を使っている PCID に，次の切り替えで TLB を破棄させる */
+  void MarkPCIDStale(uint64_t pml4_addr) {
+    for (int pcid = 0; pcid < kNumPCIDs; ++pcid) {
+      if (pcid_owner[pcid] == pml4_addr) {
+        pcid_stale[pcid] = true;
+      }
+    }
+  }
+
+  /** @brief 自 CPU の TLB から pml4 の範囲 [virt_addr, virt_addr + bytes) を取り除く */
+  void InvalidateLocalTLB(uint64_t pml4_addr, uint64_t virt_addr, uint64_t bytes) {
+    const uint64_t first = virt_addr & ~(kPageSize4K - 1);
+    const uint64_t num_pages = (virt_addr + bytes - first + kPageSize4K - 1) / kPageSize4K;
+
+    if (IndexOf(virt_addr, 4) < kKernelPML4Entries) {
+      // カーネル領域は全アドレス空間で共有しているので，
+      // PCID が有効なら他の PCID のエントリも破棄しなければならない
+      if (pcid_enabled || num_pages > kMaxInvlpgPages) {
+        FlushAllTLB();
+        return;
+      }
+    } else if ((GetCR3() & kCR3AddressMask) != pml4_addr) {
+      // 現在のアドレス空間ではないので，次にそのアドレス空間へ切り替えるときに破棄する
+      MarkPCIDStale(pml4_addr);
+      return;
+    } else if (num_pages > kMaxInvlpgPages) {
+      SetCR3(GetCR3());
+      return;
+    }
+
+    for (uint64_t i = 0; i < num_pages; ++i) {
+      InvalidateTLB(first + i * kPageSize4K);
+    }
+  }
+
+  /** @brief TLB シュートダウンの要求内容．送信側が設定し，受信した各 CPU が参照する． */
+  struct TLBShootdownRequest {
+    uint64_t pml4_addr;
+    uint64_t virt_addr;
+    uint64_t bytes;
+    /** @brief まだ無効化を終えていない CPU の数 */
+    std::atomic<unsigned int> pending;
+  };
+
+  TLBShootdownRequest shootdown_request;
+  unsigned int num_online_cpus = 1;
+
+  /** @brief 自分以外のすべての CPU に TLB シュートダウン IPI を送る */
+  void SendTLBShootdownIPI() {
+    volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+    volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+    icr_high = 0;
+    // Destination Shorthand = All Excluding Self, Level = Assert, Delivery Mode = Fixed
+    icr_low = (0b11u << 18) | (1u << 14) | InterruptVector::kTLBShootdown;
+    while (icr_low & (1u << 12)); // Delivery Status が Idle になるまで待つ
+  }
 }
 
 void SetupIdentityPageTable() {
@@ -20,7 +328,7 @@ void SetupIdentityPageTable() {
   for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
     pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
     for (int i_pd = 0; i_pd < 512; ++i_pd) {
-      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+      page_directory[i_pdpt][i_pd] = (i_pdpt * kPageSize1G + i_pd * kPageSize2M) | 0x183;
     }
   }
 
@@ -28,5 +336,168 @@ void SetupIdentityPageTable() {
 }
 
 void InitializePaging() {
+  uint32_t eax, ebx, ecx, edx;
+  CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+  if (eax >= 0x80000001) {
+    CPUID(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    page_1g_supported = (edx >> 26) & 1; // Page1GB
+  }
+  CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+  const bool pcid_supported = (ecx >> 17) & 1; // PCID
+
   SetupIdentityPageTable();
+
+  // アイデンティティマッピングはグローバルページなので，CR3 を切り替えても TLB に残る
+  uint64_t cr4 = GetCR4() | kCR4PGE;
+  if (pcid_supported) {
+    // CR3 の PCID が 0 のときにだけ PCIDE を設定できる
+    cr4 |= kCR4PCIDE;
+  }
+  SetCR4(cr4);
+  pcid_enabled = pcid_supported;
+  pcid_owner[0] = reinterpret_cast<uint64_t>(KernelPageMap());
+}
+
+bool Supports1GiBPages() {
+  return page_1g_supported;
+}
+
+bool PCIDEnabled() {
+  return pcid_enabled;
+}
+
+uint16_t AllocatePCID(PageMapEntry* pml4) {
+  if (!pcid_enabled) {
+    return 0;
+  }
+  for (int pcid = 1; pcid < kNumPCIDs; ++pcid) {
+    if (pcid_owner[pcid] == 0) {
+      pcid_owner[pcid] = reinterpret_cast<uint64_t>(pml4);
+      pcid_stale[pcid] = true;
+      return pcid;
+    }
+  }
+  return 0;
+}
+
+void FreePCID(uint16_t pcid) {
+  if (pcid != 0) {
+    pcid_owner[pcid] = 0;
+  }
+}
+
+uint64_t MakeCR3(PageMapEntry* pml4, uint16_t pcid) {
+  const auto pml4_addr = reinterpret_cast<uint64_t>(pml4);
+  if (!pcid_enabled) {
+    return pml4_addr;
+  }
+
+  if (pcid_owner[pcid] != pml4_addr) {
+    // PCID 0 を他のページマップと共用している
+    pcid_owner[pcid] = pml4_addr;
+    return pml4_addr | pcid;
+  }
+  if (pcid_stale[pcid]) {
+    pcid_stale[pcid] = false;
+    return pml4_addr | pcid;
+  }
+  return pml4_addr | pcid | kCR3NoFlush;
+}
+
+PageMapEntry* KernelPageMap() {
+  return reinterpret_cast<PageMapEntry*>(pml4_table.data());
+}
+
+WithError<PageMapEntry*> NewPageMap() {
+  auto pml4 = NewPageTable();
+  if (pml4.error) {
+    return pml4;
+  }
+
+  const auto kernel_pml4 = KernelPageMap();
+  for (int i = 0; i < kKernelPML4Entries; ++i) {
+    pml4.value[i] = kernel_pml4[i];
+  }
+  return pml4;
+}
+
+Error FreePageMap(PageMapEntry* pml4) {
+  for (int i = kKernelPML4Entries; i < 512; ++i) {
+    if (pml4[i].bits.present) {
+      if (auto err = FreePageTableTree(pml4[i].Pointer(), 3)) {
+        return err;
+      }
+    }
+  }
+  return FreePageTable(pml4);
+}
+
+Error MapRange(PageMapEntry* pml4, uint64_t virt_addr, uint64_t phys_addr,
+               uint64_t bytes, uint64_t attr) {
+  if (!IsAligned(virt_addr) || !IsAligned(phys_addr) || !IsAligned(bytes)) {
+    return MAKE_ERROR(Error::kNotAligned);
+  }
+  return MapLevel(pml4, 4, virt_addr, phys_addr, bytes, attr);
+}
+
+Error UnmapRange(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes) {
+  if (!IsAligned(virt_addr) || !IsAligned(bytes)) {
+    return MAKE_ERROR(Error::kNotAligned);
+  }
+  return UnmapLevel(pml4, 4, virt_addr, bytes);
+}
+
+Error ChangeProtection(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes,
+                       uint64_t attr) {
+  if (!IsAligned(virt_addr) || !IsAligned(bytes)) {
+    return MAKE_ERROR(Error::kNotAligned);
+  }
+  return ChangeProtectionLevel(pml4, 4, virt_addr, bytes, attr);
+}
+
+PageMapEntry* FindPageEntry(PageMapEntry* pml4, uint64_t virt_addr,
+                            uint64_t* page_size) {
+  PageMapEntry* table = pml4;
+  for (int level = 4; level >= 1; --level) {
+    auto& entry = table[IndexOf(virt_addr, level)];
+    if (!entry.bits.present) {
+      return nullptr;
+    }
+    if (level == 1 || entry.bits.huge_page) {
+      if (page_size) {
+        *page_size = PageSizeOfLevel(level);
+      }
+      return &entry;
+    }
+    table = entry.Pointer();
+  }
+  return nullptr;
+}
+
+void FlushTLB(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes) {
+  const auto pml4_addr = reinterpret_cast<uint64_t>(pml4);
+  InvalidateLocalTLB(pml4_addr, virt_addr, bytes);
+  if (num_online_cpus <= 1) {
+    return;
+  }
+
+  shootdown_request.pml4_addr = pml4_addr;
+  shootdown_request.virt_addr = virt_addr;
+  shootdown_request.bytes = bytes;
+  shootdown_request.pending = num_online_cpus - 1;
+  SendTLBShootdownIPI();
+  while (shootdown_request.pending.load() > 0) {
+    __asm__("pause");
+  }
+}
+
+void SetOnlineCPUCount(unsigned int num_cpus) {
+  num_online_cpus = num_cpus;
+}
+
+void OnTLBShootdownInterrupt() {
+  InvalidateLocalTLB(shootdown_request.pml4_addr,
+                     shootdown_request.virt_addr,
+                     shootdown_request.bytes);
+  shootdown_request.pending.fetch_sub(1);
 }
@@ -7,6 +7,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
 
 /** @brief 静的に確保するページディレクトリの個数
  *
@@ -16,9 +19,161 @@
  */
 const size_t kPageDirectoryCount = 64;
 
+/** @brief 各階層のページの大きさ（バイト） */
+const uint64_t kPageSize4K = 4096;
+const uint64_t kPageSize2M = 512 * kPageSize4K;
+const uint64_t kPageSize1G = 512 * kPageSize2M;
+
+/** @brief 全アドレス空間で共有するカーネル用 PML4 エントリの数．
+ *
+ * アイデンティティマッピングは PML4 の先頭エントリ（先頭 512GiB）に収まる．
+ * NewPageMap で作ったページマップはこの範囲を元のページマップと共有する．
+ */
+const int kKernelPML4Entries = 1;
+
+/** @brief PCID（プロセスコンテキスト識別子）の個数．PCID 0 はカーネルのページマップが使う． */
+const int kNumPCIDs = 4096;
+
+/** @brief 4 階層ページング構造（PML4，PDP，PD，PT）の 1 エントリ */
+union PageMapEntry {
+  uint64_t data;
+
+  struct {
+    uint64_t present : 1;
+    uint64_t writable : 1;
+    uint64_t user : 1;
+    uint64_t write_through : 1;
+    uint64_t cache_disable : 1;
+    uint64_t accessed : 1;
+    uint64_t dirty : 1;
+    uint64_t huge_page : 1;
+    uint64_t global : 1;
+    uint64_t cow : 1; // OS が自由に使えるビット．コピーオンライト待ちの印
+    uint64_t : 2;
+
+    uint64_t addr : 40;
+    uint64_t : 12;
+  } __attribute__((packed)) bits;
+
+  PageMapEntry* Pointer() const {
+    return reinterpret_cast<PageMapEntry*>(bits.addr << 12);
+  }
+
+  void SetPointer(PageMapEntry* p) {
+    bits.addr = reinterpret_cast<uint64_t>(p) >> 12;
+  }
+};
+
+/** @brief MapRange や ChangeProtection に渡すページ属性のビット．
+ *
+ * 値は PageMapEntry の該当ビットと同じ位置にしてある．
+ */
+namespace page_attr {
+  const uint64_t kWritable     = 1u << 1;
+  const uint64_t kUser         = 1u << 2;
+  const uint64_t kWriteThrough = 1u << 3;
+  const uint64_t kCacheDisable = 1u << 4;
+  const uint64_t kGlobal       = 1u << 8;
+
+  /** @brief 属性として指定できるビットの全体 */
+  const uint64_t kMask = kWritable | kUser | kWriteThrough | kCacheDisable | kGlobal;
+}
+
 /** @brief 仮想アドレス=物理アドレスとなるようにページテーブルを設定する．
  * 最終的に CR3 レジスタが正しく設定されたページテーブルを指すようになる．
  */
 void SetupIdentityPageTable();
 
 void InitializePaging();
+
+/** @brief CPU が 1GiB ページに対応していれば true を返す． */
+bool Supports1GiBPages();
+
+/** @brief PCID が有効になっていれば true を返す． */
+bool PCIDEnabled();
+
+/** @brief pml4 に PCID を割り当てる．
+ *
+ * PCID が無効な場合や空きがない場合は 0 を返す．
+ * PCID 0 を共用するページマップは，切り替えのたびに TLB が破棄される．
+ */
+uint16_t AllocatePCID(PageMapEntry* pml4);
+
+/** @brief AllocatePCID で割り当てた PCID を解放する． */
+void FreePCID(uint16_t pcid);
+
+/** @brief pml4 と pcid に切り替えるときに CR3 に設定する値を返す．
+ *
+ * PCID が有効で，その PCID の TLB エントリがまだ使えるなら no-flush ビット（63）を立てる．
+ * 割り当て後最初の切り替えや，他の CPU から無効化された後は立てないので，
+ * CR3 の設定によってその PCID のエントリが破棄される．
+ */
+uint64_t MakeCR3(PageMapEntry* pml4, uint16_t pcid);
+
+/** @brief カーネルが起動時に構築したページマップ（PML4）を返す． */
+PageMapEntry* KernelPageMap();
+
+/** @brief 新しいアドレス空間用の PML4 を確保する．
+ *
+ * カーネル領域（先頭 kKernelPML4Entries 個の PML4 エントリ）は KernelPageMap と共有する．
+ * ページテーブル用のフレームは memory_manager から確保する．
+ */
+WithError<PageMapEntry*> NewPageMap();
+
+/** @brief NewPageMap で確保したページマップを破棄する．
+ *
+ * カーネル領域以外のページテーブルを解放する．
+ * マッピング先の物理フレームは呼び出し側が管理するので解放しない．
+ */
+Error FreePageMap(PageMapEntry* pml4);
+
+/** @brief 仮想アドレス範囲を物理アドレス範囲にマップする．
+ *
+ * アドレスと大きさが揃っている部分は 1GiB（CPU が対応していれば）または
+ * 2MiB のページでマップし，残りを 4KiB ページでマップする．
+ * 既存のマッピングは上書きする．
+ *
+ * @param attr  page_attr のビットの組み合わせ
+ */
+Error MapRange(PageMapEntry* pml4, uint64_t virt_addr, uint64_t phys_addr,
+               uint64_t bytes, uint64_t attr);
+
+/** @brief 仮想アドレス範囲のマッピングを解除する．
+ *
+ * 範囲が大きなページの一部だけを覆う場合は，そのページを分割してから解除する．
+ * 空になったページテーブルは解放する．
+ */
+Error UnmapRange(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes);
+
+/** @brief 仮想アドレス範囲のページ属性を attr に置き換える．
+ *
+ * マップされていない部分は無視する．
+ */
+Error ChangeProtection(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes,
+                       uint64_t attr);
+
+/** @brief 仮想アドレスに対応する末端のエントリを探す．
+ *
+ * @param page_size  見つかったエントリが表すページの大きさを書き込む先（nullptr 可）
+ * @return 末端のエントリ．マップされていなければ nullptr．
+ */
+PageMapEntry* FindPageEntry(PageMapEntry* pml4, uint64_t virt_addr,
+                            uint64_t* page_size = nullptr);
+
+/** @brief ページマップを変更した後に TLB から古いエントリを取り除く．
+ *
+ * pml4 が現在のアドレス空間なら自 CPU の TLB を invlpg（範囲が大きい場合は
+ * CR3 の再設定）で無効化する．他のアドレス空間なら，その PCID に次の切り替えで
+ * TLB を破棄させる．カーネル領域は共有されているので，PCID が有効なら全エントリを破棄する．
+ * 他の CPU が動いていれば TLB シュートダウンの IPI を送り，完了を待つ．
+ */
+void FlushTLB(PageMapEntry* pml4, uint64_t virt_addr, uint64_t bytes);
+
+/** @brief TLB シュートダウンの対象となる CPU の数を設定する．
+ *
+ * AP を起動したら起動済み CPU の総数（BSP を含む）を設定する．初期値は 1．
+ */
+void SetOnlineCPUCount(unsigned int num_cpus);
+
+/** @brief TLB シュートダウン IPI を受けた CPU で呼び出す． */
+void OnTLBShootdownInterrupt();
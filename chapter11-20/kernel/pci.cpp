@@ -6,6 +6,9 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+#include <map>
+#include "acpi.hpp"
 #include "asmfunc.h"
 #include "logger.hpp"
 
@@ -26,74 +29,220 @@ namespace {
         | (reg_addr & 0xfcu);
   }
 
-  /** @brief devices[num_device] に情報を書き込み num_device をインクリメントする． */
-  Error AddDevice(const Device& device) {
-    if (num_device == devices.size()) {
-      return MAKE_ERROR(Error::kFull);
+  /** @brief ECAM 領域．base_address は start_bus の領域の先頭 */
+  struct ECAMRegion {
+    uint64_t base_address;
+    uint8_t start_bus, end_bus;
+  };
+
+  std::array<ECAMRegion, kMaxECAMRegions> ecam_regions;
+  int num_ecam_regions = 0;
+
+  /** @brief ECAM で指定のレジスタにアクセスするためのアドレス．ECAM が使えなければ nullptr． */
+  volatile uint32_t* ECAMAddress(uint8_t bus, uint8_t device,
+                                 uint8_t function, uint16_t reg_addr) {
+    for (int i = 0; i < num_ecam_regions; ++i) {
+      const auto& region = ecam_regions[i];
+      if (bus < region.start_bus || region.end_bus < bus) {
+        continue;
+      }
+      const uint64_t offset =
+        (static_cast<uint64_t>(bus - region.start_bus) << 20)
+        | (static_cast<uint64_t>(device) << 15)
+        | (static_cast<uint64_t>(function) << 12)
+        | (reg_addr & 0xffcu);
+      return reinterpret_cast<volatile uint32_t*>(region.base_address + offset);
+    }
+    return nullptr;
+  }
+
+  /** @brief コンフィグレーション空間の 32 ビットレジスタを読む．
+   *
+   * ECAM が使えればメモリアクセスで，使えなければ I/O ポート経由で読む．
+   */
+  uint32_t ReadConfig32(uint8_t bus, uint8_t device,
+                        uint8_t function, uint16_t reg_addr) {
+    if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+      return *p;
+    }
+    if (reg_addr >= 0x100) { // I/O ポートからは拡張コンフィグレーション空間に届かない
+      return 0xffffffffu;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    return ReadData();
+  }
+
+  /** @brief コンフィグレーション空間の 32 ビットレジスタに書き込む */
+  void WriteConfig32(uint8_t bus, uint8_t device,
+                     uint8_t function, uint16_t reg_addr, uint32_t value) {
+    if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+      *p = value;
+      return;
+    }
+    if (reg_addr >= 0x100) {
+      return;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    WriteData(value);
+  }
+
+  /** @brief クラスコード（24 ビット）から devices の添字への索引 */
+  std::map<uint32_t, std::vector<size_t>> class_index;
+  /** @brief ベンダ ID:デバイス ID から devices の添字への索引 */
+  std::map<uint32_t, std::vector<size_t>> id_index;
+
+  uint32_t ClassKey(const ClassCode& cc) {
+    return (cc.base << 16) | (cc.sub << 8) | cc.interface;
+  }
+
+  uint32_t IDKey(uint16_t vendor_id, uint16_t device_id) {
+    return (static_cast<uint32_t>(vendor_id) << 16) | device_id;
+  }
+
+  /** @brief ヘッダタイプに応じた数の BAR を読み，dev.bars に書き込む */
+  void ReadBars(Device& dev) {
+    const int num_bars = (dev.header_type & 0x7fu) == 0 ? 6
+                       : (dev.header_type & 0x7fu) == 1 ? 2 : 0;
+    for (int i = 0; i < num_bars; ++i) {
+      const auto bar = ReadBar(dev, i);
+      dev.bars[i] = bar.error ? 0 : bar.value;
+      // 64 ビット BAR は 2 つ分のレジスタを使う（I/O 空間の BAR は対象外）
+      if ((bar.value & 0x1u) == 0 && (bar.value & 0x4u) != 0) {
+        ++i;
+      }
     }
+  }
 
-    devices[num_device] = device;
-    ++num_device;
+  /** @brief devices に情報を追加し，索引に登録する． */
+  Error AddDevice(Device&& device) {
+    const size_t index = devices.size();
+    class_index[ClassKey(device.class_code)].push_back(index);
+    id_index[IDKey(device.vendor_id, device.device_id)].push_back(index);
+    devices.push_back(std::move(device));
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ScanBus(uint8_t bus);
+  std::vector<Device*> LookUp(const std::map<uint32_t, std::vector<size_t>>& index,
+                              uint32_t key) {
+    std::vector<Device*> result;
+    if (auto it = index.find(key); it != index.end()) {
+      for (auto i : it->second) {
+        result.push_back(&devices[i]);
+      }
+    }
+    return result;
+  }
+
+  bool Matches(const DriverMatch& match, const Device& dev) {
+    return (match.vendor_id == kAnyID || match.vendor_id == dev.vendor_id) &&
+      (match.device_id == kAnyID || match.device_id == dev.device_id) &&
+      (ClassKey(dev.class_code) & match.class_mask) == (match.class_code & match.class_mask);
+  }
 
-  /** @brief 指定のファンクションを devices に追加する．
-   * もし PCI-PCI ブリッジなら，セカンダリバスに対し ScanBus を実行する
+  /** @brief 1 つのバスを探索した結果．
+   *
+   * 探索は結果をこの構造体にだけ書き込み，共有の状態を変更しない．
+   * ECAM を使う場合はコンフィグレーション空間へのアクセスも排他が要らないので，
+   * 複数の CPU が別々のバスを同時に探索し，結果を後でまとめられる．
+   */
+  struct BusScanResult {
+    uint8_t bus;
+    std::vector<Device> devices;
+    /** @brief 見つけた PCI-PCI ブリッジのセカンダリバス */
+    std::vector<uint8_t> child_buses;
+  };
+
+  /** @brief 指定のファンクションを result に追加する．
+   * もし PCI-PCI ブリッジなら，セカンダリバスを result.child_buses に追加する．
    */
-  Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function) {
+  void ScanFunction(uint8_t bus, uint8_t device, uint8_t function,
+                    BusScanResult& result) {
     auto class_code = ReadClassCode(bus, device, function);
     auto header_type = ReadHeaderType(bus, device, function);
+    const auto id = ReadConfig32(bus, device, function, 0x00);
     Device dev{bus, device, function, header_type, class_code};
-    if (auto err = AddDevice(dev)) {
-      return err;
-    }
+    dev.vendor_id = id & 0xffffu;
+    dev.device_id = id >> 16;
+    ReadBars(dev);
+    result.devices.push_back(dev);
 
     if (class_code.Match(0x06u, 0x04u)) {
       // standard PCI-PCI bridge
       auto bus_numbers = ReadBusNumbers(bus, device, function);
-      uint8_t secondary_bus = (bus_numbers >> 8) & 0xffu;
-      return ScanBus(secondary_bus);
+      result.child_buses.push_back((bus_numbers >> 8) & 0xffu);
     }
-
-    return MAKE_ERROR(Error::kSuccess);
   }
 
   /** @brief 指定のデバイス番号の各ファンクションをスキャンする．
    * 有効なファンクションを見つけたら ScanFunction を実行する．
    */
-  Error ScanDevice(uint8_t bus, uint8_t device) {
-    if (auto err = ScanFunction(bus, device, 0)) {
-      return err;
-    }
+  void ScanDevice(uint8_t bus, uint8_t device, BusScanResult& result) {
+    ScanFunction(bus, device, 0, result);
     if (IsSingleFunctionDevice(ReadHeaderType(bus, device, 0))) {
-      return MAKE_ERROR(Error::kSuccess);
+      return;
     }
 
     for (uint8_t function = 1; function < 8; ++function) {
       if (ReadVendorId(bus, device, function) == 0xffffu) {
         continue;
       }
-      if (auto err = ScanFunction(bus, device, function)) {
-        return err;
-      }
+      ScanFunction(bus, device, function, result);
     }
-    return MAKE_ERROR(Error::kSuccess);
   }
 
   /** @brief 指定のバス番号の各デバイスをスキャンする．
    * 有効なデバイスを見つけたら ScanDevice を実行する．
+   * ブリッジの先のバスは辿らず，result.child_buses に残す．
    */
-  Error ScanBus(uint8_t bus) {
+  BusScanResult ScanBus(uint8_t bus) {
+    BusScanResult result{bus, {}, {}};
     for (uint8_t device = 0; device < 32; ++device) {
       if (ReadVendorId(bus, device, 0) == 0xffffu) {
         continue;
       }
-      if (auto err = ScanDevice(bus, device)) {
-        return err;
+      ScanDevice(bus, device, result);
+    }
+    return result;
+  }
+
+  /** @brief 探索済みのバス．ブリッジの設定が壊れていても同じバスを 2 度探索しない */
+  std::array<bool, 256> bus_scanned;
+
+  /** @brief ルートバス root_bus から辿れるバスをすべて探索し，結果を devices にまとめる．
+   *
+   * 各バスの探索は互いに独立な仕事として待ち行列に積み，
+   * 終わった仕事の結果を順に devices と索引へ登録する．
+   */
+  Error ScanHierarchy(uint8_t root_bus) {
+    const uint32_t start = acpi::ReadPMTimer();
+    ScanStats stats{root_bus, 0, 0, 0};
+
+    std::vector<uint8_t> pending{root_bus};
+    bus_scanned[root_bus] = true;
+    while (!pending.empty()) {
+      const uint8_t bus = pending.back();
+      pending.pop_back();
+
+      auto result = ScanBus(bus);
+      ++stats.num_buses;
+      stats.num_functions += result.devices.size();
+      for (auto& dev : result.devices) {
+        if (auto err = AddDevice(std::move(dev))) {
+          return err;
+        }
+      }
+      for (auto child : result.child_buses) {
+        if (bus_scanned[child]) {
+          Log(kWarn, "PCI: bus %02x is reachable twice (from %02x)\n", child, bus);
+          continue;
+        }
+        bus_scanned[child] = true;
+        pending.push_back(child);
       }
     }
+
+    stats.elapsed_us = acpi::PMTimerElapsedMicroseconds(start, acpi::ReadPMTimer());
+    scan_stats.push_back(stats);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -170,11 +319,93 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  /** @brief 指定された MSI レジスタを設定する */
+  /** @brief 指定された MSI-X ケーパビリティ構造を読み取る */
+  MSIXCapability ReadMSIXCapability(const Device& dev, uint8_t cap_addr) {
+    MSIXCapability msix_cap{};
+    msix_cap.header.data = ReadConfReg(dev, cap_addr);
+    msix_cap.table = ReadConfReg(dev, cap_addr + 4);
+    msix_cap.pba = ReadConfReg(dev, cap_addr + 8);
+    return msix_cap;
+  }
+
+  /** @brief 指定された ID を持つケーパビリティのアドレスを返す．無ければ 0． */
+  uint8_t FindCapability(const Device& dev, uint8_t cap_id) {
+    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+    while (cap_addr != 0) {
+      auto header = ReadCapabilityHeader(dev, cap_addr);
+      if (header.bits.cap_id == cap_id) {
+        return cap_addr;
+      }
+      cap_addr = header.bits.next_ptr;
+    }
+    return 0;
+  }
+
+  /** @brief MSI-X テーブルの先頭 num_entries 個を設定し，MSI-X を有効にする
+   *
+   * エントリ i には msg_addr と msg_data(i) を書き込む．
+   *
+   * @return 設定したエントリの数
+   */
+  template <class MsgDataFunc>
+  WithError<int> ConfigureMSIXEntries(const Device& dev, uint8_t cap_addr,
+                                      uint32_t msg_addr, int num_entries,
+                                      MsgDataFunc msg_data) {
+    auto msix_cap = ReadMSIXCapability(dev, cap_addr);
+    const int table_size = msix_cap.header.bits.table_size + 1;
+    num_entries = std::min(num_entries, table_size);
+
+    const auto bar = ReadBar(dev, msix_cap.table & 0x7u);
+    if (bar.error) {
+      return {0, bar.error};
+    }
+    const uint64_t table_addr =
+      (bar.value & ~static_cast<uint64_t>(0xf)) + (msix_cap.table & ~0x7u);
+    auto table = reinterpret_cast<volatile MSIXTableEntry*>(table_addr);
+
+    // テーブルを書き換えている間に割り込みが飛ばないよう，全体をマスクしておく
+    msix_cap.header.bits.msix_enable = 1;
+    msix_cap.header.bits.function_mask = 1;
+    WriteConfReg(dev, cap_addr, msix_cap.header.data);
+
+    for (int i = 0; i < table_size; ++i) {
+      if (i < num_entries) {
+        table[i].msg_addr = msg_addr;
+        table[i].msg_upper_addr = 0;
+        table[i].msg_data = msg_data(i);
+        table[i].vector_control = table[i].vector_control & ~1u;
+      } else {
+        table[i].vector_control = table[i].vector_control | 1u;
+      }
+    }
+
+    msix_cap.header.bits.function_mask = 0;
+    WriteConfReg(dev, cap_addr, msix_cap.header.data);
+    return {num_entries, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  /** @brief 指定された MSI-X レジスタを設定する
+   *
+   * MSI と同様に，2^num_vector_exponent 個のエントリへ連続したベクタを割り当てる．
+   */
   Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
                              uint32_t msg_addr, uint32_t msg_data,
                              unsigned int num_vector_exponent) {
-    return MAKE_ERROR(Error::kNotImplemented);
+    return ConfigureMSIXEntries(dev, cap_addr, msg_addr, 1 << num_vector_exponent,
+                                [msg_data](int i) { return msg_data + i; }).error;
+  }
+
+  uint32_t MakeMSIMessageAddress(uint8_t apic_id) {
+    return 0xfee00000u | (apic_id << 12);
+  }
+
+  uint32_t MakeMSIMessageData(MSITriggerMode trigger_mode,
+                              MSIDeliveryMode delivery_mode, uint8_t vector) {
+    uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+    if (trigger_mode == MSITriggerMode::kLevel) {
+      msg_data |= 0xc000;
+    }
+    return msg_data;
   }
 }
 
@@ -192,23 +423,19 @@ namespace pci {
   }
 
   uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() & 0xffffu;
+    return ReadConfig32(bus, device, function, 0x00) & 0xffffu;
   }
 
   uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() >> 16;
+    return ReadConfig32(bus, device, function, 0x00) >> 16;
   }
 
   uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x0c));
-    return (ReadData() >> 16) & 0xffu;
+    return (ReadConfig32(bus, device, function, 0x0c) >> 16) & 0xffu;
   }
 
   ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x08));
-    auto reg = ReadData();
+    auto reg = ReadConfig32(bus, device, function, 0x08);
     ClassCode cc;
     cc.base       = (reg >> 24) & 0xffu;
     cc.sub        = (reg >> 16) & 0xffu;
@@ -217,8 +444,7 @@ namespace pci {
   }
 
   uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x18));
-    return ReadData();
+    return ReadConfig32(bus, device, function, 0x18);
   }
 
   bool IsSingleFunctionDevice(uint8_t header_type) {
@@ -226,35 +452,87 @@ namespace pci {
   }
 
   Error ScanAllBus() {
-    num_device = 0;
+    devices.clear();
+    class_index.clear();
+    id_index.clear();
+    scan_stats.clear();
+    bus_scanned.fill(false);
 
+    // ホストブリッジ 0:0.n はルートバス n を表す
     auto header_type = ReadHeaderType(0, 0, 0);
-    if (IsSingleFunctionDevice(header_type)) {
-      return ScanBus(0);
-    }
-
-    for (uint8_t function = 0; function < 8; ++function) {
-      if (ReadVendorId(0, 0, function) == 0xffffu) {
+    const int num_host_bridges = IsSingleFunctionDevice(header_type) ? 1 : 8;
+    for (uint8_t function = 0; function < num_host_bridges; ++function) {
+      if (ReadVendorId(0, 0, function) == 0xffffu || bus_scanned[function]) {
         continue;
       }
-      if (auto err = ScanBus(function)) {
+      if (auto err = ScanHierarchy(function)) {
         return err;
       }
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    return ReadData();
+  std::vector<Device*> FindDevicesByClass(uint8_t base, uint8_t sub, uint8_t interface) {
+    return LookUp(class_index, ClassKey(ClassCode{base, sub, interface}));
   }
 
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    WriteData(value);
+  std::vector<Device*> FindDevicesByID(uint16_t vendor_id, uint16_t device_id) {
+    return LookUp(id_index, IDKey(vendor_id, device_id));
+  }
+
+  void BindDrivers(const DriverMatch* table, size_t num_entries) {
+    for (size_t i = 0; i < num_entries; ++i) {
+      const auto& match = table[i];
+
+      // 索引で引ける条件なら候補を絞り込み，そうでなければ全デバイスを調べる
+      std::vector<Device*> candidates;
+      if (match.vendor_id != kAnyID && match.device_id != kAnyID) {
+        candidates = FindDevicesByID(match.vendor_id, match.device_id);
+      } else if (match.class_mask == 0xffffffu) {
+        candidates = LookUp(class_index, match.class_code);
+      } else {
+        for (auto& dev : devices) {
+          candidates.push_back(&dev);
+        }
+      }
+
+      for (auto dev : candidates) {
+        if (dev->driver != nullptr || !Matches(match, *dev)) {
+          continue;
+        }
+        if (auto err = match.probe(*dev)) {
+          Log(kDebug, "%s: probe %d.%d.%d failed: %s\n", match.name,
+              dev->bus, dev->device, dev->function, err.Name());
+          continue;
+        }
+        dev->driver = match.name;
+        Log(kInfo, "%s: bound to %d.%d.%d\n", match.name,
+            dev->bus, dev->device, dev->function);
+      }
+    }
+  }
+
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr) {
+    return ReadConfig32(dev.bus, dev.device, dev.function, reg_addr);
+  }
+
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value) {
+    WriteConfig32(dev.bus, dev.device, dev.function, reg_addr, value);
+  }
+
+  Error AddECAMRegion(uint64_t base_address, uint8_t start_bus, uint8_t end_bus) {
+    if (num_ecam_regions == kMaxECAMRegions) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (end_bus < start_bus) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    ecam_regions[num_ecam_regions] = {base_address, start_bus, end_bus};
+    ++num_ecam_regions;
+    return MAKE_ERROR(Error::kSuccess);
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index) {
     if (bar_index >= 6) {
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
@@ -285,23 +563,28 @@ namespace pci {
     return header;
   }
 
-  Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
-                     unsigned int num_vector_exponent) {
-    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
-    uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
-    while (cap_addr != 0) {
-      auto header = ReadCapabilityHeader(dev, cap_addr);
-      if (header.bits.cap_id == kCapabilityMSI) {
-        msi_cap_addr = cap_addr;
-      } else if (header.bits.cap_id == kCapabilityMSIX) {
-        msix_cap_addr = cap_addr;
+  uint16_t FindExtendedCapability(const Device& dev, uint16_t cap_id) {
+    uint16_t cap_addr = 0x100;
+    // 壊れたリストで無限ループしないよう，辿る数を空間の大きさで制限する
+    for (int i = 0; i < (0x1000 - 0x100) / 4 && cap_addr >= 0x100; ++i) {
+      ExtendedCapabilityHeader header;
+      header.data = ReadConfReg(dev, cap_addr);
+      if (header.data == 0 || header.data == 0xffffffffu) {
+        return 0;
       }
-      cap_addr = header.bits.next_ptr;
+      if (header.bits.cap_id == cap_id) {
+        return cap_addr;
+      }
+      cap_addr = header.bits.next_ptr & 0xffcu;
     }
+    return 0;
+  }
 
-    if (msi_cap_addr) {
+  Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
+                     unsigned int num_vector_exponent) {
+    if (auto msi_cap_addr = FindCapability(dev, kCapabilityMSI)) {
       return ConfigureMSIRegister(dev, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
-    } else if (msix_cap_addr) {
+    } else if (auto msix_cap_addr = FindCapability(dev, kCapabilityMSIX)) {
       return ConfigureMSIXRegister(dev, msix_cap_addr, msg_addr, msg_data, num_vector_exponent);
     }
     return MAKE_ERROR(Error::kNoPCIMSI);
@@ -311,27 +594,69 @@ namespace pci {
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent) {
-    uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-    uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-    if (trigger_mode == MSITriggerMode::kLevel) {
-      msg_data |= 0xc000;
-    }
+    uint32_t msg_addr = MakeMSIMessageAddress(apic_id);
+    uint32_t msg_data = MakeMSIMessageData(trigger_mode, delivery_mode, vector);
     return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
   }
+
+  WithError<int> ConfigureMSIXFixedDestination(
+      const Device& dev, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      const uint8_t* vectors, int num_vectors) {
+    const auto msix_cap_addr = FindCapability(dev, kCapabilityMSIX);
+    if (msix_cap_addr == 0) {
+      return {0, MAKE_ERROR(Error::kNoPCIMSI)};
+    }
+
+    // MSI と MSI-X を同時に有効にしてはならない
+    if (auto msi_cap_addr = FindCapability(dev, kCapabilityMSI)) {
+      auto msi_cap = ReadMSICapability(dev, msi_cap_addr);
+      msi_cap.header.bits.msi_enable = 0;
+      WriteConfReg(dev, msi_cap_addr, msi_cap.header.data);
+    }
+
+    return ConfigureMSIXEntries(
+        dev, msix_cap_addr, MakeMSIMessageAddress(apic_id), num_vectors,
+        [&](int i) {
+          return MakeMSIMessageData(trigger_mode, delivery_mode, vectors[i]);
+        });
+  }
 }
 
 void InitializePCI() {
+  // ECAM はセグメント 0 のみ使う．MCFG が無ければ I/O ポートでアクセスする．
+  if (acpi::mcfg) {
+    for (size_t i = 0; i < acpi::mcfg->Count(); ++i) {
+      const auto& entry = (*acpi::mcfg)[i];
+      if (entry.segment != 0) {
+        continue;
+      }
+      if (auto err = pci::AddECAMRegion(entry.base_address, entry.start_bus, entry.end_bus)) {
+        Log(kWarn, "AddECAMRegion: %s\n", err.Name());
+        break;
+      }
+      Log(kInfo, "ECAM: buses %d-%d at %lx\n",
+          entry.start_bus, entry.end_bus, entry.base_address);
+    }
+  }
+
   if (auto err = pci::ScanAllBus()) {
     Log(kError, "ScanAllBus: %s\n", err.Name());
     exit(1);
   }
 
-  for (int i = 0; i < pci::num_device; ++i) {
-    const auto& dev = pci::devices[i];
-    auto vendor_id = pci::ReadVendorId(dev);
-    auto class_code = pci::ReadClassCode(dev.bus, dev.device, dev.function);
-    Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
-        dev.bus, dev.device, dev.function,
-        vendor_id, class_code, dev.header_type);
+  for (const auto& dev : pci::devices) {
+    Log(kDebug, "%d.%d.%d: vend %04x, dev %04x, class %02x%02x%02x, head %02x\n",
+        dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id,
+        dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+        dev.header_type);
+  }
+  unsigned long total_us = 0;
+  for (const auto& stats : pci::scan_stats) {
+    Log(kInfo, "PCI: root bus %02x: %d buses, %d functions, %lu us\n",
+        stats.root_bus, stats.num_buses, stats.num_functions, stats.elapsed_us);
+    total_us += stats.elapsed_us;
   }
+  Log(kInfo, "PCI: %lu functions found in %lu us (%s)\n",
+      pci::devices.size(), total_us, acpi::mcfg ? "ECAM" : "I/O port");
 }
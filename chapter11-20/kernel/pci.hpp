@@ -8,6 +8,7 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
 
 #include "error.hpp"
 
@@ -39,6 +40,11 @@ namespace pci {
   struct Device {
     uint8_t bus, device, function, header_type;
     ClassCode class_code;
+    uint16_t vendor_id, device_id;
+    /** @brief 探索時に読んだ BAR の値．64 ビット BAR は下位側の要素にまとめ，上位側は 0． */
+    std::array<uint64_t, 6> bars;
+    /** @brief BindDrivers で結び付けたドライバの名前．結び付いていなければ nullptr． */
+    const char* driver;
   };
 
   /** @brief CONFIG_ADDRESS に指定された整数を書き込む */
@@ -61,10 +67,24 @@ namespace pci {
     return ReadVendorId(dev.bus, dev.device, dev.function);
   }
 
-  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る */
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr);
+  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る
+   *
+   * reg_addr が 0x100 以上の拡張コンフィグレーション空間は ECAM 経由でのみ読める．
+   * 読めない場合は 0xffffffff を返す．
+   */
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr);
   /** @brief 指定された PCI デバイスの 32 ビットレジスタに書き込む */
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value);
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value);
+
+  /** @brief ECAM 領域の最大数 */
+  const int kMaxECAMRegions = 8;
+
+  /** @brief PCI セグメント 0 の ECAM 領域を登録する．
+   *
+   * 登録したバスのコンフィグレーション空間には，以降 I/O ポートではなく
+   * メモリアクセスで読み書きする．base_address は start_bus の領域の先頭．
+   */
+  Error AddECAMRegion(uint64_t base_address, uint8_t start_bus, uint8_t end_bus);
 
   /** @brief バス番号レジスタを読み取る（ヘッダタイプ 1 用）
    *
@@ -78,22 +98,59 @@ namespace pci {
   /** @brief 単一ファンクションの場合に真を返す． */
   bool IsSingleFunctionDevice(uint8_t header_type);
 
-  /** @brief ScanAllBus() により発見された PCI デバイスの一覧 */
-  inline std::array<Device, 32> devices;
-  /** @brief devices の有効な要素の数 */
-  inline int num_device;
+  /** @brief ScanAllBus() により発見された PCI デバイスの一覧．
+   *
+   * 探索が終わった後は要素を追加しないので，要素へのポインタは保持してよい．
+   */
+  inline std::vector<Device> devices;
+  /** @brief ルートバスごとの探索にかかった時間などの記録 */
+  struct ScanStats {
+    uint8_t root_bus;
+    int num_buses, num_functions;
+    unsigned long elapsed_us;
+  };
+  /** @brief 直前の ScanAllBus() の記録．ルートバスを探索した順に並ぶ */
+  inline std::vector<ScanStats> scan_stats;
+
   /** @brief PCI デバイスをすべて探索し devices に格納する
    *
-   * バス 0 から再帰的に PCI デバイスを探索し，devices の先頭から詰めて書き込む．
-   * 発見したデバイスの数を num_devices に設定する．
+   * ルートバスごとに，ブリッジの先のバスも含めて PCI デバイスを探索し，devices に追加する．
+   * ベンダ ID などの識別情報と BAR はこのときに読んでおき，
+   * クラスコードとベンダ ID:デバイス ID の索引を作る．
    */
   Error ScanAllBus();
 
+  /** @brief クラスコードが一致するデバイスを発見順に返す */
+  std::vector<Device*> FindDevicesByClass(uint8_t base, uint8_t sub, uint8_t interface);
+  /** @brief ベンダ ID とデバイス ID が一致するデバイスを発見順に返す */
+  std::vector<Device*> FindDevicesByID(uint16_t vendor_id, uint16_t device_id);
+
+  /** @brief DriverMatch でベンダ ID やデバイス ID を問わないことを表す */
+  const uint16_t kAnyID = 0xffffu;
+
+  /** @brief PCI デバイスとドライバの対応表の 1 行 */
+  struct DriverMatch {
+    uint16_t vendor_id; // kAnyID なら問わない
+    uint16_t device_id; // kAnyID なら問わない
+    uint32_t class_code; // 23:16 = ベース，15:8 = サブ，7:0 = インターフェース
+    uint32_t class_mask; // class_code のうち比較するビット．0 ならクラスコードを問わない
+    const char* name;
+    /** @brief デバイスを初期化する．失敗したら後続の行が試される． */
+    Error (*probe)(Device& dev);
+  };
+
+  /** @brief 対応表に従ってデバイスにドライバを結び付ける．
+   *
+   * 表の行を先頭から 1 度ずつ見て，一致するデバイスを索引から引いて probe を呼ぶ．
+   * 前の行ほど優先され，ドライバが結び付いたデバイスは以降の行では扱わない．
+   */
+  void BindDrivers(const DriverMatch* table, size_t num_entries);
+
   constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
     return 0x10 + 4 * bar_index;
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index);
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index);
 
   /** @brief PCI ケーパビリティレジスタの共通ヘッダ */
   union CapabilityHeader {
@@ -108,6 +165,22 @@ namespace pci {
   const uint8_t kCapabilityMSI = 0x05;
   const uint8_t kCapabilityMSIX = 0x11;
 
+  /** @brief PCI Express 拡張ケーパビリティの共通ヘッダ（コンフィグレーション空間 0x100 以降） */
+  union ExtendedCapabilityHeader {
+    uint32_t data;
+    struct {
+      uint32_t cap_id : 16;
+      uint32_t version : 4;
+      uint32_t next_ptr : 12;
+    } __attribute__((packed)) bits;
+  } __attribute__((packed));
+
+  /** @brief 指定された ID を持つ拡張ケーパビリティのアドレスを返す．
+   *
+   * 見つからないか，拡張コンフィグレーション空間に届かなければ 0．
+   */
+  uint16_t FindExtendedCapability(const Device& dev, uint16_t cap_id);
+
   /** @brief 指定された PCI デバイスの指定されたケーパビリティレジスタを読み込む
    *
    * @param dev  ケーパビリティを読み込む PCI デバイス
@@ -142,6 +215,36 @@ namespace pci {
     uint32_t pending_bits;
   } __attribute__((packed));
 
+  /** @brief MSI-X ケーパビリティ構造
+   *
+   * MSI-X ではメッセージのアドレスと値をコンフィグレーション空間ではなく，
+   * BAR が指すメモリ上の MSI-X テーブルに置く．
+   */
+  struct MSIXCapability {
+    union {
+      uint32_t data;
+      struct {
+        uint32_t cap_id : 8;
+        uint32_t next_ptr : 8;
+        uint32_t table_size : 11; // エントリ数 - 1
+        uint32_t : 3;
+        uint32_t function_mask : 1;
+        uint32_t msix_enable : 1;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) header;
+
+    uint32_t table; // 2:0 = BIR, 31:3 = BAR 先頭からのオフセット
+    uint32_t pba;   // 2:0 = BIR, 31:3 = BAR 先頭からのオフセット
+  } __attribute__((packed));
+
+  /** @brief MSI-X テーブルの 1 エントリ */
+  struct MSIXTableEntry {
+    uint32_t msg_addr;
+    uint32_t msg_upper_addr;
+    uint32_t msg_data;
+    uint32_t vector_control; // bit 0 = マスク
+  } __attribute__((packed));
+
   /** @brief MSI または MSI-X 割り込みを設定する
    *
    * @param dev  設定対象の PCI デバイス
@@ -170,6 +273,21 @@ namespace pci {
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent);
+
+  /** @brief MSI-X 割り込みをエントリごとに異なるベクタで設定する
+   *
+   * MSI-X テーブルのエントリ i にベクタ vectors[i] を割り当ててマスクを解除し，
+   * MSI-X を有効にする．MSI が有効になっていれば無効にする．
+   * テーブルのエントリ数が num_vectors より少なければ，入る分だけ設定する．
+   *
+   * @param vectors  エントリ 0 から順に割り当てるベクタ
+   * @param num_vectors  vectors の要素数
+   * @return 設定したエントリの数．MSI-X に対応していなければ Error::kNoPCIMSI
+   */
+  WithError<int> ConfigureMSIXFixedDestination(
+      const Device& dev, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      const uint8_t* vectors, int num_vectors);
 }
 
 void InitializePCI();
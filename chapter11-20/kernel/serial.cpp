@@ -0,0 +1,68 @@
+#include "serial.hpp"
+
+#include <atomic>
+#include <cstring>
+#include "task.hpp"
+#include "usb/classdriver/cdc.hpp"
+
+namespace {
+  /** @brief kSerialFlush を送り，まだメインタスクが処理していなければ true */
+  std::atomic<bool> flush_requested{false};
+}
+
+void InitializeSerialConsole() {
+  usb::cdc::CDCDriver::default_observer = [](usb::cdc::CDCDriver& driver) {
+    char buf[64];
+    int len;
+    while ((len = driver.ReceiveSerial(buf, sizeof(buf))) > 0) {
+      for (int i = 0; i < len; ++i) {
+        char ascii = buf[i];
+        if (ascii == '\r') {
+          ascii = '\n';
+        } else if (ascii == 0x7f) { // DEL
+          ascii = '\b';
+        }
+        Message msg{Message::kKeyPush};
+        msg.arg.keyboard.modifier = 0;
+        msg.arg.keyboard.keycode = 0;
+        msg.arg.keyboard.ascii = ascii;
+        task_manager->SendMessage(1, msg);
+      }
+    }
+  };
+}
+
+void WriteSerialConsole(const char* s) {
+  auto driver = usb::cdc::driver;
+  if (driver == nullptr) {
+    return;
+  }
+
+  // 送信リングへの書き手が 1 つになるよう，割り込みを止めてタスク切り替えを防ぐ．
+  // 割り込みハンドラからも呼ばれるので，最後は元の割り込み許可フラグに戻す．
+  uint64_t rflags;
+  __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+  while (*s) {
+    // 端末側で行頭に戻るよう LF を CRLF にする
+    const size_t len = strcspn(s, "\n");
+    driver->SendSerial(s, len);
+    s += len;
+    if (*s == '\n') {
+      driver->SendSerial("\r\n", 2);
+      ++s;
+    }
+  }
+  const bool send_request = !flush_requested.exchange(true);
+  if (send_request) {
+    task_manager->SendMessage(1, Message{Message::kSerialFlush});
+  }
+  __asm__ volatile("push %0; popfq" : : "r"(rflags) : "memory", "cc");
+}
+
+void FlushSerialConsole() {
+  flush_requested = false;
+  if (auto driver = usb::cdc::driver) {
+    // ここでのエラーを Log に出すと，それがまた送信要求になるので無視する
+    driver->Flush();
+  }
+}
@@ -0,0 +1,21 @@
+/**
+ * @file serial.hpp
+ *
+ * USB シリアルを使ったコンソール．
+ */
+
+#pragma once
+
+/** @brief USB シリアルから受信した文字をキー入力としてメインタスクへ送るよう設定する． */
+void InitializeSerialConsole();
+
+/** @brief 文字列を USB シリアルの送信リングに書き込む．
+ *
+ * 転送はメインタスクが Message::kSerialFlush を受け取ったときに開始する．
+ * それまでに書き込まれた文字列は 1 つの転送にまとめて送られる．
+ * USB シリアルが無ければ何もしない．
+ */
+void WriteSerialConsole(const char* s);
+
+/** @brief 送信リングの内容の転送を開始する．メインタスクから呼ぶ． */
+void FlushSerialConsole();
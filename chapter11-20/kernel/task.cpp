@@ -18,7 +18,7 @@ namespace {
 } // namespace
 
 /** @brief Taskクラスのコンストラクタ。指定されたタスクIDをid_に設定する */
-Task::Task(uint64_t id) : id_{id}, msgs_{} {
+Task::Task(uint64_t id) : id_{id}, page_map_{KernelPageMap()}, msgs_{} {
 }
 
 // day13a
@@ -29,10 +29,11 @@ Task::Task(uint64_t id) : id_{id}, msgs_{} {
  * 
  * @param f    : タスクの開始アドレス（実行する関数ポインタ）
  * @param data : タスクに渡す引数（fの第2引数になる）
+ * @param stack_bytes : スタック領域の大きさ
  * @return     : Task& 自身への参照
  */
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+  const size_t stack_size = stack_bytes / sizeof(stack_[0]);
   stack_.resize(stack_size);
   uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
 
@@ -65,6 +66,20 @@ TaskContext& Task::Context() {
   return context_;
 }
 
+Task& Task::SetPageMap(PageMapEntry* pml4, uint16_t pcid) {
+  page_map_ = pml4;
+  pcid_ = pcid;
+  return *this;
+}
+
+Task& Task::SetAddressSpace(std::unique_ptr<AddressSpace> space) {
+  space_ = std::move(space);
+  if (space_) {
+    return SetPageMap(space_->PageMap(), space_->PCID());
+  }
+  return SetPageMap(KernelPageMap(), 0);
+}
+
 /** @brief タスクのIDを返す */
 uint64_t Task::ID() const {
   return id_;
@@ -171,7 +186,9 @@ void TaskManager::SwitchTask(bool current_sleep) {
   }
 
   Task* next_task = running_[current_level_].front();
-  
+  // SwitchContext は CR3 が変わらなければ書き込まず，変わるときも可能なら PCID の TLB エントリを残す
+  next_task->context_.cr3 = MakeCR3(next_task->page_map_, next_task->pcid_);
+
   /** @brief アセンブラで定義したレジスタを操作してコンテキストを切り替える関数を呼び出す */
   SwitchContext(&next_task->Context(), &current_task->Context());
 }
@@ -13,8 +13,10 @@
 #include <optional>
 #include <vector>
 
+#include "address_space.hpp"
 #include "error.hpp"
 #include "message.hpp"
+#include "paging.hpp"
 
 // day13a
 /**
@@ -47,7 +49,7 @@ class Task {
   static const size_t kDefaultStackBytes = 4096; //タスク用スタックの大きさ
 
   Task(uint64_t id);
-  Task& InitContext(TaskFunc* f, int64_t data);
+  Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
   TaskContext& Context();
   uint64_t ID() const;
   Task& Sleep();
@@ -59,10 +61,22 @@ class Task {
   int Level() const { return level_; }
   bool Running() const { return running_; }
 
+  /** @brief タスクが使うページマップと PCID を設定する */
+  Task& SetPageMap(PageMapEntry* pml4, uint16_t pcid);
+  PageMapEntry* PageMap() const { return page_map_; }
+
+  /** @brief タスク専用のアドレス空間を設定する．以降のタスク切り替えではそのページマップを使う */
+  Task& SetAddressSpace(std::unique_ptr<AddressSpace> space);
+  /** @brief タスク専用のアドレス空間．カーネルのページマップを使うタスクでは nullptr */
+  AddressSpace* Space() const { return space_.get(); }
+
  private:
   uint64_t id_;
   std::vector<uint64_t> stack_;
   alignas(16) TaskContext context_;
+  PageMapEntry* page_map_;
+  uint16_t pcid_{0};
+  std::unique_ptr<AddressSpace> space_{};
   // day14b
   /** @brief 
    * main.cppのmsg_queueに割り込み関連のメッセージが格納されていたのを、メッセージキューmsgs_を付け足したことで、
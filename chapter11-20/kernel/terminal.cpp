@@ -1,10 +1,14 @@
 #include "terminal.hpp"
 
 #include <cstring>
+#include <vector>
 
+#include "block_device.hpp"
 #include "font.hpp"
 #include "layer.hpp"
 #include "pci.hpp"
+#include "boottrace.hpp"
+#include "fat.hpp"
 
 Terminal::Terminal() {
   window_ = std::make_shared<ToplevelWindow>(
@@ -19,6 +23,13 @@ Terminal::Terminal() {
     .SetDraggable(true)
     .ID();
 
+  if (auto space = task_manager->CurrentTask().Space()) {
+    auto [ addr, err ] = space->MapAnonymous(kFileBufBytes, page_attr::kWritable);
+    if (!err) {
+      file_buf_ = reinterpret_cast<char*>(addr);
+    }
+  }
+
   Print(">");
   cmd_history_.resize(8);
 }
@@ -121,15 +132,65 @@ void Terminal::ExecuteLine() {
                   {4, 4}, {8*kColumns, 16*kRows}, {0, 0, 0});
     cursor_.y = 0;
   } else if (strcmp(command, "lspci") == 0) {
-    char s[64];
-    for (int i = 0; i < pci::num_device; ++i) {
-      const auto& dev = pci::devices[i];
-      auto vendor_id = pci::ReadVendorId(dev.bus, dev.device, dev.function);
-      sprintf(s, "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x\n",
-          dev.bus, dev.device, dev.function, vendor_id, dev.header_type,
-          dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
+    char s[128];
+    for (const auto& dev : pci::devices) {
+      sprintf(s, "%02x:%02x.%d %04x:%04x head=%02x class=%02x.%02x.%02x %s\n",
+          dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id,
+          dev.header_type,
+          dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+          dev.driver ? dev.driver : "");
+      Print(s);
+    }
+  } else if (strcmp(command, "lsblk") == 0) {
+    // USB の大容量記憶装置はメインタスクで見つかり次第登録される
+    __asm__("cli");
+    auto devs = block_devices;
+    __asm__("sti");
+
+    char s[128];
+    for (auto dev : devs) {
+      // 先頭ブロックを読んで，ブートセクタの署名があるかを示す
+      std::vector<uint8_t> block(dev->BlockSize());
+      const char* boot = "-";
+      if (auto err = dev->Read(0, 1, block.data())) {
+        boot = err.Name();
+      } else if (block.size() >= 512 && block[510] == 0x55 && block[511] == 0xaa) {
+        boot = "boot sector";
+      }
+      sprintf(s, "%-10s %10lu blocks x %4lu bytes  %s\n",
+              dev->Name(), dev->NumBlocks(), dev->BlockSize(), boot);
       Print(s);
     }
+  } else if (strcmp(command, "boottime") == 0) {
+    PrintBootTimeline([this](const char* line) { Print(line); });
+  } else if (strcmp(command, "ls") == 0) {
+    ListFiles(first_arg ? first_arg : "/");
+  } else if (strcmp(command, "cat") == 0) {
+    if (first_arg) {
+      PrintFile(first_arg);
+    } else {
+      Print("usage: cat <file>\n");
+    }
+  } else if (strcmp(command, "vmtest") == 0) {
+    auto space = task_manager->CurrentTask().Space();
+    if (space == nullptr) {
+      Print("this task has no address space\n");
+      return;
+    }
+    // フレームやページテーブルを確保するので，メインタスクと同時に動かないようにする
+    __asm__("cli");
+    auto err = CheckPageFaultHandling(*space);
+    const auto stats = space->FaultStats();
+    __asm__("sti");
+
+    char s[64];
+    if (err) {
+      sprintf(s, "vmtest failed: %s\n", err.Name());
+    } else {
+      sprintf(s, "vmtest ok (demand faults %lu, cow faults %lu)\n",
+              stats.demand_faults, stats.cow_faults);
+    }
+    Print(s);
   } else if (command[0] != 0) {
     Print("no such command: ");
     Print(command);
@@ -137,6 +198,80 @@ void Terminal::ExecuteLine() {
   }
 }
 
+void Terminal::ListFiles(const char* path) {
+  auto fs = fat::boot_file_system;
+  if (fs == nullptr) {
+    Print("no file system\n");
+    return;
+  }
+
+  auto [ node, err ] = fs->Find(path);
+  if (err) {
+    Print("no such file or directory: ");
+    Print(path);
+    Print("\n");
+    return;
+  }
+
+  char name[13], line[64];
+  if (!node.entry.IsDirectory()) {
+    fat::FormatName(node.entry, name);
+    sprintf(line, "%-12s %10u\n", name, node.entry.file_size);
+    Print(line);
+    return;
+  }
+
+  auto [ nodes, list_err ] = fs->List(node);
+  if (list_err) {
+    Print("failed to read the directory\n");
+    return;
+  }
+  for (const auto& child : *nodes) {
+    fat::FormatName(child.entry, name);
+    if (child.entry.IsDirectory()) {
+      sprintf(line, "%-12s      <DIR>\n", name);
+    } else {
+      sprintf(line, "%-12s %10u\n", name, child.entry.file_size);
+    }
+    Print(line);
+  }
+}
+
+void Terminal::PrintFile(const char* path) {
+  auto fs = fat::boot_file_system;
+  if (fs == nullptr) {
+    Print("no file system\n");
+    return;
+  }
+
+  auto [ node, err ] = fs->Find(path);
+  if (err) {
+    Print("no such file: ");
+    Print(path);
+    Print("\n");
+    return;
+  } else if (node.entry.IsDirectory()) {
+    Print("is a directory: ");
+    Print(path);
+    Print("\n");
+    return;
+  }
+
+  char small_buf[257];
+  char* buf = file_buf_ ? file_buf_ : small_buf;
+  const size_t buf_size = file_buf_ ? kFileBufBytes : sizeof(small_buf);
+  for (uint64_t offset = 0; offset < node.entry.file_size; ) {
+    auto [ n, read_err ] = fs->Read(node, offset, buf, buf_size - 1);
+    if (read_err || n == 0) {
+      Print("\nfailed to read the file\n");
+      return;
+    }
+    buf[n] = '\0';
+    Print(buf);
+    offset += n;
+  }
+}
+
 void Terminal::Print(const char* s) {
   DrawCursor(false);
 
@@ -37,10 +37,21 @@ class Terminal {
 
   void ExecuteLine();
   void Print(const char* s);
+  /** @brief path のディレクトリの項目（ファイルならそのファイル）を表示する */
+  void ListFiles(const char* path);
+  /** @brief path のファイルの中身を表示する */
+  void PrintFile(const char* path);
+
+  static const size_t kFileBufBytes = 64 * 1024;
+  /** @brief ファイルを読むバッファ．タスクのアドレス空間に予約し，使ったページだけが割り当てられる */
+  char* file_buf_{nullptr};
 
   std::deque<std::array<char, kLineMax>> cmd_history_{};
   int cmd_history_index_{-1};
   Rectangle<int> HistoryUpDown(int direction);
 };
 
+/** @brief ターミナルのタスクのスタックの大きさ．ページフォルトの処理もこのスタックで行う． */
+const size_t kTerminalStackBytes = 16 * 1024;
+
 void TaskTerminal(uint64_t task_id, int64_t data);
@@ -1,8 +1,15 @@
 // day11b
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <deque>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "clocksource.hpp"
 #include "interrupt.hpp"
+#include "logger.hpp"
 #include "task.hpp"
 
 namespace {
@@ -14,6 +21,136 @@ namespace {
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
 }
 
+namespace {
+  /** @brief CPUID から求めた周波数．分からなければ 0 */
+  struct CPUIDFrequency {
+    unsigned long crystal, tsc;
+  };
+
+  /** @brief ハイパーバイザのタイミング情報のリーフ（0x40000010）から周波数を求める．
+   *
+   * EAX は TSC，EBX は LAPIC タイマ（バスクロック）の周波数を kHz 単位で示す．
+   * このリーフの意味が決まっている VMware と KVM の場合だけ使う．
+   */
+  CPUIDFrequency FrequencyFromHypervisor() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(0x40000000, 0, &eax, &ebx, &ecx, &edx);
+    const bool vmware = ebx == 0x61774d56 && ecx == 0x4d566572 && edx == 0x65726177;
+    const bool kvm = ebx == 0x4b4d564b && ecx == 0x564b4d56 && edx == 0x0000004d;
+    if (!(vmware || kvm) || eax < 0x40000010) {
+      return {0, 0};
+    }
+    CPUID(0x40000010, 0, &eax, &ebx, &ecx, &edx);
+    if (eax == 0 || ebx == 0) {
+      return {0, 0};
+    }
+    return {static_cast<unsigned long>(ebx) * 1000, static_cast<unsigned long>(eax) * 1000};
+  }
+
+  /** @brief CPUID のリーフ 0x15 と 0x16 からクリスタルと TSC の周波数を求める．
+   *
+   * リーフ 0x15 が TSC とクリスタルの比を示す Intel の CPU では，LAPIC タイマはクリスタルの周波数で動く．
+   * クリスタルの周波数が示されなければ，リーフ 0x16 の基本周波数と比から逆算する．
+   * 仮想マシンではリーフ 0x15 の値が LAPIC タイマの周波数とは限らないので，
+   * ハイパーバイザがタイミング情報のリーフで示す場合だけそれを使う．
+   */
+  CPUIDFrequency FrequencyFromCPUID() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx >> 31) & 1) { // hypervisor present
+      return FrequencyFromHypervisor();
+    }
+
+    CPUID(0, 0, &eax, &ebx, &ecx, &edx);
+    const uint32_t max_leaf = eax;
+    const bool intel = ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; // GenuineIntel
+    if (!intel || max_leaf < 0x15) {
+      return {0, 0};
+    }
+
+    CPUID(0x15, 0, &eax, &ebx, &ecx, &edx);
+    const uint32_t denominator = eax, numerator = ebx;
+    unsigned long crystal = ecx;
+    if (denominator == 0 || numerator == 0) {
+      return {0, 0};
+    }
+
+    if (crystal == 0 && max_leaf >= 0x16) {
+      CPUID(0x16, 0, &eax, &ebx, &ecx, &edx);
+      const unsigned long base_hz = static_cast<unsigned long>(eax & 0xffffu) * 1000000;
+      crystal = base_hz * denominator / numerator;
+    }
+    if (crystal == 0) {
+      return {0, 0};
+    }
+    return {crystal, crystal * numerator / denominator};
+  }
+
+  /** @brief 1 回の較正で測った周波数 */
+  struct Sample {
+    unsigned long lapic, tsc;
+  };
+
+  /** @brief 基準のクロックソースで約 msec ミリ秒を測り，その間の LAPIC タイマと TSC の進みから周波数を求める．
+   *
+   * 基準のカウンタの値が変わった直後から測り始め，区間の端の誤差を 1 カウント以内に抑える．
+   */
+  Sample SampleFrequency(const ClockSource& ref, unsigned long msec) {
+    const uint64_t prev = ref.Read();
+    uint64_t start;
+    while ((start = ref.Read()) == prev);
+
+    const uint64_t tsc_start = ReadTSC();
+    StartLAPICTimer();
+    const uint64_t target = ref.Frequency() * msec / 1000;
+    uint64_t end;
+    while (ref.Elapsed(start, end = ref.Read()) < target);
+    const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = ReadTSC();
+    StopLAPICTimer();
+
+    const uint64_t ticks = ref.Elapsed(start, end);
+    return {elapsed * ref.Frequency() / ticks, (tsc_end - tsc_start) * ref.Frequency() / ticks};
+  }
+
+  /** @brief 較正の 1 回分の長さと回数．長さは乱れが大きいときに伸ばす */
+  const unsigned long kSampleMilliseconds = 2;
+  const int kNumSamples = 5;
+  const int kMaxRounds = 3;
+  /** @brief 許容する測定値のばらつき（ppm）．超えたら測り直す */
+  const unsigned long kMaxSpreadPPM = 500;
+
+  /** @brief 基準のクロックソースで数回測り，中央値を求める．
+   *
+   * 仮想マシンや SMI による乱れで外れた測定値は中央値には効かない．
+   * 測定値の最大と最小の差を誤差の目安として spread_ppm に返す．
+   */
+  Sample Calibrate(const ClockSource& ref, unsigned long& spread_ppm) {
+    Sample result{};
+    unsigned long msec = kSampleMilliseconds;
+    for (int round = 0; round < kMaxRounds; ++round, msec *= 4) {
+      std::array<unsigned long, kNumSamples> lapic, tsc;
+      for (int i = 0; i < kNumSamples; ++i) {
+        const auto sample = SampleFrequency(ref, msec);
+        lapic[i] = sample.lapic;
+        tsc[i] = sample.tsc;
+      }
+      std::sort(lapic.begin(), lapic.end());
+      std::sort(tsc.begin(), tsc.end());
+
+      result = {lapic[kNumSamples / 2], tsc[kNumSamples / 2]};
+      if (result.lapic == 0) { // LAPIC タイマが動いていない
+        break;
+      }
+      spread_ppm = (lapic.back() - lapic.front()) * 1000000ul / result.lapic;
+      if (spread_ppm <= kMaxSpreadPPM) {
+        break;
+      }
+    }
+    return result;
+  }
+}
+
 // day12b, day11d, day11c
 /**
  * InitializeLAPICTimer
@@ -22,6 +159,9 @@ namespace {
  *   1秒間隔でタイムアウトする
  *   割り込みベクタは InterruptVector::kLAPICTimer を使用する
  *   initial_countはInitial Countレジスタに設定する値
+ *
+ *   周波数は CPUID から分かればそれを使い，分からなければ基準のクロックソースで短く数回測る
+ *   InitializeClockSources() の後に呼ぶこと
  */
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager;
@@ -29,12 +169,28 @@ void InitializeLAPICTimer() {
   divide_config = 0b1011; // divide 1:1
   lvt_timer = 0b001 << 16; // masked, one-shot
 
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  if (const auto freq = FrequencyFromCPUID(); freq.crystal != 0) {
+    lapic_timer_freq = freq.crystal;
+    tsc_freq = freq.tsc;
+    Log(kInfo, "LAPIC timer: %lu Hz, TSC: %lu Hz (CPUID)\n", lapic_timer_freq, tsc_freq);
+  } else {
+    const ClockSource& ref = *ReferenceClockSource();
+    unsigned long spread_ppm = 0;
+    const auto measured = Calibrate(ref, spread_ppm);
+    lapic_timer_freq = measured.lapic;
+    tsc_freq = measured.tsc;
+    Log(kInfo, "LAPIC timer: %lu Hz, TSC: %lu Hz (%s, spread %lu ppm)\n",
+        lapic_timer_freq, tsc_freq, ref.Name(), spread_ppm);
+  }
+  RegisterTSCClockSource(tsc_freq);
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  if (lapic_timer_freq == 0) {
+    // LAPIC タイマが動かなければ，周期割り込みを起こせる他のタイマで代える
+    if (auto err = StartPeriodicClockInterrupt(kTimerFreq, InterruptVector::kLAPICTimer)) {
+      Log(kError, "no timer can generate periodic interrupts: %s\n", err.Name());
+    }
+    return;
+  }
 
   divide_config = 0b1011; // divide 1:1
   lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
@@ -74,8 +230,8 @@ void StopLAPICTimer() {
  * Timer 
  *   Timerクラスのコンストラクタ
  */
-Timer::Timer(unsigned long timeout, int value)
-    : timeout_{timeout}, value_{value} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {
 }
 
 /**
@@ -123,7 +279,7 @@ bool TimerManager::Tick() {
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
     // day14b
-    task_manager->SendMessage(1, m);
+    task_manager->SendMessage(t.TaskID(), m);
 
     timers_.pop();
   }
@@ -134,6 +290,7 @@ bool TimerManager::Tick() {
 /** @brief タイマー管理クラスのグローバルインスタンス */
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 /**
  * LAPICTimerOnInterrupt
@@ -148,3 +305,44 @@ void LAPICTimerOnInterrupt() {
     task_manager->SwitchTask();
   }
 }
+
+void SleepMilliseconds(unsigned long msec) {
+  if (timer_manager == nullptr || task_manager == nullptr) {
+    acpi::WaitMilliseconds(msec);
+    return;
+  }
+
+  // 割り込みを禁止して呼ばれた場合は，眠っている間だけ許可し，戻る前に禁止し直す
+  uint64_t rflags;
+  __asm__ volatile("pushfq; pop %0" : "=r"(rflags) : : "memory");
+
+  Task& task = task_manager->CurrentTask();
+  const unsigned long ticks = std::max(1ul, (msec * kTimerFreq + 999) / 1000);
+  __asm__("cli");
+  timer_manager->AddTimer(
+      Timer{timer_manager->CurrentTick() + ticks, kSleepTimerValue, task.ID()});
+  __asm__("sti");
+
+  std::deque<Message> others;
+  while (true) {
+    __asm__("cli");
+    auto msg = task.ReceiveMessage();
+    if (!msg) {
+      task.Sleep();
+      __asm__("sti");
+      continue;
+    }
+    __asm__("sti");
+
+    if (msg->type == Message::kTimerTimeout && msg->arg.timer.value == kSleepTimerValue) {
+      break;
+    }
+    others.push_back(*msg);
+  }
+
+  __asm__("cli");
+  for (const auto& msg : others) {
+    task.SendMessage(msg);
+  }
+  __asm__ volatile("push %0; popfq" : : "r"(rflags) : "memory", "cc");
+}
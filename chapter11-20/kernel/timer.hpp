@@ -19,16 +19,19 @@ void StopLAPICTimer();
  * Timer
  *   論理的なタイマを表す
  *   timeout変数はタイムアウト時刻を表し、value_変数はタイムアウト時に送信する値を格納する
+ *   タイムアウトは task_id_ のタスクへ Message::kTimerTimeout として通知する
  */
 class Timer {
  public:
-  Timer(unsigned long timeout, int value);
+  Timer(unsigned long timeout, int value, uint64_t task_id = 1);
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
+  uint64_t TaskID() const { return task_id_; }
 
  private:
   unsigned long timeout_;
   int value_;
+  uint64_t task_id_;
 };
 
 /** @brief タイマー優先度を比較する。タイムアウトが遠いほど優先度低。 */
@@ -60,9 +63,24 @@ class TimerManager {
 /** @brief Local APICタイマの1カウントの時間を計り、その結果を記憶しておくためのグローバル変数 */
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+/** @brief TSC の周波数（Hz）．InitializeLAPICTimer() で LAPIC タイマと同時に求める */
+extern unsigned long tsc_freq;
 const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 const int kTaskTimerValue = std::numeric_limits<int>::min();
+/** @brief SleepMilliseconds() が使うタイマの値 */
+const int kSleepTimerValue = std::numeric_limits<int>::min() + 1;
+/** @brief USB ハブの待ち時間の経過をメインタスクに知らせるタイマの値 */
+const int kUSBHubTimerValue = std::numeric_limits<int>::min() + 2;
+
+/** @brief 現在のタスクを msec ミリ秒以上眠らせる．
+ *
+ * タイマ割り込みの周期（1000 / kTimerFreq ミリ秒）単位に切り上げて待つ．
+ * 待っている間に届いた他のメッセージは，起きた後で自分のキューに戻す．
+ * タスク管理の初期化前は ACPI PM タイマでビジーウェイトする．
+ * メインタスクから呼ぶと画面の更新が止まるので，他のタスクから呼ぶこと．
+ */
+void SleepMilliseconds(unsigned long msec);
 
 void LAPICTimerOnInterrupt();
@@ -23,7 +23,12 @@ namespace usb {
     virtual Error OnEndpointsConfigured() = 0;
     virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                      const void* buf, int len) = 0;
-    virtual Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) = 0;
+    /** @brief Normal 転送の完了を受け取る．
+     *
+     * result は転送の結果．失敗した場合，len はあてにならない．
+     */
+    virtual Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                    Error result) = 0;
 
     /** このクラスドライバを保持する USB デバイスを返す． */
     Device* ParentDevice() const { return dev_; }
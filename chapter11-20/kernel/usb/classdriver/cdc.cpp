@@ -0,0 +1,213 @@
+#include "usb/classdriver/cdc.hpp"
+
+#include "usb/memory.hpp"
+#include "usb/device.hpp"
+#include "logger.hpp"
+
+namespace {
+  // SET_CONTROL_LINE_STATE の値
+  const uint16_t kLineStateDTR = 1u << 0;
+  const uint16_t kLineStateRTS = 1u << 1;
+}
+
+namespace usb::cdc {
+  CDCDriver::CDCDriver(Device* dev, int interface_index, Variant variant)
+      : ClassDriver{dev}, interface_index_{interface_index}, variant_{variant} {
+  }
+
+  void* CDCDriver::operator new(size_t size) {
+    return AllocMem(sizeof(CDCDriver), 64, 0);
+  }
+
+  void CDCDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error CDCDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error CDCDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+      ep_interrupt_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+      bulk_in_packet_size_ = config.max_packet_size;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error CDCDriver::OnEndpointsConfigured() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+
+    if (variant_ == Variant::kFTDI) {
+      setup_data.request_type.bits.type = request_type::kVendor;
+      setup_data.request_type.bits.recipient = request_type::kDevice;
+      setup_data.request = ftdi_request::kSetBaudRate;
+      setup_data.value = ftdi_request::kBaudRate115200;
+      setup_data.index = 0;
+      setup_data.length = 0;
+
+      initialize_phase_ = 2;
+      return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+    }
+
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request = request::kSetLineCoding;
+    setup_data.value = 0;
+    setup_data.index = interface_index_;
+    setup_data.length = sizeof(LineCoding);
+
+    initialize_phase_ = 1;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data,
+                                      &line_coding_, sizeof(LineCoding), this);
+  }
+
+  Error CDCDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    Log(kDebug, "CDCDriver::OnControlCompleted: phase = %d, req = 0x%02x, len = %d\n",
+        initialize_phase_, setup_data.request, len);
+
+    if (initialize_phase_ == 1) {
+      return SetControlLineState();
+    } else if (initialize_phase_ == 2) {
+      initialize_phase_ = 3;
+      Log(kInfo, "CDCDriver: ready (%s)\n", variant_ == Variant::kFTDI ? "FTDI" : "ACM");
+      if (driver == nullptr) {
+        driver = this;
+      }
+      if (auto err = StartReceive()) {
+        return err;
+      }
+      return Flush();
+    }
+
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error CDCDriver::OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                     Error result) {
+    if (result) {
+      // 失敗した転送はやり直さず，次の送受信の要求を受け付けられるようにしておく
+      if (ep_id.Address() == ep_bulk_in_.Address()) {
+        rx_in_flight_ = 0;
+      } else if (ep_id.Address() == ep_bulk_out_.Address()) {
+        tx_in_flight_ = 0;
+      }
+      return result;
+    }
+    if (ep_id.Address() == ep_bulk_in_.Address()) {
+      rx_in_flight_ = 0;
+      if (variant_ == Variant::kFTDI) {
+        len = StripFTDIStatus(len);
+      }
+      rx_ring_.Produce(len);
+      if (len > 0 && default_observer) {
+        default_observer(*this);
+      }
+      return StartReceive();
+    } else if (ep_id.Address() == ep_bulk_out_.Address()) {
+      tx_ring_.Consume(tx_in_flight_);
+      tx_in_flight_ = 0;
+      return Flush();
+    }
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+
+  Error CDCDriver::SendSerial(const void* buf, int len) {
+    if (tx_ring_.Write(buf, len) < static_cast<size_t>(len)) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error CDCDriver::Flush() {
+    if (!IsReady() || tx_in_flight_ > 0 || tx_ring_.Size() == 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // リングに溜まった分を 1 つの転送にまとめ，リングから直接送る
+    auto span = tx_ring_.Readable(kMaxTransferSize);
+    const BufferSegment segments[2] = {
+      {span.buf[0], static_cast<int>(span.len[0])},
+      {span.buf[1], static_cast<int>(span.len[1])},
+    };
+    tx_in_flight_ = span.len[0] + span.len[1];
+    if (auto err = ParentDevice()->QueueNormal(
+          ep_bulk_out_, segments, span.len[1] > 0 ? 2 : 1)) {
+      tx_in_flight_ = 0;
+      return err;
+    }
+    return ParentDevice()->Commit(ep_bulk_out_);
+  }
+
+  int CDCDriver::ReceiveSerial(void* buf, int len) {
+    const int recv_len = rx_ring_.Read(buf, len);
+    if (recv_len > 0 && rx_in_flight_ == 0) {
+      // リングが一杯で止めていた受信を再開する
+      if (auto err = StartReceive()) {
+        Log(kError, "CDCDriver: failed to restart receiving: %s\n", err.Name());
+      }
+    }
+    return recv_len;
+  }
+
+  Error CDCDriver::SetControlLineState() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = request::kSetControlLineState;
+    setup_data.value = kLineStateDTR | kLineStateRTS;
+    setup_data.index = interface_index_;
+    setup_data.length = 0;
+
+    initialize_phase_ = 2;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error CDCDriver::StartReceive() {
+    if (!IsReady() || rx_in_flight_ > 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // パケットの途中で転送が終わるとバブルになるので，最大パケットサイズの倍数だけ要求する．
+    // 空きが 1 パケットに満たなければ，ReceiveSerial で読み出されるまで受信を止める．
+    const int len = std::min<int>(rx_ring_.Free(), kMaxTransferSize)
+      / bulk_in_packet_size_ * bulk_in_packet_size_;
+    if (len == 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto span = rx_ring_.Writable(len);
+    const BufferSegment segments[2] = {
+      {span.buf[0], static_cast<int>(span.len[0])},
+      {span.buf[1], static_cast<int>(span.len[1])},
+    };
+    rx_in_flight_ = len;
+    if (auto err = ParentDevice()->QueueNormal(
+          ep_bulk_in_, segments, span.len[1] > 0 ? 2 : 1)) {
+      rx_in_flight_ = 0;
+      return err;
+    }
+    return ParentDevice()->Commit(ep_bulk_in_);
+  }
+
+  int CDCDriver::StripFTDIStatus(int len) {
+    // 受信データはリングの書き込み位置から並んでいるので，その場で前に詰める
+    int dst = 0;
+    for (int packet = 0; packet < len; packet += bulk_in_packet_size_) {
+      const int end = std::min(packet + bulk_in_packet_size_, len);
+      for (int src = packet + ftdi_request::kStatusBytes; src < end; ++src) {
+        rx_ring_.AtTail(dst++) = rx_ring_.AtTail(src);
+      }
+    }
+    return dst;
+  }
+
+  std::function<CDCDriver::ObserverType> CDCDriver::default_observer;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file usb/classdriver/cdc.hpp
+ *
+ * CDC class drivers.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include "usb/classdriver/base.hpp"
+
+namespace usb::cdc {
+  enum class CharFormat : uint8_t {
+    kStopBit1,
+    kStopBit15,
+    kStopBit2
+  };
+
+  enum class ParityType : uint8_t {
+    kNone,
+    kOdd,
+    kEven,
+    kMark,
+    kSpace
+  };
+
+  struct LineCoding {
+    uint32_t dte_rate;
+    CharFormat char_format;
+    ParityType parity_type;
+    uint8_t data_bits; // 5, 6, 7, 8, 16
+  } __attribute__((packed));
+
+  /** @brief FTDI 社の USB シリアル変換チップのベンダリクエスト */
+  namespace ftdi_request {
+    const int kSetBaudRate = 3;
+    /** @brief kSetBaudRate に渡す 115200 bps の分周値 */
+    const int kBaudRate115200 = 0x001a;
+    /** @brief FTDI の受信パケットの先頭に付くモデム状態のバイト数 */
+    const int kStatusBytes = 2;
+  }
+
+  /** @brief 1 つの書き手と 1 つの読み手で共有する固定長のバイトリング．
+   *
+   * 書き手は tail_ だけを，読み手は head_ だけを進めるのでロックは要らない．
+   * 添字は N で割らずに増やし続け，差を取れば格納しているバイト数になる．
+   * USB の転送は Writable / Readable が返す領域に直接 DMA する．
+   */
+  template <size_t N>
+  class ByteRing {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+   public:
+    /** @brief 連続した領域．リングの末尾で折り返す場合は 2 つに分かれる． */
+    struct Span {
+      uint8_t* buf[2];
+      size_t len[2];
+    };
+
+    size_t Size() const { return tail_.load() - head_.load(); }
+    size_t Free() const { return N - Size(); }
+
+    /** @brief 書き込み可能な領域（最大 max_len バイト）を返す．書き手だけが呼ぶ． */
+    Span Writable(size_t max_len) {
+      return MakeSpan(tail_.load(), std::min(Free(), max_len));
+    }
+    /** @brief Writable で得た領域の先頭 len バイトを読み手に渡す． */
+    void Produce(size_t len) { tail_.store(tail_.load() + len); }
+
+    /** @brief 読み出し可能な領域（最大 max_len バイト）を返す．読み手だけが呼ぶ． */
+    Span Readable(size_t max_len) {
+      return MakeSpan(head_.load(), std::min(Size(), max_len));
+    }
+    /** @brief Readable で得た領域の先頭 len バイトを解放する． */
+    void Consume(size_t len) { head_.store(head_.load() + len); }
+
+    /** @brief 書き込み位置から offset バイト先のバイトを返す．受信データの整形に使う． */
+    uint8_t& AtTail(size_t offset) { return buf_[(tail_.load() + offset) & (N - 1)]; }
+
+    /** @brief buf から最大 len バイトをコピーして書き込み，書き込めたバイト数を返す． */
+    size_t Write(const void* buf, size_t len) {
+      auto span = Writable(len);
+      auto src = reinterpret_cast<const uint8_t*>(buf);
+      memcpy(span.buf[0], src, span.len[0]);
+      memcpy(span.buf[1], src + span.len[0], span.len[1]);
+      Produce(span.len[0] + span.len[1]);
+      return span.len[0] + span.len[1];
+    }
+
+    /** @brief 最大 len バイトを buf に読み出し，読み出せたバイト数を返す． */
+    size_t Read(void* buf, size_t len) {
+      auto span = Readable(len);
+      auto dst = reinterpret_cast<uint8_t*>(buf);
+      memcpy(dst, span.buf[0], span.len[0]);
+      memcpy(dst + span.len[0], span.buf[1], span.len[1]);
+      Consume(span.len[0] + span.len[1]);
+      return span.len[0] + span.len[1];
+    }
+
+   private:
+    alignas(64) std::array<uint8_t, N> buf_{};
+    std::atomic<size_t> head_{0}, tail_{0};
+
+    Span MakeSpan(size_t index, size_t len) {
+      const size_t offset = index & (N - 1);
+      const size_t first = std::min(len, N - offset);
+      return {{&buf_[offset], &buf_[0]}, {first, len - first}};
+    }
+  };
+
+  /** @brief CDC-ACM のシリアルデバイスのドライバ．
+   *
+   * データの経路が同じなので，FTDI 互換の USB シリアル変換（QEMU の usb-serial など）も扱う．
+   * 送受信データは固定長のリングに置き，バルク転送はリングとの間で直接行う．
+   * 送信中に書き込まれたデータは，前の転送が終わった時点でまとめて 1 つの転送にする．
+   */
+  class CDCDriver : public ClassDriver {
+   public:
+    /** @brief デバイスの種類 */
+    enum class Variant {
+      kACM,  // CDC-ACM
+      kFTDI, // FTDI 互換
+    };
+
+    static const size_t kRingSize = 4096;
+    /** @brief 1 回のバルク転送の最大長 */
+    static const int kMaxTransferSize = 1024;
+
+    CDCDriver(Device* dev, int interface_index, Variant variant);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                            Error result) override;
+
+    /** @brief buf の len バイトを送信リングに書き込む．
+     *
+     * 転送は開始しない．書き込み側が 1 つになるよう，呼び出し側で排他すること．
+     * リングに入りきらなかった分は捨て，Error::kFull を返す．
+     */
+    Error SendSerial(const void* buf, int len);
+
+    /** @brief 送信中の転送が無ければ，送信リングのデータの転送を開始する．
+     *
+     * USB のイベントを処理するタスクから呼ぶ．
+     */
+    Error Flush();
+
+    /** @brief 受信リングから最大 len バイトを buf に読み出し，読み出したバイト数を返す．
+     *
+     * USB のイベントを処理するタスクから呼ぶ．
+     */
+    int ReceiveSerial(void* buf, int len);
+
+    bool IsReady() const { return initialize_phase_ == 3; }
+
+    /** @brief データを受信したときに呼ばれる． */
+    using ObserverType = void (CDCDriver& driver);
+    static std::function<ObserverType> default_observer;
+
+   private:
+    EndpointID ep_interrupt_in_, ep_bulk_in_, ep_bulk_out_;
+    int bulk_in_packet_size_{64};
+    const int interface_index_;
+    const Variant variant_;
+    int initialize_phase_{0};
+    LineCoding line_coding_{115200, CharFormat::kStopBit1, ParityType::kNone, 8};
+
+    ByteRing<kRingSize> tx_ring_, rx_ring_;
+    /** @brief 転送中のバイト数．0 なら転送していない． */
+    int tx_in_flight_{0}, rx_in_flight_{0};
+
+    Error SetControlLineState();
+    Error StartReceive();
+    /** @brief FTDI の受信データからパケットごとのモデム状態を取り除き，残りのバイト数を返す． */
+    int StripFTDIStatus(int len);
+  };
+
+  inline CDCDriver* driver = nullptr;
+}
@@ -18,6 +18,10 @@ namespace usb {
   Error HIDBaseDriver::SetEndpoint(const EndpointConfig& config) {
     if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
       ep_interrupt_in_ = config.ep_id;
+      if (protocol_ == Protocol::kReport) {
+        // レポートの長さは Report ディスクリプタ次第なので，1 パケット分を受け取れるようにする
+        in_packet_size_ = std::min<int>(config.max_packet_size, kBufferSize);
+      }
     } else if (config.ep_type == EndpointType::kInterrupt && !config.ep_id.IsIn()) {
       ep_interrupt_out_ = config.ep_id;
     }
@@ -25,6 +29,25 @@ namespace usb {
   }
 
   Error HIDBaseDriver::OnEndpointsConfigured() {
+    if (protocol_ == Protocol::kBoot) {
+      return SetBootProtocol();
+    }
+
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kStandard;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = static_cast<uint16_t>(descriptor_type::kReport) << 8;
+    setup_data.index = interface_index_;
+    setup_data.length = buf_.size();
+
+    initialize_phase_ = 1;
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     buf_.data(), buf_.size(), this);
+  }
+
+  Error HIDBaseDriver::SetBootProtocol() {
     SetupData setup_data{};
     setup_data.request_type.bits.direction = request_type::kOut;
     setup_data.request_type.bits.type = request_type::kClass;
@@ -34,7 +57,7 @@ namespace usb {
     setup_data.index = interface_index_;
     setup_data.length = 0;
 
-    initialize_phase_ = 1;
+    initialize_phase_ = 2;
     return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
   }
 
@@ -43,18 +66,36 @@ namespace usb {
     Log(kDebug, "HIDBaseDriver::OnControlCompleted: dev %08x, phase = %d, len = %d\n",
         this, initialize_phase_, len);
     if (initialize_phase_ == 1) {
-      initialize_phase_ = 2;
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      if (auto err = OnReportDescriptorReceived(buf_.data(), len)) {
+        return err;
+      }
+      if (protocol_ == Protocol::kNone) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (protocol_ == Protocol::kBoot) {
+        return SetBootProtocol();
+      }
+      // リセット後のデバイスはレポートプロトコルで動いているので SET_PROTOCOL は送らない．
+      // ブートインターフェースでないデバイスは SET_PROTOCOL に対応していないこともある．
+      initialize_phase_ = 3;
+      return ParentDevice()->NormalIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+    } else if (initialize_phase_ == 2) {
+      initialize_phase_ = 3;
+      return ParentDevice()->NormalIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
-  Error HIDBaseDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+  Error HIDBaseDriver::OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                         Error result) {
+    if (result) {
+      return result;
+    }
     if (ep_id.IsIn()) {
       OnDataReceived();
       std::copy_n(buf_.begin(), len, previous_buf_.begin());
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      return ParentDevice()->NormalIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
@@ -17,19 +17,48 @@ namespace usb {
     Error OnEndpointsConfigured() override;
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len) override;
-    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                            Error result) override;
 
     virtual Error OnDataReceived() = 0;
     const static size_t kBufferSize = 1024;
     const std::array<uint8_t, kBufferSize>& Buffer() const { return buf_; }
     const std::array<uint8_t, kBufferSize>& PreviousBuffer() const { return previous_buf_; }
 
+    /** @brief レポートの形式 */
+    enum class Protocol {
+      kBoot,   // ブートプロトコル（固定形式）
+      kReport, // Report ディスクリプタで形式が決まるレポートプロトコル
+      kNone,   // 扱えないインターフェースなので，レポートを受け取らない
+    };
+
+   protected:
+    /** @brief 使うプロトコルを選ぶ．既定は Protocol::kBoot．
+     *
+     * kReport を選ぶと，初期化時に Report ディスクリプタを読み込んで
+     * OnReportDescriptorReceived を呼び，レポートはエンドポイントの最大パケットサイズで受け取る．
+     */
+    void SelectProtocol(Protocol protocol) { protocol_ = protocol; }
+    Protocol SelectedProtocol() const { return protocol_; }
+
+    /** @brief Report ディスクリプタを受け取ったときに呼ばれる．
+     *
+     * ここで SelectProtocol(Protocol::kBoot) を呼べばブートプロトコルに切り替える．
+     * SelectProtocol(Protocol::kNone) を呼ぶか，エラーを返すとレポートの受信を始めない．
+     */
+    virtual Error OnReportDescriptorReceived(const uint8_t* desc, int len) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
    private:
     EndpointID ep_interrupt_in_;
     EndpointID ep_interrupt_out_;
     const int interface_index_;
     int in_packet_size_;
     int initialize_phase_{0};
+    Protocol protocol_{Protocol::kBoot};
+
+    Error SetBootProtocol();
 
     std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
   };
@@ -0,0 +1,272 @@
+#include "usb/classdriver/hidreport.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+  // 項目の種類（bType）
+  const int kTypeMain = 0;
+  const int kTypeGlobal = 1;
+  const int kTypeLocal = 2;
+
+  // Main 項目のタグ
+  const int kTagInput = 0x8;
+  const int kTagCollection = 0xa;
+  const int kTagEndCollection = 0xc;
+
+  // Global 項目のタグ
+  const int kTagUsagePage = 0x0;
+  const int kTagLogicalMinimum = 0x1;
+  const int kTagLogicalMaximum = 0x2;
+  const int kTagReportSize = 0x7;
+  const int kTagReportID = 0x8;
+  const int kTagReportCount = 0x9;
+  const int kTagPush = 0xa;
+  const int kTagPop = 0xb;
+
+  // Local 項目のタグ
+  const int kTagUsage = 0x0;
+  const int kTagUsageMinimum = 0x1;
+  const int kTagUsageMaximum = 0x2;
+
+  // Input 項目のフラグ
+  const uint32_t kInputConstant = 1u << 0;
+  const uint32_t kInputVariable = 1u << 1;
+  const uint32_t kInputRelative = 1u << 2;
+
+  // 使用する Usage（上位 16 ビットが Usage Page）
+  const uint32_t kUsagePageButton = 0x09;
+  const uint32_t kUsagePageDigitizer = 0x0d;
+  const uint32_t kUsagePointer = 0x00010001;
+  const uint32_t kUsageMouse = 0x00010002;
+  const uint32_t kUsageX = 0x00010030;
+  const uint32_t kUsageY = 0x00010031;
+  const uint32_t kUsageWheel = 0x00010038;
+
+  const int kMaxUsages = 16;
+  const int kGlobalStackDepth = 4;
+  const int kMaxCollectionDepth = 16;
+  const unsigned int kMaxButtons = 8;
+  /** @brief 扱うレポートの最大長（HIDBaseDriver::kBufferSize と同じ） */
+  const unsigned int kMaxReportBits = 1024 * 8;
+
+  struct GlobalState {
+    uint32_t usage_page;
+    int32_t logical_min, logical_max;
+    uint32_t report_size, report_count;
+    uint8_t report_id;
+  };
+
+  struct LocalState {
+    std::array<uint32_t, kMaxUsages> usages;
+    int num_usages;
+    uint32_t usage_min, usage_max;
+    bool has_range;
+
+    /** @brief index 番目のフィールドの Usage を返す．Usage が足りなければ最後のものを繰り返す． */
+    uint32_t UsageAt(unsigned int index) const {
+      if (has_range) {
+        return std::min(usage_min + index, usage_max);
+      } else if (num_usages == 0) {
+        return 0;
+      }
+      return usages[std::min<unsigned int>(index, num_usages - 1)];
+    }
+  };
+
+  /** @brief 項目データを符号なしで読む */
+  uint32_t ReadUnsigned(const uint8_t* p, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; ++i) {
+      value |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  /** @brief 項目データを符号付きで読む */
+  int32_t ReadSigned(const uint8_t* p, int size) {
+    if (size == 0) {
+      return 0;
+    }
+    const uint32_t sign_bit = 1u << (8 * size - 1);
+    const uint32_t value = ReadUnsigned(p, size);
+    return static_cast<int32_t>((value ^ sign_bit) - sign_bit);
+  }
+
+  /** @brief マウスやタブレットを表すコレクションの Usage なら true．
+   *
+   * ジョイスティックやゲームパッドも X, Y を持つが，ポインタとしては扱わない．
+   */
+  bool IsPointerCollection(uint32_t usage) {
+    return usage == kUsagePointer || usage == kUsageMouse ||
+      (usage >> 16) == kUsagePageDigitizer;
+  }
+
+  /** @brief 2 バイト以下の Usage に Usage Page を付ける */
+  uint32_t ExtendedUsage(uint32_t usage, int size, uint32_t usage_page) {
+    return size == 4 ? usage : (usage_page << 16) | usage;
+  }
+}
+
+namespace usb {
+  HIDField::HIDField(unsigned int bit_offset, unsigned int bit_size, bool is_signed)
+      : byte_offset_(bit_offset / 8),
+        num_bytes_((bit_offset % 8 + bit_size + 7) / 8),
+        shift_(bit_offset % 8),
+        mask_((uint64_t{1} << bit_size) - 1),
+        sign_bit_(is_signed && bit_size > 0 ? uint64_t{1} << (bit_size - 1) : 0) {
+  }
+
+  WithError<HIDPointerLayout> ParseHIDPointerReport(const uint8_t* desc, int len) {
+    HIDPointerLayout layout{};
+    bool found_x = false, found_y = false;
+
+    GlobalState global{};
+    std::array<GlobalState, kGlobalStackDepth> global_stack;
+    int global_stack_size = 0;
+    LocalState local{};
+    bool uses_report_id = false;
+    // レポート ID ごとの入力レポートのビット数（ID のバイトを除く）
+    std::array<uint32_t, 256> report_bits{};
+    // 深さごとに，ポインタのコレクションの中にいるかどうか．深すぎる分は最も深いもので代用する．
+    std::array<bool, kMaxCollectionDepth + 1> in_pointer{};
+    int collection_depth = 0;
+
+    for (int i = 0; i < len; ) {
+      const uint8_t prefix = desc[i];
+      if (prefix == 0xfe) { // Long item は使われないので読み飛ばす
+        if (i + 1 >= len) {
+          break;
+        }
+        i += 3 + desc[i + 1];
+        continue;
+      }
+
+      const int size = (prefix & 0x3u) == 3 ? 4 : (prefix & 0x3u);
+      const int type = (prefix >> 2) & 0x3u;
+      const int tag = prefix >> 4;
+      if (i + 1 + size > len) {
+        break;
+      }
+      const uint8_t* data = &desc[i + 1];
+      const uint32_t udata = ReadUnsigned(data, size);
+      i += 1 + size;
+
+      if (type == kTypeGlobal) {
+        switch (tag) {
+        case kTagUsagePage: global.usage_page = udata; break;
+        case kTagLogicalMinimum: global.logical_min = ReadSigned(data, size); break;
+        case kTagLogicalMaximum:
+          // 最小値が非負なら最大値は符号なしとして扱う
+          global.logical_max = global.logical_min >= 0
+            ? static_cast<int32_t>(udata) : ReadSigned(data, size);
+          break;
+        case kTagReportSize: global.report_size = udata; break;
+        case kTagReportID:
+          global.report_id = udata;
+          uses_report_id = true;
+          break;
+        case kTagReportCount: global.report_count = udata; break;
+        case kTagPush:
+          if (global_stack_size < kGlobalStackDepth) {
+            global_stack[global_stack_size++] = global;
+          }
+          break;
+        case kTagPop:
+          if (global_stack_size > 0) {
+            global = global_stack[--global_stack_size];
+          }
+          break;
+        }
+        continue;
+      }
+
+      if (type == kTypeLocal) {
+        switch (tag) {
+        case kTagUsage:
+          if (local.num_usages < kMaxUsages) {
+            local.usages[local.num_usages++] = ExtendedUsage(udata, size, global.usage_page);
+          }
+          break;
+        case kTagUsageMinimum:
+          local.usage_min = ExtendedUsage(udata, size, global.usage_page);
+          local.has_range = true;
+          break;
+        case kTagUsageMaximum:
+          local.usage_max = ExtendedUsage(udata, size, global.usage_page);
+          local.has_range = true;
+          break;
+        }
+        continue;
+      }
+
+      if (type != kTypeMain) {
+        continue;
+      }
+
+      const bool pointer = in_pointer[std::min(collection_depth, kMaxCollectionDepth)];
+      if (tag == kTagCollection) {
+        if (collection_depth < kMaxCollectionDepth) {
+          in_pointer[collection_depth + 1] = pointer || IsPointerCollection(local.UsageAt(0));
+        }
+        ++collection_depth;
+      } else if (tag == kTagEndCollection) {
+        collection_depth = std::max(collection_depth - 1, 0);
+      } else if (tag == kTagInput) {
+        auto& bits = report_bits[global.report_id];
+        const bool is_variable = (udata & kInputVariable) && !(udata & kInputConstant);
+        const bool is_signed = global.logical_min < 0;
+        // レポート ID を使う場合，レポートの先頭 1 バイトは ID
+        const unsigned int id_bits = uses_report_id ? 8 : 0;
+        const bool same_report = !found_x || global.report_id == layout.report_id;
+        const bool wanted = pointer && is_variable && same_report;
+
+        for (unsigned int n = 0; wanted && n < global.report_count; ++n) {
+          const uint32_t usage = local.UsageAt(n);
+          const unsigned int offset = id_bits + bits + n * global.report_size;
+          const unsigned int field_size = std::min<uint32_t>(global.report_size, 32);
+          if (offset + field_size > kMaxReportBits) {
+            break;
+          }
+
+          if ((usage >> 16) == kUsagePageButton && (usage & 0xffffu) == 1 &&
+              global.report_size == 1) {
+            const unsigned int num_buttons =
+              std::min<unsigned int>(global.report_count - n, kMaxButtons);
+            layout.buttons = HIDField{offset, num_buttons, false};
+          } else if (usage == kUsageX && !found_x) {
+            found_x = true;
+            layout.report_id = global.report_id;
+            layout.absolute = (udata & kInputRelative) == 0;
+            layout.x = HIDField{offset, field_size, is_signed};
+            layout.x_min = global.logical_min;
+            layout.x_max = global.logical_max;
+          } else if (usage == kUsageY && !found_y) {
+            found_y = true;
+            layout.y = HIDField{offset, field_size, is_signed};
+            layout.y_min = global.logical_min;
+            layout.y_max = global.logical_max;
+          } else if (usage == kUsageWheel) {
+            layout.wheel = HIDField{offset, field_size, is_signed};
+          }
+        }
+        bits += global.report_size * global.report_count;
+      }
+      // Main 項目ごとに Local 項目は初期化される
+      local = LocalState{};
+    }
+
+    if (!found_x || !found_y) {
+      return {layout, MAKE_ERROR(Error::kInvalidDescriptor)};
+    }
+    return {layout, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  HIDPointerLayout BootMouseLayout() {
+    HIDPointerLayout layout{};
+    layout.buttons = HIDField{0, 3, false};
+    layout.x = HIDField{8, 8, true};
+    layout.y = HIDField{16, 8, true};
+    return layout;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * @file usb/classdriver/hidreport.hpp
+ *
+ * HID Report ディスクリプタの解析と，レポートからの値の取り出し．
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "error.hpp"
+
+namespace usb {
+  /** @brief レポート中の 1 つのフィールドを取り出す手順．
+   *
+   * Report ディスクリプタの解析時にバイト位置，シフト量，マスクを求めておき，
+   * レポートを受け取るたびにディスクリプタを解釈し直さなくて済むようにする．
+   * 幅が 0 のフィールドは常に 0 を返す．
+   */
+  class HIDField {
+   public:
+    HIDField() = default;
+    /** @brief レポート先頭から bit_offset ビット目にある bit_size ビットのフィールド．
+     *
+     * bit_size は 32 以下でなければならない．
+     */
+    HIDField(unsigned int bit_offset, unsigned int bit_size, bool is_signed);
+
+    bool IsValid() const { return num_bytes_ > 0; }
+
+    int32_t Extract(const uint8_t* report) const {
+      uint64_t value = 0;
+      memcpy(&value, report + byte_offset_, num_bytes_);
+      value = (value >> shift_) & mask_;
+      // 符号ビットが立っていれば上位ビットを埋める
+      return static_cast<int32_t>((value ^ sign_bit_) - sign_bit_);
+    }
+
+   private:
+    uint16_t byte_offset_{0};
+    uint8_t num_bytes_{0};
+    uint8_t shift_{0};
+    uint64_t mask_{0};
+    uint64_t sign_bit_{0};
+  };
+
+  /** @brief マウスやタブレットのレポートの構成 */
+  struct HIDPointerLayout {
+    /** @brief 対象のレポートの ID．0 ならレポート ID を使わない． */
+    uint8_t report_id;
+    /** @brief X, Y が絶対位置（タブレット）なら true，移動量（マウス）なら false */
+    bool absolute;
+    /** @brief ボタン 1 から順に下位ビットへ並べたボタンの状態（最大 8 個） */
+    HIDField buttons;
+    HIDField x, y;
+    /** @brief ホイールの回転量．無ければ幅 0． */
+    HIDField wheel;
+    /** @brief absolute の場合の X, Y の論理値の範囲 */
+    int32_t x_min, x_max, y_min, y_max;
+  };
+
+  /** @brief Report ディスクリプタを解析し，X と Y を含む最初の入力レポートの構成を求める．
+   *
+   * Mouse，Pointer，または Digitizer ページのコレクションの中にある項目だけを見る．
+   * そのような X, Y を持つレポートが無ければ Error::kInvalidDescriptor を返す．
+   */
+  WithError<HIDPointerLayout> ParseHIDPointerReport(const uint8_t* desc, int len);
+
+  /** @brief ブートプロトコルのマウスのレポートの構成 */
+  HIDPointerLayout BootMouseLayout();
+}
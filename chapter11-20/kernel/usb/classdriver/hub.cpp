@@ -0,0 +1,355 @@
+#include "usb/classdriver/hub.hpp"
+
+#include <algorithm>
+#include <vector>
+#include "usb/memory.hpp"
+#include "usb/device.hpp"
+#include "usb/xhci/speed.hpp"
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  // wPortStatus
+  const uint16_t kPortStatusConnection = 1u << 0;
+  const uint16_t kPortStatusEnable = 1u << 1;
+  const uint16_t kPortStatusLowSpeed = 1u << 9;   // USB 2.0 ハブのみ
+  const uint16_t kPortStatusHighSpeed = 1u << 10; // USB 2.0 ハブのみ
+
+  // wPortChange
+  const uint16_t kPortChangeConnection = 1u << 0;
+  const uint16_t kPortChangeEnable = 1u << 1;      // USB 2.0 ハブのみ
+  const uint16_t kPortChangeSuspend = 1u << 2;     // USB 2.0 ハブのみ
+  const uint16_t kPortChangeOverCurrent = 1u << 3;
+  const uint16_t kPortChangeReset = 1u << 4;
+  const uint16_t kPortChangeBHReset = 1u << 5;     // USB 3.x ハブのみ
+  const uint16_t kPortChangeLinkState = 1u << 6;   // USB 3.x ハブのみ
+  const uint16_t kPortChangeConfigError = 1u << 7; // USB 3.x ハブのみ
+
+  /** @brief リセットが終わってからデバイスにアクセスするまでの時間（TRSTRCY） */
+  const unsigned long kResetRecoveryMs = 10;
+
+  /** @brief 待ち時間が過ぎるのを待っているハブ */
+  struct HubWait {
+    unsigned long timeout;
+    usb::HubDriver* hub;
+    uint8_t port_num;
+    int speed;
+  };
+
+  // ハブの処理はメインタスクで行うので，SleepMilliseconds で待つ代わりに
+  // タイマを登録し，通知を受け取ったら続きを行う．
+  std::vector<HubWait> hub_waits;
+}
+
+namespace usb {
+  HubDriver::HubDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  HubDriver::~HubDriver() {
+    hub_waits.erase(
+        std::remove_if(hub_waits.begin(), hub_waits.end(),
+                       [this](const HubWait& w) { return w.hub == this; }),
+        hub_waits.end());
+  }
+
+  void* HubDriver::operator new(size_t size) {
+    return AllocMem(sizeof(HubDriver), 64, 0);
+  }
+
+  void HubDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error HubDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+      ep_interrupt_in_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnEndpointsConfigured() {
+    // USB 3.x ハブは SuperSpeed 側と High Speed 側の 2 つのデバイスとして見える
+    super_speed_ = ParentDevice()->USBRelease() >= 0x0300;
+
+    const uint8_t desc_type =
+      super_speed_ ? HubDescriptor::kTypeSuperSpeed : HubDescriptor::kType;
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kDevice;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = static_cast<uint16_t>(desc_type) << 8;
+    setup_data.index = 0;
+    setup_data.length = desc_buf_.size();
+
+    initialize_phase_ = 1;
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     desc_buf_.data(), desc_buf_.size(), this);
+  }
+
+  Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    Log(kDebug, "HubDriver::OnControlCompleted: phase = %d, request = %d, len = %d\n",
+        initialize_phase_, setup_data.request, len);
+
+    if (initialize_phase_ == 1) {
+      auto desc = reinterpret_cast<const HubDescriptor*>(buf);
+      if (len < 7) {
+        return MAKE_ERROR(Error::kInvalidDescriptor);
+      }
+      num_ports_ = std::min<int>(desc->num_ports, kMaxPorts);
+      power_good_ms_ = 2ul * desc->power_on_to_power_good;
+      Log(kInfo, "HubDriver: %d ports%s\n", num_ports_, super_speed_ ? " (SuperSpeed)" : "");
+
+      // TT think time は High Speed ハブだけが持つ．Multi-TT の代替設定は使わない．
+      const uint8_t tt_think_time = (desc->hub_characteristics >> 5) & 0x3u;
+      if (auto err = ParentDevice()->ConfigureHub(
+            num_ports_, false, super_speed_ ? 0 : tt_think_time)) {
+        return err;
+      }
+
+      if (!super_speed_) {
+        return StartPorts();
+      }
+
+      SetupData depth_setup{};
+      depth_setup.request_type.bits.direction = request_type::kOut;
+      depth_setup.request_type.bits.type = request_type::kClass;
+      depth_setup.request_type.bits.recipient = request_type::kDevice;
+      depth_setup.request = hub_request::kSetHubDepth;
+      depth_setup.value = ParentDevice()->HubDepth();
+      depth_setup.index = 0;
+      depth_setup.length = 0;
+
+      initialize_phase_ = 2;
+      return ParentDevice()->ControlOut(kDefaultControlPipeID, depth_setup,
+                                        nullptr, 0, this);
+    } else if (initialize_phase_ == 2) {
+      return StartPorts();
+    } else if (initialize_phase_ == 3) {
+      if (!request_in_flight_ || requests_.empty()) {
+        return MAKE_ERROR(Error::kInvalidPhase);
+      }
+      const auto req = requests_.front();
+      requests_.pop_front();
+      request_in_flight_ = false;
+
+      if (req.request == request::kGetStatus) {
+        if (len < 4) {
+          return MAKE_ERROR(Error::kTransferFailed);
+        }
+        const uint16_t status = port_status_[0] | (port_status_[1] << 8);
+        const uint16_t change = port_status_[2] | (port_status_[3] << 8);
+        if (auto err = OnPortStatusReceived(req.port_num, status, change)) {
+          return err;
+        }
+      } else if (req.request == request::kSetFeature &&
+                 req.feature == hub_feature::kPortPower && req.port_num == num_ports_) {
+        if (auto err = OnPortsPowered()) {
+          return err;
+        }
+      }
+      return SendRequest();
+    }
+
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                     Error result) {
+    if (result) {
+      return result;
+    }
+    if (!ep_id.IsIn()) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    // ビット n が立っていればポート n の状態が変化した
+    for (int port_num = 1; port_num <= num_ports_; ++port_num) {
+      if (port_num / 8 < len && (change_bitmap_[port_num / 8] >> (port_num % 8)) & 1u) {
+        if (auto err = PushRequest(request::kGetStatus, 0, port_num)) {
+          return err;
+        }
+      }
+    }
+
+    return ParentDevice()->NormalIn(ep_interrupt_in_, change_bitmap_.data(),
+                                    (num_ports_ + 1 + 7) / 8);
+  }
+
+  Error HubDriver::ResetPort(uint8_t port_num) {
+    if (port_num == 0 || num_ports_ < port_num) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    port_states_[port_num] = PortState::kResetting;
+    return PushRequest(request::kSetFeature, hub_feature::kPortReset, port_num);
+  }
+
+  Error HubDriver::StartPorts() {
+    initialize_phase_ = 3;
+
+    // 給電を始めると，デバイスが繋がっているポートは状態変化として報告される．
+    // 最後のポートへの給電が終わったら OnPortsPowered で通知を待ち始める．
+    for (int port_num = 1; port_num <= num_ports_; ++port_num) {
+      if (auto err = PushRequest(request::kSetFeature, hub_feature::kPortPower, port_num)) {
+        return err;
+      }
+    }
+    if (num_ports_ == 0) {
+      return OnPortsPowered();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnPortsPowered() {
+    return WaitThen(power_good_ms_, 0, 0);
+  }
+
+  Error HubDriver::WaitThen(unsigned long msec, uint8_t port_num, int speed) {
+    if (msec == 0) {
+      return OnWaitFinished(port_num, speed);
+    }
+
+    // 現在のティックの途中から数え始めるので，1 ティック余分に待つ
+    const unsigned long ticks = (msec * kTimerFreq + 999) / 1000 + 1;
+    __asm__("cli");
+    const unsigned long timeout = timer_manager->CurrentTick() + ticks;
+    timer_manager->AddTimer(Timer{timeout, kUSBHubTimerValue});
+    __asm__("sti");
+    hub_waits.push_back(HubWait{timeout, this, port_num, speed});
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnWaitFinished(uint8_t port_num, int speed) {
+    if (port_num == 0) {
+      return ParentDevice()->NormalIn(ep_interrupt_in_, change_bitmap_.data(),
+                                      (num_ports_ + 1 + 7) / 8);
+    }
+    return ParentDevice()->OnHubPortReset(port_num, speed);
+  }
+
+  void HubDriver::OnTimerTimeout(unsigned long timeout) {
+    // 再開した処理が新たに待ちを登録することがあるので，先に取り出してから呼ぶ
+    std::vector<HubWait> expired;
+    auto it = std::partition(hub_waits.begin(), hub_waits.end(),
+                             [timeout](const HubWait& w) { return w.timeout > timeout; });
+    expired.assign(it, hub_waits.end());
+    hub_waits.erase(it, hub_waits.end());
+
+    for (const auto& w : expired) {
+      if (auto err = w.hub->OnWaitFinished(w.port_num, w.speed)) {
+        Log(kError, "HubDriver: failed to resume after waiting: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+    }
+  }
+
+  Error HubDriver::PushRequest(uint8_t request, uint16_t feature, uint8_t port_num) {
+    requests_.push_back(PortRequest{request, feature, port_num});
+    if (request_in_flight_) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return SendRequest();
+  }
+
+  Error HubDriver::SendRequest() {
+    if (requests_.empty()) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    const auto& req = requests_.front();
+
+    SetupData setup_data{};
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kOther;
+    setup_data.request = req.request;
+    setup_data.value = req.feature;
+    setup_data.index = req.port_num;
+
+    request_in_flight_ = true;
+    if (req.request == request::kGetStatus) {
+      setup_data.request_type.bits.direction = request_type::kIn;
+      setup_data.length = port_status_.size();
+      return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                       port_status_.data(), port_status_.size(), this);
+    }
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data,
+                                      nullptr, 0, this);
+  }
+
+  Error HubDriver::OnPortStatusReceived(uint8_t port_num, uint16_t status, uint16_t change) {
+    Log(kDebug, "HubDriver: port %d status %04x change %04x\n", port_num, status, change);
+
+    // 変化ビットはクリアしないと再び報告される
+    const std::array<std::pair<uint16_t, int>, 8> change_features{{
+      {kPortChangeConnection, hub_feature::kCPortConnection},
+      {kPortChangeEnable, hub_feature::kCPortEnable},
+      {kPortChangeSuspend, hub_feature::kCPortSuspend},
+      {kPortChangeOverCurrent, hub_feature::kCPortOverCurrent},
+      {kPortChangeReset, hub_feature::kCPortReset},
+      {kPortChangeBHReset, hub_feature::kCBHPortReset},
+      {kPortChangeLinkState, hub_feature::kCPortLinkState},
+      {kPortChangeConfigError, hub_feature::kCPortConfigError},
+    }};
+    for (auto [bit, feature] : change_features) {
+      if ((change & bit) == 0) {
+        continue;
+      }
+      const bool usb2_only = bit == kPortChangeEnable || bit == kPortChangeSuspend;
+      const bool usb3_only = bit == kPortChangeBHReset || bit == kPortChangeLinkState ||
+                             bit == kPortChangeConfigError;
+      if ((super_speed_ && usb2_only) || (!super_speed_ && usb3_only)) {
+        continue;
+      }
+      if (auto err = PushRequest(request::kClearFeature, feature, port_num)) {
+        return err;
+      }
+    }
+
+    auto& state = port_states_[port_num];
+    if (state == PortState::kResetting &&
+        (change & (kPortChangeReset | kPortChangeBHReset))) {
+      const bool enabled = status & kPortStatusEnable;
+      state = enabled ? PortState::kEnabled : PortState::kIdle;
+      if (enabled) {
+        return WaitThen(kResetRecoveryMs, port_num, PortSpeed(status));
+      }
+      return ParentDevice()->OnHubPortReset(port_num, 0);
+    }
+
+    if (change & kPortChangeConnection) {
+      if (status & kPortStatusConnection) {
+        if (state == PortState::kIdle) {
+          state = PortState::kWaitingReset;
+          return ParentDevice()->RequestHubPortReset(port_num, this);
+        }
+      } else {
+        Log(kInfo, "HubDriver: device on port %d has been disconnected\n", port_num);
+        const bool resetting = state == PortState::kResetting;
+        state = PortState::kIdle;
+        if (resetting) {
+          // 順番を次のポートに渡す
+          return ParentDevice()->OnHubPortReset(port_num, 0);
+        }
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  int HubDriver::PortSpeed(uint16_t status) const {
+    if (super_speed_) {
+      return xhci::kSuperSpeed;
+    } else if (status & kPortStatusHighSpeed) {
+      return xhci::kHighSpeed;
+    } else if (status & kPortStatusLowSpeed) {
+      return xhci::kLowSpeed;
+    }
+    return xhci::kFullSpeed;
+  }
+}
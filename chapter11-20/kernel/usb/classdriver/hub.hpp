@@ -0,0 +1,127 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * USB hub class driver.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  /** @brief ハブディスクリプタのうち USB 2.0 と USB 3.x で共通の部分 */
+  struct HubDescriptor {
+    static const uint8_t kType = 0x29;
+    static const uint8_t kTypeSuperSpeed = 0x2a;
+
+    uint8_t length;                 // offset 0
+    uint8_t descriptor_type;        // offset 1
+    uint8_t num_ports;              // offset 2
+    uint16_t hub_characteristics;   // offset 3
+    uint8_t power_on_to_power_good; // offset 5, 2ms 単位
+    uint8_t hub_control_current;    // offset 6
+  } __attribute__((packed));
+
+  namespace hub_request {
+    const int kSetHubDepth = 12;
+  }
+
+  /** @brief ハブクラスのフィーチャセレクタ */
+  namespace hub_feature {
+    const int kPortReset = 4;
+    const int kPortPower = 8;
+    const int kCPortConnection = 16;
+    const int kCPortEnable = 17;
+    const int kCPortSuspend = 18;
+    const int kCPortOverCurrent = 19;
+    const int kCPortReset = 20;
+    const int kCPortLinkState = 25;
+    const int kCPortConfigError = 26;
+    const int kCBHPortReset = 29;
+  }
+
+  class HubDriver : public ClassDriver {
+   public:
+    /** @brief 扱えるポートの最大数．ルートストリングの 1 段は 4 ビットなので 15 まで． */
+    static const int kMaxPorts = 15;
+
+    HubDriver(Device* dev, int interface_index);
+    ~HubDriver() override;
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                            Error result) override;
+
+    /** @brief ポート port_num をリセットする．
+     *
+     * Device::RequestHubPortReset で予約したリセットの順番が来たときに呼ばれる．
+     * リセットが終わると Device::OnHubPortReset で結果を伝える．
+     */
+    Error ResetPort(uint8_t port_num);
+
+    /** @brief 待ち時間が過ぎたハブの処理を再開する．
+     *
+     * メインタスクが kUSBHubTimerValue のタイマの通知を受け取ったときに呼ぶ．
+     */
+    static void OnTimerTimeout(unsigned long timeout);
+
+   private:
+    /** @brief ポートの状態 */
+    enum class PortState {
+      kIdle,         // 未接続，またはリセット前
+      kWaitingReset, // リセットの順番待ち
+      kResetting,    // リセット中
+      kEnabled,      // リセットが終わり，デバイスが使える
+    };
+
+    /** @brief 順に送信するポート宛てのリクエスト */
+    struct PortRequest {
+      uint8_t request; // kGetStatus, kSetFeature, kClearFeature のいずれか
+      uint16_t feature;
+      uint8_t port_num;
+    };
+
+    EndpointID ep_interrupt_in_;
+    const int interface_index_;
+    int initialize_phase_{0};
+    bool super_speed_{false};
+    uint8_t num_ports_{0};
+    /** @brief ポートに給電してから電源が安定するまでの時間 */
+    unsigned long power_good_ms_{0};
+
+    std::array<PortState, kMaxPorts + 1> port_states_{}; // index: port number
+    std::deque<PortRequest> requests_{};
+    /** @brief requests_ の先頭を送信済みで完了を待っているなら true */
+    bool request_in_flight_{false};
+
+    /** @brief 状態が変化したポートのビットマップ（ビット 0 はハブ自身） */
+    std::array<uint8_t, 4> change_bitmap_{};
+    /** @brief GET_STATUS の応答（wPortStatus, wPortChange） */
+    std::array<uint8_t, 4> port_status_{};
+    /** @brief ハブディスクリプタを受け取るバッファ */
+    std::array<uint8_t, 16> desc_buf_{};
+
+    Error StartPorts();
+    /** @brief すべてのポートへの給電が終わったら，電源が安定するのを待つ */
+    Error OnPortsPowered();
+    /** @brief msec ミリ秒後に OnWaitFinished(port_num, speed) を呼ぶよう予約する */
+    Error WaitThen(unsigned long msec, uint8_t port_num, int speed);
+    /** @brief 待ち時間が過ぎたら呼ばれる．port_num が 0 なら電源の安定を待っていた． */
+    Error OnWaitFinished(uint8_t port_num, int speed);
+    Error PushRequest(uint8_t request, uint16_t feature, uint8_t port_num);
+    Error SendRequest();
+    Error OnPortStatusReceived(uint8_t port_num, uint16_t status, uint16_t change);
+    int PortSpeed(uint16_t status) const;
+  };
+}
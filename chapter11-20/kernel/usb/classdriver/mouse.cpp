@@ -5,17 +5,63 @@
 #include "usb/device.hpp"
 #include "logger.hpp"
 
+namespace {
+  /** @brief 論理値 value を min 〜 max の範囲から 0 〜 range に写す */
+  int Normalize(int32_t value, int32_t min, int32_t max, int range) {
+    if (max <= min) {
+      return 0;
+    }
+    value = std::clamp(value, min, max);
+    return static_cast<int64_t>(value - min) * range / (static_cast<int64_t>(max) - min);
+  }
+}
+
 namespace usb {
-  HIDMouseDriver::HIDMouseDriver(Device* dev, int interface_index)
-      : HIDBaseDriver{dev, interface_index, 3} {
+  HIDMouseDriver::HIDMouseDriver(Device* dev, int interface_index, bool boot_interface)
+      : HIDBaseDriver{dev, interface_index, 3}, boot_interface_{boot_interface},
+        layout_{BootMouseLayout()} {
+    SelectProtocol(Protocol::kReport);
+  }
+
+  Error HIDMouseDriver::OnReportDescriptorReceived(const uint8_t* desc, int len) {
+    auto [ layout, err ] = ParseHIDPointerReport(desc, len);
+    if (err) {
+      if (!boot_interface_) {
+        // ポインタ以外の HID（キーボードやゲームパッドなど）なので何もしない
+        Log(kInfo, "HIDMouseDriver: no pointer in report descriptor (%d bytes), ignored\n", len);
+        SelectProtocol(Protocol::kNone);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      Log(kInfo, "HIDMouseDriver: falling back to boot protocol\n");
+      SelectProtocol(Protocol::kBoot);
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    layout_ = layout;
+    Log(kInfo, "HIDMouseDriver: %s, report id %d, wheel %s\n",
+        layout_.absolute ? "absolute" : "relative", layout_.report_id,
+        layout_.wheel.IsValid() ? "yes" : "no");
+    return MAKE_ERROR(Error::kSuccess);
   }
 
   Error HIDMouseDriver::OnDataReceived() {
-    uint8_t buttons = Buffer()[0];
-    int8_t displacement_x = Buffer()[1];
-    int8_t displacement_y = Buffer()[2];
-    NotifyMouseMove(buttons, displacement_x, displacement_y);
-    Log(kDebug, "%02x,(%3d,%3d)\n", buttons, displacement_x, displacement_y);
+    const uint8_t* report = Buffer().data();
+    if (layout_.report_id != 0 && report[0] != layout_.report_id) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const uint8_t buttons = layout_.buttons.Extract(report);
+    const int x = layout_.x.Extract(report);
+    const int y = layout_.y.Extract(report);
+    const int wheel = layout_.wheel.Extract(report);
+    if (layout_.absolute) {
+      NotifyAbsoluteMove(buttons,
+                         Normalize(x, layout_.x_min, layout_.x_max, kAbsoluteRange),
+                         Normalize(y, layout_.y_min, layout_.y_max, kAbsoluteRange),
+                         wheel);
+    } else {
+      NotifyMouseMove(buttons, x, y, wheel);
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -31,13 +77,23 @@ namespace usb {
     observers_[num_observers_++] = observer;
   }
 
+  void HIDMouseDriver::SubscribeAbsoluteMove(std::function<AbsoluteObserverType> observer) {
+    absolute_observers_[num_absolute_observers_++] = observer;
+  }
+
   std::function<HIDMouseDriver::ObserverType> HIDMouseDriver::default_observer;
+  std::function<HIDMouseDriver::AbsoluteObserverType> HIDMouseDriver::default_absolute_observer;
 
   void HIDMouseDriver::NotifyMouseMove(
-      uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+      uint8_t buttons, int displacement_x, int displacement_y, int wheel) {
     for (int i = 0; i < num_observers_; ++i) {
-      observers_[i](buttons, displacement_x, displacement_y);
+      observers_[i](buttons, displacement_x, displacement_y, wheel);
     }
   }
-}
 
+  void HIDMouseDriver::NotifyAbsoluteMove(uint8_t buttons, int x, int y, int wheel) {
+    for (int i = 0; i < num_absolute_observers_; ++i) {
+      absolute_observers_[i](buttons, x, y, wheel);
+    }
+  }
+}
@@ -8,25 +8,49 @@
 
 #include <functional>
 #include "usb/classdriver/hid.hpp"
+#include "usb/classdriver/hidreport.hpp"
 
 namespace usb {
+  /** @brief マウスとタブレットのドライバ．
+   *
+   * Report ディスクリプタからレポートの構成を求めてレポートプロトコルで動かす．
+   * 解析できなかった場合，ブートインターフェースであればブートプロトコルで動かし，
+   * そうでなければポインタではないとみなしてレポートを受け取らない．
+   */
   class HIDMouseDriver : public HIDBaseDriver {
    public:
-    HIDMouseDriver(Device* dev, int interface_index);
+    /** @brief 絶対位置を 0 〜 kAbsoluteRange に正規化して通知する */
+    static const int kAbsoluteRange = 0x8000;
+
+    HIDMouseDriver(Device* dev, int interface_index, bool boot_interface);
 
     void* operator new(size_t size);
     void operator delete(void* ptr) noexcept;
 
     Error OnDataReceived() override;
 
-    using ObserverType = void (uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    using ObserverType = void (uint8_t buttons, int displacement_x, int displacement_y, int wheel);
     void SubscribeMouseMove(std::function<ObserverType> observer);
     static std::function<ObserverType> default_observer;
 
+    /** @brief タブレットの入力．x, y は 0 〜 kAbsoluteRange に正規化した位置． */
+    using AbsoluteObserverType = void (uint8_t buttons, int x, int y, int wheel);
+    void SubscribeAbsoluteMove(std::function<AbsoluteObserverType> observer);
+    static std::function<AbsoluteObserverType> default_absolute_observer;
+
+   protected:
+    Error OnReportDescriptorReceived(const uint8_t* desc, int len) override;
+
    private:
+    const bool boot_interface_;
+    HIDPointerLayout layout_;
+
     std::array<std::function<ObserverType>, 4> observers_;
     int num_observers_ = 0;
+    std::array<std::function<AbsoluteObserverType>, 4> absolute_observers_;
+    int num_absolute_observers_ = 0;
 
-    void NotifyMouseMove(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    void NotifyMouseMove(uint8_t buttons, int displacement_x, int displacement_y, int wheel);
+    void NotifyAbsoluteMove(uint8_t buttons, int x, int y, int wheel);
   };
 }
@@ -0,0 +1,497 @@
+#include "usb/classdriver/msc.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "usb/memory.hpp"
+#include "usb/device.hpp"
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  uint32_t ReadBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+  }
+
+  void WriteBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+
+  void WriteBE16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+  }
+
+  /** @brief 要求の完了を待つ間隔．タイマ割り込みの周期より短くしても意味がない */
+  const unsigned long kPollIntervalMs = 1000 / kTimerFreq;
+  /** @brief 要求の完了を待つ最大の時間．リセットからの回復を含めても十分に長くとる． */
+  const unsigned long kRequestTimeoutMs = 10000;
+}
+
+namespace usb::msc {
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  void* MassStorageDriver::operator new(size_t size) {
+    return AllocMem(sizeof(MassStorageDriver), 64, 0);
+  }
+
+  void MassStorageDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = request::kGetMaxLUN;
+    setup_data.value = 0;
+    setup_data.index = interface_index_;
+    setup_data.length = 1;
+
+    initialize_phase_ = 1;
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     buf_.data(), 1, this);
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    Log(kDebug, "MassStorageDriver::OnControlCompleted: phase = %d, len = %d\n",
+        initialize_phase_, len);
+    if (reset_phase_ > 0) {
+      return ContinueResetRecovery();
+    }
+    if (initialize_phase_ == 1) {
+      max_lun_ = len >= 1 ? buf_[0] : 0;
+      initialize_phase_ = 2;
+      Log(kDebug, "MassStorageDriver: max LUN = %d\n", max_lun_);
+
+      if (auto err = Inquiry()) {
+        return err;
+      }
+      return ReadCapacity();
+    }
+
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                              Error result) {
+    if (reset_phase_ > 0) {
+      // 回復を始める前に積んだ転送の完了．要求は回復を終えてから完了させる
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (!in_flight_) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    const auto& req = queue_[queue_head_];
+
+    if (result) {
+      // STALL などで止まったエンドポイントは，リセットして回復させるまで使えない
+      Log(kWarn, "MassStorageDriver: command %02x failed on ep %d: %s\n",
+          req.cb[0], ep_id.Address(), result.Name());
+      return StartResetRecovery(result);
+    }
+
+    if (buf == &cbw_) {
+      return MAKE_ERROR(Error::kSuccess);
+    } else if (buf == &csw_) {
+      if (csw_.signature != CommandStatusWrapper::kSignature ||
+          csw_.tag != cbw_.tag) {
+        Log(kError, "MassStorageDriver: invalid CSW (sig %08x, tag %u)\n",
+            csw_.signature, csw_.tag);
+        return StartResetRecovery(MAKE_ERROR(Error::kTransferFailed));
+      }
+      if (csw_.status == 2) { // フェーズエラーからはリセットでしか戻れない
+        Log(kWarn, "MassStorageDriver: command %02x: phase error\n", req.cb[0]);
+        return StartResetRecovery(MAKE_ERROR(Error::kTransferFailed));
+      }
+      if (csw_.status != 0) {
+        Log(kDebug, "MassStorageDriver: command %02x failed: status %d\n",
+            req.cb[0], csw_.status);
+        return CompleteCommand(MAKE_ERROR(Error::kTransferFailed));
+      }
+      return CompleteCommand(MAKE_ERROR(Error::kSuccess));
+    } else if (req.num_segments > 0 && buf == req.segments[0].buf) {
+      data_transferred_ = len;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  Error MassStorageDriver::Read(uint32_t lba, uint16_t num_blocks, void* buf,
+                                std::function<CallbackType> callback) {
+    BufferSegment segment{buf, static_cast<int>(num_blocks * block_size_)};
+    return Read(lba, num_blocks, &segment, 1, callback);
+  }
+
+  Error MassStorageDriver::Write(uint32_t lba, uint16_t num_blocks, const void* buf,
+                                 std::function<CallbackType> callback) {
+    BufferSegment segment{const_cast<void*>(buf), static_cast<int>(num_blocks * block_size_)};
+    return Write(lba, num_blocks, &segment, 1, callback);
+  }
+
+  Error MassStorageDriver::Read(uint32_t lba, uint16_t num_blocks,
+                                const BufferSegment* segments, int num_segments,
+                                std::function<CallbackType> callback) {
+    return SubmitReadWrite(scsi::kRead10, lba, num_blocks,
+                           segments, num_segments, true, callback);
+  }
+
+  Error MassStorageDriver::Write(uint32_t lba, uint16_t num_blocks,
+                                 const BufferSegment* segments, int num_segments,
+                                 std::function<CallbackType> callback) {
+    return SubmitReadWrite(scsi::kWrite10, lba, num_blocks,
+                           segments, num_segments, false, callback);
+  }
+
+  Error MassStorageDriver::SubmitReadWrite(
+      uint8_t opcode, uint32_t lba, uint16_t num_blocks,
+      const BufferSegment* segments, int num_segments,
+      bool dir_in, std::function<CallbackType> callback) {
+    if (!IsReady()) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (num_segments <= 0 || kMaxSegments < num_segments) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    Request req{};
+    req.cb[0] = opcode;
+    WriteBE32(&req.cb[2], lba);
+    WriteBE16(&req.cb[7], num_blocks);
+    req.cb_length = 10;
+    std::copy_n(segments, num_segments, req.segments.begin());
+    req.num_segments = num_segments;
+    for (int i = 0; i < num_segments; ++i) {
+      req.len += segments[i].len;
+    }
+    if (req.len != num_blocks * block_size_) {
+      return MAKE_ERROR(Error::kBufferTooSmall);
+    }
+    req.dir_in = dir_in;
+    req.lba = lba;
+    req.callback = callback;
+    return Submit(req);
+  }
+
+  Error MassStorageDriver::Submit(const Request& req) {
+    if (queue_count_ == kQueueDepth) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    queue_[(queue_head_ + queue_count_) % kQueueDepth] = req;
+    ++queue_count_;
+    return StartNext();
+  }
+
+  Error MassStorageDriver::StartNext() {
+    if (in_flight_ || reset_phase_ > 0 || queue_count_ == 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (auto err = StartCommand()) {
+      // 途中まで積んだ転送が残っているかもしれないので，回復させてから失敗させる
+      Log(kWarn, "MassStorageDriver: failed to start command %02x: %s\n",
+          queue_[queue_head_].cb[0], err.Name());
+      return StartResetRecovery(err);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::StartCommand() {
+    const auto& req = queue_[queue_head_];
+
+    cbw_ = CommandBlockWrapper{};
+    cbw_.signature = CommandBlockWrapper::kSignature;
+    cbw_.tag = next_tag_++;
+    cbw_.data_transfer_length = req.len;
+    cbw_.flags = req.dir_in ? 0x80 : 0;
+    cbw_.lun = 0;
+    cbw_.cb_length = req.cb_length;
+    std::copy_n(req.cb.begin(), req.cb_length, cbw_.cb);
+    csw_ = CommandStatusWrapper{};
+    data_transferred_ = 0;
+    in_flight_ = true;
+
+    // CBW，データ，CSW の転送をまとめて積み，ドアベルはエンドポイントごとに 1 回だけ鳴らす．
+    // データが短く終わっても TD 単位で打ち切られるので，CSW は次の TD として受け取れる．
+    auto dev = ParentDevice();
+    BufferSegment cbw_segment{&cbw_, sizeof(cbw_)};
+    if (auto err = dev->QueueNormal(ep_bulk_out_, &cbw_segment, 1)) {
+      return err;
+    }
+    if (req.len > 0) {
+      const auto ep_data = req.dir_in ? ep_bulk_in_ : ep_bulk_out_;
+      if (auto err = dev->QueueNormal(ep_data, req.segments.data(), req.num_segments)) {
+        return err;
+      }
+    }
+    BufferSegment csw_segment{&csw_, sizeof(csw_)};
+    if (auto err = dev->QueueNormal(ep_bulk_in_, &csw_segment, 1)) {
+      return err;
+    }
+
+    if (auto err = dev->Commit(ep_bulk_out_)) {
+      return err;
+    }
+    return dev->Commit(ep_bulk_in_);
+  }
+
+  Error MassStorageDriver::CompleteCommand(Error err) {
+    auto req = queue_[queue_head_];
+    queue_[queue_head_].callback = nullptr;
+    queue_head_ = (queue_head_ + 1) % kQueueDepth;
+    --queue_count_;
+
+    // コールバック中に発行された要求は，in_flight_ を戻した後でここから開始する
+    if (req.callback) {
+      req.callback(err, req.lba, req.segments[0].buf, data_transferred_);
+    }
+
+    in_flight_ = false;
+    return StartNext();
+  }
+
+  Error MassStorageDriver::StartResetRecovery(Error cause) {
+    reset_error_ = cause;
+    reset_phase_ = 1;
+
+    // 積んだままの CBW，データ，CSW を捨て，ホスト側のデータトグルも初期化する
+    auto dev = ParentDevice();
+    for (auto ep_id : {ep_bulk_out_, ep_bulk_in_}) {
+      if (auto err = dev->ResetEndpoint(ep_id)) {
+        Log(kWarn, "MassStorageDriver: failed to reset ep %d: %s\n",
+            ep_id.Address(), err.Name());
+      }
+    }
+    return ContinueResetRecovery();
+  }
+
+  Error MassStorageDriver::ContinueResetRecovery() {
+    Error err = MAKE_ERROR(Error::kSuccess);
+    switch (reset_phase_++) {
+    case 1: {
+      SetupData setup_data{};
+      setup_data.request_type.bits.direction = request_type::kOut;
+      setup_data.request_type.bits.type = request_type::kClass;
+      setup_data.request_type.bits.recipient = request_type::kInterface;
+      setup_data.request = request::kBulkOnlyMassStorageReset;
+      setup_data.value = 0;
+      setup_data.index = interface_index_;
+      setup_data.length = 0;
+      err = ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data,
+                                       nullptr, 0, this);
+      break;
+    }
+    case 2:
+      err = ClearHalt(ep_bulk_in_);
+      break;
+    case 3:
+      err = ClearHalt(ep_bulk_out_);
+      break;
+    default:
+      reset_phase_ = 0;
+      return CompleteCommand(reset_error_);
+    }
+
+    if (err) {
+      Log(kError, "MassStorageDriver: reset recovery failed: %s\n", err.Name());
+      reset_phase_ = 0;
+      return CompleteCommand(reset_error_);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::ClearHalt(EndpointID ep_id) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kStandard;
+    setup_data.request_type.bits.recipient = request_type::kEndpoint;
+    setup_data.request = request::kClearFeature;
+    setup_data.value = 0; // ENDPOINT_HALT
+    setup_data.index = ep_id.Number() | (ep_id.IsIn() ? 0x80 : 0);
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data,
+                                      nullptr, 0, this);
+  }
+
+  Error MassStorageDriver::Inquiry() {
+    Request req{};
+    req.cb[0] = scsi::kInquiry;
+    req.cb[4] = 36;
+    req.cb_length = 6;
+    req.segments[0] = {buf_.data(), 36};
+    req.num_segments = 1;
+    req.len = 36;
+    req.dir_in = true;
+    req.callback = [this](Error err, uint32_t, void* buf, int len) {
+      if (err || len < 32) {
+        Log(kWarn, "MassStorageDriver: INQUIRY failed: %s\n", err.Name());
+        return;
+      }
+      auto p = reinterpret_cast<const char*>(buf);
+      Log(kInfo, "MassStorageDriver: %.8s %.16s\n", p + 8, p + 16);
+    };
+    return Submit(req);
+  }
+
+  Error MassStorageDriver::ReadCapacity() {
+    Request req{};
+    req.cb[0] = scsi::kReadCapacity10;
+    req.cb_length = 10;
+    req.segments[0] = {buf_.data(), 8};
+    req.num_segments = 1;
+    req.len = 8;
+    req.dir_in = true;
+    req.callback = [this](Error err, uint32_t, void* buf, int len) {
+      if (err || len < 8) {
+        // 接続直後は UNIT ATTENTION で失敗することがあるので，センスデータを読んでやり直す
+        if (++capacity_retry_ < 3) {
+          RequestSense();
+        } else {
+          Log(kError, "MassStorageDriver: READ CAPACITY failed: %s\n", err.Name());
+        }
+        return;
+      }
+      auto p = reinterpret_cast<const uint8_t*>(buf);
+      num_blocks_ = static_cast<uint64_t>(ReadBE32(p)) + 1;
+      block_size_ = ReadBE32(p + 4);
+      Log(kInfo, "MassStorageDriver: %lu blocks x %u bytes\n",
+          num_blocks_, block_size_);
+      if (driver == nullptr) {
+        driver = this;
+      }
+
+      auto blk = new BlockDevice{*this};
+      if (auto err = blk->Initialize()) {
+        Log(kError, "MassStorageDriver: failed to create block device: %s\n", err.Name());
+        delete blk;
+        return;
+      }
+      RegisterBlockDevice(blk);
+    };
+    return Submit(req);
+  }
+
+  Error MassStorageDriver::RequestSense() {
+    Request req{};
+    req.cb[0] = scsi::kRequestSense;
+    req.cb[4] = 18;
+    req.cb_length = 6;
+    req.segments[0] = {buf_.data(), 18};
+    req.num_segments = 1;
+    req.len = 18;
+    req.dir_in = true;
+    req.callback = [this](Error, uint32_t, void*, int) {
+      ReadCapacity();
+    };
+    return Submit(req);
+  }
+
+  BlockDevice::BlockDevice(MassStorageDriver& driver) : driver_{driver} {
+  }
+
+  Error BlockDevice::Initialize() {
+    if (driver_.BlockSize() == 0 || kBounceBytes < driver_.BlockSize()) {
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+    bounce_ = reinterpret_cast<uint8_t*>(AllocMem(kBounceBytes, 4096, 0));
+    if (bounce_ == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Read(uint64_t lba, size_t num_blocks, void* buf) {
+    if (lba + num_blocks > NumBlocks()) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    auto data = reinterpret_cast<uint8_t*>(buf);
+    const size_t max_blocks = kBounceBytes / BlockSize();
+    while (num_blocks > 0) {
+      const size_t n = std::min(num_blocks, max_blocks);
+      if (auto err = Submit(false, lba, n)) {
+        return err;
+      }
+      memcpy(data, bounce_, n * BlockSize());
+      lba += n;
+      data += n * BlockSize();
+      num_blocks -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Write(uint64_t lba, size_t num_blocks, const void* buf) {
+    if (lba + num_blocks > NumBlocks()) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    auto data = reinterpret_cast<const uint8_t*>(buf);
+    const size_t max_blocks = kBounceBytes / BlockSize();
+    while (num_blocks > 0) {
+      const size_t n = std::min(num_blocks, max_blocks);
+      memcpy(bounce_, data, n * BlockSize());
+      if (auto err = Submit(true, lba, n)) {
+        return err;
+      }
+      lba += n;
+      data += n * BlockSize();
+      num_blocks -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Submit(bool write, uint64_t lba, size_t num_blocks) {
+    if (abandoned_) {
+      // 見捨てた要求がまだバッファへ書き込むかもしれない
+      return MAKE_ERROR(Error::kTimeout);
+    }
+
+    const uint64_t sequence = sequence_ + 1;
+    auto callback = [this, sequence](Error err, uint32_t, void*, int) {
+      if (sequence == sequence_) {
+        result_ = err;
+        done_ = true;
+      }
+    };
+
+    // ドライバの状態はメインタスクのイベント処理と共有している
+    __asm__("cli");
+    sequence_ = sequence;
+    done_ = false;
+    auto err = write
+      ? driver_.Write(lba, num_blocks, bounce_, callback)
+      : driver_.Read(lba, num_blocks, bounce_, callback);
+    __asm__("sti");
+    if (err) {
+      return err;
+    }
+
+    for (unsigned long waited = 0; !done_; waited += kPollIntervalMs) {
+      if (waited >= kRequestTimeoutMs) {
+        Log(kError, "usb-msc: request at %lu timed out\n", lba);
+        abandoned_ = true;
+        return MAKE_ERROR(Error::kTimeout);
+      }
+      SleepMilliseconds(kPollIntervalMs);
+    }
+    return result_;
+  }
+}
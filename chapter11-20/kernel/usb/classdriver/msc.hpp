@@ -0,0 +1,210 @@
+/**
+ * @file usb/classdriver/msc.hpp
+ *
+ * USB mass storage class driver (Bulk-Only Transport + SCSI).
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include "block_device.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/device.hpp"
+
+namespace usb::msc {
+  /** @brief Command Block Wrapper．Bulk OUT エンドポイントへ送る 31 バイトの構造． */
+  struct CommandBlockWrapper {
+    static const uint32_t kSignature = 0x43425355; // "USBC"
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags; // bit 7: 1 = デバイスからホストへ
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /** @brief Command Status Wrapper．Bulk IN エンドポイントから返る 13 バイトの構造． */
+  struct CommandStatusWrapper {
+    static const uint32_t kSignature = 0x53425355; // "USBS"
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status; // 0: 成功, 1: 失敗, 2: フェーズエラー
+  } __attribute__((packed));
+
+  namespace scsi {
+    const uint8_t kTestUnitReady = 0x00;
+    const uint8_t kRequestSense = 0x03;
+    const uint8_t kInquiry = 0x12;
+    const uint8_t kReadCapacity10 = 0x25;
+    const uint8_t kRead10 = 0x28;
+    const uint8_t kWrite10 = 0x2a;
+  }
+
+  class MassStorageDriver : public ClassDriver {
+   public:
+    /** @brief 要求が完了したときに呼ばれる関数の型．
+     *
+     * len は実際に転送できたバイト数．
+     * 転送エラーで失敗した要求は，デバイスをリセットして回復させてから完了させる．
+     */
+    using CallbackType = void (Error err, uint32_t lba, void* buf, int len);
+
+    /** @brief 同時に受け付けられる要求の最大数 */
+    static const size_t kQueueDepth = 32;
+    /** @brief 1 つの要求に指定できるバッファ断片の最大数 */
+    static const int kMaxSegments = 8;
+
+    MassStorageDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                            Error result) override;
+
+    /** @brief lba から num_blocks ブロックを buf へ読み込む要求を発行する．
+     *
+     * 要求はキューに積まれ，完了すると callback が呼ばれる．
+     * buf は USB コントローラから DMA でアクセスできる領域でなければならない．
+     */
+    Error Read(uint32_t lba, uint16_t num_blocks, void* buf,
+               std::function<CallbackType> callback);
+
+    /** @brief buf の内容を lba から num_blocks ブロックへ書き込む要求を発行する． */
+    Error Write(uint32_t lba, uint16_t num_blocks, const void* buf,
+                std::function<CallbackType> callback);
+
+    /** @brief 複数のバッファ断片へ読み込む（スキャッタ）．
+     *
+     * 断片の合計は num_blocks * BlockSize() バイトでなければならない．
+     * callback の buf には segments[0].buf が渡される．
+     */
+    Error Read(uint32_t lba, uint16_t num_blocks,
+               const BufferSegment* segments, int num_segments,
+               std::function<CallbackType> callback);
+
+    /** @brief 複数のバッファ断片から書き込む（ギャザ）． */
+    Error Write(uint32_t lba, uint16_t num_blocks,
+                const BufferSegment* segments, int num_segments,
+                std::function<CallbackType> callback);
+
+    /** @brief 容量の取得が終わり，Read/Write を受け付けられるなら true */
+    bool IsReady() const { return block_size_ != 0; }
+    uint32_t BlockSize() const { return block_size_; }
+    uint64_t NumBlocks() const { return num_blocks_; }
+
+   private:
+    /** @brief キューに積まれた 1 つの SCSI コマンド */
+    struct Request {
+      std::array<uint8_t, 16> cb;
+      uint8_t cb_length;
+      std::array<BufferSegment, kMaxSegments> segments;
+      int num_segments;
+      int len;
+      bool dir_in;
+      uint32_t lba;
+      std::function<CallbackType> callback;
+    };
+
+    EndpointID ep_bulk_in_, ep_bulk_out_;
+    const int interface_index_;
+    int initialize_phase_{0};
+    uint8_t max_lun_{0};
+    uint32_t block_size_{0};
+    uint64_t num_blocks_{0};
+    int capacity_retry_{0};
+
+    std::array<Request, kQueueDepth> queue_{};
+    size_t queue_head_{0}, queue_count_{0};
+
+    /** @brief キュー先頭の要求をデバイスへ送出済みなら true */
+    bool in_flight_{false};
+    uint32_t next_tag_{1};
+    int data_transferred_{0};
+
+    /** @brief リセットからの回復（Reset Recovery）の段階．0 なら回復中でない．
+     *
+     * Bulk-Only Mass Storage Reset，Bulk IN と Bulk OUT の CLEAR_FEATURE(ENDPOINT_HALT)
+     * の順にコントロール転送を 1 つずつ出す．
+     */
+    int reset_phase_{0};
+    /** @brief 回復を終えたときに，キュー先頭の要求へ返すエラー */
+    Error reset_error_ = MAKE_ERROR(Error::kSuccess);
+
+    alignas(64) CommandBlockWrapper cbw_{};
+    alignas(64) CommandStatusWrapper csw_{};
+    /** @brief 初期化時の INQUIRY や READ CAPACITY などで使うバッファ */
+    alignas(64) std::array<uint8_t, 64> buf_{};
+
+    Error SubmitReadWrite(uint8_t opcode, uint32_t lba, uint16_t num_blocks,
+                          const BufferSegment* segments, int num_segments,
+                          bool dir_in, std::function<CallbackType> callback);
+    Error Submit(const Request& req);
+    /** @brief キュー先頭の要求を開始する．開始できなければ回復させてから失敗させる． */
+    Error StartNext();
+    Error StartCommand();
+    Error CompleteCommand(Error err);
+
+    /** @brief 積んだ転送を捨て，デバイスをリセットしてキュー先頭の要求を cause で失敗させる */
+    Error StartResetRecovery(Error cause);
+    /** @brief 回復の次の段階のコントロール転送を出す．終わったら要求を完了させる． */
+    Error ContinueResetRecovery();
+    Error ClearHalt(EndpointID ep_id);
+
+    Error Inquiry();
+    Error ReadCapacity();
+    Error RequestSense();
+  };
+
+  /** @brief 最初に見つかった大容量記憶装置のドライバ．なければ nullptr． */
+  inline MassStorageDriver* driver = nullptr;
+
+  /** @brief 大容量記憶装置をブロックデバイスとして使うためのアダプタ．
+   *
+   * 要求は USB コントローラが DMA できるバッファを経由して複製する．
+   * 完了はメインタスクのイベント処理で通知されるので，タスクを眠らせながら待つ．
+   * そのため Read / Write はメインタスク以外のタスクから呼ぶこと．
+   */
+  class BlockDevice : public ::BlockDevice {
+   public:
+    /** @brief 経由するバッファの大きさ．1 つの要求で読み書きする最大のバイト数． */
+    static const size_t kBounceBytes = 64 * 1024;
+
+    explicit BlockDevice(MassStorageDriver& driver);
+
+    /** @brief 経由するバッファを確保する */
+    Error Initialize();
+
+    const char* Name() const override { return "usb-msc"; }
+    size_t BlockSize() const override { return driver_.BlockSize(); }
+    uint64_t NumBlocks() const override { return driver_.NumBlocks(); }
+    Error Read(uint64_t lba, size_t num_blocks, void* buf) override;
+    Error Write(uint64_t lba, size_t num_blocks, const void* buf) override;
+
+   private:
+    MassStorageDriver& driver_;
+    uint8_t* bounce_{nullptr};
+
+    /** @brief 待っている要求の番号．時間切れで見捨てた要求の完了を区別する． */
+    volatile uint64_t sequence_{0};
+    volatile bool done_{false};
+    Error result_ = MAKE_ERROR(Error::kSuccess);
+    /** @brief 時間切れになった要求が経由するバッファを使っているかもしれないなら true */
+    bool abandoned_{false};
+
+    /** @brief 経由するバッファの先頭 num_blocks ブロックを読み書きする要求を出し，完了を待つ */
+    Error Submit(bool write, uint64_t lba, size_t num_blocks);
+  };
+}
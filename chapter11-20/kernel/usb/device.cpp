@@ -3,8 +3,11 @@
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/cdc.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/keyboard.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/msc.hpp"
 
 #include "logger.hpp"
 
@@ -55,20 +58,41 @@ namespace {
 
   usb::ClassDriver* NewClassDriver(usb::Device* dev, const usb::InterfaceDescriptor& if_desc) {
     if (if_desc.interface_class == 3 &&
-        if_desc.interface_sub_class == 1) {  // HID boot interface
-      if (if_desc.interface_protocol == 1) {  // keyboard
-        auto keyboard_driver = new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
-        if (usb::HIDKeyboardDriver::default_observer) {
-          keyboard_driver->SubscribeKeyPush(usb::HIDKeyboardDriver::default_observer);
-        }
-        return keyboard_driver;
-      } else if (if_desc.interface_protocol == 2) {  // mouse
-        auto mouse_driver = new usb::HIDMouseDriver{dev, if_desc.interface_number};
-        if (usb::HIDMouseDriver::default_observer) {
-          mouse_driver->SubscribeMouseMove(usb::HIDMouseDriver::default_observer);
-        }
-        return mouse_driver;
+        if_desc.interface_sub_class == 1 &&  // HID boot interface
+        if_desc.interface_protocol == 1) {  // keyboard
+      auto keyboard_driver = new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
+      if (usb::HIDKeyboardDriver::default_observer) {
+        keyboard_driver->SubscribeKeyPush(usb::HIDKeyboardDriver::default_observer);
+      }
+      return keyboard_driver;
+    } else if (if_desc.interface_class == 3 &&
+               ((if_desc.interface_sub_class == 1 &&
+                 if_desc.interface_protocol == 2) ||  // boot mouse
+                if_desc.interface_sub_class == 0)) {  // non-boot (e.g. tablet)
+      // 非ブートの HID がポインタかどうかは，HIDMouseDriver が Report ディスクリプタで判断する
+      auto mouse_driver = new usb::HIDMouseDriver{
+        dev, if_desc.interface_number, if_desc.interface_sub_class == 1};
+      if (usb::HIDMouseDriver::default_observer) {
+        mouse_driver->SubscribeMouseMove(usb::HIDMouseDriver::default_observer);
+      }
+      if (usb::HIDMouseDriver::default_absolute_observer) {
+        mouse_driver->SubscribeAbsoluteMove(usb::HIDMouseDriver::default_absolute_observer);
       }
+      return mouse_driver;
+    } else if (if_desc.interface_class == 8 &&
+               if_desc.interface_sub_class == 6 &&  // SCSI transparent command set
+               if_desc.interface_protocol == 0x50) {  // Bulk-Only Transport
+      return new usb::msc::MassStorageDriver{dev, if_desc.interface_number};
+    } else if (if_desc.interface_class == 9) {  // hub
+      return new usb::HubDriver{dev, if_desc.interface_number};
+    } else if (if_desc.interface_class == 2 &&
+               if_desc.interface_sub_class == 2) {  // CDC Abstract Control Model
+      return new usb::cdc::CDCDriver{
+        dev, if_desc.interface_number, usb::cdc::CDCDriver::Variant::kACM};
+    } else if (if_desc.interface_class == 0xff &&
+               dev->VendorID() == 0x0403) {  // FTDI USB serial converter
+      return new usb::cdc::CDCDriver{
+        dev, if_desc.interface_number, usb::cdc::CDCDriver::Variant::kFTDI};
     }
     return nullptr;
   }
@@ -120,14 +144,43 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::InterruptIn(EndpointID ep_id, void* buf, int len) {
+  Error Device::NormalIn(EndpointID ep_id, void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::NormalOut(EndpointID ep_id, const void* buf, int len) {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::InterruptOut(EndpointID ep_id, void* buf, int len) {
+  Error Device::QueueNormal(EndpointID ep_id,
+                            const BufferSegment* segments, int num_segments) {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::Commit(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::ConfigureHub(uint8_t num_ports, bool multi_tt, uint8_t tt_think_time) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  int Device::HubDepth() const {
+    return 0;
+  }
+
+  Error Device::RequestHubPortReset(uint8_t port_num, HubDriver* hub) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortReset(uint8_t port_num, int speed) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
   Error Device::StartInitialize() {
     is_initialized_ = false;
     initialize_phase_ = 1;
@@ -152,6 +205,8 @@ namespace usb {
         buf, len, setup_data.request_type.bits.direction);
     if (is_initialized_) {
       if (auto w = event_waiters_.Get(setup_data)) {
+        // 完了した要求の登録は消しておかないと，表が埋まって次の要求を登録できなくなる
+        event_waiters_.Delete(setup_data);
         return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
       }
       return MAKE_ERROR(Error::kNoWaiter);
@@ -180,10 +235,12 @@ namespace usb {
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
-  Error Device::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
-    Log(kDebug, "Device::OnInterruptCompleted: ep addr %d\n", ep_id.Address());
+  Error Device::OnNormalCompleted(EndpointID ep_id, const void* buf, int len,
+                                  Error result) {
+    Log(kDebug, "Device::OnNormalCompleted: ep addr %d, %s\n",
+        ep_id.Address(), result.Name());
     if (auto w = class_drivers_[ep_id.Number()]) {
-      return w->OnInterruptCompleted(ep_id, buf, len);
+      return w->OnNormalCompleted(ep_id, buf, len, result);
     }
     return MAKE_ERROR(Error::kNoWaiter);
   }
@@ -191,6 +248,9 @@ namespace usb {
   Error Device::InitializePhase1(const uint8_t* buf, int len) {
     const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
     num_configurations_ = device_desc->num_configurations;
+    usb_release_ = device_desc->usb_release;
+    vendor_id_ = device_desc->vendor_id;
+    product_id_ = device_desc->product_id;
     config_index_ = 0;
     initialize_phase_ = 2;
     Log(kDebug, "issuing GetDesc(Config): index=%d)\n", config_index_);
@@ -217,18 +277,39 @@ namespace usb {
       }
 
       num_ep_configs_ = 0;
+      auto read_endpoints = [&](int num_endpoints) {
+        num_endpoints += num_ep_configs_;
+        while (num_ep_configs_ < num_endpoints) {
+          auto desc = config_reader.Next();
+          if (desc == nullptr) {
+            return MAKE_ERROR(Error::kInvalidDescriptor);
+          }
+          if (auto ep_desc = DescriptorDynamicCast<EndpointDescriptor>(desc)) {
+            auto conf = MakeEPConfig(*ep_desc);
+            Log(kDebug, conf);
+
+            ep_configs_[num_ep_configs_] = conf;
+            ++num_ep_configs_;
+            class_drivers_[conf.ep_id.Number()] = class_driver;
+          } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
+            Log(kDebug, *hid_desc);
+          }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+      };
 
-      while (num_ep_configs_ < if_desc->num_endpoints) {
-        auto desc = config_reader.Next();
-        if (auto ep_desc = DescriptorDynamicCast<EndpointDescriptor>(desc)) {
-          auto conf = MakeEPConfig(*ep_desc);
-          Log(kDebug, conf);
-
-          ep_configs_[num_ep_configs_] = conf;
-          ++num_ep_configs_;
-          class_drivers_[conf.ep_id.Number()] = class_driver;
-        } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
-          Log(kDebug, *hid_desc);
+      if (auto err = read_endpoints(if_desc->num_endpoints)) {
+        return err;
+      }
+      if (if_desc->interface_class == 2) {
+        // CDC の通信インターフェースの後にはデータインターフェースが続き，
+        // そのバルクエンドポイントも同じクラスドライバが使う
+        if (auto data_if = config_reader.Next<InterfaceDescriptor>();
+            data_if && data_if->interface_class == 10) {
+          Log(kDebug, *data_if);
+          if (auto err = read_endpoints(data_if->num_endpoints)) {
+            return err;
+          }
         }
       }
 
@@ -15,6 +15,13 @@
 
 namespace usb {
   class ClassDriver;
+  class HubDriver;
+
+  /** @brief 転送に使うメモリ領域の 1 断片．スキャッタ・ギャザ転送で使う． */
+  struct BufferSegment {
+    void* buf;
+    int len;
+  };
 
   class Device {
    public:
@@ -23,8 +30,53 @@ namespace usb {
                             void* buf, int len, ClassDriver* issuer);
     virtual Error ControlOut(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len, ClassDriver* issuer);
-    virtual Error InterruptIn(EndpointID ep_id, void* buf, int len);
-    virtual Error InterruptOut(EndpointID ep_id, void* buf, int len);
+    virtual Error NormalIn(EndpointID ep_id, void* buf, int len);
+    virtual Error NormalOut(EndpointID ep_id, const void* buf, int len);
+
+    /** @brief segments を 1 つの転送としてエンドポイントのキューに積む．
+     *
+     * 転送は Commit を呼ぶまで開始されない．複数の転送を積んでから
+     * Commit を 1 回呼ぶことで，まとめて開始できる．
+     * 転送が完了すると，segments[0].buf と転送できた総バイト数で
+     * OnNormalCompleted が 1 回呼ばれる．転送が失敗した場合はエラーも渡される．
+     * 失敗したエンドポイントは止まったままになるので，ResetEndpoint で作り直す．
+     */
+    virtual Error QueueNormal(EndpointID ep_id,
+                              const BufferSegment* segments, int num_segments);
+
+    /** @brief QueueNormal で積んだ転送を開始する． */
+    virtual Error Commit(EndpointID ep_id);
+
+    /** @brief エンドポイントに積まれた転送を取り消し，データトグルを初期化して作り直す．
+     *
+     * デバイス側の Halt を解除する CLEAR_FEATURE(ENDPOINT_HALT) と組にして使う．
+     * 作り直しは非同期に進み，それまでに積んだ転送は捨てられる．
+     * 呼んだ後に積んだ転送は，作り直しが終わってから開始される．
+     */
+    virtual Error ResetEndpoint(EndpointID ep_id);
+
+    /** @brief このデバイスがハブであることをホストコントローラに伝える．
+     *
+     * @param tt_think_time  High Speed ハブの TT think time（ハブディスクリプタの値）
+     */
+    virtual Error ConfigureHub(uint8_t num_ports, bool multi_tt, uint8_t tt_think_time);
+
+    /** @brief ハブであるこのデバイスの階層．ルートハブに直接つながっていれば 0． */
+    virtual int HubDepth() const;
+
+    /** @brief ハブのポート port_num のリセットを予約する．
+     *
+     * リセットからアドレス割り当てまではバス全体で 1 ポートずつしか行えない．
+     * 順番が来ると hub->ResetPort(port_num) が呼ばれる．
+     */
+    virtual Error RequestHubPortReset(uint8_t port_num, HubDriver* hub);
+
+    /** @brief ハブのポート port_num のリセットが終わったことを伝える．
+     *
+     * speed は接続されたデバイスの速度（xHCI の Protocol Speed ID）．
+     * リセットに失敗したら 0 を渡す．いずれの場合も次のポートに順番が移る．
+     */
+    virtual Error OnHubPortReset(uint8_t port_num, int speed);
 
     Error StartInitialize();
     bool IsInitialized() { return is_initialized_; }
@@ -33,11 +85,15 @@ namespace usb {
     Error OnEndpointsConfigured();
 
     uint8_t* Buffer() { return buf_.data(); }
+    /** @brief デバイスディスクリプタの bcdUSB */
+    uint16_t USBRelease() const { return usb_release_; }
+    uint16_t VendorID() const { return vendor_id_; }
+    uint16_t ProductID() const { return product_id_; }
 
    protected:
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                              const void* buf, int len);
-    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnNormalCompleted(EndpointID ep_id, const void* buf, int len, Error result);
 
    private:
     /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -52,6 +108,8 @@ namespace usb {
     // following fields are used during initialization
     uint8_t num_configurations_;
     uint8_t config_index_;
+    uint16_t usb_release_{0};
+    uint16_t vendor_id_{0}, product_id_{0};
 
     Error OnDeviceDescriptorReceived(const uint8_t* buf, int len);
     Error OnConfigurationDescriptorReceived(const uint8_t* buf, int len);
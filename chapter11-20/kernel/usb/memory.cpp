@@ -1,43 +1,163 @@
 #include "usb/memory.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include <map>
 
 namespace {
-  template <class T>
-  T Ceil(T value, unsigned int alignment) {
-    return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
+  /** @brief 最小のサイズクラス（バイト）．xHCI の構造体が要求する 64 バイト整列を満たす． */
+  const size_t kMinBlockSize = 64;
+  /** @brief サイズクラスの数．64, 128, ..., 2048 バイト */
+  const int kNumSizeClasses = 6;
+  /** @brief フレームに割り当てた領域がサイズクラス用ではないことを表す */
+  const int kLargeBlock = -1;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  /** @brief フレームの用途 */
+  struct FrameInfo {
+    /** @brief 小さい領域用ならサイズクラスの番号，そうでなければ kLargeBlock */
+    int size_class;
+    /** @brief kLargeBlock の場合，この領域のフレーム数 */
+    size_t num_frames;
+    /** @brief 小さい領域用の場合，使用中のブロックの数．0 になったらフレームを返す． */
+    size_t num_used;
+  };
+
+  std::array<FreeBlock*, kNumSizeClasses> free_lists{};
+
+  /** @brief プールが使っているフレームの情報．キーはフレーム ID（大きな領域は先頭フレーム） */
+  std::map<size_t, FrameInfo> frame_info;
+
+  MemoryZone zone = MemoryZone::kNormal;
+
+  size_t RoundUpPow2(size_t value) {
+    size_t p = 1;
+    while (p < value) {
+      p <<= 1;
+    }
+    return p;
   }
 
-  template <class T, class U>
-  T MaskBits(T value, U mask) {
-    return value & ~static_cast<T>(mask - 1);
+  /** @brief 先頭アドレスが align の倍数となる num_frames 個の連続フレームを確保する．
+   *
+   * memory_manager は整列を指定できないので，多めに確保してから前後の余りを返す．
+   */
+  WithError<FrameID> AllocateAlignedFrames(size_t num_frames, size_t align) {
+    const size_t align_frames = std::max<size_t>(align / kBytesPerFrame, 1);
+    const size_t extra = align_frames - 1;
+    auto frames = memory_manager->Allocate(num_frames + extra, zone);
+    if (frames.error) {
+      return frames;
+    }
+
+    const size_t begin = frames.value.ID();
+    const size_t aligned = (begin + align_frames - 1) / align_frames * align_frames;
+    if (aligned > begin) {
+      memory_manager->Free(FrameID{begin}, aligned - begin);
+    }
+    const size_t tail = begin + num_frames + extra - (aligned + num_frames);
+    if (tail > 0) {
+      memory_manager->Free(FrameID{aligned + num_frames}, tail);
+    }
+    return {FrameID{aligned}, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  /** @brief サイズクラス size_class の空きリストに 1 フレーム分のブロックを補充する． */
+  bool RefillFreeList(int size_class) {
+    auto frame = memory_manager->Allocate(1, zone);
+    if (frame.error) {
+      return false;
+    }
+    frame_info[frame.value.ID()] = {size_class, 1, 0};
+
+    const size_t block_size = kMinBlockSize << size_class;
+    auto base = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    for (size_t offset = kBytesPerFrame; offset >= block_size; offset -= block_size) {
+      auto block = reinterpret_cast<FreeBlock*>(base + offset - block_size);
+      block->next = free_lists[size_class];
+      free_lists[size_class] = block;
+    }
+    return true;
+  }
+
+  /** @brief 全ブロックが空いたフレームのブロックを空きリストから外し，フレームを返す． */
+  void ReleaseFrame(size_t frame_id, int size_class) {
+    for (FreeBlock** p = &free_lists[size_class]; *p != nullptr;) {
+      if (reinterpret_cast<uintptr_t>(*p) / kBytesPerFrame == frame_id) {
+        *p = (*p)->next;
+      } else {
+        p = &(*p)->next;
+      }
+    }
+    memory_manager->Free(FrameID{frame_id}, 1);
   }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
-
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
-    }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    // ブロックを 2 のべき乗のサイズに切り上げ，そのサイズに整列させて配置すれば，
+    // size <= boundary である限り boundary を跨ぐことはない
+    size_t block_size = RoundUpPow2(std::max<size_t>({size, alignment, kMinBlockSize}));
+
+    if (block_size <= (kMinBlockSize << (kNumSizeClasses - 1))) {
+      int size_class = 0;
+      while ((kMinBlockSize << size_class) < block_size) {
+        ++size_class;
       }
+      if (free_lists[size_class] == nullptr && !RefillFreeList(size_class)) {
+        return nullptr;
+      }
+      auto block = free_lists[size_class];
+      free_lists[size_class] = block->next;
+      ++frame_info[reinterpret_cast<uintptr_t>(block) / kBytesPerFrame].num_used;
+      memset(block, 0, block_size);
+      return block;
     }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
+    const size_t num_frames = (size + kBytesPerFrame - 1) / kBytesPerFrame;
+    size_t align = std::max<size_t>(alignment, kBytesPerFrame);
+    if (boundary > 0 && size <= boundary) {
+      align = std::max(align, block_size);
+    }
+    auto frames = AllocateAlignedFrames(num_frames, align);
+    if (frames.error) {
       return nullptr;
     }
+    frame_info[frames.value.ID()] = {kLargeBlock, num_frames, 0};
+    memset(frames.value.Frame(), 0, num_frames * kBytesPerFrame);
+    return frames.value.Frame();
+  }
+
+  void FreeMem(void* p) {
+    if (p == nullptr) {
+      return;
+    }
+    auto it = frame_info.find(reinterpret_cast<uintptr_t>(p) / kBytesPerFrame);
+    if (it == frame_info.end()) {
+      return;
+    }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+    if (it->second.size_class == kLargeBlock) {
+      memory_manager->Free(FrameID{it->first}, it->second.num_frames);
+      frame_info.erase(it);
+      return;
+    }
+
+    auto block = reinterpret_cast<FreeBlock*>(p);
+    block->next = free_lists[it->second.size_class];
+    free_lists[it->second.size_class] = block;
+    if (--it->second.num_used == 0) {
+      ReleaseFrame(it->first, it->second.size_class);
+      frame_info.erase(it);
+    }
   }
 
-  void FreeMem(void* p) {}
+  void SetMemoryZone(MemoryZone value) {
+    zone = value;
+  }
 }
@@ -8,15 +8,19 @@
 
 #include <cstddef>
 
-namespace usb {
-  /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-  static const size_t kMemoryPoolSize = 4096 * 32;
+#include "memory_manager.hpp"
 
+namespace usb {
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
    *
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+   * 確保した領域は 0 で埋められている．
+   *
+   * 2KiB 以下の領域は 2 のべき乗のサイズクラスごとの空きリストから，
+   * それより大きい領域は memory_manager から直接フレーム単位で確保する．
+   * alignment と boundary は 2 のべき乗（または 0）でなければならない．
    *
    * @param size        確保するメモリ領域のサイズ（バイト単位）
    * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
@@ -31,9 +35,21 @@ namespace usb {
         AllocMem(sizeof(T) * num_obj, alignment, boundary));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する．
+   *
+   * 小さい領域はサイズクラスの空きリストに戻し，次の AllocMem で再利用する．
+   * その結果フレーム内のブロックがすべて空けば，フレームを memory_manager に返す．
+   * フレーム単位で確保した領域は memory_manager に返す．
+   */
   void FreeMem(void* p);
 
+  /** @brief AllocMem がフレームを確保するメモリゾーンを設定する．
+   *
+   * 64 ビットアドレスを扱えない xHC のために MemoryZone::kDMA32 を指定する．
+   * 最初の AllocMem より前に呼ばなければならない．
+   */
+  void SetMemoryZone(MemoryZone zone);
+
   /** @brief 標準コンテナ用のメモリアロケータ */
   template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096>
   class Allocator {
@@ -47,6 +47,15 @@ namespace usb {
     // HID class specific report values
     const int kGetReport = 1;
     const int kSetProtocol = 11;
+
+    // CDC class specific request values
+    const int kSetLineCoding = 0x20;
+    const int kGetLineCoding = 0x21;
+    const int kSetControlLineState = 0x22;
+
+    // Mass storage class specific request values
+    const int kGetMaxLUN = 254;
+    const int kBulkOnlyMassStorageReset = 255;
   }
 
   namespace descriptor_type {
@@ -62,6 +71,7 @@ namespace usb {
     const int kBOS = 15;
     const int kDeviceCapability = 16;
     const int kHID = 33;
+    const int kReport = 34;
     const int kSuperspeedUSBEndpointCompanion = 48;
     const int kSuperspeedPlusIsochronousEndpointCompanion = 49;
   }
@@ -1,14 +1,18 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
   using namespace usb::xhci;
 
-  SetupStageTRB MakeSetupStageTRB(usb::SetupData setup_data, int transfer_type) {
+  SetupStageTRB MakeSetupStageTRB(usb::SetupData setup_data, int transfer_type,
+                                  int interrupter_target) {
     SetupStageTRB setup{};
+    setup.bits.interrupter_target = interrupter_target;
     setup.bits.request_type = setup_data.request_type.data;
     setup.bits.request = setup_data.request;
     setup.bits.value = setup_data.value;
@@ -18,8 +22,10 @@ namespace {
     return setup;
   }
 
-  DataStageTRB MakeDataStageTRB(const void* buf, int len, bool dir_in) {
+  DataStageTRB MakeDataStageTRB(const void* buf, int len, bool dir_in,
+                                int interrupter_target) {
     DataStageTRB data{};
+    data.bits.interrupter_target = interrupter_target;
     data.SetPointer(buf);
     data.bits.trb_transfer_length = len;
     data.bits.td_size = 0;
@@ -27,6 +33,26 @@ namespace {
     return data;
   }
 
+  /** @brief 1 つの Normal TRB が跨いではいけない境界 */
+  const uintptr_t kTRBBoundary = 64 * 1024;
+
+  /** @brief buf から len バイトを転送するのに必要な Normal TRB の数 */
+  size_t CountNormalTRBs(const void* buf, int len) {
+    const auto begin = reinterpret_cast<uintptr_t>(buf);
+    if (len <= 0) {
+      return 1;
+    }
+    return (begin + len - 1) / kTRBBoundary - begin / kTRBBoundary + 1;
+  }
+
+  /** @brief TD Size：この TRB より後に残っているパケット数（最大 31） */
+  unsigned int TDSize(int remaining, int max_packet_size) {
+    if (max_packet_size == 0) {
+      return 0;
+    }
+    return std::min(31, (remaining + max_packet_size - 1) / max_packet_size);
+  }
+
   void Log(LogLevel level, const DataStageTRB& trb) {
     Log(level,
         "DataStageTRB: len %d, buf 0x%08lx, dir %d, attr 0x%02x\n",
@@ -94,11 +120,30 @@ namespace usb::xhci {
     state_ = State::kSlotAssigning;
   }
 
+  Device::~Device() {
+    for (auto tr : transfer_rings_) {
+      if (tr != nullptr) {
+        tr->~Ring();
+        FreeMem(tr);
+      }
+    }
+  }
+
   Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size) {
     int i = index.value - 1;
+    if (auto old_tr = transfer_rings_[i]) {
+      old_tr->~Ring();
+      FreeMem(old_tr);
+    }
+
     auto tr = AllocArray<Ring>(1, 64, 4096);
     if (tr) {
-      tr->Initialize(buf_size);
+      new(tr) Ring;
+      if (tr->Initialize(buf_size)) {
+        tr->~Ring();
+        FreeMem(tr);
+        tr = nullptr;
+      }
     }
     transfer_rings_[i] = tr;
     return tr;
@@ -124,29 +169,33 @@ namespace usb::xhci {
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
+    if (auto err = tr->Reserve(3)) {
+      return err;
+    }
 
     auto status = StatusStageTRB{};
+    status.bits.interrupter_target = interrupter_target_;
 
     if (buf) {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-            MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage)));
-      auto data = MakeDataStageTRB(buf, len, true);
+            MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage, interrupter_target_)));
+      auto data = MakeDataStageTRB(buf, len, true, interrupter_target_);
       data.bits.interrupt_on_completion = true;
       auto data_trb_position = tr->Push(data);
       tr->Push(status);
 
-      setup_stage_map_.Put(data_trb_position, setup_trb_position);
+      tr->SetContext(data_trb_position, setup_trb_position);
     } else {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-            MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
+            MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage, interrupter_target_)));
       status.bits.direction = true;
       status.bits.interrupt_on_completion = true;
       auto status_trb_position = tr->Push(status);
 
-      setup_stage_map_.Put(status_trb_position, setup_trb_position);
+      tr->SetContext(status_trb_position, setup_trb_position);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -171,87 +220,295 @@ namespace usb::xhci {
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
+    if (auto err = tr->Reserve(3)) {
+      return err;
+    }
 
     auto status = StatusStageTRB{};
+    status.bits.interrupter_target = interrupter_target_;
     status.bits.direction = true;
 
     if (buf) {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-            MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage)));
-      auto data = MakeDataStageTRB(buf, len, false);
+            MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage, interrupter_target_)));
+      auto data = MakeDataStageTRB(buf, len, false, interrupter_target_);
       data.bits.interrupt_on_completion = true;
       auto data_trb_position = tr->Push(data);
       tr->Push(status);
 
-      setup_stage_map_.Put(data_trb_position, setup_trb_position);
+      tr->SetContext(data_trb_position, setup_trb_position);
     } else {
       auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-            MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
+            MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage, interrupter_target_)));
       status.bits.interrupt_on_completion = true;
       auto status_trb_position = tr->Push(status);
 
-      setup_stage_map_.Put(status_trb_position, setup_trb_position);
+      tr->SetContext(status_trb_position, setup_trb_position);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::InterruptIn(EndpointID ep_id, void* buf, int len) {
-    if (auto err = usb::Device::InterruptIn(ep_id, buf, len)) {
+  Error Device::NormalIn(EndpointID ep_id, void* buf, int len) {
+    if (auto err = usb::Device::NormalIn(ep_id, buf, len)) {
+      return err;
+    }
+    BufferSegment segment{buf, len};
+    if (auto err = QueueNormal(ep_id, &segment, 1)) {
       return err;
     }
+    return Commit(ep_id);
+  }
 
-    const DeviceContextIndex dci{ep_id};
+  Error Device::NormalOut(EndpointID ep_id, const void* buf, int len) {
+    if (auto err = usb::Device::NormalOut(ep_id, buf, len)) {
+      return err;
+    }
+    BufferSegment segment{const_cast<void*>(buf), len};
+    if (auto err = QueueNormal(ep_id, &segment, 1)) {
+      return err;
+    }
+    return Commit(ep_id);
+  }
 
-    Ring* tr = transfer_rings_[dci.value - 1];
+  Error Device::QueueNormal(EndpointID ep_id,
+                            const BufferSegment* segments, int num_segments) {
+    if (auto err = usb::Device::QueueNormal(ep_id, segments, num_segments)) {
+      return err;
+    }
+    if (num_segments <= 0) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
 
+    const DeviceContextIndex dci{ep_id};
+    Ring* tr = transfer_rings_[dci.value - 1];
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
 
-    NormalTRB normal{};
-    normal.SetPointer(buf);
-    normal.bits.trb_transfer_length = len;
-    normal.bits.interrupt_on_short_packet = true;
-    normal.bits.interrupt_on_completion = true;
+    int total_len = 0;
+    size_t num_trbs = 1; // Event Data TRB
+    for (int i = 0; i < num_segments; ++i) {
+      total_len += segments[i].len;
+      num_trbs += CountNormalTRBs(segments[i].buf, segments[i].len);
+    }
+    if (auto err = tr->Reserve(num_trbs)) {
+      return err;
+    }
+
+    const int max_packet_size = ctx_.ep_contexts[dci.value - 1].bits.max_packet_size;
+    int remaining = total_len;
+    TRB* first_trb = nullptr;
+    for (int i = 0; i < num_segments; ++i) {
+      auto p = reinterpret_cast<uint8_t*>(segments[i].buf);
+      int len = segments[i].len;
+      do {
+        const auto addr = reinterpret_cast<uintptr_t>(p);
+        const int trb_len = std::min<int>(len, kTRBBoundary - addr % kTRBBoundary);
+        remaining -= trb_len;
+
+        NormalTRB normal{};
+        normal.SetPointer(p);
+        normal.bits.trb_transfer_length = trb_len;
+        normal.bits.td_size = TDSize(remaining, max_packet_size);
+        normal.bits.chain_bit = true;
+        normal.bits.interrupter_target = interrupter_target_;
+        auto trb = tr->Push(normal);
+        if (first_trb == nullptr) {
+          first_trb = trb;
+        }
+
+        p += trb_len;
+        len -= trb_len;
+      } while (len > 0);
+    }
 
-    tr->Push(normal);
-    dbreg_->Ring(dci.value);
+    // 完了は TD 末尾の Event Data TRB でだけ通知させる．
+    // ショートパケットで TD が打ち切られても，この TRB のイベントは発生する．
+    // イベントには TD 先頭の TRB を載せ，そこからバッファと TD の範囲を求める．
+    EventDataTRB event_data{};
+    event_data.SetPointer(first_trb);
+    event_data.bits.interrupt_on_completion = true;
+    event_data.bits.interrupter_target = interrupter_target_;
+    tr->Push(event_data);
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::Commit(EndpointID ep_id) {
+    if (auto err = usb::Device::Commit(ep_id)) {
+      return err;
+    }
+    const DeviceContextIndex dci{ep_id};
+    if (transfer_rings_[dci.value - 1] == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+    RingDoorbell(dci);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id) {
+    const DeviceContextIndex dci{ep_id};
+    if (dci.value <= 1) {
+      return MAKE_ERROR(Error::kInvalidEndpointNumber);
+    }
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    const uint32_t bit = 1u << dci.value;
+    if ((ep_stopping_ | ep_stopped_ | ep_reconfiguring_) & bit) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    reset_points_[dci.value - 1] = {tr->EnqueuePointer(), tr->CycleBit()};
+    ep_stopping_ |= bit;
+    if (auto err = StopEndpoint(*controller, *this, dci)) {
+      ep_stopping_ &= ~bit;
+      return err;
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::InterruptOut(EndpointID ep_id, void* buf, int len) {
-    if (auto err = usb::Device::InterruptOut(ep_id, buf, len)) {
+  Error Device::OnEndpointStopped(DeviceContextIndex dci) {
+    const uint32_t bit = 1u << dci.value;
+    if ((ep_stopping_ & bit) == 0) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (ctx_.ep_contexts[dci.value - 1].bits.ep_state == 2) {
+      // Stop Endpoint が実行される前にエラーで止まっていたので，Reset Endpoint で止め直す
+      return StopEndpoint(*controller, *this, dci);
+    }
+
+    ep_stopping_ &= ~bit;
+    ep_stopped_ |= bit;
+    if (ep_stopping_ != 0 || ep_reconfiguring_ != 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return StartReconfigure();
+  }
+
+  Error Device::StartReconfigure() {
+    const uint32_t mask = ep_stopped_;
+    for (int i = 0; i < 31; ++i) {
+      if ((mask >> (i + 1)) & 1u) {
+        // 入力コンテキストには ConfigureEndpoints で設定した内容が残っている
+        auto& ep_ctx = input_ctx_.ep_contexts[i];
+        ep_ctx.SetTransferRingBuffer(reset_points_[i].dequeue);
+        ep_ctx.bits.dequeue_cycle_state = reset_points_[i].cycle_bit;
+      }
+    }
+
+    ep_stopped_ = 0;
+    ep_reconfiguring_ = mask;
+    if (auto err = ReconfigureEndpoints(*controller, *this, mask)) {
+      ep_reconfiguring_ = 0;
+      ep_stopped_ = mask;
       return err;
     }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::OnEndpointsReconfigured() {
+    const uint32_t mask = ep_reconfiguring_;
+    ep_reconfiguring_ = 0;
+    for (int i = 0; i < 31; ++i) {
+      const uint32_t bit = 1u << (i + 1);
+      if ((mask & bit) == 0) {
+        continue;
+      }
+      transfer_rings_[i]->SkipTo(reset_points_[i].dequeue);
+      if (doorbell_deferred_ & bit) {
+        doorbell_deferred_ &= ~bit;
+        dbreg_->Ring(i + 1);
+      }
+    }
 
-    Log(kDebug, "Device::InterrutpOut: ep addr %d, buf %08lx, len %d, dev %08lx\n",
-        ep_id.Address(), buf, len, this);
-    return MAKE_ERROR(Error::kNotImplemented);
+    // 作り直している間に止め終わったエンドポイント
+    if (ep_stopped_ != 0 && ep_stopping_ == 0) {
+      return StartReconfigure();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Device::RingDoorbell(DeviceContextIndex dci) {
+    const uint32_t bit = 1u << dci.value;
+    if ((ep_stopping_ | ep_stopped_ | ep_reconfiguring_) & bit) {
+      doorbell_deferred_ |= bit;
+      return;
+    }
+    dbreg_->Ring(dci.value);
+  }
+
+  Error Device::ConfigureHub(uint8_t num_ports, bool multi_tt, uint8_t tt_think_time) {
+    return usb::xhci::ConfigureHub(*controller, *this, num_ports, multi_tt, tt_think_time);
+  }
+
+  int Device::HubDepth() const {
+    return RouteStringDepth(ctx_.slot_context.bits.route_string);
+  }
+
+  Error Device::RequestHubPortReset(uint8_t port_num, HubDriver* hub) {
+    return usb::xhci::RequestHubPortReset(*controller, slot_id_, port_num, hub);
+  }
+
+  Error Device::OnHubPortReset(uint8_t port_num, int speed) {
+    return usb::xhci::OnHubPortReset(*controller, slot_id_, port_num, speed);
   }
 
   Error Device::OnTransferEventReceived(const TransferEventTRB& trb) {
     const auto residual_length = trb.bits.trb_transfer_length;
+    const auto completion_code = trb.bits.completion_code;
 
-    if (trb.bits.completion_code != 1 /* Success */ &&
-        trb.bits.completion_code != 13 /* Short Packet */) {
+    if (completion_code == 26 /* Stopped */ ||
+        completion_code == 27 /* Stopped - Length Invalid */ ||
+        completion_code == 28 /* Stopped - Short Packet */) {
+      // ResetEndpoint で止めた転送．TD は作り直すときにまとめて捨てる
       Log(kDebug, trb);
-      return MAKE_ERROR(Error::kTransferFailed);
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Ring* tr = transfer_rings_[DeviceContextIndex{trb.EndpointID()}.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    if (completion_code != 1 /* Success */ &&
+        completion_code != 13 /* Short Packet */) {
+      Log(kWarn, trb);
+      return OnTransferFailed(trb, *tr);
     }
     Log(kDebug, trb);
 
+    if (trb.bits.event_data) {
+      // Event Data TRB の場合，転送長の欄は TD 全体で転送できたバイト数（EDTLA）
+      auto first_trb = TRBDynamicCast<NormalTRB>(trb.Pointer());
+      if (first_trb == nullptr) {
+        return MAKE_ERROR(Error::kNotImplemented);
+      }
+      void* buf = first_trb->Pointer();
+      tr->Complete(tr->EndOfTD(trb.Pointer()));
+      return this->OnNormalCompleted(
+          trb.EndpointID(), buf, trb.bits.trb_transfer_length,
+          MAKE_ERROR(Error::kSuccess));
+    }
+
     TRB* issuer_trb = trb.Pointer();
+    tr->Complete(issuer_trb);
     if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
       const auto transfer_length =
         normal_trb->bits.trb_transfer_length - residual_length;
-      return this->OnInterruptCompleted(
-          trb.EndpointID(), normal_trb->Pointer(), transfer_length);
+      return this->OnNormalCompleted(
+          trb.EndpointID(), normal_trb->Pointer(), transfer_length,
+          MAKE_ERROR(Error::kSuccess));
     }
 
-    auto opt_setup_stage_trb = setup_stage_map_.Get(issuer_trb);
-    if (!opt_setup_stage_trb) {
+    // コントロール転送では，完了を通知する TRB に SetupStageTRB を記録してある
+    auto setup_stage_trb =
+      reinterpret_cast<const SetupStageTRB*>(tr->TakeContext(issuer_trb));
+    if (setup_stage_trb == nullptr) {
       Log(kDebug, "No Corresponding Setup Stage for issuer %s\n",
           kTRBTypeToName[issuer_trb->bits.trb_type]);
       if (auto data_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
@@ -259,9 +516,6 @@ namespace usb::xhci {
       }
       return MAKE_ERROR(Error::kNoCorrespondingSetupStage);
     }
-    setup_stage_map_.Delete(issuer_trb);
-
-    auto setup_stage_trb = opt_setup_stage_trb.value();
     SetupData setup_data{};
     setup_data.request_type.data = setup_stage_trb->bits.request_type;
     setup_data.request = setup_stage_trb->bits.request;
@@ -283,4 +537,30 @@ namespace usb::xhci {
     return this->OnControlCompleted(
         trb.EndpointID(), setup_data, data_stage_buffer, transfer_length);
   }
+
+  Error Device::OnTransferFailed(const TransferEventTRB& trb, Ring& tr) {
+    const auto result = MAKE_ERROR(Error::kTransferFailed);
+    TRB* issuer_trb = trb.Pointer();
+
+    // Normal 転送の TD は先頭の TRB からバッファを，末尾の Event Data TRB から範囲を求める．
+    // 途中の TRB で失敗した場合，末尾の Event Data TRB が先頭の TRB を指している．
+    NormalTRB* first_trb = nullptr;
+    if (trb.bits.event_data) {
+      first_trb = TRBDynamicCast<NormalTRB>(issuer_trb);
+    } else if (TRBDynamicCast<NormalTRB>(issuer_trb)) {
+      if (auto event_data = TRBDynamicCast<EventDataTRB>(tr.EndOfTD(issuer_trb))) {
+        first_trb = TRBDynamicCast<NormalTRB>(reinterpret_cast<TRB*>(event_data->Pointer()));
+      }
+    }
+    if (first_trb) {
+      void* buf = first_trb->Pointer();
+      tr.Complete(tr.EndOfTD(reinterpret_cast<TRB*>(first_trb)));
+      return this->OnNormalCompleted(trb.EndpointID(), buf, 0, result);
+    }
+
+    // コントロール転送の残りのステージは，エンドポイントを作り直すまでリングに残る
+    tr.Complete(issuer_trb);
+    tr.TakeContext(issuer_trb);
+    return result;
+  }
 }
@@ -11,7 +11,6 @@
 
 #include "error.hpp"
 #include "usb/device.hpp"
-#include "usb/arraymap.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/trb.hpp"
 #include "usb/xhci/registers.hpp"
@@ -34,6 +33,7 @@ namespace usb::xhci {
         TRB* issue_trb);
 
     Device(uint8_t slot_id, DoorbellRegister* dbreg);
+    ~Device() override;
 
     Error Initialize();
 
@@ -46,16 +46,35 @@ namespace usb::xhci {
     uint8_t SlotID() const { return slot_id_; }
 
     void SelectForSlotAssignment();
+    /** @brief このデバイスの転送イベントを受け取るインタラプタを設定する． */
+    void SetInterrupterTarget(int interrupter) { interrupter_target_ = interrupter; }
     Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size);
 
     Error ControlIn(EndpointID ep_id, SetupData setup_data,
                     void* buf, int len, ClassDriver* issuer) override;
     Error ControlOut(EndpointID ep_id, SetupData setup_data,
                      const void* buf, int len, ClassDriver* issuer) override;
-    Error InterruptIn(EndpointID ep_id, void* buf, int len) override;
-    Error InterruptOut(EndpointID ep_id, void* buf, int len) override;
+    Error NormalIn(EndpointID ep_id, void* buf, int len) override;
+    Error NormalOut(EndpointID ep_id, const void* buf, int len) override;
+    Error QueueNormal(EndpointID ep_id,
+                      const BufferSegment* segments, int num_segments) override;
+    Error Commit(EndpointID ep_id) override;
+    /** @brief Stop Endpoint（Halted なら Reset Endpoint）で止めてから Configure Endpoint で作り直す．
+     *
+     * 作り直しの途中で同じエンドポイントについて呼んでも何もしない．
+     * デフォルトコントロールパイプは作り直せない．
+     */
+    Error ResetEndpoint(EndpointID ep_id) override;
+    Error ConfigureHub(uint8_t num_ports, bool multi_tt, uint8_t tt_think_time) override;
+    int HubDepth() const override;
+    Error RequestHubPortReset(uint8_t port_num, HubDriver* hub) override;
+    Error OnHubPortReset(uint8_t port_num, int speed) override;
 
     Error OnTransferEventReceived(const TransferEventTRB& trb);
+    /** @brief Stop Endpoint / Reset Endpoint コマンドの完了を受け取る */
+    Error OnEndpointStopped(DeviceContextIndex dci);
+    /** @brief ReconfigureEndpoints で発行した Configure Endpoint コマンドの完了を受け取る */
+    Error OnEndpointsReconfigured();
 
    private:
     alignas(64) struct DeviceContext ctx_;
@@ -65,12 +84,30 @@ namespace usb::xhci {
     DoorbellRegister* const dbreg_;
 
     enum State state_;
-    std::array<Ring*, 31> transfer_rings_; // index = dci - 1
+    int interrupter_target_{0};
+    std::array<Ring*, 31> transfer_rings_{}; // index = dci - 1
 
-    /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
-     * から対応する SetupStageTRB を検索するためのマップ．
+    /* ResetEndpoint の進み具合．ビット n が DCI n のエンドポイントを表す．
+     * 止めるコマンドの完了待ち（stopping）→ 作り直し待ち（stopped）→
+     * Configure Endpoint の完了待ち（reconfiguring）の順に進む．
+     * 止め終わったものはまとめて 1 つの Configure Endpoint で作り直す．
      */
-    ArrayMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
+    uint32_t ep_stopping_{0}, ep_stopped_{0}, ep_reconfiguring_{0};
+    /** @brief 作り直している間に鳴らせなかったドアベル */
+    uint32_t doorbell_deferred_{0};
+    /** @brief 作り直した後のデキュー位置．ResetEndpoint を呼んだときのエンキュー位置． */
+    struct ResetPoint {
+      TRB* dequeue;
+      bool cycle_bit;
+    };
+    std::array<ResetPoint, 31> reset_points_{}; // index = dci - 1
+
+    /** @brief ドアベルを鳴らす．作り直し中のエンドポイントなら，作り直すまで遅らせる． */
+    void RingDoorbell(DeviceContextIndex dci);
+    /** @brief 止め終わったエンドポイントをまとめて作り直す */
+    Error StartReconfigure();
+    /** @brief 失敗した転送の TD を回収し，クラスドライバにエラーを伝える */
+    Error OnTransferFailed(const TransferEventTRB& trb, Ring& tr);
 
     //usb::Device* usb_device_;
   };
@@ -93,6 +93,9 @@ namespace usb::xhci {
 
   Error DeviceManager::Remove(uint8_t slot_id) {
     device_context_pointers_[slot_id] = nullptr;
+    if (devices_[slot_id] != nullptr) {
+      devices_[slot_id]->~Device();
+    }
     FreeMem(devices_[slot_id]);
     devices_[slot_id] = nullptr;
     return MAKE_ERROR(Error::kSuccess);
@@ -3,88 +3,251 @@
 #include <cstring>
 #include "usb/memory.hpp"
 
+namespace {
+  using namespace usb::xhci;
+
+  size_t RoundUpPow2(size_t value) {
+    size_t p = 1;
+    while (p < value) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  /** @brief 0 で埋めた TRB の配列を確保する．cycle_bit が真なら全 TRB の cycle bit を立てる．
+   *
+   * 領域は TRB の配列とそれに続く要求情報の配列からなり，先頭は seg_bytes に整列する．
+   */
+  TRB* AllocSegment(size_t buf_size, size_t seg_bytes, bool cycle_bit) {
+    auto seg = reinterpret_cast<TRB*>(usb::AllocMem(seg_bytes, seg_bytes, 64 * 1024));
+    if (seg == nullptr) {
+      return nullptr;
+    }
+    memset(seg, 0, seg_bytes);
+    if (cycle_bit) {
+      for (size_t i = 0; i < buf_size; ++i) {
+        seg[i].bits.cycle_bit = 1;
+      }
+    }
+    return seg;
+  }
+}
+
 namespace usb::xhci {
   Ring::~Ring() {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    for (size_t i = 0; i < num_segments_; ++i) {
+      FreeMem(segments_[i]);
     }
   }
 
   Error Ring::Initialize(size_t buf_size) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    for (size_t i = 0; i < num_segments_; ++i) {
+      FreeMem(segments_[i]);
     }
 
     cycle_bit_ = true;
+    write_segment_ = 0;
     write_index_ = 0;
     buf_size_ = buf_size;
+    num_segments_ = 0;
+    num_used_ = 0;
+    segment_bytes_ = RoundUpPow2(buf_size_ * (sizeof(TRB) + sizeof(const void*)));
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
+    segments_[0] = AllocSegment(buf_size_, segment_bytes_, false);
+    if (segments_[0] == nullptr) {
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
+    num_segments_ = 1;
+    dequeue_ = segments_[0];
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
 
+  Error Ring::Reserve(size_t num_trbs) {
+    while (NumFree() < num_trbs) {
+      // デキュー位置が同じセグメントの先にあると，間にセグメントを挿入しても
+      // エンキュー位置はデキュー位置を追い越せないので空きは増えない
+      const TRB* write_ptr = &segments_[write_segment_][write_index_];
+      if (num_used_ > 0 && SegmentOf(dequeue_) == write_segment_ && write_ptr < dequeue_) {
+        return MAKE_ERROR(Error::kFull);
+      }
+      if (auto err = Grow()) {
+        return err;
+      }
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  void Ring::Complete(const TRB* trb) {
+    if (SegmentOf(trb) == num_segments_) {
+      return;
+    }
+    size_t n = 0;
+    for (const TRB* p = dequeue_; n < num_used_; p = Next(p)) {
+      ++n;
+      if (p == trb) {
+        num_used_ -= n;
+        dequeue_ = Next(p);
+        return;
+      }
+    }
+  }
+
+  void Ring::SkipTo(const TRB* p) {
+    size_t n = 0;
+    const TRB* q = dequeue_;
+    while (q != p && n < num_used_) {
+      q = Next(q);
+      ++n;
+    }
+    if (q == p) {
+      num_used_ -= n;
+      dequeue_ = const_cast<TRB*>(p);
+    }
+  }
+
+  TRB* Ring::EndOfTD(TRB* first) const {
+    TRB* p = first;
+    while ((p->data[3] >> 4) & 1u) { // chain bit
+      p = Next(p);
+    }
+    return p;
+  }
+
+  void Ring::SetContext(const TRB* trb, const void* context) {
+    ContextOf(trb) = context;
+  }
+
+  const void* Ring::TakeContext(const TRB* trb) {
+    auto& slot = ContextOf(trb);
+    auto context = slot;
+    slot = nullptr;
+    return context;
+  }
+
+  const void*& Ring::ContextOf(const TRB* trb) const {
+    // セグメントは segment_bytes_ に整列しているので，下位ビットを落とせば先頭が求まる
+    const auto addr = reinterpret_cast<uintptr_t>(trb);
+    const auto seg = reinterpret_cast<TRB*>(addr & ~(segment_bytes_ - 1));
+    auto contexts = reinterpret_cast<const void**>(seg + buf_size_);
+    return contexts[trb - seg];
+  }
+
   void Ring::CopyToLast(const std::array<uint32_t, 4>& data) {
+    TRB* buf = segments_[write_segment_];
     for (int i = 0; i < 3; ++i) {
       // data[0..2] must be written prior to data[3].
-      buf_[write_index_].data[i] = data[i];
+      buf[write_index_].data[i] = data[i];
     }
-    buf_[write_index_].data[3]
+    buf[write_index_].data[3]
       = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit_);
   }
 
   TRB* Ring::Push(const std::array<uint32_t, 4>& data) {
-    auto trb_ptr = &buf_[write_index_];
+    auto trb_ptr = &segments_[write_segment_][write_index_];
     CopyToLast(data);
+    // 以前この位置にあった TRB の要求情報を引き継がないようにする
+    ContextOf(trb_ptr) = nullptr;
+    ++num_used_;
 
     ++write_index_;
     if (write_index_ == buf_size_ - 1) {
-      LinkTRB link{buf_};
-      link.bits.toggle_cycle = true;
+      const bool last_segment = write_segment_ == num_segments_ - 1;
+      const size_t next_segment = last_segment ? 0 : write_segment_ + 1;
+
+      LinkTRB link{segments_[next_segment]};
+      link.bits.toggle_cycle = last_segment;
+      // TD の途中で折り返す場合は Link TRB も TD の一部として chain bit を立てる
+      link.bits.chain_bit = (data[3] >> 4) & 1u;
       CopyToLast(link.data);
 
+      write_segment_ = next_segment;
       write_index_ = 0;
-      cycle_bit_ = !cycle_bit_;
+      if (last_segment) {
+        cycle_bit_ = !cycle_bit_;
+      }
     }
 
     return trb_ptr;
   }
 
-  Error EventRing::Initialize(size_t buf_size,
+  size_t Ring::SegmentOf(const TRB* p) const {
+    for (size_t i = 0; i < num_segments_; ++i) {
+      if (segments_[i] <= p && p < segments_[i] + buf_size_) {
+        return i;
+      }
+    }
+    return num_segments_;
+  }
+
+  TRB* Ring::Next(const TRB* p) const {
+    const size_t seg = SegmentOf(p);
+    const size_t index = p - segments_[seg];
+    if (index + 1 < buf_size_ - 1) {
+      return segments_[seg] + index + 1;
+    }
+    return segments_[seg + 1 == num_segments_ ? 0 : seg + 1];
+  }
+
+  Error Ring::Grow() {
+    if (num_segments_ == kMaxSegments) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    // xHC は今のサイクル状態のまま新しいセグメントに到達するので，
+    // まだ書き込んでいない TRB を xHC が処理しないよう cycle bit を反転させておく
+    auto seg = AllocSegment(buf_size_, segment_bytes_, !cycle_bit_);
+    if (seg == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+
+    // エンキュー位置のセグメントの Link TRB はまだ書いていないので，
+    // 並び順を変えるだけで新しいセグメントがリングに組み込まれる
+    for (size_t i = num_segments_; i > write_segment_ + 1; --i) {
+      segments_[i] = segments_[i - 1];
+    }
+    segments_[write_segment_ + 1] = seg;
+    ++num_segments_;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error EventRing::Initialize(size_t buf_size, size_t num_segments,
                               InterrupterRegisterSet* interrupter) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    if (num_segments == 0 || kMaxSegments < num_segments) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
     }
 
     cycle_bit_ = true;
     buf_size_ = buf_size;
+    num_segments_ = num_segments;
+    dequeue_segment_ = 0;
     interrupter_ = interrupter;
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
-      return MAKE_ERROR(Error::kNoEnoughMemory);
+    for (size_t i = 0; i < num_segments_; ++i) {
+      segments_[i] = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
+      if (segments_[i] == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      memset(segments_[i], 0, buf_size_ * sizeof(TRB));
     }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
 
-    erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+    erst_ = AllocArray<EventRingSegmentTableEntry>(num_segments_, 64, 64 * 1024);
     if (erst_ == nullptr) {
-      FreeMem(buf_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
+    memset(erst_, 0, num_segments_ * sizeof(EventRingSegmentTableEntry));
 
-    erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-    erst_[0].bits.ring_segment_size = buf_size_;
+    for (size_t i = 0; i < num_segments_; ++i) {
+      erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segments_[i]);
+      erst_[i].bits.ring_segment_size = buf_size_;
+    }
 
     ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-    erstsz.SetSize(1);
+    erstsz.SetSize(num_segments_);
     interrupter_->ERSTSZ.Write(erstsz);
 
-    WriteDequeuePointer(&buf_[0]);
+    dequeue_ = segments_[0];
+    WriteDequeuePointer(dequeue_);
 
     ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
     erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
@@ -96,21 +259,27 @@ namespace usb::xhci {
   void EventRing::WriteDequeuePointer(TRB* p) {
     auto erdp = interrupter_->ERDP.Read();
     erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+    erdp.bits.dequeue_erst_segment_index = dequeue_segment_ & 0x7u;
+    erdp.bits.event_handler_busy = 1; // 1 を書き込むとクリアされる
     interrupter_->ERDP.Write(erdp);
   }
 
   void EventRing::Pop() {
-    auto p = ReadDequeuePointer() + 1;
+    auto p = dequeue_ + 1;
 
-    TRB* segment_begin
-      = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
-    TRB* segment_end = segment_begin + erst_[0].bits.ring_segment_size;
-
-    if (p == segment_end) {
-      p = segment_begin;
-      cycle_bit_ = !cycle_bit_;
+    if (p == segments_[dequeue_segment_] + buf_size_) {
+      ++dequeue_segment_;
+      if (dequeue_segment_ == num_segments_) {
+        dequeue_segment_ = 0;
+        cycle_bit_ = !cycle_bit_;
+      }
+      p = segments_[dequeue_segment_];
     }
 
-    WriteDequeuePointer(p);
+    dequeue_ = p;
+  }
+
+  void EventRing::UpdateDequeuePointer() {
+    WriteDequeuePointer(dequeue_);
   }
 }
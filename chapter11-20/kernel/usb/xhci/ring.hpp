@@ -15,17 +15,35 @@
 #include "usb/xhci/trb.hpp"
 
 namespace usb::xhci {
-  /** @brief Command/Transfer Ring を表すクラス． */
+  /** @brief Command/Transfer Ring を表すクラス．
+   *
+   * リングは Link TRB でつないだ 1 つ以上のセグメントからなる．
+   * 空きが足りなくなったら Reserve がセグメントを追加してリングを広げる．
+   */
   class Ring {
    public:
+    /** @brief 1 つのリングが持てるセグメントの最大数 */
+    static const size_t kMaxSegments = 16;
+
     Ring() = default;
     Ring(const Ring&) = delete;
     ~Ring();
     Ring& operator=(const Ring&) = delete;
 
-    /** @brief リングのメモリ領域を割り当て，メンバを初期化する． */
+    /** @brief 1 セグメントのリングのメモリ領域を割り当て，メンバを初期化する．
+     *
+     * @param buf_size  1 セグメントあたりの TRB 数（Link TRB の分を含む）
+     */
     Error Initialize(size_t buf_size);
 
+    /** @brief num_trbs 個の TRB を続けて Push できるだけの空きを確保する．
+     *
+     * 空きが足りなければエンキュー位置のセグメントの直後に新しいセグメントを挿入する．
+     * 挿入しても空きが増えない（デキュー位置がエンキュー位置と同じセグメントの先にある）
+     * 場合や，セグメント数が上限に達した場合は kFull を返す．
+     */
+    Error Reserve(size_t num_trbs);
+
     /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
      *
      * @return 追加された（リング上の）TRB を指すポインタ．
@@ -35,32 +53,93 @@ namespace usb::xhci {
       return Push(trb.data);
     }
 
-    TRB* Buffer() const { return buf_; }
+    /** @brief trb までの TRB を xHC が処理し終えたことを記録し，その分の空きを回収する． */
+    void Complete(const TRB* trb);
+
+    /** @brief first から始まる TD（chain bit でつながった TRB 列）の最後の TRB を返す． */
+    TRB* EndOfTD(TRB* first) const;
+
+    /** @brief 次に Push される TRB の位置 */
+    TRB* EnqueuePointer() const { return &segments_[write_segment_][write_index_]; }
+    /** @brief 次に Push される TRB に設定する cycle bit */
+    bool CycleBit() const { return cycle_bit_; }
+
+    /** @brief p の手前までの TRB を，xHC に処理させないまま取り除いて空きを回収する．
+     *
+     * xHC のデキュー位置を p に移した後（エンドポイントを作り直した後など）に呼ぶ．
+     */
+    void SkipTo(const TRB* p);
+
+    /** @brief trb で表される要求の情報 context を記録する．
+     *
+     * 情報は TRB の位置ごとに 1 つ保持され，完了イベントの TRB から O(1) で引ける．
+     * 同じ位置に次の TRB が Push されると消える．
+     */
+    void SetContext(const TRB* trb, const void* context);
+
+    /** @brief SetContext で記録した情報を取り出し，記録を消す．無ければ nullptr． */
+    const void* TakeContext(const TRB* trb);
+
+    /** @brief 先頭セグメントの先頭アドレス．Endpoint Context や CRCR に設定する． */
+    TRB* Buffer() const { return segments_[0]; }
+
+    /** @brief 1 セグメントに置ける TRB の数（Link TRB の分を含む） */
+    size_t BufferSize() const { return buf_size_; }
+
+    /** @brief 今すぐ Push できる TRB の数 */
+    size_t NumFree() const {
+      return num_segments_ * (buf_size_ - 1) - num_used_ - 1;
+    }
 
    private:
-    TRB* buf_ = nullptr;
+    /** @brief リングを構成するセグメント．並び順が Link TRB でつながる順番になる． */
+    std::array<TRB*, kMaxSegments> segments_{};
+    size_t num_segments_ = 0;
     size_t buf_size_ = 0;
+    /** @brief 1 セグメント分の領域の大きさ（2 のべき乗）．
+     *
+     * 領域には TRB の配列に続けて，TRB の位置ごとの要求情報の配列を置く．
+     */
+    size_t segment_bytes_ = 0;
 
     /** @brief プロデューサ・サイクル・ステートを表すビット */
     bool cycle_bit_;
-    /** @brief リング上で次に書き込む位置 */
+    /** @brief 次に書き込むセグメントと，その中の位置 */
+    size_t write_segment_;
     size_t write_index_;
 
+    /** @brief xHC がまだ処理していない最も古い TRB */
+    TRB* dequeue_;
+    /** @brief Push したが xHC の処理が終わっていない TRB の数（Link TRB を除く） */
+    size_t num_used_;
+
     /** @brief TRB に cycle bit を設定した上でリング末尾に書き込む．
      *
      * write_index_ は変化させない．
      */
     void CopyToLast(const std::array<uint32_t, 4>& data);
 
+    /** @brief trb の位置に対応する要求情報の格納場所 */
+    const void*& ContextOf(const TRB* trb) const;
+
     /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
      *
-     * write_index_ をインクリメントする．その結果 write_index_ がリング末尾
-     * に達したら LinkTRB を適切に配置して write_index_ を 0 に戻し，
-     * cycle bit を反転させる．
+     * write_index_ をインクリメントする．その結果 write_index_ がセグメント末尾
+     * に達したら次のセグメントへの LinkTRB を配置して次のセグメントへ移る．
+     * 最後のセグメントから先頭へ戻るときは cycle bit を反転させる．
      *
      * @return 追加された（リング上の）TRB を指すポインタ．
      */
     TRB* Push(const std::array<uint32_t, 4>& data);
+
+    /** @brief p を含むセグメントの添字．リング外なら num_segments_ を返す． */
+    size_t SegmentOf(const TRB* p) const;
+
+    /** @brief リング上で p の次に xHC が処理する TRB（Link TRB は飛ばす） */
+    TRB* Next(const TRB* p) const;
+
+    /** @brief セグメントを 1 つ確保し，エンキュー位置のセグメントの直後に挿入する． */
+    Error Grow();
   };
 
   union EventRingSegmentTableEntry {
@@ -77,7 +156,15 @@ namespace usb::xhci {
 
   class EventRing {
    public:
-    Error Initialize(size_t buf_size, InterrupterRegisterSet* interrupter);
+    /** @brief ERST に登録できるセグメントの最大数 */
+    static const size_t kMaxSegments = 16;
+
+    /** @brief セグメントを num_segments 個持つイベントリングを構築する．
+     *
+     * @param buf_size  1 セグメントあたりの TRB 数
+     */
+    Error Initialize(size_t buf_size, size_t num_segments,
+                     InterrupterRegisterSet* interrupter);
 
     TRB* ReadDequeuePointer() const {
       return reinterpret_cast<TRB*>(interrupter_->ERDP.Read().Pointer());
@@ -90,14 +177,30 @@ namespace usb::xhci {
     }
 
     TRB* Front() const {
-      return ReadDequeuePointer();
+      return dequeue_;
     }
 
+    /** @brief 先頭のイベントを取り除く．
+     *
+     * ソフトウェア側のデキュー位置を進めるだけで，ERDP には書き込まない．
+     * xHC に処理済みの位置を伝えるには UpdateDequeuePointer() を呼ぶ．
+     */
     void Pop();
 
+    /** @brief 現在のデキュー位置を ERDP に書き込み，EHB（Event Handler Busy）をクリアする．
+     *
+     * 一連のイベントを処理し終えたところで 1 回だけ呼ぶ．
+     */
+    void UpdateDequeuePointer();
+
    private:
-    TRB* buf_;
+    std::array<TRB*, kMaxSegments> segments_{};
+    size_t num_segments_;
     size_t buf_size_;
+    /** @brief デキュー位置があるセグメントの添字 */
+    size_t dequeue_segment_;
+    /** @brief ソフトウェア側のデキュー位置．ERDP へはまとめて書き込む． */
+    TRB* dequeue_;
 
     bool cycle_bit_;
     EventRingSegmentTableEntry* erst_;
@@ -1,12 +1,17 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <deque>
 #include "logger.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
+#include "timer.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/xhci/speed.hpp"
 
 namespace {
@@ -31,25 +36,78 @@ namespace {
     kInitializingDevice,
     kConfiguringEndpoints,
     kConfigured,
+    kConfiguringHub,
+    kResettingEndpoints,
   };
-  /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
-   * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
+  /* ポート（ルートハブのポート，またはハブのポート）はリセット処理をしてから
+   * アドレスを割り当てるまでは，他のポートのリセットを挟んではならない．
    * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
    * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+   *
+   * アドレスを割り当てた後の処理（kInitializingDevice 以降）はスロットごとに
+   * 進めるので，複数のデバイスの初期化が並行して進む．
    */
 
-  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
+  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: root hub port number
+  std::array<volatile ConfigPhase, 256> slot_config_phase{};  // index: slot ID
 
-  /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
-   * 0 ならその状態のポートがないことを示す．
-   */
-  uint8_t addressing_port{0};
+  /** @brief デバイスが接続された場所．ルートハブのポートか，ハブのポート． */
+  struct AttachPoint {
+    uint8_t hub_slot_id; // 0 ならルートハブ
+    uint8_t port_num;
+    usb::HubDriver* hub; // hub_slot_id != 0 のときのハブクラスドライバ
+  };
 
-  void InitializeSlotContext(SlotContext& ctx, Port& port) {
-    ctx.bits.route_string = 0;
-    ctx.bits.root_hub_port_num = port.Number();
+  /** @brief kResettingPort から kAddressingDevice までの処理を実行中の接続場所．
+   *
+   * phase が kNotConnected ならその状態の接続場所はない．
+   */
+  struct {
+    AttachPoint ap;
+    ConfigPhase phase;
+    int speed;
+    uint8_t slot_id;
+  } addressing{};
+
+  /** @brief リセットの順番を待っている接続場所 */
+  std::deque<AttachPoint> reset_queue{};
+
+  Error InitializeSlotContext(Controller& xhc, SlotContext& ctx) {
+    const auto& ap = addressing.ap;
     ctx.bits.context_entries = 1;
-    ctx.bits.speed = port.Speed();
+    ctx.bits.speed = addressing.speed;
+
+    if (ap.hub_slot_id == 0) {
+      ctx.bits.route_string = 0;
+      ctx.bits.root_hub_port_num = ap.port_num;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto hub = xhc.DeviceManager()->FindBySlot(ap.hub_slot_id);
+    if (hub == nullptr) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+    const auto& hub_ctx = hub->DeviceContext()->slot_context;
+    const int depth = RouteStringDepth(hub_ctx.bits.route_string);
+    if (depth >= 5) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    ctx.bits.route_string = hub_ctx.bits.route_string
+      | (std::min<uint32_t>(ap.port_num, 15) << (4 * depth));
+    ctx.bits.root_hub_port_num = hub_ctx.bits.root_hub_port_num;
+
+    // Low/Full Speed デバイスは上流で最も近い High Speed ハブの TT を通る
+    if (addressing.speed == kFullSpeed || addressing.speed == kLowSpeed) {
+      if (hub_ctx.bits.speed == kHighSpeed) {
+        ctx.bits.tt_hub_slot_id = ap.hub_slot_id;
+        ctx.bits.tt_port_num = ap.port_num;
+      } else {
+        ctx.bits.tt_hub_slot_id = hub_ctx.bits.tt_hub_slot_id;
+        ctx.bits.tt_port_num = hub_ctx.bits.tt_port_num;
+      }
+      ctx.bits.mtt = hub_ctx.bits.mtt;
+    }
+    return MAKE_ERROR(Error::kSuccess);
   }
 
   unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed) {
@@ -88,6 +146,49 @@ namespace {
     ctx.bits.error_count = 3;
   }
 
+  Error StartReset(Controller& xhc, const AttachPoint& ap) {
+    addressing.ap = ap;
+    addressing.phase = ConfigPhase::kResettingPort;
+    addressing.speed = 0;
+    addressing.slot_id = 0;
+
+    if (ap.hub_slot_id == 0) {
+      port_config_phase[ap.port_num] = ConfigPhase::kResettingPort;
+      auto port = xhc.PortAt(ap.port_num);
+      return port.Reset();
+    }
+    return ap.hub->ResetPort(ap.port_num);
+  }
+
+  /** @brief ap のリセットを予約する．実行中の接続場所が無ければすぐにリセットする． */
+  Error RequestReset(Controller& xhc, const AttachPoint& ap) {
+    if (addressing.phase != ConfigPhase::kNotConnected) {
+      if (ap.hub_slot_id == 0) {
+        port_config_phase[ap.port_num] = ConfigPhase::kWaitingAddressed;
+      }
+      reset_queue.push_back(ap);
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return StartReset(xhc, ap);
+  }
+
+  /** @brief アドレス割り当てまでを終え，順番を待っている次の接続場所をリセットする． */
+  Error FinishAddressing(Controller& xhc) {
+    addressing.phase = ConfigPhase::kNotConnected;
+    while (!reset_queue.empty()) {
+      const auto ap = reset_queue.front();
+      reset_queue.pop_front();
+      if (auto err = StartReset(xhc, ap)) {
+        Log(kError, "failed to reset port %d of slot %d: %s\n",
+            ap.port_num, ap.hub_slot_id, err.Name());
+        addressing.phase = ConfigPhase::kNotConnected;
+        continue;
+      }
+      break;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error ResetPort(Controller& xhc, Port& port) {
     const bool is_connected = port.IsConnected();
     Log(kDebug, "ResetPort: port.IsConnected() = %s\n",
@@ -97,18 +198,22 @@ namespace {
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    if (addressing_port != 0) {
-      port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
-    } else {
-      const auto port_phase = port_config_phase[port.Number()];
-      if (port_phase != ConfigPhase::kNotConnected &&
-          port_phase != ConfigPhase::kWaitingAddressed) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      addressing_port = port.Number();
-      port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-      port.Reset();
+    if (port_config_phase[port.Number()] != ConfigPhase::kNotConnected) {
+      return MAKE_ERROR(Error::kInvalidPhase);
     }
+    return RequestReset(xhc, AttachPoint{0, port.Number(), nullptr});
+  }
+
+  Error EnableSlot(Controller& xhc) {
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
+
+    addressing.phase = ConfigPhase::kEnablingSlot;
+
+    EnableSlotCommandTRB cmd{};
+    xhc.CommandRing()->Push(cmd);
+    xhc.DoorbellRegisterAt(0)->Ring(0);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -123,16 +228,20 @@ namespace {
       port.ClearPortResetChange();
 
       port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
+      addressing.speed = port.Speed();
+      return EnableSlot(xhc);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error AddressDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "AddressDevice: port_id = %d (hub slot %d), slot_id = %d\n",
+        addressing.ap.port_num, addressing.ap.hub_slot_id, slot_id);
+
+    // デバイスやコンテキストを用意する前に，コマンドを積める空きがあるかを確かめる
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
 
     xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
 
@@ -140,6 +249,8 @@ namespace {
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
+    // 転送イベントを受け取るインタラプタをデバイスごとに振り分ける
+    dev->SetInterrupterTarget(slot_id % xhc.NumInterrupters());
 
     memset(&dev->InputContext()->input_control_context, 0,
            sizeof(InputControlContext));
@@ -148,8 +259,9 @@ namespace {
     auto slot_ctx = dev->InputContext()->EnableSlotContext();
     auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-    auto port = xhc.PortAt(port_id);
-    InitializeSlotContext(*slot_ctx, port);
+    if (auto err = InitializeSlotContext(xhc, *slot_ctx)) {
+      return err;
+    }
 
     InitializeEP0Context(
         *ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
@@ -157,7 +269,11 @@ namespace {
 
     xhc.DeviceManager()->LoadDCBAA(slot_id);
 
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+    addressing.phase = ConfigPhase::kAddressingDevice;
+    addressing.slot_id = slot_id;
+    if (addressing.ap.hub_slot_id == 0) {
+      port_config_phase[addressing.ap.port_num] = ConfigPhase::kAddressingDevice;
+    }
 
     AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
     xhc.CommandRing()->Push(addr_dev_cmd);
@@ -166,31 +282,31 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error InitializeDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "InitializeDevice: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
+    slot_config_phase[slot_id] = ConfigPhase::kInitializingDevice;
     dev->StartInitialize();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error CompleteConfiguration(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "CompleteConfiguration: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
+    slot_config_phase[slot_id] = ConfigPhase::kConfigured;
     dev->OnEndpointsConfigured();
 
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -219,70 +335,131 @@ namespace {
       return err;
     }
 
-    const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
     if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
+        slot_config_phase[slot_id] == ConfigPhase::kInitializingDevice) {
       return ConfigureEndpoints(xhc, *dev);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error OnEndpointStopped(Controller& xhc, uint8_t slot_id, usb::EndpointID ep_id) {
+    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+    if (dev == nullptr) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+    return dev->OnEndpointStopped(DeviceContextIndex{ep_id});
+  }
+
   Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
+    xhc.CommandRing()->Complete(trb.Pointer());
     const auto issuer_type = trb.Pointer()->bits.trb_type;
     const auto slot_id = trb.bits.slot_id;
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
         trb.bits.slot_id, kTRBTypeToName[issuer_type]);
 
     if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
+      if (addressing.phase != ConfigPhase::kEnablingSlot) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
 
-      return AddressDevice(xhc, addressing_port, slot_id);
+      return AddressDevice(xhc, slot_id);
     } else if (issuer_type == AddressDeviceCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-
-      if (port_id != addressing_port) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
+      if (addressing.phase != ConfigPhase::kAddressingDevice ||
+          addressing.slot_id != slot_id) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
 
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
-        }
+      if (addressing.ap.hub_slot_id == 0) {
+        // アドレス割り当て後の状態はスロットごとに管理する
+        port_config_phase[addressing.ap.port_num] = ConfigPhase::kConfigured;
+      }
+      if (auto err = FinishAddressing(xhc)) {
+        return err;
       }
 
-      return InitializeDevice(xhc, port_id, slot_id);
+      return InitializeDevice(xhc, slot_id);
     } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
+      switch (slot_config_phase[slot_id]) {
+      case ConfigPhase::kConfiguringEndpoints:
+        return CompleteConfiguration(xhc, slot_id);
+      case ConfigPhase::kConfiguringHub:
+        slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+        return MAKE_ERROR(Error::kSuccess);
+      case ConfigPhase::kResettingEndpoints:
+        slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+        return dev->OnEndpointsReconfigured();
+      default:
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-
-      return CompleteConfiguration(xhc, port_id, slot_id);
+    } else if (auto cmd = TRBDynamicCast<ResetEndpointCommandTRB>(trb.Pointer())) {
+      return OnEndpointStopped(xhc, slot_id, cmd->EndpointID());
+    } else if (auto cmd = TRBDynamicCast<StopEndpointCommandTRB>(trb.Pointer())) {
+      return OnEndpointStopped(xhc, slot_id, cmd->EndpointID());
     }
 
     return MAKE_ERROR(Error::kInvalidPhase);
   }
 
+  /** @brief イベントリングの 1 セグメントあたりの TRB 数 */
+  const size_t kEventRingSegmentSize = 64;
+
+  /** @brief 割り込みの最小間隔（IMODI，250ns 単位）．1000 なら 250us． */
+  const uint16_t kInterruptModerationInterval = 1000;
+
+  /** @brief ERDP を更新せずに処理するイベントの最大数．
+   *
+   * 大量のイベントを処理する間もイベントリングがあふれないよう，
+   * この数ごとに xHC へデキュー位置を伝える．
+   */
+  const int kEventBatchSize = kEventRingSegmentSize;
+
+  /** @brief インタラプタごとの，メインタスクへの通知が未処理かどうか */
+  std::array<std::atomic<bool>, Controller::kMaxInterrupters> event_notified{};
+
+  /** @brief ポート数とデバイス数から見積もったイベントリングのセグメント数．
+   *
+   * ポート状態の変化が一斉に起きても，各デバイスが転送イベントを溜めても
+   * あふれないだけの容量を確保する．xHC が対応する ERST のエントリ数を超えない．
+   */
+  size_t NumEventRingSegments(uint8_t max_ports, size_t num_devices,
+                              HCSPARAMS2_Bitmap hcsparams2) {
+    const size_t num_events = max_ports * 4 + num_devices * 32;
+    const size_t num_segments =
+      (num_events + kEventRingSegmentSize - 1) / kEventRingSegmentSize;
+    const size_t erst_max = 1u << hcsparams2.bits.event_ring_segment_table_max;
+    return std::min({num_segments, erst_max, EventRing::kMaxSegments});
+  }
+
+  /** @brief ポーリングの間隔．タイマ割り込みの周期より短くしても意味がない */
+  const unsigned long kPollIntervalMs = 1000 / kTimerFreq;
+  const unsigned long kOwnershipTimeoutMs = 1000;
+  const unsigned long kResetTimeoutMs = 1000;
+
+  /** @brief cond() が真になるまで，タスクを眠らせながら待つ．
+   *
+   * timeout_ms ミリ秒待っても偽のままなら false を返す．
+   */
+  template <class F>
+  bool WaitUntil(F cond, unsigned long timeout_ms) {
+    for (unsigned long waited = 0; !cond(); waited += kPollIntervalMs) {
+      if (waited >= timeout_ms) {
+        return false;
+      }
+      SleepMilliseconds(kPollIntervalMs);
+    }
+    return true;
+  }
+
   void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
     ExtendedRegisterList extregs{ mmio_base, hccp };
 
@@ -305,22 +482,23 @@ namespace {
     Log(kDebug, "waiting until OS owns xHC...\n");
     reg.Write(r);
 
-    do {
-      r = reg.Read();
-    } while (r.bits.hc_bios_owned_semaphore ||
-             !r.bits.hc_os_owned_semaphore);
+    const bool owned = WaitUntil([&reg]() {
+      auto r = reg.Read();
+      return !r.bits.hc_bios_owned_semaphore && r.bits.hc_os_owned_semaphore;
+    }, kOwnershipTimeoutMs);
+    if (!owned) {
+      // 応答しない BIOS は多いので，そのまま使い始める
+      Log(kWarn, "BIOS did not release xHC in %lu ms\n", kOwnershipTimeoutMs);
+      return;
+    }
     Log(kDebug, "OS has owned xHC\n");
   }
 
   void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
-    bool intel_ehc_exist = false;
-    for (int i = 0; i < pci::num_device; ++i) {
-      if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x20u) /* EHCI */ &&
-          0x8086 == pci::ReadVendorId(pci::devices[i])) {
-        intel_ehc_exist = true;
-        break;
-      }
-    }
+    const auto ehcs = pci::FindDevicesByClass(0x0cu, 0x03u, 0x20u); // EHCI
+    const bool intel_ehc_exist = std::any_of(
+        ehcs.begin(), ehcs.end(),
+        [](const pci::Device* dev) { return dev->vendor_id == 0x8086; });
     if (!intel_ehc_exist) {
       return;
     }
@@ -345,7 +523,12 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
+  Error Controller::Initialize(int num_interrupters) {
+    // 64 ビットアドレスを扱えない xHC には 4GiB 未満のメモリだけを渡す
+    if (!cap_->HCCPARAMS1.Read().bits.addressing_capability_64) {
+      SetMemoryZone(MemoryZone::kDMA32);
+    }
+
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
@@ -362,14 +545,21 @@ namespace usb::xhci {
     }
 
     op_->USBCMD.Write(usbcmd);
-    while (!op_->USBSTS.Read().bits.host_controller_halted);
+    if (!WaitUntil([this]() { return op_->USBSTS.Read().bits.host_controller_halted; },
+                   kResetTimeoutMs)) {
+      return MAKE_ERROR(Error::kHostControllerNotHalted);
+    }
 
     // Reset controller
     usbcmd = op_->USBCMD.Read();
     usbcmd.bits.host_controller_reset = true;
     op_->USBCMD.Write(usbcmd);
-    while (op_->USBCMD.Read().bits.host_controller_reset);
-    while (op_->USBSTS.Read().bits.controller_not_ready);
+    if (!WaitUntil([this]() {
+          return !op_->USBCMD.Read().bits.host_controller_reset &&
+                 !op_->USBSTS.Read().bits.controller_not_ready;
+        }, kResetTimeoutMs)) {
+      return MAKE_ERROR(Error::kTimeout);
+    }
 
     Log(kDebug, "MaxSlots: %u\n", cap_->HCSPARAMS1.Read().bits.max_device_slots);
     // Set "Max Slots Enabled" field in CONFIG.
@@ -397,21 +587,34 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
     if (auto err = cr_.Initialize(32)) {
         return err;
     }
     if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
         return err; }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
+
+    // コマンド完了とポート状態変化のイベントはインタラプタ 0 に届く．
+    // 転送イベントはデバイスごとに割り振ったインタラプタに届く．
+    num_interrupters_ = std::clamp(num_interrupters, 1, kMaxInterrupters);
+    const size_t num_segments =
+      NumEventRingSegments(max_ports_, kDeviceSize, hcsparams2);
+    for (int i = 0; i < num_interrupters_; ++i) {
+      auto interrupter = &InterrupterRegisterSets()[i];
+      if (auto err = er_[i].Initialize(kEventRingSegmentSize, num_segments, interrupter)) {
         return err;
-    }
+      }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
+      // イベントが立て続けに起きても割り込みは一定間隔にまとめられる
+      auto imod = interrupter->IMOD.Read();
+      imod.bits.interrupt_moderation_interval = kInterruptModerationInterval;
+      imod.bits.interrupt_moderation_counter = 0;
+      interrupter->IMOD.Write(imod);
+
+      auto iman = interrupter->IMAN.Read();
+      iman.bits.interrupt_pending = true;
+      iman.bits.interrupt_enable = true;
+      interrupter->IMAN.Write(iman);
+    }
 
     // Enable interrupt for the controller
     usbcmd = op_->USBCMD.Read();
@@ -437,6 +640,14 @@ namespace usb::xhci {
     return &DoorbellRegisters()[index];
   }
 
+  int RouteStringDepth(uint32_t route_string) {
+    int depth = 0;
+    while (depth < 5 && ((route_string >> (4 * depth)) & 0xfu) != 0) {
+      ++depth;
+    }
+    return depth;
+  }
+
   Error ConfigurePort(Controller& xhc, Port& port) {
     if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
       return ResetPort(xhc, port);
@@ -445,6 +656,10 @@ namespace usb::xhci {
   }
 
   Error ConfigureEndpoints(Controller& xhc, Device& dev) {
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
+
     const auto configs = dev.EndpointConfigs();
     const auto len = dev.NumEndpointConfigs();
 
@@ -454,8 +669,7 @@ namespace usb::xhci {
 
     auto slot_ctx = dev.InputContext()->EnableSlotContext();
     slot_ctx->bits.context_entries = 31;
-    const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-    const int port_speed{xhc.PortAt(port_id).Speed()};
+    const int port_speed = dev.DeviceContext()->slot_context.bits.speed;
     if (port_speed == 0 || port_speed > kSuperSpeedPlus) {
       return MAKE_ERROR(Error::kUnknownXHCISpeedID);
     }
@@ -500,7 +714,7 @@ namespace usb::xhci {
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringEndpoints;
 
     ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
     xhc.CommandRing()->Push(cmd);
@@ -509,13 +723,98 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+  Error ConfigureHub(Controller& xhc, Device& dev,
+                     uint8_t num_ports, bool multi_tt, uint8_t tt_think_time) {
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
+
+    memset(&dev.InputContext()->input_control_context, 0, sizeof(InputControlContext));
+    memcpy(&dev.InputContext()->slot_context,
+           &dev.DeviceContext()->slot_context, sizeof(SlotContext));
+
+    auto slot_ctx = dev.InputContext()->EnableSlotContext();
+    slot_ctx->bits.hub = 1;
+    slot_ctx->bits.num_ports = num_ports;
+    slot_ctx->bits.mtt = multi_tt;
+    slot_ctx->bits.ttt = tt_think_time;
+
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringHub;
+
+    // コマンドは順に処理されるので，このハブの先のデバイスへの Address Device より先に反映される
+    ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
+    xhc.CommandRing()->Push(cmd);
+    xhc.DoorbellRegisterAt(0)->Ring(0);
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error StopEndpoint(Controller& xhc, Device& dev, DeviceContextIndex dci) {
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
+    const EndpointID ep_id{dci.value};
+    const auto& ep_ctx = dev.DeviceContext()->ep_contexts[dci.value - 1];
+    if (ep_ctx.bits.ep_state == 2) { // Halted
+      ResetEndpointCommandTRB cmd{ep_id, dev.SlotID()};
+      xhc.CommandRing()->Push(cmd);
+    } else {
+      StopEndpointCommandTRB cmd{ep_id, dev.SlotID()};
+      xhc.CommandRing()->Push(cmd);
+    }
+    xhc.DoorbellRegisterAt(0)->Ring(0);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ReconfigureEndpoints(Controller& xhc, Device& dev, uint32_t mask) {
+    if (auto err = xhc.CommandRing()->Reserve(1)) {
+      return err;
+    }
+    memcpy(&dev.InputContext()->slot_context,
+           &dev.DeviceContext()->slot_context, sizeof(SlotContext));
+
+    // 同じエンドポイントを削除してから追加すると，xHC はそれを初期状態から作り直す
+    auto& icc = dev.InputContext()->input_control_context;
+    memset(&icc, 0, sizeof(InputControlContext));
+    icc.drop_context_flags = mask;
+    icc.add_context_flags = mask | 1u; // スロットコンテキストも含める
+
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kResettingEndpoints;
+
+    ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
+    xhc.CommandRing()->Push(cmd);
+    xhc.DoorbellRegisterAt(0)->Ring(0);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error RequestHubPortReset(Controller& xhc, uint8_t hub_slot_id,
+                            uint8_t port_num, usb::HubDriver* hub) {
+    return RequestReset(xhc, AttachPoint{hub_slot_id, port_num, hub});
+  }
+
+  Error OnHubPortReset(Controller& xhc, uint8_t hub_slot_id,
+                       uint8_t port_num, int speed) {
+    if (addressing.phase != ConfigPhase::kResettingPort ||
+        addressing.ap.hub_slot_id != hub_slot_id ||
+        addressing.ap.port_num != port_num) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (speed == 0) {
+      return FinishAddressing(xhc);
+    }
+    addressing.speed = speed;
+    return EnableSlot(xhc);
+  }
+
+  Error ProcessEvent(Controller& xhc, int interrupter) {
+    auto er = xhc.EventRingAt(interrupter);
+    if (!er->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
+    auto event_trb = er->Front();
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -523,56 +822,71 @@ namespace usb::xhci {
     } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     }
-    xhc.PrimaryEventRing()->Pop();
+    er->Pop();
 
     return err;
   }
 
   Controller* controller;
 
-  void Initialize() {
-    // Intel 製を優先して xHC を探す
-    pci::Device* xhc_dev = nullptr;
-    for (int i = 0; i < pci::num_device; ++i) {
-      if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x30u)) {
-        xhc_dev = &pci::devices[i];
-
-        if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
-          break;
-        }
-      }
+  Error Probe(pci::Device& xhc_dev) {
+    if (controller) { // 複数の xHC は扱わない
+      return MAKE_ERROR(Error::kAlreadyAllocated);
     }
+    Log(kInfo, "xHC has been found: %d.%d.%d\n",
+        xhc_dev.bus, xhc_dev.device, xhc_dev.function);
 
-    if (xhc_dev) {
-      Log(kInfo, "xHC has been found: %d.%d.%d\n",
-          xhc_dev->bus, xhc_dev->device, xhc_dev->function);
-    } else {
-      Log(kError, "xHC has not been found\n");
-      exit(1);
+    const uint64_t xhc_mmio_base = xhc_dev.bars[0] & ~static_cast<uint64_t>(0xf);
+    Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
+    if (xhc_mmio_base == 0) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
     }
 
+    // 初期化を終えるまでは他から見えないよう，controller にはまだ設定しない
+    auto xhc_ptr = new Controller{xhc_mmio_base};
+    Controller& xhc = *xhc_ptr;
+
+    // MSI-X が使えればインタラプタごとに別のベクタを割り当て，
+    // 使えなければ MSI でインタラプタ 0 だけを使う
     const uint8_t bsp_local_apic_id =
       *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-    pci::ConfigureMSIFixedDestination(
-        *xhc_dev, bsp_local_apic_id,
-        pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-        InterruptVector::kXHCI, 0);
-
-    const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
-    Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
-    const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
-    Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
+    const std::array<uint8_t, Controller::kMaxInterrupters> xhc_vectors{
+      InterruptVector::kXHCI, InterruptVector::kXHCI1,
+      InterruptVector::kXHCI2, InterruptVector::kXHCI3,
+    };
+    auto num_vectors = pci::ConfigureMSIXFixedDestination(
+        xhc_dev, bsp_local_apic_id,
+        pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed,
+        xhc_vectors.data(), std::min(xhc.MaxInterrupters(), Controller::kMaxInterrupters));
+    int num_interrupters = num_vectors.value;
+    if (num_vectors.error) {
+      Log(kDebug, "MSI-X is not available: %s\n", num_vectors.error.Name());
+      pci::ConfigureMSIFixedDestination(
+          xhc_dev, bsp_local_apic_id,
+          pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
+          InterruptVector::kXHCI, 0);
+      num_interrupters = 1;
+    }
+    Log(kInfo, "xHC uses %d interrupter(s)\n", num_interrupters);
+
+    if (xhc_dev.vendor_id == 0x8086) {
+      SwitchEhci2Xhci(xhc_dev);
+    }
+    if (auto err = xhc.Initialize(num_interrupters)) {
+      Log(kError, "xhc initialize failed: %s\n", err.Name());
+      delete xhc_ptr;
+      return err;
+    }
 
-    usb::xhci::controller = new Controller{xhc_mmio_base};
-    Controller& xhc = *usb::xhci::controller;
+    usb::xhci::controller = xhc_ptr;
+    return MAKE_ERROR(Error::kSuccess);
+  }
 
-    if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
-      SwitchEhci2Xhci(*xhc_dev);
-    }
-    if (auto err = xhc.Initialize()) {
-      Log(kError, "xhc initialize failed: %s\n", err.Name());
-      exit(1);
+  void Start() {
+    if (controller == nullptr) {
+      return;
     }
+    Controller& xhc = *controller;
 
     Log(kInfo, "xHC starting\n");
     xhc.Run();
@@ -591,12 +905,33 @@ namespace usb::xhci {
     }
   }
 
-  void ProcessEvents() {
-    while (controller->PrimaryEventRing()->HasFront()) {
-      if (auto err = ProcessEvent(*controller)) {
+  void ProcessEvents(int interrupter) {
+    if (controller == nullptr ||
+        interrupter < 0 || controller->NumInterrupters() <= interrupter) {
+      return;
+    }
+
+    // 処理を始める前に下ろしておけば，処理中に来た割り込みは新たに通知される
+    event_notified[interrupter] = false;
+
+    auto er = controller->EventRingAt(interrupter);
+    int num_processed = 0;
+    while (er->HasFront()) {
+      if (auto err = ProcessEvent(*controller, interrupter)) {
         Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
             err.Name(), err.File(), err.Line());
       }
+      if (++num_processed % kEventBatchSize == 0) {
+        er->UpdateDequeuePointer();
+      }
+    }
+    er->UpdateDequeuePointer();
+  }
+
+  bool ShouldNotifyEvents(int interrupter) {
+    if (interrupter < 0 || Controller::kMaxInterrupters <= interrupter) {
+      return false;
     }
+    return !event_notified[interrupter].exchange(true);
   }
 }
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
 #include "error.hpp"
 #include "usb/xhci/registers.hpp"
@@ -14,14 +15,33 @@
 #include "usb/xhci/port.hpp"
 #include "usb/xhci/devmgr.hpp"
 
+namespace pci {
+  struct Device;
+}
+
 namespace usb::xhci {
   class Controller {
    public:
+    /** @brief 使用するインタラプタの最大数 */
+    static const int kMaxInterrupters = 4;
+
     Controller(uintptr_t mmio_base);
-    Error Initialize();
+
+    /** @brief xHC を初期化する．
+     *
+     * @param num_interrupters  有効にするインタラプタの数．
+     *   それぞれに専用のイベントリングを割り当てる．
+     */
+    Error Initialize(int num_interrupters);
     Error Run();
     Ring* CommandRing() { return &cr_; }
-    EventRing* PrimaryEventRing() { return &er_; }
+    EventRing* PrimaryEventRing() { return &er_[0]; }
+    EventRing* EventRingAt(int interrupter) { return &er_[interrupter]; }
+    int NumInterrupters() const { return num_interrupters_; }
+    /** @brief xHC が持つインタラプタの数（HCSPARAMS1） */
+    int MaxInterrupters() const {
+      return cap_->HCSPARAMS1.Read().bits.max_interrupters;
+    }
     DoorbellRegister* DoorbellRegisterAt(uint8_t index);
     Port PortAt(uint8_t port_num) {
       return Port{port_num, PortRegisterSets()[port_num - 1]};
@@ -39,7 +59,8 @@ namespace usb::xhci {
 
     class DeviceManager devmgr_;
     Ring cr_;
-    EventRing er_;
+    std::array<EventRing, kMaxInterrupters> er_;
+    int num_interrupters_{1};
 
     InterrupterRegisterSetArray InterrupterRegisterSets() const {
       return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -57,16 +78,73 @@ namespace usb::xhci {
   Error ConfigurePort(Controller& xhc, Port& port);
   Error ConfigureEndpoints(Controller& xhc, Device& dev);
 
+  /** @brief ルートストリングで使われている段数．ルートハブ直下のデバイスなら 0． */
+  int RouteStringDepth(uint32_t route_string);
+
+  /** @brief dev がハブであることを Configure Endpoint コマンドで xHC に伝える． */
+  Error ConfigureHub(Controller& xhc, Device& dev,
+                     uint8_t num_ports, bool multi_tt, uint8_t tt_think_time);
+
+  /** @brief dev のエンドポイント dci を止めるコマンドを発行する．
+   *
+   * エラーで止まっている（Halted）なら Reset Endpoint，そうでなければ Stop Endpoint を使う．
+   * 完了すると dev.OnEndpointStopped(dci) を呼ぶ．
+   */
+  Error StopEndpoint(Controller& xhc, Device& dev, DeviceContextIndex dci);
+
+  /** @brief mask のビット（DCI）が立ったエンドポイントを Configure Endpoint で作り直す．
+   *
+   * 入力コンテキストのエンドポイントコンテキストを設定してから呼ぶ．
+   * データトグルとデキュー位置が初期化される．完了すると dev.OnEndpointsReconfigured() を呼ぶ．
+   */
+  Error ReconfigureEndpoints(Controller& xhc, Device& dev, uint32_t mask);
+
+  /** @brief スロット hub_slot_id のハブのポート port_num のリセットを予約する．
+   *
+   * リセットからアドレス割り当てまでは 1 ポートずつ行う．
+   * 順番が来ると hub->ResetPort(port_num) を呼ぶ．
+   */
+  Error RequestHubPortReset(Controller& xhc, uint8_t hub_slot_id,
+                            uint8_t port_num, usb::HubDriver* hub);
+
+  /** @brief ハブのポートのリセットが終わったので，スロットを割り当ててアドレスを設定する．
+   *
+   * speed が 0 ならリセットに失敗したものとして，次のポートに順番を渡す．
+   */
+  Error OnHubPortReset(Controller& xhc, uint8_t hub_slot_id,
+                       uint8_t port_num, int speed);
+
   /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
-   * xhc のプライマリイベントリングの先頭のイベントを処理する．
+   * xhc のインタラプタ interrupter のイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
+   * ERDP は更新しないので，呼び出し側で EventRing::UpdateDequeuePointer() を呼ぶこと．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
-  Error ProcessEvent(Controller& xhc);
+  Error ProcessEvent(Controller& xhc, int interrupter = 0);
 
   extern Controller* controller;
-  void Initialize();
-  void ProcessEvents();
+  /** @brief xHC をリセットして初期化し，controller に設定する．
+   *
+   * pci::BindDrivers から呼ばれる．controller が設定済みなら Error::kAlreadyAllocated を返す．
+   * BIOS からの所有権の移譲やリセットの完了をタスクを眠らせて待つので，
+   * メインタスク以外のタスクから呼ぶ．
+   */
+  Error Probe(pci::Device& xhc_dev);
+  /** @brief controller を動かし，接続済みのポートの設定を始める．
+   *
+   * 以降のイベントはメインタスクの ProcessEvents で処理するので，メインタスクから呼ぶ．
+   * controller が無ければ何もしない．
+   */
+  void Start();
+  /** @brief インタラプタ interrupter のイベントリングが空になるまでイベントを処理する． */
+  void ProcessEvents(int interrupter = 0);
+
+  /** @brief 割り込みハンドラから呼び，メインタスクへ通知を送るべきかを返す．
+   *
+   * 同じインタラプタへの通知が ProcessEvents() で処理され始める前に
+   * 次の割り込みが来た場合は false を返し，メッセージが重複しないようにする．
+   */
+  bool ShouldNotifyEvents(int interrupter);
 }
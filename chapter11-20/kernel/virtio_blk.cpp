@@ -0,0 +1,309 @@
+#include "virtio_blk.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "clocksource.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+namespace {
+  const uint8_t kCapabilityVendor = 0x09;
+
+  // virtio_pci_cap の cfg_type
+  const uint8_t kCfgTypeCommon = 1;
+  const uint8_t kCfgTypeNotify = 2;
+  const uint8_t kCfgTypeDevice = 4;
+
+  // common 設定領域のレジスタ
+  const uint32_t kDeviceFeatureSelect = 0;
+  const uint32_t kDeviceFeature = 4;
+  const uint32_t kDriverFeatureSelect = 8;
+  const uint32_t kDriverFeature = 12;
+  const uint32_t kDeviceStatus = 20;
+  const uint32_t kQueueSelect = 22;
+  const uint32_t kQueueSize = 24;
+  const uint32_t kQueueMSIXVector = 26;
+  const uint32_t kQueueEnable = 28;
+  const uint32_t kQueueNotifyOff = 30;
+  const uint32_t kQueueDesc = 32;
+  const uint32_t kQueueDriver = 40;
+  const uint32_t kQueueDevice = 48;
+
+  // device_status のビット
+  const uint8_t kStatusAcknowledge = 1;
+  const uint8_t kStatusDriver = 2;
+  const uint8_t kStatusDriverOK = 4;
+  const uint8_t kStatusFeaturesOK = 8;
+  const uint8_t kStatusFailed = 128;
+
+  /** @brief VIRTIO_F_VERSION_1（機能ビット 32）．modern インターフェースに必須． */
+  const uint32_t kFeatureVersion1High = 1u << 0;
+
+  const uint16_t kNoVector = 0xffff;
+
+  // ディスクリプタのフラグ
+  const uint16_t kDescNext = 1;
+  const uint16_t kDescWrite = 2;
+
+  /** @brief avail リングの flags．完了しても割り込みを送らせない． */
+  const uint16_t kAvailNoInterrupt = 1;
+
+  // 要求の種類と状態
+  const uint32_t kRequestIn = 0;
+  const uint32_t kRequestOut = 1;
+  const uint8_t kStatusOK = 0;
+
+  const uint16_t kMaxQueueSize = 16;
+
+  // virtqueue と要求ヘッダを置くフレーム内の配置
+  const size_t kAvailOffset = sizeof(virtio::VirtqDesc) * kMaxQueueSize;
+  const size_t kUsedOffset = 1024;
+  const size_t kRequestOffset = 2048;
+  const size_t kRequestHeaderSize = 16; // type, reserved, sector
+  const size_t kStatusOffset = kRequestHeaderSize;
+
+  const uint64_t kTimeoutMicroseconds = 1000000;
+
+  /** @brief [addr, addr + bytes) がアイデンティティマップされた範囲に収まれば true */
+  bool IsIdentityMapped(const void* addr, size_t bytes) {
+    const auto begin = reinterpret_cast<uintptr_t>(addr);
+    return begin + bytes <= kPageDirectoryCount * kPageSize1G;
+  }
+
+  /** @brief cond() が真になるまで待つ．kTimeoutMicroseconds 待っても偽なら false を返す． */
+  template <class F>
+  bool PollUntil(F cond) {
+    auto clock = BestClockSource();
+    const uint64_t start = clock->Read();
+    while (!cond()) {
+      if (clock->ToMicroseconds(clock->Elapsed(start, clock->Read())) > kTimeoutMicroseconds) {
+        return false;
+      }
+      __asm__ volatile("pause");
+    }
+    return true;
+  }
+
+  /** @brief virtio_pci_cap の内容 */
+  struct VirtioCap {
+    uint8_t cfg_type, bar;
+    uint32_t offset;
+    uint32_t extra; // notify の場合は notify_off_multiplier
+  };
+
+  /** @brief 種類が cfg_type である最初の virtio ケーパビリティを探す */
+  bool FindVirtioCap(const pci::Device& dev, uint8_t cfg_type, VirtioCap& cap) {
+    uint8_t cap_addr = pci::ReadConfReg(dev, 0x34) & 0xffu;
+    while (cap_addr != 0) {
+      auto header = pci::ReadCapabilityHeader(dev, cap_addr);
+      if (header.bits.cap_id == kCapabilityVendor) {
+        const uint32_t dw0 = header.data;
+        const uint32_t dw1 = pci::ReadConfReg(dev, cap_addr + 4);
+        if (((dw0 >> 24) & 0xffu) == cfg_type) {
+          cap.cfg_type = cfg_type;
+          cap.bar = dw1 & 0xffu;
+          cap.offset = pci::ReadConfReg(dev, cap_addr + 8);
+          cap.extra = cfg_type == kCfgTypeNotify ? pci::ReadConfReg(dev, cap_addr + 16) : 0;
+          return cap.bar < 6;
+        }
+      }
+      cap_addr = header.bits.next_ptr;
+    }
+    return false;
+  }
+
+  /** @brief ケーパビリティが指す領域のアドレス．BAR がメモリ空間に無ければ 0． */
+  uintptr_t CapAddress(const pci::Device& dev, const VirtioCap& cap) {
+    const uint64_t bar = dev.bars[cap.bar];
+    if (bar & 1u) { // I/O 空間
+      return 0;
+    }
+    const uint64_t base = bar & ~static_cast<uint64_t>(0xf);
+    return base == 0 ? 0 : base + cap.offset;
+  }
+}
+
+namespace virtio {
+  BlockDevice::BlockDevice(const pci::Device& dev, uintptr_t common_cfg, uintptr_t notify,
+                           uint32_t notify_off_multiplier, uintptr_t device_cfg)
+      : pci_dev_{dev},
+        common_cfg_{reinterpret_cast<volatile uint8_t*>(common_cfg)},
+        notify_base_{reinterpret_cast<volatile uint8_t*>(notify)},
+        notify_off_multiplier_{notify_off_multiplier},
+        device_cfg_{reinterpret_cast<volatile uint8_t*>(device_cfg)} {
+  }
+
+  Error BlockDevice::Initialize() {
+    // リセットしてから，ドライバが居ることをデバイスに伝える
+    Common<uint8_t>(kDeviceStatus) = 0;
+    if (!PollUntil([this]() { return Common<uint8_t>(kDeviceStatus) == 0; })) {
+      return MAKE_ERROR(Error::kTimeout);
+    }
+    Common<uint8_t>(kDeviceStatus) = kStatusAcknowledge;
+    Common<uint8_t>(kDeviceStatus) = kStatusAcknowledge | kStatusDriver;
+
+    // VERSION_1 以外の機能は使わない
+    Common<uint32_t>(kDeviceFeatureSelect) = 1;
+    if ((Common<uint32_t>(kDeviceFeature) & kFeatureVersion1High) == 0) {
+      Common<uint8_t>(kDeviceStatus) = kStatusFailed;
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    Common<uint32_t>(kDriverFeatureSelect) = 0;
+    Common<uint32_t>(kDriverFeature) = 0;
+    Common<uint32_t>(kDriverFeatureSelect) = 1;
+    Common<uint32_t>(kDriverFeature) = kFeatureVersion1High;
+
+    uint8_t status = kStatusAcknowledge | kStatusDriver | kStatusFeaturesOK;
+    Common<uint8_t>(kDeviceStatus) = status;
+    if ((Common<uint8_t>(kDeviceStatus) & kStatusFeaturesOK) == 0) {
+      Common<uint8_t>(kDeviceStatus) = kStatusFailed;
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    Common<uint16_t>(kQueueSelect) = 0;
+    const uint16_t max_queue_size = Common<uint16_t>(kQueueSize);
+    queue_size_ = std::min(max_queue_size, kMaxQueueSize);
+    if (queue_size_ < 3) { // 1 つの要求に 3 つのディスクリプタを使う
+      Common<uint8_t>(kDeviceStatus) = kStatusFailed;
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error) {
+      return frame.error;
+    }
+    auto ring = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    memset(ring, 0, kBytesPerFrame);
+    desc_ = reinterpret_cast<volatile VirtqDesc*>(ring);
+    avail_ = reinterpret_cast<volatile uint16_t*>(ring + kAvailOffset);
+    used_idx_ = reinterpret_cast<volatile uint16_t*>(ring + kUsedOffset + 2);
+    request_ = ring + kRequestOffset;
+    avail_[0] = kAvailNoInterrupt;
+
+    const size_t bounce_frames =
+      (kMaxTransferBlocks * BlockSize() + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto bounce = memory_manager->Allocate(bounce_frames, MemoryZone::kDMA32);
+    if (bounce.error) {
+      return bounce.error;
+    }
+    bounce_ = reinterpret_cast<uint8_t*>(bounce.value.Frame());
+
+    Common<uint16_t>(kQueueSize) = queue_size_;
+    Common<uint16_t>(kQueueMSIXVector) = kNoVector;
+    SetCommon64(kQueueDesc, reinterpret_cast<uintptr_t>(desc_));
+    SetCommon64(kQueueDriver, reinterpret_cast<uintptr_t>(avail_));
+    SetCommon64(kQueueDevice, reinterpret_cast<uintptr_t>(ring + kUsedOffset));
+    const uint16_t notify_off = Common<uint16_t>(kQueueNotifyOff);
+    queue_notify_ = reinterpret_cast<volatile uint16_t*>(
+        notify_base_ + notify_off * notify_off_multiplier_);
+    Common<uint16_t>(kQueueEnable) = 1;
+
+    Common<uint8_t>(kDeviceStatus) = status | kStatusDriverOK;
+
+    auto capacity = reinterpret_cast<volatile uint32_t*>(device_cfg_);
+    capacity_ = capacity[0] | static_cast<uint64_t>(capacity[1]) << 32;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Read(uint64_t lba, size_t num_blocks, void* buf) {
+    return Submit(kRequestIn, lba, num_blocks, buf);
+  }
+
+  Error BlockDevice::Write(uint64_t lba, size_t num_blocks, const void* buf) {
+    return Submit(kRequestOut, lba, num_blocks, const_cast<void*>(buf));
+  }
+
+  Error BlockDevice::Submit(uint32_t type, uint64_t lba, size_t num_blocks, void* buf) {
+    if (lba + num_blocks > capacity_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    auto data = reinterpret_cast<uint8_t*>(buf);
+    while (num_blocks > 0) {
+      const size_t n = std::min(num_blocks, kMaxTransferBlocks);
+      const size_t bytes = n * BlockSize();
+      // タスクのアドレス空間にあるバッファは物理アドレスが分からないので，一旦複製する
+      const bool bounce = !IsIdentityMapped(data, bytes);
+      if (bounce && type == kRequestOut) {
+        memcpy(bounce_, data, bytes);
+      }
+
+      auto header = reinterpret_cast<volatile uint32_t*>(request_);
+      header[0] = type;
+      header[1] = 0;
+      *reinterpret_cast<volatile uint64_t*>(request_ + 8) = lba;
+      request_[kStatusOffset] = 0xff;
+
+      // ヘッダ，データ，状態バイトの 3 つのディスクリプタをつなげる
+      desc_[0].addr = reinterpret_cast<uintptr_t>(request_);
+      desc_[0].len = kRequestHeaderSize;
+      desc_[0].flags = kDescNext;
+      desc_[0].next = 1;
+      desc_[1].addr = reinterpret_cast<uintptr_t>(bounce ? bounce_ : data);
+      desc_[1].len = bytes;
+      desc_[1].flags = kDescNext | (type == kRequestIn ? kDescWrite : 0);
+      desc_[1].next = 2;
+      desc_[2].addr = reinterpret_cast<uintptr_t>(request_ + kStatusOffset);
+      desc_[2].len = 1;
+      desc_[2].flags = kDescWrite;
+      desc_[2].next = 0;
+
+      const uint16_t avail_idx = avail_[1];
+      avail_[2 + avail_idx % queue_size_] = 0;
+      __asm__ volatile("mfence" ::: "memory");
+      avail_[1] = avail_idx + 1;
+      __asm__ volatile("mfence" ::: "memory");
+      *queue_notify_ = 0;
+
+      if (!PollUntil([this]() { return *used_idx_ != last_used_idx_; })) {
+        return MAKE_ERROR(Error::kTimeout);
+      }
+      ++last_used_idx_;
+
+      if (request_[kStatusOffset] != kStatusOK) {
+        Log(kWarn, "virtio-blk: request %u at %lu failed: %d\n",
+            type, lba, request_[kStatusOffset]);
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      if (bounce && type == kRequestIn) {
+        memcpy(data, bounce_, bytes);
+      }
+      lba += n;
+      data += bytes;
+      num_blocks -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ProbeBlockDevice(pci::Device& dev) {
+    VirtioCap common, notify, device;
+    if (!FindVirtioCap(dev, kCfgTypeCommon, common) ||
+        !FindVirtioCap(dev, kCfgTypeNotify, notify) ||
+        !FindVirtioCap(dev, kCfgTypeDevice, device)) {
+      // legacy インターフェースしか持たないデバイスは扱わない
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    const uintptr_t common_addr = CapAddress(dev, common);
+    const uintptr_t notify_addr = CapAddress(dev, notify);
+    const uintptr_t device_addr = CapAddress(dev, device);
+    if (common_addr == 0 || notify_addr == 0 || device_addr == 0) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // ファームウェアが終了時にバスマスタを止めていることがあるので，改めて有効にする
+    const uint32_t command = pci::ReadConfReg(dev, 0x04);
+    pci::WriteConfReg(dev, 0x04, command | 0x6u); // Memory Space, Bus Master
+
+    auto blk = new BlockDevice{dev, common_addr, notify_addr, notify.extra, device_addr};
+    if (auto err = blk->Initialize()) {
+      delete blk;
+      return err;
+    }
+    Log(kInfo, "virtio-blk %d.%d.%d: %lu sectors\n",
+        dev.bus, dev.device, dev.function, blk->NumBlocks());
+    RegisterBlockDevice(blk);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
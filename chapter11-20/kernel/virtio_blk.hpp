@@ -0,0 +1,84 @@
+/**
+ * @file virtio_blk.hpp
+ *
+ * virtio-blk（PCI，virtio 1.0 以降の modern インターフェース）のドライバ．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "block_device.hpp"
+#include "error.hpp"
+#include "pci.hpp"
+
+namespace virtio {
+  /** @brief virtio の split virtqueue のディスクリプタ */
+  struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+  } __attribute__((packed));
+
+  /** @brief virtio-blk のディスク．
+   *
+   * 割り込みは使わず，要求を 1 つずつ出して完了をポーリングで待つ．
+   * アイデンティティマップされたバッファはそのまま DMA に使い，
+   * それ以外（タスクのアドレス空間など）は 4GiB 未満に確保したバッファを経由して複製する．
+   */
+  class BlockDevice : public ::BlockDevice {
+   public:
+    /** @brief 1 つの要求で読み書きする最大のブロック数 */
+    static const size_t kMaxTransferBlocks = 256;
+
+    BlockDevice(const pci::Device& dev, uintptr_t common_cfg, uintptr_t notify,
+                uint32_t notify_off_multiplier, uintptr_t device_cfg);
+
+    /** @brief デバイスをリセットし，要求用の virtqueue を 1 つ設定する */
+    Error Initialize();
+
+    const char* Name() const override { return "virtio-blk"; }
+    // virtio-blk のセクタは BLK_SIZE 機能の有無によらず常に 512 バイト
+    size_t BlockSize() const override { return 512; }
+    uint64_t NumBlocks() const override { return capacity_; }
+    Error Read(uint64_t lba, size_t num_blocks, void* buf) override;
+    Error Write(uint64_t lba, size_t num_blocks, const void* buf) override;
+    const pci::Device* PCIDevice() const override { return &pci_dev_; }
+
+   private:
+    const pci::Device pci_dev_;
+    volatile uint8_t* const common_cfg_;
+    volatile uint8_t* const notify_base_;
+    const uint32_t notify_off_multiplier_;
+    volatile uint8_t* const device_cfg_;
+
+    uint64_t capacity_{0};
+    uint16_t queue_size_{0};
+    volatile uint16_t* queue_notify_{nullptr};
+    volatile VirtqDesc* desc_{nullptr};
+    volatile uint16_t* avail_{nullptr}; // flags, idx, ring[queue_size_]
+    volatile uint16_t* used_idx_{nullptr};
+    uint16_t last_used_idx_{0};
+    /** @brief 要求ヘッダと状態バイト（デバイスが DMA で読み書きする） */
+    volatile uint8_t* request_{nullptr};
+    /** @brief アイデンティティマップされていないバッファを読み書きするときに経由する領域 */
+    uint8_t* bounce_{nullptr};
+
+    template <typename T>
+    volatile T& Common(uint32_t offset) const {
+      return *reinterpret_cast<volatile T*>(common_cfg_ + offset);
+    }
+    /** @brief 64 ビットのレジスタを 32 ビットずつ書く */
+    void SetCommon64(uint32_t offset, uint64_t value) const {
+      Common<uint32_t>(offset) = value & 0xffffffffu;
+      Common<uint32_t>(offset + 4) = value >> 32;
+    }
+
+    /** @brief 1 つの要求を出して完了を待つ */
+    Error Submit(uint32_t type, uint64_t lba, size_t num_blocks, void* buf);
+  };
+
+  /** @brief virtio-blk の PCI デバイスを初期化し，ブロックデバイスとして登録する */
+  Error ProbeBlockDevice(pci::Device& dev);
+}